@@ -0,0 +1,685 @@
+/*
+ * hdr_beam_thread.c
+ *
+ * Alternative to hdr_strip_thread that forms BEAMNUM tied-array beams from
+ * the input blocks instead of keeping every antenna (see "Beam blocks" in
+ * hdr_databuf.h).  For each recorded channel c (STRPCHAN), beam b and pol p
+ *
+ *   B[m,b,p,c,t] = BEAMGAIN * sum_a w[b,a,p,c] * V[m,a,c,t,p]
+ *
+ * is rounded to 4b+4b, clipped to +-7, and handed to hdr_write_thread (or
+ * hdr_requant_thread) like a stripped block, cutting the recorded bytes by
+ * N_ANTS/BEAMNUM.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <immintrin.h>
+
+#include "hashpipe.h"
+#include "hdr_databuf.h"
+#include "hdr_trace.h"
+
+#define ELAPSED_NS(start,stop) \
+  (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
+
+// Bytes between antennas of one m in an input block
+#define BEAM_ANT_STRIDE (Nc*Nt*Np)
+
+/* Weights.  BEAMFILE names a text file of weights, re-read whenever the key
+ * or the file's modification time changes; without BEAMFILE, BEAMWGT holds
+ * the same lines separated by ';'.  Each line is
+ *
+ *   beam ant pol re im [chan]
+ *
+ * giving the complex weight of input (ant,pol) in beam for X engine channel
+ * chan, or for all channels if chan is omitted.  '#' starts a comment and a
+ * later line overrides an earlier one.  Weights that are not given are 0.
+ * With no weights at all, every beam is the plain sum of all antennas
+ * (pointing at zenith).
+ */
+typedef struct {
+    int16_t beam, ant, pol;
+    int16_t chan;        // -1 for all channels
+    float re, im;
+} beam_weight_t;
+
+typedef struct {
+    int n;
+    beam_weight_t *w;
+} beam_weights_t;
+
+// Parses weight lines, separated by newlines or sep, into bw.  Returns
+// HASHPIPE_OK or, leaving bw unchanged, HASHPIPE_ERR_PARAM.
+static int beam_weights_parse(beam_weights_t *bw, const char *text, char sep,
+                              const char *what)
+{
+    beam_weight_t *w = NULL, *tmp;
+    const char *line, *end;
+    char buf[256], *hash;
+    int beam, ant, pol, chan;
+    float re, im;
+    int n = 0, max = 0, lineno = 0, k;
+
+    for(line = text; *line; line = *end ? end+1 : end){
+      for(end = line; *end && *end != '\n' && *end != sep; end++);
+      lineno++;
+      k = end - line < (int)sizeof(buf)-1 ? end - line : (int)sizeof(buf)-1;
+      memcpy(buf, line, k);
+      buf[k] = '\0';
+      if((hash = strchr(buf, '#'))){
+        *hash = '\0';
+      }
+      chan = -1;
+      k = sscanf(buf, "%d %d %d %f %f %d", &beam, &ant, &pol, &re, &im, &chan);
+      if(k <= 0){
+        continue;
+      }
+      if(k < 5 || beam < 0 || beam >= N_MAX_BEAMS || ant < 0 || ant >= N_ANTS
+      || pol < 0 || pol >= Np || chan < -1 || chan >= Nc){
+        hashpipe_warn(__FUNCTION__, "%s line %d: invalid weight \"%s\"", what, lineno, buf);
+        free(w);
+        return HASHPIPE_ERR_PARAM;
+      }
+      if(n == max){
+        max = max ? 2*max : 256;
+        if(!(tmp = realloc(w, max*sizeof(*w)))){
+          free(w);
+          return HASHPIPE_ERR_PARAM;
+        }
+        w = tmp;
+      }
+      w[n].beam = beam;
+      w[n].ant = ant;
+      w[n].pol = pol;
+      w[n].chan = chan;
+      w[n].re = re;
+      w[n].im = im;
+      n++;
+    }
+
+    free(bw->w);
+    bw->w = w;
+    bw->n = n;
+    return HASHPIPE_OK;
+}
+
+// Reads and parses weight file filename into bw
+static int beam_weights_load(beam_weights_t *bw, const char *filename)
+{
+    FILE *fp;
+    char *text;
+    long len;
+    int rv = HASHPIPE_ERR_PARAM;
+
+    if(!(fp = fopen(filename, "r"))){
+      hashpipe_warn(__FUNCTION__, "error opening BEAMFILE %s", filename);
+      return HASHPIPE_ERR_PARAM;
+    }
+    fseek(fp, 0, SEEK_END);
+    len = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if(len >= 0 && (text = malloc(len+1))){
+      text[fread(text, 1, len, fp)] = '\0';
+      rv = beam_weights_parse(bw, text, '\n', filename);
+      free(text);
+    }
+    fclose(fp);
+    return rv;
+}
+
+/* Weight table for the current channel set, beams and gain, with the gain
+ * folded in.  The weights of 8 consecutive antennas are one AVX2 vector.
+ */
+typedef struct {
+    float re[N_MAX_BEAMS][Nsc][Np][N_ANTS];
+    float im[N_MAX_BEAMS][Nsc][Np][N_ANTS];
+    int32_t inoff[Nsc];  // byte offset of each recorded channel in a row
+} beam_table_t;
+
+static void beam_table_compile(beam_table_t *bt, const beam_weights_t *bw,
+                               const int32_t *chan, int nbeams, float gain)
+{
+    const beam_weight_t *w;
+    int i, b, c, p, a;
+
+    memset(bt->re, 0, sizeof(bt->re));
+    memset(bt->im, 0, sizeof(bt->im));
+    for(c=0; c<Nsc; c++){
+      bt->inoff[c] = chan[c]*Nt*Np;
+    }
+    if(bw->n == 0){
+      for(b=0; b<nbeams; b++)
+        for(c=0; c<Nsc; c++)
+          for(p=0; p<Np; p++)
+            for(a=0; a<N_ANTS; a++)
+              bt->re[b][c][p][a] = gain;
+      return;
+    }
+    for(i=0; i<bw->n; i++){
+      w = &bw->w[i];
+      for(c=0; c<Nsc; c++){
+        if(w->chan == -1 || w->chan == chan[c]){
+          bt->re[w->beam][c][w->pol][w->ant] = gain * w->re;
+          bt->im[w->beam][c][w->pol][w->ant] = gain * w->im;
+        }
+      }
+    }
+}
+
+// Rounds and clips a beam sample to a 4b+4b byte
+static inline uint8_t beam_pack(int re, int im)
+{
+    re = re < -7 ? -7 : re > 7 ? 7 : re;
+    im = im < -7 ? -7 : im > 7 ? 7 : im;
+    return (uint8_t)(((re & 0xf) << 4) | (im & 0xf));
+}
+
+/* Beamforming kernels.  Both form beams 0 to nbeams-1 of recorded channels
+ * c0 to c1-1 of a block.  The scalar kernel is the reference; the AVX2
+ * kernel sums in a different order, so the two can round a sample that is
+ * within float precision of a half integer differently.
+ *
+ * For every (m,c) the AVX2 kernel gathers the (t,p) samples of 8 antennas
+ * at a time as 32 bit words, sign-extends each nibble to 32 bits with shifts,
+ * converts them to float and accumulates the complex products with every
+ * beam's weights in one vector per (b,t,p) and real/imaginary part.  The 8
+ * vectors of a beam are then reduced together with horizontal adds.
+ */
+#if defined(__AVX2__) && defined(__FMA__) && Nt*Np == 4 && N_ANTS % 8 == 0
+#define HAVE_BEAM_AVX2
+#endif
+
+static void beam_block_scalar(uint8_t *outdata, const uint8_t *indata,
+                              const beam_table_t *bt, int nbeams, int c0, int c1)
+{
+    const uint8_t *row;
+    float sr, si, xr, xi, wr, wi;
+    int m, b, c, t, p, a;
+    uint8_t s;
+
+    for(c=c0; c<c1; c++){
+      for(m=0; m<Nm; m++){
+        row = indata + hdr_input_databuf_data_idx8(m,0,0,0,0) + bt->inoff[c];
+        for(b=0; b<nbeams; b++){
+          for(t=0; t<Nt; t++){
+            for(p=0; p<Np; p++){
+              sr = si = 0;
+              for(a=0; a<N_ANTS; a++){
+                s = row[a*BEAM_ANT_STRIDE + t*Np + p];
+                xr = (int8_t)(s & 0xf0) >> 4;
+                xi = (int8_t)(s << 4) >> 4;
+                wr = bt->re[b][c][p][a];
+                wi = bt->im[b][c][p][a];
+                sr += wr*xr - wi*xi;
+                si += wr*xi + wi*xr;
+              }
+              outdata[hdr_stripper_databuf_data_idx8(m,b,p,c,t)] =
+                beam_pack((int)nearbyintf(sr), (int)nearbyintf(si));
+            }
+          }
+        }
+      }
+    }
+}
+
+#ifdef HAVE_BEAM_AVX2
+// Returns the sums of the elements of v[0] to v[7] as one vector
+static inline __m256 beam_hsum8(const __m256 *v)
+{
+    __m256 s0 = _mm256_hadd_ps(_mm256_hadd_ps(v[0], v[1]), _mm256_hadd_ps(v[2], v[3]));
+    __m256 s1 = _mm256_hadd_ps(_mm256_hadd_ps(v[4], v[5]), _mm256_hadd_ps(v[6], v[7]));
+
+    return _mm256_add_ps(_mm256_permute2f128_ps(s0, s1, 0x20),
+                         _mm256_permute2f128_ps(s0, s1, 0x31));
+}
+
+static void beam_block_avx2(uint8_t *outdata, const uint8_t *indata,
+                            const beam_table_t *bt, int nbeams, int c0, int c1)
+{
+    const __m256i vindex = _mm256_setr_epi32(
+        0, BEAM_ANT_STRIDE, 2*BEAM_ANT_STRIDE, 3*BEAM_ANT_STRIDE,
+        4*BEAM_ANT_STRIDE, 5*BEAM_ANT_STRIDE, 6*BEAM_ANT_STRIDE, 7*BEAM_ANT_STRIDE);
+    const __m256i lim = _mm256_set1_epi32(7);
+    // acc[b][0-3]: real part of (t,p) = j, acc[b][4-7]: imaginary part
+    __m256 acc[N_MAX_BEAMS][8];
+    __m256 xr[4], xi[4], wr, wi;
+    __m256i v, q;
+    int32_t s[8];
+    const uint8_t *row;
+    int m, b, c, g, j, p, t;
+
+    for(c=c0; c<c1; c++){
+      for(m=0; m<Nm; m++){
+        row = indata + hdr_input_databuf_data_idx8(m,0,0,0,0) + bt->inoff[c];
+        for(b=0; b<nbeams; b++){
+          for(j=0; j<8; j++){
+            acc[b][j] = _mm256_setzero_ps();
+          }
+        }
+        for(g=0; g<N_ANTS; g+=8){
+          // Byte j = t*Np+p of each word: real part in the high nibble
+          v = _mm256_i32gather_epi32((const int *)(row + g*BEAM_ANT_STRIDE), vindex, 1);
+          xr[0] = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(v, 24), 28));
+          xi[0] = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(v, 28), 28));
+          xr[1] = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(v, 16), 28));
+          xi[1] = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(v, 20), 28));
+          xr[2] = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(v, 8), 28));
+          xi[2] = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(v, 12), 28));
+          xr[3] = _mm256_cvtepi32_ps(_mm256_srai_epi32(v, 28));
+          xi[3] = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(v, 4), 28));
+          for(b=0; b<nbeams; b++){
+            for(p=0; p<Np; p++){
+              wr = _mm256_loadu_ps(&bt->re[b][c][p][g]);
+              wi = _mm256_loadu_ps(&bt->im[b][c][p][g]);
+              for(t=0; t<Nt; t++){
+                j = t*Np + p;
+                acc[b][j]   = _mm256_fmadd_ps(wr, xr[j], _mm256_fnmadd_ps(wi, xi[j], acc[b][j]));
+                acc[b][j+4] = _mm256_fmadd_ps(wr, xi[j], _mm256_fmadd_ps(wi, xr[j], acc[b][j+4]));
+              }
+            }
+          }
+        }
+        for(b=0; b<nbeams; b++){
+          q = _mm256_cvtps_epi32(beam_hsum8(acc[b]));
+          q = _mm256_max_epi32(_mm256_min_epi32(q, lim), _mm256_sub_epi32(_mm256_setzero_si256(), lim));
+          _mm256_storeu_si256((__m256i *)s, q);
+          for(j=0; j<4; j++){
+            outdata[hdr_stripper_databuf_data_idx8(m,b,j%Np,c,j/Np)] = beam_pack(s[j], s[j+4]);
+          }
+        }
+      }
+    }
+}
+#endif // HAVE_BEAM_AVX2
+
+/* Worker pool.  BEAMNTHR threads (including this thread) each form the beams
+ * of a disjoint range of the recorded channels of the same block, meeting at
+ * a "start" and a "done" barrier like the workers of hdr_strip_thread.
+ * Worker i is pinned to the i-th CPU listed in BEAMCPUS, if any.
+ */
+#define MAX_BEAM_WORKERS Nsc
+
+struct beam_pool;
+
+typedef struct {
+    struct beam_pool *pool;
+    int c0, c1;        // channel range
+    int cpu;           // -1 for no pinning
+    pthread_t thread;
+} beam_worker_t;
+
+typedef struct beam_pool {
+    int nworkers;
+    int quit;
+    int scalar;        // use the scalar kernel
+    int nbeams;
+    const beam_table_t *table;
+    const uint8_t *indata;
+    uint8_t *outdata;
+    pthread_mutex_t startup; // held until the barriers are set up
+    pthread_barrier_t start;
+    pthread_barrier_t done;
+    beam_worker_t worker[MAX_BEAM_WORKERS];
+} beam_pool_t;
+
+static void beam_worker_range(beam_worker_t *w)
+{
+    beam_pool_t *pool = w->pool;
+
+#ifdef HAVE_BEAM_AVX2
+    if(!pool->scalar){
+      beam_block_avx2(pool->outdata, pool->indata, pool->table, pool->nbeams, w->c0, w->c1);
+      return;
+    }
+#endif
+    beam_block_scalar(pool->outdata, pool->indata, pool->table, pool->nbeams, w->c0, w->c1);
+}
+
+static void *beam_worker_run(void *arg)
+{
+    beam_worker_t *w = (beam_worker_t *)arg;
+    beam_pool_t *pool = w->pool;
+
+    pthread_mutex_lock(&pool->startup);
+    pthread_mutex_unlock(&pool->startup);
+    while(1){
+      pthread_barrier_wait(&pool->start);
+      if(pool->quit){
+        break;
+      }
+      beam_worker_range(w);
+      pthread_barrier_wait(&pool->done);
+    }
+    return NULL;
+}
+
+static void beam_pin_cpu(pthread_t thread, int cpu)
+{
+    cpu_set_t cpuset;
+
+    if(cpu < 0){
+      return;
+    }
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if(pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset)){
+      hashpipe_warn(__FUNCTION__, "could not pin beam worker to cpu %d", cpu);
+    }
+}
+
+// Stops the workers started by beam_pool_start
+static void beam_pool_stop(beam_pool_t *pool)
+{
+    int i;
+
+    pool->quit = 1;
+    pthread_barrier_wait(&pool->start);
+    for(i=1; i<pool->nworkers; i++){
+      pthread_join(pool->worker[i].thread, NULL);
+    }
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->startup);
+}
+
+// Sets up nworkers workers (worker 0 being the calling thread) and starts
+// workers 1 to nworkers-1.  Returns 0, or -1 if cpus holds an entry that is
+// not a CPU number or a worker could not be started, in which case the
+// workers that were started are stopped.
+static int beam_pool_start(beam_pool_t *pool, int nworkers, const char *cpus)
+{
+    char *p = (char *)cpus;
+    char *q;
+    int i;
+
+    memset(pool, 0, sizeof(beam_pool_t));
+    pool->nworkers = nworkers;
+    for(i=0; i<nworkers; i++){
+      pool->worker[i].pool = pool;
+      pool->worker[i].c0 = i*Nsc/nworkers;
+      pool->worker[i].c1 = (i+1)*Nsc/nworkers;
+      pool->worker[i].cpu = -1;
+      if(*p){
+        pool->worker[i].cpu = strtol(p, &q, 0);
+        if(q == p){
+          hashpipe_error(__FUNCTION__, "bad BEAMCPUS entry \"%s\"", p);
+          return -1;
+        }
+        for(p=q; *p == ',' || *p == ' '; p++);
+      }
+    }
+
+    pool->worker[0].thread = pthread_self();
+    beam_pin_cpu(pool->worker[0].thread, pool->worker[0].cpu);
+
+    // The workers wait for the barriers, which are sized for the workers
+    // that actually started
+    pthread_mutex_init(&pool->startup, NULL);
+    pthread_mutex_lock(&pool->startup);
+    for(i=1; i<nworkers; i++){
+      if(pthread_create(&pool->worker[i].thread, NULL, beam_worker_run, &pool->worker[i])){
+        hashpipe_error(__FUNCTION__, "error starting beam worker %d", i);
+        break;
+      }
+      beam_pin_cpu(pool->worker[i].thread, pool->worker[i].cpu);
+    }
+    pool->nworkers = i;
+    pthread_barrier_init(&pool->start, NULL, i);
+    pthread_barrier_init(&pool->done, NULL, i);
+    pthread_mutex_unlock(&pool->startup);
+
+    if(i < nworkers){
+      beam_pool_stop(pool);
+      return -1;
+    }
+    return 0;
+}
+
+// Forms the beams of one block using all workers
+static void beam_pool_run(beam_pool_t *pool, uint8_t *outdata, const uint8_t *indata,
+                          const beam_table_t *table, int nbeams, int scalar)
+{
+    pool->table = table;
+    pool->nbeams = nbeams;
+    pool->outdata = outdata;
+    pool->indata = indata;
+    pool->scalar = scalar;
+
+    if(pool->nworkers == 1){
+      beam_worker_range(&pool->worker[0]);
+      return;
+    }
+    pthread_barrier_wait(&pool->start);
+    beam_worker_range(&pool->worker[0]);
+    pthread_barrier_wait(&pool->done);
+}
+
+// Returns the RMS of the real and imaginary values of n bytes of 4b+4b samples
+static double beam_rms(const uint8_t *data, size_t n)
+{
+    uint64_t sum = 0;
+    int re, im;
+    size_t i;
+
+    for(i=0; i<n; i++){
+      re = (int8_t)(data[i] & 0xf0) >> 4;
+      im = (int8_t)(data[i] << 4) >> 4;
+      sum += re*re + im*im;
+    }
+    return n ? sqrt((double)sum / (2*n)) : 0;
+}
+
+static void *hdr_beam_thread_run(hashpipe_thread_args_t * args){
+    hdr_input_databuf_t    *idb = (hdr_input_databuf_t *)args->ibuf;
+    hdr_stripper_databuf_t *odb = (hdr_stripper_databuf_t *)args->obuf;
+    hashpipe_status_t st = args->st;
+    const char *status_key = args->thread_desc->skey;
+
+    hdr_trace_thread_name("beam");
+
+    int rv;
+    uint64_t mcnt = 0;
+    uint8_t *indata;
+    uint8_t *outdata;
+    int iblk = 0;
+    int oblk = 0;
+    char kernel[16] = "avx2";  // BEAMKERN: "avx2" or "scalar"
+    struct timespec start, stop;
+    uint64_t beam_ns = 0;
+    double rms = 0;
+    int nworkers = 1;          // BEAMNTHR
+    char cpus[256] = "";       // BEAMCPUS
+    beam_pool_t pool;
+    int nbeams = 1;            // BEAMNUM
+    double gain = 1/sqrt(N_ANTS); // BEAMGAIN
+    char file[256] = "";       // BEAMFILE
+    char wgt[256] = "";        // BEAMWGT
+    char spec[80] = "";        // STRPCHAN
+    char cur_file[256] = "";
+    char cur_wgt[256] = "";
+    char cur_spec[80];
+    time_t file_mtime = 0;
+    struct stat sb;
+    int32_t chan[Nsc];
+    int table_nbeams = 0;
+    double table_gain = 0;
+    int stale = 1;             // the table needs compiling
+    beam_weights_t weights = {0, NULL};
+    beam_table_t *table;
+
+    hdr_chan_set_default(chan);
+    sprintf(cur_spec, "0-%d", Nsc-1);
+
+    if(posix_memalign((void **)&table, 64, sizeof(beam_table_t))){
+      hashpipe_error(__FUNCTION__, "error allocating weight table");
+      pthread_exit(NULL);
+    }
+
+    hashpipe_status_lock_safe(&st);
+    hgeti4(st.buf, "BEAMNTHR", &nworkers);
+    hgets(st.buf, "BEAMCPUS", sizeof(cpus), cpus);
+    nworkers = nworkers < 1 ? 1 : nworkers > MAX_BEAM_WORKERS ? MAX_BEAM_WORKERS : nworkers;
+    hputi4(st.buf, "BEAMNTHR", nworkers);
+    hashpipe_status_unlock_safe(&st);
+
+    if(beam_pool_start(&pool, nworkers, cpus)){
+      pthread_exit(NULL);
+    }
+
+    while (run_threads()) {
+
+        hashpipe_status_lock_safe(&st);
+        hputi4(st.buf, "BEAMBKIN", iblk);
+        hputs(st.buf, status_key, "waiting");
+        hputi4(st.buf, "BEAMBKOU", oblk);
+        hputi8(st.buf, "BEAMMCNT", mcnt);
+        hgets(st.buf, "BEAMKERN", sizeof(kernel), kernel);
+        hgeti4(st.buf, "BEAMNUM", &nbeams);
+        hgetr8(st.buf, "BEAMGAIN", &gain);
+        hgets(st.buf, "BEAMFILE", sizeof(file), file);
+        hgets(st.buf, "BEAMWGT", sizeof(wgt), wgt);
+        strcpy(spec, cur_spec);
+        hgets(st.buf, STRPCHAN_KEY, sizeof(spec), spec);
+        nbeams = nbeams < 1 ? 1 : nbeams > N_MAX_BEAMS ? N_MAX_BEAMS : nbeams;
+        hputi4(st.buf, "BEAMNUM", nbeams);
+        hputr8(st.buf, "BEAMGAIN", gain);
+        hputs(st.buf, "BEAMKERN", kernel);
+        if(beam_ns) {
+            hputi8(st.buf, "BEAMNS", beam_ns);
+            hputr4(st.buf, "BEAMRMS", rms);
+        }
+        hashpipe_status_unlock_safe(&st);
+
+        // Pick up a new channel set, weights, number of beams or gain
+        if(strcmp(spec, cur_spec)){
+            if(hdr_chan_set_parse(spec, chan) == HASHPIPE_OK){
+                stale = 1;
+            }else{
+                hashpipe_warn(__FUNCTION__, "ignoring invalid %s \"%s\"", STRPCHAN_KEY, spec);
+            }
+            strcpy(cur_spec, spec);
+        }
+        if(*file){
+            if(stat(file, &sb)){
+                sb.st_mtime = 0;
+            }
+            if(strcmp(file, cur_file) || sb.st_mtime != file_mtime){
+                if(beam_weights_load(&weights, file) == HASHPIPE_OK){
+                    stale = 1;
+                }
+                strcpy(cur_file, file);
+                file_mtime = sb.st_mtime;
+            }
+        }else if(*cur_file || strcmp(wgt, cur_wgt)){
+            if(beam_weights_parse(&weights, wgt, ';', "BEAMWGT") == HASHPIPE_OK){
+                stale = 1;
+            }
+            *cur_file = '\0';
+            strcpy(cur_wgt, wgt);
+        }
+        if(stale || nbeams != table_nbeams || gain != table_gain){
+            beam_table_compile(table, &weights, chan, nbeams, gain);
+            table_nbeams = nbeams;
+            table_gain = gain;
+            stale = 0;
+            hashpipe_status_lock_safe(&st);
+            hputi4(st.buf, "BEAMNWGT", weights.n);
+            hashpipe_status_unlock_safe(&st);
+        }
+
+        while ((rv=hdr_input_databuf_wait_filled(idb, iblk))!= HASHPIPE_OK){
+            if (rv==HASHPIPE_TIMEOUT){
+                hashpipe_status_lock_safe(&st);
+                hputs(st.buf, status_key, "blocked");
+                hashpipe_status_unlock_safe(&st);
+                continue;
+            }else{
+                hashpipe_error(__FUNCTION__, "error waiting for filled databuf");
+                pthread_exit(NULL);
+                break;
+            }
+        }
+
+        while ((rv=hdr_stripper_databuf_wait_free(odb, oblk))!= HASHPIPE_OK){
+            if (rv==HASHPIPE_TIMEOUT){
+                hashpipe_status_lock_safe(&st);
+                hputs(st.buf, status_key, "outblocked");
+                hashpipe_status_unlock_safe(&st);
+                continue;
+            }else{
+                hashpipe_error(__FUNCTION__, "error waiting for free databuf");
+                pthread_exit(NULL);
+                break;
+            }
+        }
+
+        hashpipe_status_lock_safe(&st);
+        hputs(st.buf, status_key, "beamforming");
+        hashpipe_status_unlock_safe(&st);
+        mcnt = idb->block[iblk].header.mcnt;
+
+        indata = (uint8_t *)idb->block[iblk].data;
+        outdata = (uint8_t *)odb->block[oblk].data;
+
+        odb->block[oblk].header.good_data = idb->block[iblk].header.good_data;
+        odb->block[oblk].header.mcnt = mcnt;
+        memcpy(odb->block[oblk].header.chan, chan, sizeof(chan));
+        odb->block[oblk].header.nbits = 4;
+        odb->block[oblk].header.nbeams = nbeams;
+        memcpy(odb->block[oblk].header.pkt_map, idb->block[iblk].header.pkt_map,
+               sizeof(odb->block[oblk].header.pkt_map));
+
+        // Missing packets must not add stale data to the beams
+        if(!idb->block[iblk].header.good_data){
+          hdr_input_block_zero_missing(&idb->block[iblk]);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        beam_pool_run(&pool, outdata, indata, table, nbeams, !strcmp(kernel, "scalar"));
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        beam_ns = ELAPSED_NS(start, stop);
+        rms = beam_rms(outdata, hdr_stripper_data_bytes(&odb->block[oblk].header));
+
+        // Mark input block as free, output block as filled
+        hdr_stripper_databuf_set_filled(odb, oblk);
+        hdr_input_databuf_set_free(idb, iblk);
+
+        iblk = (iblk + 1)%idb->header.n_block;
+        oblk = (oblk + 1)%odb->header.n_block;
+
+        /* Will exit if thread has been cancelled */
+        pthread_testcancel();
+    }
+
+    beam_pool_stop(&pool);
+    free(weights.w);
+    free(table);
+
+    // Thread success!
+    return THREAD_OK;
+}
+
+
+hashpipe_thread_desc_t hdr_beam_thread = {
+    name: "hdr_beam_thread",
+    skey: "BEAMSTAT",
+    init: NULL,
+    run: hdr_beam_thread_run,
+    ibuf_desc: {hdr_input_databuf_create},
+    obuf_desc: {hdr_stripper_databuf_create}
+};
+
+static __attribute__((constructor)) void ctor(){
+    register_hashpipe_thread(&hdr_beam_thread);
+}
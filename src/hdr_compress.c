@@ -0,0 +1,148 @@
+/* hdr_compress.c
+ *
+ * Bitshuffle + LZ4 compression of stripper blocks (see hdr_compress.h).
+ */
+#include <stdio.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "hdr_compress.h"
+#include "hdr_nibble.h"
+
+// hdr_nibble rows are the time samples of one antenna, pol and channel
+#if Nm*Nt != HDR_NIB_ROW_BYTES
+#error Nm*Nt must equal HDR_NIB_ROW_BYTES
+#endif
+
+#ifdef HAVE_LZ4_H
+#include <lz4.h>
+
+static void write_be32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void write_be64(uint8_t *p, uint64_t v)
+{
+    write_be32(p, v >> 32);
+    write_be32(p + 4, v);
+}
+#endif
+
+void hdr_bitshuffle(const uint8_t *in, uint8_t *out, size_t n)
+{
+    size_t plane = n / 8;
+    size_t i;
+    int b;
+
+#ifdef __AVX2__
+    // movemask gathers the top bit of 32 bytes; doubling each byte moves the
+    // next bit up
+    __m256i v;
+    uint32_t mask;
+
+    for(i=0; i<n; i+=32) {
+        v = _mm256_loadu_si256((const __m256i *)(in + i));
+        for(b=7; b>=0; b--) {
+            mask = _mm256_movemask_epi8(v);
+            memcpy(out + b*plane + i/8, &mask, sizeof(mask));
+            v = _mm256_add_epi8(v, v);
+        }
+    }
+#else
+    // 8x8 bit matrix transpose of each 8 bytes
+    uint64_t x, t;
+
+    for(i=0; i<n; i+=8) {
+        memcpy(&x, in + i, sizeof(x));
+        t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+        x = x ^ t ^ (t << 7);
+        t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+        x = x ^ t ^ (t << 14);
+        t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+        x = x ^ t ^ (t << 28);
+        for(b=0; b<8; b++) {
+            out[b*plane + i/8] = x >> (8*b);
+        }
+    }
+#endif
+}
+
+size_t hdr_bshuf_lz4_compress(const void *in, size_t nbytes, void *out, void *tmp)
+{
+#ifdef HAVE_LZ4_H
+    const uint8_t *src = (const uint8_t *)in;
+    uint8_t *dst = (uint8_t *)out;
+    size_t pos = HDR_BSHUF_HEADER_BYTES;
+    size_t i;
+    int n;
+
+    write_be64(dst, nbytes);
+    write_be32(dst + 8, HDR_BSHUF_BLOCK);
+    for(i=0; i<nbytes; i+=HDR_BSHUF_BLOCK) {
+        if(pos + 4 >= nbytes) {
+            return 0;
+        }
+        hdr_bitshuffle(src + i, (uint8_t *)tmp, HDR_BSHUF_BLOCK);
+        // LZ4 gives up (returns 0) if the block would not fit in the rest of
+        // the output, i.e. if the block does not compress
+        n = LZ4_compress_default((const char *)tmp, (char *)dst + pos + 4,
+                                 HDR_BSHUF_BLOCK, nbytes - pos - 4);
+        if(n <= 0) {
+            return 0;
+        }
+        write_be32(dst + pos, n);
+        pos += 4 + n;
+    }
+    return pos;
+#else
+    return 0;
+#endif
+}
+
+int hdr_codec_parse(const char *name)
+{
+    if(!strcmp(name, "none")) {
+        return HDR_CODEC_NONE;
+    } else if(!strcmp(name, "lz4")) {
+        return HDR_CODEC_LZ4;
+    } else if(!strcmp(name, "nib")) {
+        return HDR_CODEC_NIBBLE;
+    }
+    return -1;
+}
+
+int hdr_codec_available(int codec)
+{
+#ifndef HAVE_LZ4_H
+    if(codec == HDR_CODEC_LZ4) {
+        return 0;
+    }
+#endif
+    return 1;
+}
+
+size_t hdr_compress_block(int codec, const void *in, size_t nbytes, int nbits,
+                          void *out, void *tmp)
+{
+    switch(codec) {
+    case HDR_CODEC_LZ4:
+        // Beam blocks of a few beams need not fill whole bitshuffle blocks
+        if(nbytes % HDR_BSHUF_BLOCK) {
+            return 0;
+        }
+        return hdr_bshuf_lz4_compress(in, nbytes, out, tmp);
+    case HDR_CODEC_NIBBLE:
+        // The codec models 4 bit values, requantized blocks are stored as is.
+        // Antenna and beam blocks alike are rows of Nm*Nt samples.  Only
+        // worth storing if it is smaller than the block.
+        if(nbits != 4 || nbytes % HDR_NIB_ROW_BYTES) {
+            return 0;
+        }
+        return hdr_nib_encode((const uint8_t *)in, nbytes, (uint8_t *)out, nbytes - 1);
+    }
+    return 0;
+}
@@ -0,0 +1,76 @@
+/* hdr_compress.h
+ *
+ * Compression of stripper blocks before they are written (WRITCOMP).  Two
+ * codecs are available:
+ *
+ *   lz4  bitshuffle + LZ4, stored with the bitshuffle HDF5 filter
+ *   nib  the 4b+4b voltage codec of hdr_nibble.h, stored with its own HDF5
+ *        filter (plugin libh5hdrnib.so)
+ *
+ * A bitshuffle + LZ4 compressed block is exactly what the bitshuffle HDF5
+ * filter (filter id 32008, LZ4 mode) stores for one chunk, so compressed
+ * blocks can be handed to H5Dwrite_chunk and read back by any HDF5 reader
+ * with the bitshuffle plugin (e.g. h5py with hdf5plugin or bitshuffle
+ * installed).  The chunk format is:
+ *
+ *   uint64 BE  uncompressed bytes
+ *   uint32 BE  bitshuffle block size in bytes (HDR_BSHUF_BLOCK)
+ *   for each block:
+ *     uint32 BE  LZ4 compressed bytes of the block
+ *     LZ4 block compressed bit-plane transpose of the block
+ *
+ * With 1 byte elements, bitshuffling a block of n bytes stores bit plane b
+ * (b = 0 is the least significant bit) of all n bytes as n/8 bytes at
+ * offset b*n/8.  Runs of zeros and flagged antennas become long runs of
+ * identical bytes that LZ4 compresses well.
+ */
+#ifndef _HDR_COMPRESS_H
+#define _HDR_COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "hdr_databuf.h"
+
+#define HDR_BSHUF_FILTER_ID   32008
+#define HDR_BSHUF_COMPRESS_LZ4 2
+#define HDR_BSHUF_BLOCK       8192     // bytes per bitshuffle block
+#define HDR_BSHUF_HEADER_BYTES 12
+
+// cd_values of the bitshuffle filter: version major, version minor, element
+// size, block size (elements), compression
+#define HDR_BSHUF_NCD_VALUES  5
+#define HDR_BSHUF_CD_VALUES   {0, 3, 1, HDR_BSHUF_BLOCK, HDR_BSHUF_COMPRESS_LZ4}
+
+#if N_BYTES_PER_RQNT_BLOCK % HDR_BSHUF_BLOCK
+#error N_BYTES_PER_RQNT_BLOCK must be a multiple of HDR_BSHUF_BLOCK
+#endif
+
+// Block codecs
+#define HDR_CODEC_NONE    0
+#define HDR_CODEC_LZ4     1
+#define HDR_CODEC_NIBBLE  2
+
+// Bit-plane transposes n bytes (a multiple of 32) from in to out
+void hdr_bitshuffle(const uint8_t *in, uint8_t *out, size_t n);
+
+// Compresses one stripper block of nbytes bytes (a multiple of
+// HDR_BSHUF_BLOCK) into out, which holds nbytes bytes, using tmp
+// (HDR_BSHUF_BLOCK bytes) as scratch.  Returns the size of the compressed
+// block, or 0 if it would not be smaller than the block or if the recorder
+// was built without LZ4.
+size_t hdr_bshuf_lz4_compress(const void *in, size_t nbytes, void *out, void *tmp);
+
+// Returns the codec named name ("none", "lz4" or "nib") or -1
+int hdr_codec_parse(const char *name);
+
+// Returns 1 if codec is available in this build
+int hdr_codec_available(int codec);
+
+// Compresses one stripper block of nbytes bytes (hdr_stripper_data_bytes of
+// its header) and nbits bits per value (of its header) with codec into out,
+// which holds nbytes bytes, using tmp (HDR_BSHUF_BLOCK bytes) as scratch.
+// Returns the size of the compressed block, or 0 to store the block as is.
+size_t hdr_compress_block(int codec, const void *in, size_t nbytes, int nbits,
+                          void *out, void *tmp);
+
+#endif // _HDR_COMPRESS_H
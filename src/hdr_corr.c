@@ -0,0 +1,288 @@
+/* hdr_corr.c
+ *
+ * Correlator kernels and the correlator product of the integration writer
+ * (see hdr_corr.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "hashpipe.h"
+#include "hdr_corr.h"
+#include "hdr_hdf5_header.h"
+
+// Adds baseline (a0,a1) to bl[n] unless it, or its conjugate, is listed
+static void add_baseline(hdr_corr_bl_t *bl, int *n, uint8_t *seen, int a0, int a1)
+{
+    if(seen[a0*N_ANTS + a1]){
+      return;
+    }
+    seen[a0*N_ANTS + a1] = seen[a1*N_ANTS + a0] = 1;
+    bl[*n].a0 = a0;
+    bl[*n].a1 = a1;
+    (*n)++;
+}
+
+int hdr_corr_parse_baselines(const char *spec, hdr_corr_bl_t *bl)
+{
+    uint8_t *seen;
+    const char *p = spec;
+    char *q;
+    long a0, a1;
+    int n = 0;
+    int a, b;
+
+    if(!(seen = calloc(N_ANTS*N_ANTS, 1))){
+      return -1;
+    }
+    while(*p){
+      while(*p == ' ') p++;
+      if(!strncmp(p, "auto", 4)){
+        p += 4;
+        for(a=0; a<N_ANTS; a++){
+          add_baseline(bl, &n, seen, a, a);
+        }
+      }else if(!strncmp(p, "all", 3)){
+        p += 3;
+        for(a=0; a<N_ANTS; a++){
+          for(b=a; b<N_ANTS; b++){
+            add_baseline(bl, &n, seen, a, b);
+          }
+        }
+      }else{
+        a0 = strtol(p, &q, 0);
+        if(q == p || *q != ':' || a0 < 0 || a0 >= N_ANTS){
+          goto error;
+        }
+        p = q + 1;
+        if(*p == '*'){
+          p++;
+          for(b=0; b<N_ANTS; b++){
+            add_baseline(bl, &n, seen, a0, b);
+          }
+        }else{
+          a1 = strtol(p, &q, 0);
+          if(q == p || a1 < 0 || a1 >= N_ANTS){
+            goto error;
+          }
+          p = q;
+          add_baseline(bl, &n, seen, a0, a1);
+        }
+      }
+      while(*p == ' ') p++;
+      if(*p == ','){
+        if(!*++p){
+          goto error;
+        }
+      }else if(*p){
+        goto error;
+      }
+    }
+    free(seen);
+    return n == 0 ? -1 : n;
+
+error:
+    free(seen);
+    return -1;
+}
+
+/* Correlation kernels.  In a stripped block the Nm*Nt samples of each
+ * (a,p,c) are one contiguous row, so a baseline's visibility in channel c
+ * for pol product (p0,p1) is the dot product of row (a0,p0,c) with the
+ * conjugate of row (a1,p1,c).
+ *
+ * The AVX2 kernel loads each 32 byte row once per (baseline, channel),
+ * expands its nibbles to int8 real and imaginary vectors with a pshufb
+ * lookup table and forms the four real products of each pol product with
+ * maddubs (using the usual abs/sign trick, since maddubs takes one unsigned
+ * operand), giving 16 bit partial sums of at most 2*2*64.  These are widened
+ * with madd, and the 8 vectors of a (baseline, channel) are reduced together
+ * with horizontal adds into its 8 (pol product, re/im) values.
+ */
+#if defined(__AVX2__) && Nm*Nt == 32 && Np == 2
+#define HAVE_CORR_AVX2
+#endif
+
+static inline int nib(uint8_t n)
+{
+    return n & 0x8 ? (int)(n & 0xf) - 16 : n & 0xf;
+}
+
+static void corr_block_scalar(int32_t *acc, const uint8_t *data,
+                              const hdr_corr_bl_t *bl, int b0, int b1)
+{
+    const uint8_t *x, *y;
+    int32_t *v;
+    int b, c, p0, p1, i;
+    int xr, xi, yr, yi;
+
+    for(b=b0; b<b1; b++){
+      for(c=0; c<Nsc; c++){
+        v = acc + b*HDR_CORR_BL_VALUES + c*HDR_CORR_NPP*2;
+        for(p0=0; p0<Np; p0++){
+          for(p1=0; p1<Np; p1++){
+            x = data + hdr_stripper_databuf_data_idx8(0,bl[b].a0,p0,c,0);
+            y = data + hdr_stripper_databuf_data_idx8(0,bl[b].a1,p1,c,0);
+            for(i=0; i<Nm*Nt; i++){
+              xr = nib(x[i] >> 4);
+              xi = nib(x[i]);
+              yr = nib(y[i] >> 4);
+              yi = nib(y[i]);
+              v[2*(p0*Np+p1)]   += xr*yr + xi*yi;
+              v[2*(p0*Np+p1)+1] += xi*yr - xr*yi;
+            }
+          }
+        }
+      }
+    }
+}
+
+#ifdef HAVE_CORR_AVX2
+// Returns the sums of the elements of v[0] to v[7] as one vector
+static inline __m256i corr_hsum8(const __m256i *v)
+{
+    __m256i s0 = _mm256_hadd_epi32(_mm256_hadd_epi32(v[0], v[1]), _mm256_hadd_epi32(v[2], v[3]));
+    __m256i s1 = _mm256_hadd_epi32(_mm256_hadd_epi32(v[4], v[5]), _mm256_hadd_epi32(v[6], v[7]));
+
+    return _mm256_add_epi32(_mm256_permute2x128_si256(s0, s1, 0x20),
+                            _mm256_permute2x128_si256(s0, s1, 0x31));
+}
+
+// x.y of int8 vectors as 16 bit sums of adjacent pairs
+static inline __m256i dot8(__m256i x, __m256i y)
+{
+    return _mm256_maddubs_epi16(_mm256_abs_epi8(x), _mm256_sign_epi8(y, x));
+}
+
+static void corr_block_avx2(int32_t *acc, const uint8_t *data,
+                            const hdr_corr_bl_t *bl, int b0, int b1)
+{
+    // 4 bit two's complement -> int8
+    const __m256i lut = _mm256_setr_epi8(
+        0, 1, 2, 3, 4, 5, 6, 7, -8, -7, -6, -5, -4, -3, -2, -1,
+        0, 1, 2, 3, 4, 5, 6, 7, -8, -7, -6, -5, -4, -3, -2, -1);
+    const __m256i lo4 = _mm256_set1_epi8(0x0f);
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i xr[Np], xi[Np], yr[Np], yi[Np];
+    __m256i v[8], s;
+    __m256i *out;
+    int b, c, p, p0, p1, j;
+
+    for(b=b0; b<b1; b++){
+      for(c=0; c<Nsc; c++){
+        for(p=0; p<Np; p++){
+          s = _mm256_loadu_si256((const __m256i *)
+                (data + hdr_stripper_databuf_data_idx8(0,bl[b].a0,p,c,0)));
+          xr[p] = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(s, 4), lo4));
+          xi[p] = _mm256_shuffle_epi8(lut, _mm256_and_si256(s, lo4));
+          s = _mm256_loadu_si256((const __m256i *)
+                (data + hdr_stripper_databuf_data_idx8(0,bl[b].a1,p,c,0)));
+          yr[p] = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(s, 4), lo4));
+          yi[p] = _mm256_shuffle_epi8(lut, _mm256_and_si256(s, lo4));
+        }
+        for(p0=0; p0<Np; p0++){
+          for(p1=0; p1<Np; p1++){
+            j = 2*(p0*Np + p1);
+            v[j]   = _mm256_madd_epi16(_mm256_add_epi16(dot8(xr[p0], yr[p1]),
+                                                        dot8(xi[p0], yi[p1])), ones);
+            v[j+1] = _mm256_madd_epi16(_mm256_sub_epi16(dot8(xi[p0], yr[p1]),
+                                                        dot8(xr[p0], yi[p1])), ones);
+          }
+        }
+        out = (__m256i *)(acc + b*HDR_CORR_BL_VALUES + c*HDR_CORR_NPP*2);
+        _mm256_storeu_si256(out, _mm256_add_epi32(_mm256_loadu_si256(out), corr_hsum8(v)));
+      }
+    }
+}
+#endif // HAVE_CORR_AVX2
+
+void hdr_corr_accumulate(int32_t *acc, const uint8_t *data, const hdr_corr_bl_t *bl,
+                         int b0, int b1, int scalar)
+{
+#ifdef HAVE_CORR_AVX2
+    if(!scalar){
+      corr_block_avx2(acc, data, bl, b0, b1);
+      return;
+    }
+#endif
+    corr_block_scalar(acc, data, bl, b0, b1);
+}
+
+// Adds the correlator's header datasets: Nbls, Nfreqs, freq_array,
+// chan_array, ant_1_array and ant_2_array
+static int corr_write_header(const void *arg, hid_t group_id, const hdr_int_info_t *info)
+{
+    const hdr_corr_writer_t *cw = (const hdr_corr_writer_t *)arg;
+    hsize_t dims[1];
+    hid_t dataset_id, dataspace_id;
+    double freq_array[Nsc];
+    double chan_width = 250.0/8192.0;
+    int32_t *ants;
+    int64_t val;
+    int c, b;
+
+    dims[0] = 1;
+    val = cw->nbl;
+    H5_WRITE_HEADER_I64(group_id, "Nbls", val, dims);
+    val = Nsc;
+    H5_WRITE_HEADER_I64(group_id, "Nfreqs", val, dims);
+    for(c=0; c<Nsc; c++){
+      freq_array[c] = (info->xid*N_CHAN_PER_X + info->chan[c]) * chan_width;
+    }
+    dims[0] = Nsc;
+    H5_WRITE_HEADER_ARRAY(group_id, "freq_array", H5T_IEEE_F64LE, H5T_NATIVE_DOUBLE,
+                          freq_array, dims);
+    H5_WRITE_HEADER_ARRAY(group_id, "chan_array", H5T_STD_I32LE, H5T_NATIVE_INT32,
+                          info->chan, dims);
+    if(!(ants = malloc(cw->nbl*sizeof(int32_t)))){
+      return HASHPIPE_ERR_SYS;
+    }
+    dims[0] = cw->nbl;
+    for(b=0; b<cw->nbl; b++){
+      ants[b] = cw->bl[b].a0;
+    }
+    H5_WRITE_HEADER_ARRAY(group_id, "ant_1_array", H5T_STD_I32LE, H5T_NATIVE_INT32,
+                          ants, dims);
+    for(b=0; b<cw->nbl; b++){
+      ants[b] = cw->bl[b].a1;
+    }
+    H5_WRITE_HEADER_ARRAY(group_id, "ant_2_array", H5T_STD_I32LE, H5T_NATIVE_INT32,
+                          ants, dims);
+    free(ants);
+    return HASHPIPE_OK;
+}
+
+int hdr_corr_writer_start(hdr_corr_writer_t *cw, const char *dir, int nblk,
+                          int ints_per_file, const hdr_corr_bl_t *bl, int nbl)
+{
+    hdr_int_product_t prod = {
+      .name = "corr",
+      .dset = "vis",
+      .type = H5T_STD_I32LE,
+      .rank = 4,
+      .dims = {nbl, Nsc, HDR_CORR_NPP, 2},
+      .nbytes = nbl*HDR_CORR_BL_VALUES*sizeof(int32_t),
+      .by_chan = 1,
+      .write_header = corr_write_header,
+      .arg = cw,
+    };
+    int rv;
+
+    cw->nbl = nbl;
+    if(!(cw->bl = malloc(nbl*sizeof(hdr_corr_bl_t)))){
+      return HASHPIPE_ERR_SYS;
+    }
+    memcpy(cw->bl, bl, nbl*sizeof(hdr_corr_bl_t));
+    rv = hdr_int_writer_start(&cw->w, &prod, dir, nblk, ints_per_file);
+    if(rv != HASHPIPE_OK){
+      free(cw->bl);
+    }
+    return rv;
+}
+
+void hdr_corr_writer_stop(hdr_corr_writer_t *cw)
+{
+    hdr_int_writer_stop(&cw->w);
+    free(cw->bl);
+}
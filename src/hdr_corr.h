@@ -0,0 +1,93 @@
+#ifndef _HDR_CORR_H
+#define _HDR_CORR_H
+
+/* Mini correlator.
+ *
+ * Once the stripper's workers have stripped a block they correlate the
+ * recorded channels of a list of baselines (CORRBL), adding
+ *
+ *   V[bl,c,p0p1] = sum_{m,t} x[a0,p0,c,m,t] * conj(x[a1,p1,c,m,t])
+ *
+ * to an integration buffer of int32 (re,im) pairs in (baseline, channel,
+ * pol product) order, pol products being p0p1 = 00, 01, 10, 11.  After
+ * CORRNBLK blocks the buffer is handed to a writer thread that appends it to
+ * a hera_volt_corr_<time>.h5 file holding
+ *
+ *   vis             (integration, baseline, channel, pol product, re/im) int32
+ *   time            (integration) uint64, ms at the first block
+ *   mcnt            (integration) uint64, mcnt of the first block
+ *   nblocks         (integration) int32, blocks integrated
+ *   header/...      Nants, Nbls, Npols, Nfreqs, ant_1_array, ant_2_array,
+ *                   freq_array, chan_array, chan_width, nblocks
+ *
+ * Every block adds at most N_TIME_PER_BLOCK*128 to a value, so up to
+ * HDR_CORR_MAX_NBLK blocks can be integrated without overflow.
+ */
+#include <stdint.h>
+#include "hdr_databuf.h"
+#include "hdr_int_writer.h"
+
+#define HDR_CORR_NPP        (Np*Np)                // pol products
+#define HDR_CORR_BL_VALUES  (Nsc*HDR_CORR_NPP*2)   // int32 values per baseline
+#define HDR_CORR_MAX_BL     (N_ANTS*(N_ANTS+1)/2)
+#define HDR_CORR_MAX_NBLK   65536
+#define HDR_CORR_FILE_INTS  256   // default integrations per file
+
+typedef struct {
+    int16_t a0, a1;
+} hdr_corr_bl_t;
+
+/* Parses a baseline list into bl, which must have room for HDR_CORR_MAX_BL
+ * baselines.  The list is comma separated items
+ *
+ *   a0:a1   the baseline of antennas a0 and a1
+ *   a:*     every baseline of antenna a (a:0 to a:N_ANTS-1)
+ *   auto    every autocorrelation
+ *   all     every baseline, autocorrelations included
+ *
+ * e.g. "auto,0:1,12:140".  Returns the number of baselines or, if spec is
+ * invalid or empty, -1.
+ */
+int hdr_corr_parse_baselines(const char *spec, hdr_corr_bl_t *bl);
+
+// Adds the visibilities of baselines b0 to b1-1 of stripped block data to
+// acc.  The AVX2 kernel is used unless scalar is set or it is not compiled in.
+void hdr_corr_accumulate(int32_t *acc, const uint8_t *data, const hdr_corr_bl_t *bl,
+                         int b0, int b1, int scalar);
+
+// Integration handed to the writer
+typedef hdr_int_info_t hdr_corr_int_t;
+
+/* Writer of correlator files (see hdr_int_writer.h), used like the power
+ * writer (see hdr_power.h): hdr_corr_writer_get returns the next integration
+ * buffer, zeroed, or NULL if the writer has not written it yet, and
+ * hdr_corr_writer_put queues it.  A new file is started every ints_per_file
+ * integrations and whenever the XID or the channel set changes.
+ */
+typedef struct hdr_corr_writer {
+    hdr_int_writer_t w;
+    int nbl;
+    hdr_corr_bl_t *bl;
+} hdr_corr_writer_t;
+
+// Allocates the buffers for the nbl baselines bl, which are copied, and
+// starts the writer thread.  Returns HASHPIPE_OK, HASHPIPE_ERR_SYS or, if the
+// HDF5 library is not thread-safe, HASHPIPE_ERR_GEN.
+int hdr_corr_writer_start(hdr_corr_writer_t *cw, const char *dir, int nblk,
+                          int ints_per_file, const hdr_corr_bl_t *bl, int nbl);
+
+static inline int32_t *hdr_corr_writer_get(hdr_corr_writer_t *cw)
+{
+    return (int32_t *)hdr_int_writer_get(&cw->w);
+}
+
+static inline void hdr_corr_writer_put(hdr_corr_writer_t *cw, int32_t *buf,
+                                       const hdr_corr_int_t *info)
+{
+    hdr_int_writer_put(&cw->w, buf, info);
+}
+
+// Writes any queued integrations, closes the file and frees the buffers
+void hdr_corr_writer_stop(hdr_corr_writer_t *cw);
+
+#endif // _HDR_CORR_H
@@ -12,29 +12,73 @@
 #include <sys/sem.h>
 #include <errno.h>
 #include <time.h>
-
-#ifdef DEBUG_SEMS
+#include <limits.h>
+#include <unistd.h>
 #include <pthread.h>
-static struct timespec start;
-static struct timespec now;
-#define ELAPSED_NS(stop) \
-  (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
-
-#define SEMLOG(pd, msg)                                        \
-  do {                                                         \
-    int orig_errno = errno;                                    \
-    clock_gettime(CLOCK_MONOTONIC, &now);                      \
-    fprintf(stderr, "%13ld tid %lu " msg " %d (%lx)\n",        \
-        ELAPSED_NS(now), pthread_self(), block_id,             \
-        hashpipe_databuf_total_mask((hashpipe_databuf_t *)pd)); \
-    errno = orig_errno;                                        \
-  } while(0)
-
-#else
-#define SEMLOG(pd, msg)
-#endif // DEBUG_SEMS
+#include <immintrin.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 
 #include "hdr_databuf.h"
+#include "hdr_stats.h"
+#include "hdr_trace.h"
+
+#define TRACE_FAILED(rv) ((rv) != HASHPIPE_OK ? HDR_TRACE_FAILED : 0)
+
+/*
+ * Histograms of the time the wait functions below take to get a block,
+ * published as DIWF* and DIWL* (input databuf, waits for free and filled
+ * blocks) and DSWF* and DSWL* (stripper databufs) by the histogram publisher
+ * (see hdr_stats.h).  The stripper databufs between all stages share theirs.
+ * A wait that times out is retried by its caller, so it is timed from the
+ * first call until one gets the block or fails otherwise, and waits that
+ * never get their block are not counted.
+ */
+enum {
+    WAIT_INPUT_FREE,
+    WAIT_INPUT_FILLED,
+    WAIT_STRP_FREE,
+    WAIT_STRP_FILLED,
+    N_WAIT_HISTS
+};
+
+static hdr_hist_t wait_hist[N_WAIT_HISTS];
+// Start of the wait of this thread in progress, 0 if none
+static __thread uint64_t wait_start_ns[N_WAIT_HISTS];
+static pthread_once_t wait_hist_once = PTHREAD_ONCE_INIT;
+
+static void wait_hist_register(void)
+{
+    hdr_hist_register(&wait_hist[WAIT_INPUT_FREE],   "DIWF");
+    hdr_hist_register(&wait_hist[WAIT_INPUT_FILLED], "DIWL");
+    hdr_hist_register(&wait_hist[WAIT_STRP_FREE],    "DSWF");
+    hdr_hist_register(&wait_hist[WAIT_STRP_FILLED],  "DSWL");
+}
+
+static inline uint64_t wait_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000*1000*1000 + ts.tv_nsec;
+}
+
+static inline void wait_hist_start(int h)
+{
+    if(!wait_start_ns[h]) {
+        wait_start_ns[h] = wait_clock_ns();
+    }
+}
+
+static inline void wait_hist_record(int h, int rv)
+{
+    if(rv == HASHPIPE_TIMEOUT) {
+        return;
+    }
+    if(rv == HASHPIPE_OK) {
+        hdr_hist_record(&wait_hist[h], wait_clock_ns() - wait_start_ns[h]);
+    }
+    wait_start_ns[h] = 0;
+}
 
 /*
  * Since the first element of hdr_input_databuf_t is a hashpipe_databuf_t, a
@@ -62,6 +106,210 @@ static struct timespec now;
  */
 
 
+/* -----------------
+ *   BLOCK HAND-OFF
+ * -----------------
+ */
+
+// Both databuf types start with the same header, so the functions below
+// take either as a hashpipe_databuf_t
+_Static_assert(offsetof(hdr_input_databuf_t, sync) == offsetof(hdr_stripper_databuf_t, sync),
+               "hdr_databuf_sync_t must be at the same offset in all databufs");
+
+static inline hdr_databuf_sync_t *db_sync(hashpipe_databuf_t *d)
+{
+    return &((hdr_input_databuf_t *)d)->sync;
+}
+
+// Reads DBFUTEX and DBSPIN for the databufs of instance_id
+static void db_sync_config(int instance_id, int *futex, int *spin)
+{
+    hashpipe_status_t st;
+
+    *futex = 0;
+    *spin = 1000;
+    if(hashpipe_status_attach(instance_id, &st) != HASHPIPE_OK) {
+        return;
+    }
+    hashpipe_status_lock_safe(&st);
+    hgeti4(st.buf, "DBFUTEX", futex);
+    hgeti4(st.buf, "DBSPIN", spin);
+    hputi4(st.buf, "DBFUTEX", *futex);
+    hputi4(st.buf, "DBSPIN", *spin);
+    hashpipe_status_unlock_safe(&st);
+    hashpipe_status_detach(&st);
+}
+
+// The futexes are in shared memory, so the process shared operations are
+// used
+static inline long futex_wait(uint32_t *p, uint32_t v, const struct timespec *timeout)
+{
+    return syscall(SYS_futex, p, FUTEX_WAIT, v, timeout, NULL, 0);
+}
+
+static inline long futex_wake(uint32_t *p)
+{
+    return syscall(SYS_futex, p, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Waits for block_id of s to be in state want.  Like the semaphore waits,
+// returns HASHPIPE_TIMEOUT after sleeping 250 ms without a change and
+// HASHPIPE_ERR_SYS with errno EINTR if interrupted by a signal.
+static int sync_wait(hdr_databuf_sync_t *s, int block_id, uint32_t want, int busy)
+{
+    static const struct timespec timeout = {0, 250*1000*1000};
+    uint32_t *p = &s->block[block_id].state;
+    uint32_t spin = s->spin;
+    uint32_t v;
+    uint32_t i;
+
+    for(i=0; ; i++) {
+        v = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+        if((v & ~HDR_BLOCK_WAITERS) == want) {
+            return HASHPIPE_OK;
+        }
+        if(busy) {
+            // A busy wait has no other cancellation point
+            if((i & 0xffff) == 0) {
+                pthread_testcancel();
+            }
+        } else if(i >= spin) {
+            break;
+        }
+        _mm_pause();
+    }
+
+    for(;;) {
+        // Tell set_* to wake us before sleeping
+        if(!(v & HDR_BLOCK_WAITERS)
+        && !__atomic_compare_exchange_n(p, &v, v | HDR_BLOCK_WAITERS, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+            if((v & ~HDR_BLOCK_WAITERS) == want) {
+                return HASHPIPE_OK;
+            }
+            continue;
+        }
+        if(futex_wait(p, v | HDR_BLOCK_WAITERS, &timeout) == -1) {
+            if(errno == ETIMEDOUT) {
+                return HASHPIPE_TIMEOUT;
+            }
+            if(errno == EINTR) {
+                return HASHPIPE_ERR_SYS;
+            }
+            // EAGAIN: the state changed before we slept
+        }
+        v = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+        if((v & ~HDR_BLOCK_WAITERS) == want) {
+            return HASHPIPE_OK;
+        }
+    }
+}
+
+static int sync_set(hdr_databuf_sync_t *s, int block_id, uint32_t state)
+{
+    uint32_t *p = &s->block[block_id].state;
+
+    if(__atomic_exchange_n(p, state, __ATOMIC_RELEASE) & HDR_BLOCK_WAITERS) {
+        futex_wake(p);
+    }
+    return HASHPIPE_OK;
+}
+
+static int db_wait(hashpipe_databuf_t *d, int block_id, uint32_t want, int busy)
+{
+    hdr_databuf_sync_t *s = db_sync(d);
+
+    if(!s->futex) {
+        if(want == HDR_BLOCK_FREE) {
+            return busy ? hashpipe_databuf_busywait_free(d, block_id)
+                        : hashpipe_databuf_wait_free(d, block_id);
+        }
+        return busy ? hashpipe_databuf_busywait_filled(d, block_id)
+                    : hashpipe_databuf_wait_filled(d, block_id);
+    }
+    if(block_id < 0 || block_id >= d->n_block) {
+        hashpipe_error(__FUNCTION__, "block_id=%d out of range [0, %d)",
+                       block_id, d->n_block);
+        return HASHPIPE_ERR_PARAM;
+    }
+    return sync_wait(s, block_id, want, busy);
+}
+
+static int db_set(hashpipe_databuf_t *d, int block_id, uint32_t state)
+{
+    hdr_databuf_sync_t *s = db_sync(d);
+
+    if(!s->futex) {
+        return state == HDR_BLOCK_FREE ? hashpipe_databuf_set_free(d, block_id)
+                                       : hashpipe_databuf_set_filled(d, block_id);
+    }
+    if(block_id < 0 || block_id >= d->n_block) {
+        hashpipe_error(__FUNCTION__, "block_id=%d out of range [0, %d)",
+                       block_id, d->n_block);
+        return HASHPIPE_ERR_PARAM;
+    }
+    return sync_set(s, block_id, state);
+}
+
+void hdr_databuf_set_futex(hashpipe_databuf_t *d, int futex, int spin)
+{
+    hdr_databuf_sync_t *s = db_sync(d);
+
+    s->spin = spin > 0 ? spin : 0;
+    s->futex = futex ? 1 : 0;
+    hdr_databuf_clear(d);
+}
+
+void hdr_databuf_clear(hashpipe_databuf_t *d)
+{
+    hdr_databuf_sync_t *s = db_sync(d);
+    int i;
+
+    hashpipe_databuf_clear(d);
+    for(i=0; i<HDR_DATABUF_MAX_BLOCKS; i++) {
+        sync_set(s, i, HDR_BLOCK_FREE);
+    }
+}
+
+int hdr_databuf_block_status(hashpipe_databuf_t *d, int block_id)
+{
+    hdr_databuf_sync_t *s = db_sync(d);
+
+    if(!s->futex) {
+        return hashpipe_databuf_block_status(d, block_id);
+    }
+    if(block_id < 0 || block_id >= d->n_block) {
+        return HASHPIPE_ERR_PARAM;
+    }
+    return (__atomic_load_n(&s->block[block_id].state, __ATOMIC_ACQUIRE)
+            & ~HDR_BLOCK_WAITERS) == HDR_BLOCK_FILLED;
+}
+
+int hdr_databuf_total_status(hashpipe_databuf_t *d)
+{
+    if(!db_sync(d)->futex) {
+        return hashpipe_databuf_total_status(d);
+    }
+    return __builtin_popcountll(hdr_databuf_total_mask(d));
+}
+
+uint64_t hdr_databuf_total_mask(hashpipe_databuf_t *d)
+{
+    hdr_databuf_sync_t *s = db_sync(d);
+    uint64_t mask = 0;
+    int i;
+
+    if(!s->futex) {
+        return hashpipe_databuf_total_mask(d);
+    }
+    for(i=0; i<d->n_block; i++) {
+        if(hdr_databuf_block_status(d, i) == 1) {
+            mask |= 1ULL << i;
+        }
+    }
+    return mask;
+}
+
 /* -----------------
  *   INPUT BUFFERS
  * ----------------- 
@@ -72,71 +320,108 @@ static struct timespec now;
  */
 hashpipe_databuf_t *hdr_input_databuf_create(int instance_id, int databuf_id)
 {
-#ifdef DEBUG_SEMS
-    // Init clock variables
-    if(databuf_id==1) {
-        clock_gettime(CLOCK_MONOTONIC, &start);
-        now.tv_sec = start.tv_sec;
-        now.tv_nsec = start.tv_nsec;
-    }
-#endif
+    pthread_once(&wait_hist_once, wait_hist_register);
 
     /* Calc databuf sizes */
-    size_t header_size = sizeof(hashpipe_databuf_t)
-                       + sizeof(hashpipe_databuf_cache_alignment);
+    size_t header_size = offsetof(hdr_input_databuf_t, block);
     size_t block_size  = sizeof(hdr_input_block_t);
     int    n_block = N_INPUT_BLOCKS + N_DEBUG_INPUT_BLOCKS;
 
-    return hashpipe_databuf_create(
+    hashpipe_databuf_t *d = hashpipe_databuf_create(
         instance_id, databuf_id, header_size, block_size, n_block);
+    int futex, spin;
+
+    if(d) {
+        db_sync_config(instance_id, &futex, &spin);
+        hdr_databuf_set_futex(d, futex, spin);
+    }
+    hdr_trace_buf(d, databuf_id, "input");
+    return d;
 }
 
 int hdr_input_databuf_wait_free(hdr_input_databuf_t *d, int block_id)
 {
     int rv;
-    SEMLOG(d, "wait free");
-    rv = hashpipe_databuf_wait_free((hashpipe_databuf_t *)d, block_id);
-    SEMLOG(d, "got  free");
+    wait_hist_start(WAIT_INPUT_FREE);
+    hdr_trace(HDR_TRACE_WAIT_FREE, d, block_id);
+    rv = db_wait((hashpipe_databuf_t *)d, block_id, HDR_BLOCK_FREE, 0);
+    hdr_trace(HDR_TRACE_GOT_FREE | TRACE_FAILED(rv), d, block_id);
+    wait_hist_record(WAIT_INPUT_FREE, rv);
     return rv;
 }
 
 int hdr_input_databuf_busywait_free(hdr_input_databuf_t *d, int block_id)
 {
     int rv;
-    SEMLOG(d, "busy-wait free");
-    rv = hashpipe_databuf_busywait_free((hashpipe_databuf_t *)d, block_id);
-    SEMLOG(d, "busy-got  free");
+    wait_hist_start(WAIT_INPUT_FREE);
+    hdr_trace(HDR_TRACE_WAIT_FREE | HDR_TRACE_BUSY, d, block_id);
+    rv = db_wait((hashpipe_databuf_t *)d, block_id, HDR_BLOCK_FREE, 1);
+    hdr_trace(HDR_TRACE_GOT_FREE | HDR_TRACE_BUSY | TRACE_FAILED(rv), d, block_id);
+    wait_hist_record(WAIT_INPUT_FREE, rv);
     return rv;
 }
 
 int hdr_input_databuf_wait_filled(hdr_input_databuf_t *d, int block_id)
 {
     int rv;
-    SEMLOG(d, "wait fill");
-    rv = hashpipe_databuf_wait_filled((hashpipe_databuf_t *)d, block_id);
-    SEMLOG(d, "got  fill");
+    wait_hist_start(WAIT_INPUT_FILLED);
+    hdr_trace(HDR_TRACE_WAIT_FILLED, d, block_id);
+    rv = db_wait((hashpipe_databuf_t *)d, block_id, HDR_BLOCK_FILLED, 0);
+    hdr_trace(HDR_TRACE_GOT_FILLED | TRACE_FAILED(rv), d, block_id);
+    wait_hist_record(WAIT_INPUT_FILLED, rv);
     return rv;
 }
 
 int hdr_input_databuf_busywait_filled(hdr_input_databuf_t *d, int block_id)
 {
     int rv;
-    SEMLOG(d, "busy-wait fill");
-    rv = hashpipe_databuf_busywait_filled((hashpipe_databuf_t *)d, block_id);
-    SEMLOG(d, "busy-got  fill");
+    wait_hist_start(WAIT_INPUT_FILLED);
+    hdr_trace(HDR_TRACE_WAIT_FILLED | HDR_TRACE_BUSY, d, block_id);
+    rv = db_wait((hashpipe_databuf_t *)d, block_id, HDR_BLOCK_FILLED, 1);
+    hdr_trace(HDR_TRACE_GOT_FILLED | HDR_TRACE_BUSY | TRACE_FAILED(rv), d, block_id);
+    wait_hist_record(WAIT_INPUT_FILLED, rv);
     return rv;
 }
 
 int hdr_input_databuf_set_free(hdr_input_databuf_t *d, int block_id)
 {
-    SEMLOG(d, "set  free");
-    return hashpipe_databuf_set_free((hashpipe_databuf_t *)d, block_id);
+    hdr_trace(HDR_TRACE_SET_FREE, d, block_id);
+    return db_set((hashpipe_databuf_t *)d, block_id, HDR_BLOCK_FREE);
 }
 
 int hdr_input_databuf_set_filled(hdr_input_databuf_t *d, int block_id)
 {
-    SEMLOG(d, "set  fill");
-    return hashpipe_databuf_set_filled((hashpipe_databuf_t *)d, block_id);
+    hdr_trace(HDR_TRACE_SET_FILLED, d, block_id);
+    return db_set((hashpipe_databuf_t *)d, block_id, HDR_BLOCK_FILLED);
+}
+
+int hdr_input_block_zero_missing(hdr_input_block_t *b)
+{
+    const uint64_t *map = b->header.pkt_map;
+    uint8_t *data = (uint8_t *)b->data;
+    int bit, m, g, cp, a;
+    int nmissing = 0;
+
+    for(bit=0; bit<N_PACKETS_PER_BLOCK; bit++) {
+        // Skip words of received packets
+        if(!(bit&63) && map[bit>>6] == ~0ULL && bit+64 <= N_PACKETS_PER_BLOCK) {
+            bit += 63;
+            continue;
+        }
+        if(hdr_pkt_map_test(map, bit)) {
+            continue;
+        }
+        nmissing++;
+        cp = bit % N_PKT_CPKTS;
+        g = (bit / N_PKT_CPKTS) % N_PKT_AGRPS;
+        m = bit / (N_PKT_CPKTS*N_PKT_AGRPS);
+        for(a=g*N_ANTS_PER_PACKET; a<(g+1)*N_ANTS_PER_PACKET; a++) {
+            memset(data + hdr_input_databuf_data_idx8(m, a, 0, cp*N_CHAN_PER_PACKET, 0),
+                   0, N_CHAN_PER_PACKET*Nt*Np);
+        }
+    }
+
+    return nmissing;
 }
 
 /* --------------------
@@ -149,70 +434,185 @@ int hdr_input_databuf_set_filled(hdr_input_databuf_t *d, int block_id)
  */
 hashpipe_databuf_t *hdr_stripper_databuf_create(int instance_id, int databuf_id)
 {
-#ifdef DEBUG_SEMS
-    // Init clock variables
-    if(databuf_id==1) {
-        clock_gettime(CLOCK_MONOTONIC, &start);
-        now.tv_sec = start.tv_sec;
-        now.tv_nsec = start.tv_nsec;
-    }
-#endif
+    pthread_once(&wait_hist_once, wait_hist_register);
 
     /* Calc databuf sizes */
-    size_t header_size = sizeof(hashpipe_databuf_t)
-                       + sizeof(hashpipe_databuf_cache_alignment);
+    size_t header_size = offsetof(hdr_stripper_databuf_t, block);
     size_t block_size  = sizeof(hdr_stripper_block_t);
-    int    n_block = N_INPUT_BLOCKS + N_DEBUG_INPUT_BLOCKS;
+    int    n_block = N_STRP_BLOCKS + N_DEBUG_STRP_BLOCKS;
 
-    return hashpipe_databuf_create(
+    hashpipe_databuf_t *d = hashpipe_databuf_create(
         instance_id, databuf_id, header_size, block_size, n_block);
+    int futex, spin;
+
+    if(d) {
+        db_sync_config(instance_id, &futex, &spin);
+        hdr_databuf_set_futex(d, futex, spin);
+    }
+    hdr_trace_buf(d, databuf_id, "stripper");
+    return d;
 }
 
 int hdr_stripper_databuf_wait_free(hdr_stripper_databuf_t *d, int block_id)
 {
     int rv;
-    SEMLOG(d, "wait free");
-    rv = hashpipe_databuf_wait_free((hashpipe_databuf_t *)d, block_id);
-    SEMLOG(d, "got  free");
+    wait_hist_start(WAIT_STRP_FREE);
+    hdr_trace(HDR_TRACE_WAIT_FREE, d, block_id);
+    rv = db_wait((hashpipe_databuf_t *)d, block_id, HDR_BLOCK_FREE, 0);
+    hdr_trace(HDR_TRACE_GOT_FREE | TRACE_FAILED(rv), d, block_id);
+    wait_hist_record(WAIT_STRP_FREE, rv);
     return rv;
 }
 
 int hdr_stripper_databuf_busywait_free(hdr_stripper_databuf_t *d, int block_id)
 {
     int rv;
-    SEMLOG(d, "busy-wait free");
-    rv = hashpipe_databuf_busywait_free((hashpipe_databuf_t *)d, block_id);
-    SEMLOG(d, "busy-got  free");
+    wait_hist_start(WAIT_STRP_FREE);
+    hdr_trace(HDR_TRACE_WAIT_FREE | HDR_TRACE_BUSY, d, block_id);
+    rv = db_wait((hashpipe_databuf_t *)d, block_id, HDR_BLOCK_FREE, 1);
+    hdr_trace(HDR_TRACE_GOT_FREE | HDR_TRACE_BUSY | TRACE_FAILED(rv), d, block_id);
+    wait_hist_record(WAIT_STRP_FREE, rv);
     return rv;
 }
 
 int hdr_stripper_databuf_wait_filled(hdr_stripper_databuf_t *d, int block_id)
 {
     int rv;
-    SEMLOG(d, "wait fill");
-    rv = hashpipe_databuf_wait_filled((hashpipe_databuf_t *)d, block_id);
-    SEMLOG(d, "got  fill");
+    wait_hist_start(WAIT_STRP_FILLED);
+    hdr_trace(HDR_TRACE_WAIT_FILLED, d, block_id);
+    rv = db_wait((hashpipe_databuf_t *)d, block_id, HDR_BLOCK_FILLED, 0);
+    hdr_trace(HDR_TRACE_GOT_FILLED | TRACE_FAILED(rv), d, block_id);
+    wait_hist_record(WAIT_STRP_FILLED, rv);
     return rv;
 }
 
 int hdr_stripper_databuf_busywait_filled(hdr_stripper_databuf_t *d, int block_id)
 {
     int rv;
-    SEMLOG(d, "busy-wait fill");
-    rv = hashpipe_databuf_busywait_filled((hashpipe_databuf_t *)d, block_id);
-    SEMLOG(d, "busy-got  fill");
+    wait_hist_start(WAIT_STRP_FILLED);
+    hdr_trace(HDR_TRACE_WAIT_FILLED | HDR_TRACE_BUSY, d, block_id);
+    rv = db_wait((hashpipe_databuf_t *)d, block_id, HDR_BLOCK_FILLED, 1);
+    hdr_trace(HDR_TRACE_GOT_FILLED | HDR_TRACE_BUSY | TRACE_FAILED(rv), d, block_id);
+    wait_hist_record(WAIT_STRP_FILLED, rv);
     return rv;
 }
 
 int hdr_stripper_databuf_set_free(hdr_stripper_databuf_t *d, int block_id)
 {
-    SEMLOG(d, "set  free");
-    return hashpipe_databuf_set_free((hashpipe_databuf_t *)d, block_id);
+    hdr_trace(HDR_TRACE_SET_FREE, d, block_id);
+    return db_set((hashpipe_databuf_t *)d, block_id, HDR_BLOCK_FREE);
 }
 
 int hdr_stripper_databuf_set_filled(hdr_stripper_databuf_t *d, int block_id)
 {
-    SEMLOG(d, "set  fill");
-    return hashpipe_databuf_set_filled((hashpipe_databuf_t *)d, block_id);
+    hdr_trace(HDR_TRACE_SET_FILLED, d, block_id);
+    return db_set((hashpipe_databuf_t *)d, block_id, HDR_BLOCK_FILLED);
+}
+
+
+int hdr_stripper_block_zero_missing(hdr_stripper_block_t *b)
+{
+    const uint64_t *map = b->header.pkt_map;
+    uint8_t *data = (uint8_t *)b->data;
+    int bit, m, g, cp, a, p, c;
+    int nmissing = 0;
+
+    for(bit=0; bit<N_PACKETS_PER_BLOCK; bit++) {
+        if(!(bit&63) && map[bit>>6] == ~0ULL && bit+64 <= N_PACKETS_PER_BLOCK) {
+            bit += 63;
+            continue;
+        }
+        if(hdr_pkt_map_test(map, bit)) {
+            continue;
+        }
+        nmissing++;
+        cp = bit % N_PKT_CPKTS;
+        g = (bit / N_PKT_CPKTS) % N_PKT_AGRPS;
+        m = bit / (N_PKT_CPKTS*N_PKT_AGRPS);
+        for(c=0; c<Nsc; c++) {
+            if(b->header.chan[c] / N_CHAN_PER_PACKET != cp) {
+                continue;
+            }
+            for(a=g*N_ANTS_PER_PACKET; a<(g+1)*N_ANTS_PER_PACKET; a++) {
+                for(p=0; p<Np; p++) {
+                    memset(data + hdr_stripper_databuf_data_idx8(m, a, p, c, 0), 0, Nt);
+                }
+            }
+        }
+    }
+
+    return nmissing;
 }
 
+int hdr_pkt_map_flags(const uint64_t *pkt_map, const int32_t *chan, uint8_t *flags)
+{
+    int m, g, c, a;
+    int missing;
+    int nflags = 0;
+
+    for(m=0; m<Nm; m++) {
+        for(g=0; g<N_PKT_AGRPS; g++) {
+            missing = 0;
+            for(c=0; c<Nsc; c++) {
+                if(!hdr_pkt_map_test(pkt_map, hdr_pkt_bit(m, g, chan[c]/N_CHAN_PER_PACKET))) {
+                    missing = 1;
+                    break;
+                }
+            }
+            for(a=g*N_ANTS_PER_PACKET; a<(g+1)*N_ANTS_PER_PACKET; a++) {
+                flags[m*N_ANTS+a] = missing;
+            }
+            nflags += missing*N_ANTS_PER_PACKET;
+        }
+    }
+
+    return nflags;
+}
+
+
+/* ---------------------
+ *   CHANNEL SELECTION
+ * ---------------------
+ */
+
+int hdr_chan_set_parse(const char *spec, int32_t *chan)
+{
+    int32_t tmp[Nsc];
+    int n = 0;
+    long first, last;
+    char *p = (char *)spec;
+
+    while(*p) {
+        first = strtol(p, &p, 0);
+        last = first;
+        if(*p == '-') {
+            last = strtol(p+1, &p, 0);
+        }
+        if(first < 0 || last >= Nc || first > last || n + (last-first+1) > Nsc) {
+            return HASHPIPE_ERR_PARAM;
+        }
+        while(first <= last) {
+            tmp[n++] = first++;
+        }
+        while(*p == ' ') p++;
+        if(*p == ',') {
+            p++;
+        } else if(*p) {
+            return HASHPIPE_ERR_PARAM;
+        }
+    }
+
+    if(n != Nsc) {
+        return HASHPIPE_ERR_PARAM;
+    }
+    memcpy(chan, tmp, sizeof(tmp));
+    return HASHPIPE_OK;
+}
+
+void hdr_chan_set_default(int32_t *chan)
+{
+    int c;
+    for(c=0; c<Nsc; c++) {
+        chan[c] = c;
+    }
+}
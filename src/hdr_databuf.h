@@ -2,6 +2,11 @@
 #define _PAPER_DATABUF_H
 
 #include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "hashpipe_databuf.h"
 #include "config.h"
 
@@ -101,6 +106,68 @@
 // Number of complex elements = 2
 #define Nx 2
 
+/* Packet presence maps.  Every block header carries a bitmap with one bit per
+ * F engine packet of the block, set when the packet was received.  A packet
+ * holds the Nt time samples at one m of N_CHAN_PER_PACKET channels (a channel
+ * packet cp = c/N_CHAN_PER_PACKET) of N_ANTS_PER_PACKET antennas (an antenna
+ * group g = a/N_ANTS_PER_PACKET), and is bit hdr_pkt_bit(m,g,cp) of the map.
+ * Data of packets that were not received are zeroed before they are used.
+ */
+#define N_ANTS_PER_PACKET    (N_INPUTS_PER_PACKET/2)
+#define N_PKT_AGRPS          (Na/N_ANTS_PER_PACKET)
+#define N_PKT_CPKTS          (Nc/N_CHAN_PER_PACKET)
+#define N_PKT_MAP_WORDS      ((N_PACKETS_PER_BLOCK+255)/256*4)
+
+#define hdr_pkt_bit(m,g,cp) \
+  ((((m)*N_PKT_AGRPS + (g))*N_PKT_CPKTS) + (cp))
+
+#if    N_PACKETS_PER_BLOCK != Nm*N_PKT_AGRPS*N_PKT_CPKTS
+#error N_PACKETS_PER_BLOCK != Nm*N_PKT_AGRPS*N_PKT_CPKTS
+#endif
+
+static inline void hdr_pkt_map_set(uint64_t *map, int bit)
+{
+    map[bit>>6] |= 1ULL << (bit&63);
+}
+
+static inline int hdr_pkt_map_test(const uint64_t *map, int bit)
+{
+    return (map[bit>>6] >> (bit&63)) & 1;
+}
+
+// Clears map, i.e. marks every packet missing
+static inline void hdr_pkt_map_clear(uint64_t *map)
+{
+#ifdef __AVX2__
+    int i;
+    for(i=0; i<N_PKT_MAP_WORDS; i+=4) {
+        _mm256_storeu_si256((__m256i *)(map+i), _mm256_setzero_si256());
+    }
+#else
+    memset(map, 0, N_PKT_MAP_WORDS*sizeof(uint64_t));
+#endif
+}
+
+// Sets the bit of every packet of a block in map
+static inline void hdr_pkt_map_fill(uint64_t *map)
+{
+    int i, n;
+    for(i=0; i<N_PKT_MAP_WORDS; i++) {
+        n = N_PACKETS_PER_BLOCK - 64*i;
+        map[i] = n >= 64 ? ~0ULL : n > 0 ? (1ULL << n) - 1 : 0;
+    }
+}
+
+// Returns the number of packets present in map
+static inline int hdr_pkt_map_count(const uint64_t *map)
+{
+    int i, n = 0;
+    for(i=0; i<N_PKT_MAP_WORDS; i++) {
+        n += __builtin_popcountll(map[i]);
+    }
+    return n;
+}
+
 // Computes hdr_input_databuf_t data word (uint64_t) offset for complex data
 // word corresponding to the given parameters for HERA F engine packets.
 
@@ -126,6 +193,7 @@
 typedef struct hdr_input_header {
   int64_t good_data; // functions as a boolean, 64 bit to maintain word alignment
   uint64_t mcnt;     // mcount of first packet
+  uint64_t pkt_map[N_PKT_MAP_WORDS]; // packets received, see hdr_pkt_bit
 } hdr_input_header_t;
 
 typedef uint8_t hdr_input_header_cache_alignment[
@@ -143,12 +211,73 @@ typedef uint8_t hashpipe_databuf_cache_alignment[
   CACHE_ALIGNMENT - (sizeof(hashpipe_databuf_t)%CACHE_ALIGNMENT)
 ];
 
+/*
+ * BLOCK HAND-OFF
+ *
+ * By default the wait and set functions below hand blocks off with
+ * hashpipe's SysV semaphores, i.e. a system call each.  If DBFUTEX is 1 in
+ * the status buffer when a databuf is created, they use the state words of
+ * hdr_databuf_sync_t in the databuf header instead.  set_* stores the new
+ * state and only makes a futex wake system call if a thread sleeps on it.
+ * wait_* checks the state DBSPIN times (default 1000, about 50 us) before
+ * sleeping on it with a futex wait, and busywait_* never sleeps.  Each state
+ * word has its own cache line.
+ *
+ * Block states of a DBFUTEX databuf are not visible to hashpipe_check_databuf
+ * or the hashpipe_databuf_* status functions, only to the hdr_*_databuf_*
+ * ones.
+ */
+#define HDR_DATABUF_MAX_BLOCKS 16
+
+#define HDR_BLOCK_FREE    0
+#define HDR_BLOCK_FILLED  1
+#define HDR_BLOCK_WAITERS 2  // a thread sleeps on the state word
+
+typedef struct {
+  uint32_t state;     // HDR_BLOCK_*
+  uint8_t padding[CACHE_ALIGNMENT - sizeof(uint32_t)];
+} hdr_block_sync_t;
+
+typedef struct {
+  uint32_t futex;     // 1 if the state words are used
+  uint32_t spin;      // checks before sleeping
+  uint8_t padding[CACHE_ALIGNMENT - 2*sizeof(uint32_t)];
+  hdr_block_sync_t block[HDR_DATABUF_MAX_BLOCKS];
+} hdr_databuf_sync_t;
+
 typedef struct hdr_input_databuf {
   hashpipe_databuf_t header;
   hashpipe_databuf_cache_alignment padding; // Maintain cache alignment
+  hdr_databuf_sync_t sync;
   hdr_input_block_t block[N_INPUT_BLOCKS+N_DEBUG_INPUT_BLOCKS];
 } hdr_input_databuf_t;
 
+#if N_INPUT_BLOCKS+N_DEBUG_INPUT_BLOCKS > HDR_DATABUF_MAX_BLOCKS
+#error N_INPUT_BLOCKS+N_DEBUG_INPUT_BLOCKS must not exceed HDR_DATABUF_MAX_BLOCKS
+#endif
+
+/*
+ * FUNCTIONS OF BOTH DATABUF TYPES
+ */
+
+// Switches databuf d, which must be a hdr_input_databuf_t or
+// hdr_stripper_databuf_t that no thread uses at the moment, to the futex
+// hand-off with spin checks before sleeping (futex 1) or back to the
+// semaphores (futex 0), and marks all blocks free
+void hdr_databuf_set_futex(hashpipe_databuf_t *d, int futex, int spin);
+
+// Marks all blocks of d free
+void hdr_databuf_clear(hashpipe_databuf_t *d);
+
+// Returns 1 if block block_id of d is filled, otherwise 0
+int hdr_databuf_block_status(hashpipe_databuf_t *d, int block_id);
+
+// Returns the number of filled blocks of d
+int hdr_databuf_total_status(hashpipe_databuf_t *d);
+
+// Returns a mask of the filled blocks of d
+uint64_t hdr_databuf_total_mask(hashpipe_databuf_t *d);
+
 
 /*
  * INPUT BUFFER FUNCTIONS
@@ -168,17 +297,17 @@ static inline int hdr_input_databuf_detach(hdr_input_databuf_t *d)
 
 static inline void hdr_input_databuf_clear(hdr_input_databuf_t *d)
 {
-    hashpipe_databuf_clear((hashpipe_databuf_t *)d);
+    hdr_databuf_clear((hashpipe_databuf_t *)d);
 }
 
 static inline int hdr_input_databuf_block_status(hdr_input_databuf_t *d, int block_id)
 {
-    return hashpipe_databuf_block_status((hashpipe_databuf_t *)d, block_id);
+    return hdr_databuf_block_status((hashpipe_databuf_t *)d, block_id);
 }
 
 static inline int hdr_input_databuf_total_status(hdr_input_databuf_t *d)
 {
-    return hashpipe_databuf_total_status((hashpipe_databuf_t *)d);
+    return hdr_databuf_total_status((hashpipe_databuf_t *)d);
 }
 
 
@@ -194,6 +323,10 @@ int hdr_input_databuf_set_free(hdr_input_databuf_t *d, int block_id);
 
 int hdr_input_databuf_set_filled(hdr_input_databuf_t *d, int block_id);
 
+// Zeroes the data of the packets missing from the pkt_map of block b.
+// Returns the number of missing packets.
+int hdr_input_block_zero_missing(hdr_input_block_t *b);
+
 
 
 /*
@@ -255,11 +388,55 @@ int hdr_input_databuf_set_filled(hdr_input_databuf_t *d, int block_id);
 #define hdr_stripper_databuf_data_idx256(m,a,p,c,t) \
   ((((a)*Nsc*Nm*Nt*Np) + ((p)*Nsc*Nm*Nt) + ((c)*Nm*Nt) + ((m)*Nt) + (t))/ sizeof(__m256i))
 
+/* Requantized blocks.  hdr_requant_thread can requantize the 4b+4b samples
+ * of a stripped block to 2b+2b (nbits == 2 in the block header).  The block
+ * keeps the (a,p,c,m,t) order but holds two samples per byte, the earlier
+ * one in the high nibble, so it is N_BYTES_PER_RQNT_BLOCK bytes long.  Each
+ * sample nibble is the 2 bit code of the real part in bits 3-2 and of the
+ * imaginary part in bits 1-0.  With the threshold T = thresh[a*Np+p] of the
+ * input, a 4 bit value v is coded as
+ *
+ *   0  v <= -T        1  -T < v < 0        2  0 <= v < T        3  v >= T
+ *
+ * i.e. the codes stand for the levels -3, -1, +1 and +3 in offset binary.
+ */
+#define N_BYTES_PER_RQNT_BLOCK    (N_BYTES_PER_STRP_BLOCK/2)
+
+/* Beam blocks.  hdr_beam_thread can take the place of hdr_strip_thread and
+ * fill stripper blocks with nbeams (1 to N_MAX_BEAMS) tied-array beams
+ * instead of antennas (nbeams > 0 in the block header).  Beam b takes the
+ * place of antenna b, so a beam block is laid out as (b,p,c,m,t) and only
+ * its first nbeams antenna rows hold data.  Beam blocks can be requantized
+ * like antenna blocks.
+ */
+#define N_MAX_BEAMS               16
+
+// The recorded channels are selected at runtime.  chan[c] is the X engine
+// channel (0 to Nc-1) stored at stripper channel index c.
 typedef struct hdr_stripper_header{
    int64_t good_data;  // boolean
    uint64_t mcnt;      //mcount of the first packet
+   int32_t chan[N_STRP_CHANS_PER_X]; // X engine channel of each recorded channel
+   int32_t nbits;      // bits per real or imaginary value: 4, or 2 if requantized
+   uint8_t thresh[N_INPUTS]; // 2 bit threshold of each (a,p), if nbits == 2
+   int32_t nbeams;     // beams in place of antennas, 0 for antenna data
+   uint64_t pkt_map[N_PKT_MAP_WORDS]; // F engine packets received, see hdr_pkt_bit
 } hdr_stripper_header_t;
 
+// Returns the number of antenna (or beam) rows of a block with header h
+static inline int hdr_stripper_nants(const hdr_stripper_header_t *h)
+{
+    return h->nbeams > 0 ? h->nbeams : N_ANTS;
+}
+
+// Returns the number of data bytes of a block with header h
+static inline size_t hdr_stripper_data_bytes(const hdr_stripper_header_t *h)
+{
+    size_t n = (size_t)hdr_stripper_nants(h) * (N_BYTES_PER_STRP_BLOCK/N_ANTS);
+
+    return h->nbits == 2 ? n/2 : n;
+}
+
 typedef uint8_t hdr_stripper_header_cache_alignment[
     CACHE_ALIGNMENT - (sizeof(hdr_stripper_header_t)%CACHE_ALIGNMENT)
 ];
@@ -277,9 +454,31 @@ typedef uint8_t hdr_stripper_block_cache_alignment[
 typedef struct hdr_stripper_databuf{
   hashpipe_databuf_t header;
   hashpipe_databuf_cache_alignment padding;
+  hdr_databuf_sync_t sync;
   hdr_stripper_block_t block[N_STRP_BLOCKS + N_DEBUG_STRP_BLOCKS];
 } hdr_stripper_databuf_t;
 
+#if N_STRP_BLOCKS+N_DEBUG_STRP_BLOCKS > HDR_DATABUF_MAX_BLOCKS
+#error N_STRP_BLOCKS+N_DEBUG_STRP_BLOCKS must not exceed HDR_DATABUF_MAX_BLOCKS
+#endif
+
+/*
+ * RECORDED CHANNEL SELECTION
+ */
+
+// Status key holding the recorded channel set.  Its value is a comma separated
+// list of X engine channels and/or first-last ranges, e.g. "0-3,100,200-202",
+// that must name exactly Nsc channels.  The default is "0-<Nsc-1>".
+#define STRPCHAN_KEY "STRPCHAN"
+
+// Parses a channel set specification into chan[Nsc].  Returns HASHPIPE_OK or,
+// leaving chan unchanged, HASHPIPE_ERR_PARAM if spec is malformed, names a
+// channel outside 0 to Nc-1, or does not name exactly Nsc channels.
+int hdr_chan_set_parse(const char *spec, int32_t *chan);
+
+// Sets chan[Nsc] to the default channel set (channels 0 to Nsc-1)
+void hdr_chan_set_default(int32_t *chan);
+
 /*
  * STRIPPED BUFFER FUNCTIONS
  */
@@ -298,17 +497,17 @@ static inline int hdr_stripper_databuf_detach(hdr_stripper_databuf_t *d)
 
 static inline void hdr_stripper_databuf_clear(hdr_stripper_databuf_t *d)
 {
-    hashpipe_databuf_clear((hashpipe_databuf_t *)d);
+    hdr_databuf_clear((hashpipe_databuf_t *)d);
 }
 
 static inline int hdr_stripper_databuf_block_status(hdr_stripper_databuf_t *d, int block_id)
 {
-    return hashpipe_databuf_block_status((hashpipe_databuf_t *)d, block_id);
+    return hdr_databuf_block_status((hashpipe_databuf_t *)d, block_id);
 }
 
 static inline int hdr_stripper_databuf_total_status(hdr_stripper_databuf_t *d)
 {
-    return hashpipe_databuf_total_status((hashpipe_databuf_t *)d);
+    return hdr_databuf_total_status((hashpipe_databuf_t *)d);
 }
 
 
@@ -324,4 +523,13 @@ int hdr_stripper_databuf_set_free(hdr_stripper_databuf_t *d, int block_id);
 
 int hdr_stripper_databuf_set_filled(hdr_stripper_databuf_t *d, int block_id);
 
+// Zeroes the recorded channels of the packets missing from the pkt_map of
+// block b, which must hold 4 bit antenna data.  Returns the number of missing
+// packets.
+int hdr_stripper_block_zero_missing(hdr_stripper_block_t *b);
+
+// Sets flags[m*N_ANTS+a] to 1 if any recorded channel chan[] of antenna a at
+// m is missing from pkt_map, otherwise to 0.  Returns the number of flags set.
+int hdr_pkt_map_flags(const uint64_t *pkt_map, const int32_t *chan, uint8_t *flags);
+
 #endif // _PAPER_DATABUF_H
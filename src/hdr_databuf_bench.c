@@ -0,0 +1,219 @@
+/* hdr_databuf_bench.c
+ *
+ * Hand-off latency and CPU cost of the databuf block hand-off, SysV
+ * semaphores against futexes (see hdr_databuf.h).  A producer and a consumer
+ * thread pass one block of a hdr_stripper_databuf back and forth, each
+ * optionally busy with WORK_NS ns of work per block, and report the time per
+ * hand-off (beyond the work), the CPU time per block of each thread and
+ * their context switches.
+ *
+ * The databuf is created for hashpipe instance INSTANCE (default 15) and
+ * removed at the end.
+ *
+ * Usage: hdr_databuf_bench [-n ITERATIONS] [-i INSTANCE] [-s SPIN] [-w WORK_NS]
+ *                          [-c PRODUCER_CPU,CONSUMER_CPU]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/sem.h>
+#include <sys/resource.h>
+
+#include "hashpipe.h"
+#include "hdr_databuf.h"
+
+#define ELAPSED_NS(start,stop) \
+  (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
+
+typedef struct {
+    const char *name;
+    int futex;
+    int spin;               // -1 for the -s value
+    int busy;
+} bench_mode_t;
+
+static const bench_mode_t modes[] = {
+    {"sem wait",       0,  0, 0},
+    {"sem busywait",   0,  0, 1},
+    {"futex sleep",    1,  0, 0},
+    {"futex spin",     1, -1, 0},
+    {"futex busywait", 1,  0, 1},
+};
+
+typedef struct {
+    hdr_stripper_databuf_t *db;
+    int producer;
+    int busy;
+    int cpu;
+    long iterations;
+    long work_ns;
+    int64_t cpu_ns;         // thread CPU time
+    long nvcsw;             // voluntary context switches
+    long nivcsw;            // involuntary context switches
+} bench_thread_t;
+
+static void work(long ns)
+{
+    struct timespec start, now;
+
+    if(ns <= 0) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while(ELAPSED_NS(start, now) < ns);
+}
+
+static void *bench_thread(void *arg)
+{
+    bench_thread_t *t = (bench_thread_t *)arg;
+    struct timespec cpu;
+    struct rusage ru;
+    cpu_set_t cpuset;
+    long i;
+    int rv;
+
+    if(t->cpu >= 0) {
+        CPU_ZERO(&cpuset);
+        CPU_SET(t->cpu, &cpuset);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+    }
+
+    for(i=0; i<t->iterations; i++) {
+        if(t->producer) {
+            do {
+                rv = t->busy ? hdr_stripper_databuf_busywait_free(t->db, 0)
+                             : hdr_stripper_databuf_wait_free(t->db, 0);
+            } while(rv == HASHPIPE_TIMEOUT);
+        } else {
+            do {
+                rv = t->busy ? hdr_stripper_databuf_busywait_filled(t->db, 0)
+                             : hdr_stripper_databuf_wait_filled(t->db, 0);
+            } while(rv == HASHPIPE_TIMEOUT);
+        }
+        if(rv != HASHPIPE_OK) {
+            fprintf(stderr, "wait error %d\n", rv);
+            break;
+        }
+        work(t->work_ns);
+        if(t->producer) {
+            hdr_stripper_databuf_set_filled(t->db, 0);
+        } else {
+            hdr_stripper_databuf_set_free(t->db, 0);
+        }
+    }
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    t->cpu_ns = (int64_t)cpu.tv_sec*1000*1000*1000 + cpu.tv_nsec;
+    getrusage(RUSAGE_THREAD, &ru);
+    t->nvcsw = ru.ru_nvcsw;
+    t->nivcsw = ru.ru_nivcsw;
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    long iterations = 100000;
+    int instance_id = 15;
+    int spin = 1000;
+    long work_ns = 0;
+    int cpus[2] = {-1, -1};
+    hdr_stripper_databuf_t *db;
+    bench_thread_t t[2];
+    pthread_t thread[2];
+    struct timespec start, stop;
+    double handoff_ns;
+    int shmid, semid;
+    int opt, m, i;
+
+    while((opt = getopt(argc, argv, "n:i:s:w:c:h")) != -1) {
+        switch(opt) {
+        case 'n':
+            iterations = atol(optarg);
+            break;
+        case 'i':
+            instance_id = atoi(optarg);
+            break;
+        case 's':
+            spin = atoi(optarg);
+            break;
+        case 'w':
+            work_ns = atol(optarg);
+            break;
+        case 'c':
+            if(sscanf(optarg, "%d,%d", &cpus[0], &cpus[1]) != 2) {
+                fprintf(stderr, "-c takes PRODUCER_CPU,CONSUMER_CPU\n");
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n ITERATIONS] [-i INSTANCE] [-s SPIN] [-w WORK_NS]\n"
+                    "          [-c PRODUCER_CPU,CONSUMER_CPU]\n", argv[0]);
+            return 1;
+        }
+    }
+    if(iterations < 1) {
+        fprintf(stderr, "ITERATIONS must be positive\n");
+        return 1;
+    }
+
+    db = (hdr_stripper_databuf_t *)hdr_stripper_databuf_create(instance_id, 1);
+    if(!db) {
+        fprintf(stderr, "error creating databuf for instance %d\n", instance_id);
+        return 1;
+    }
+    shmid = db->header.shmid;
+    semid = db->header.semid;
+
+    printf("%ld blocks, %ld ns work per block and thread, producer CPU %d, consumer CPU %d\n",
+           iterations, work_ns, cpus[0], cpus[1]);
+    printf("%-16s %12s %14s %14s %10s %10s\n", "mode", "ns/hand-off",
+           "prod CPU ns", "cons CPU ns", "vol cs", "invol cs");
+
+    for(m=0; m<sizeof(modes)/sizeof(modes[0]); m++) {
+        hdr_databuf_set_futex((hashpipe_databuf_t *)db, modes[m].futex,
+                              modes[m].spin < 0 ? spin : modes[m].spin);
+
+        for(i=0; i<2; i++) {
+            memset(&t[i], 0, sizeof(t[i]));
+            t[i].db = db;
+            t[i].producer = i == 0;
+            t[i].busy = modes[m].busy;
+            t[i].cpu = cpus[i];
+            t[i].iterations = iterations;
+            t[i].work_ns = work_ns;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for(i=0; i<2; i++) {
+            pthread_create(&thread[i], NULL, bench_thread, &t[i]);
+        }
+        for(i=0; i<2; i++) {
+            pthread_join(thread[i], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+
+        // Each block is handed off twice (filled and back free), with the
+        // work of both threads in between
+        handoff_ns = (ELAPSED_NS(start, stop) - 2.0 * iterations * work_ns)
+                     / (2.0 * iterations);
+        printf("%-16s %12.0f %14.0f %14.0f %10ld %10ld\n", modes[m].name, handoff_ns,
+               (double)t[0].cpu_ns / iterations - work_ns,
+               (double)t[1].cpu_ns / iterations - work_ns,
+               t[0].nvcsw + t[1].nvcsw, t[0].nivcsw + t[1].nivcsw);
+    }
+
+    hdr_stripper_databuf_detach(db);
+    shmctl(shmid, IPC_RMID, NULL);
+    semctl(semid, 0, IPC_RMID);
+
+    return 0;
+}
@@ -17,12 +17,15 @@
 
 #include "hashpipe.h"
 #include "hdr_databuf.h"
+#include "hdr_trace.h"
 
 static void *fake_thread_run(hashpipe_thread_args_t * args){
     hdr_input_databuf_t *db = (hdr_input_databuf_t *)args->obuf;
     hashpipe_status_t st = args->st;
     const char *status_key = args->thread_desc->skey;
 
+    hdr_trace_thread_name("fake_net");
+
     /* Main loop */
     int rv;              // store return of buffer status calls
     uint64_t mcnt = 0;   // mcnt of each block
@@ -63,6 +66,7 @@ static void *fake_thread_run(hashpipe_thread_args_t * args){
         // Set block header
         db->block[block_idx].header.good_data = 1;
         db->block[block_idx].header.mcnt = mcnt;
+        hdr_pkt_map_fill(db->block[block_idx].header.pkt_map);
         mcnt+=Nm;
 
         // Set all block data to zero
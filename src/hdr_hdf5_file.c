@@ -0,0 +1,320 @@
+/* hdr_hdf5_file.c
+ *
+ * Routines for creating and writing hera_volt_data_*.h5 files.  Used by
+ * hdr_write_thread and by the hdr_raw2hdf5 converter.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hashpipe.h"
+#include "hdr_hdf5_header.h"
+#include "hdr_compress.h"
+#include "hdr_nibble.h"
+
+// Fills in the header for a file recording channels chan[] of X engine xid.
+// freq_array is in MHz relative to the first F engine channel.
+struct hdf5_header *initialize_header(int xid, const int32_t *chan){
+   int i;
+   struct hdf5_header *header;
+   header = calloc(1, sizeof(hdf5_header_t));
+
+   header->Nants = N_ANTS;
+   header->Nants_data = N_ANTS;
+   header->Npols = 2;
+   header->Nfreqs = N_STRP_CHANS_PER_X;
+   header->channel_width = 250.0/8192.0;
+   header->Ntimes = 131072;  // 32 per block* 4096 blocks
+   //header->time_units = (char *)malloc(128, sizeof(char));
+   strcpy(header->time_units, "millisec");
+   header->nbits = 4;
+   header->nbeams = 0;
+
+   for(i=0; i<N_ANTS; i++)
+      header->ant_array[i] = i;
+
+   for(i=0; i<N_STRP_CHANS_PER_X; i++){
+      header->chan_array[i] = chan[i];
+      header->freq_array[i] = (xid*N_CHAN_PER_X + chan[i]) * header->channel_width;
+   }
+
+   return header;
+}
+
+void write_hdf5_header(hdf5_header_t *header, hid_t file_id){
+   hid_t group_id, dataset_id, dataspace_id;
+   hsize_t dims[1];
+
+   group_id = H5Gcreate2(file_id, "header", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+
+   dims[0] = 1;
+   H5_WRITE_HEADER_I64(group_id, "Nants", header->Nants, dims);
+   H5_WRITE_HEADER_I64(group_id, "Nants_data", header->Nants_data, dims);
+   H5_WRITE_HEADER_I64(group_id, "Nfreqs", header->Nfreqs, dims);
+   H5_WRITE_HEADER_I64(group_id, "Ntimes", header->Ntimes, dims);
+   H5_WRITE_HEADER_I64(group_id, "Npols", header->Npols, dims);
+   H5_WRITE_HEADER_I64(group_id, "chan_width", header->channel_width, dims);
+   H5_WRITE_HEADER_I64(group_id, "time_units", header->time_units, dims);
+   H5_WRITE_HEADER_I64(group_id, "nbits", header->nbits, dims);
+   H5_WRITE_HEADER_I64(group_id, "Nbeams", header->nbeams, dims);
+
+   dims[0] = N_STRP_CHANS_PER_X;
+   H5_WRITE_HEADER_ARRAY(group_id, "freq_array", H5T_IEEE_F64LE, H5T_NATIVE_DOUBLE,
+                         header->freq_array, dims);
+   H5_WRITE_HEADER_ARRAY(group_id, "chan_array", H5T_STD_I32LE, H5T_NATIVE_INT32,
+                         header->chan_array, dims);
+   H5Gclose(group_id);
+}
+
+// Gets the time (flags and thresh) file dataspaces and selects their first
+// entry as the template that h5_output_file_write moves to each block's entry
+static void select_time_entry(h5_output_file_t *f)
+{
+    hsize_t zero[] = {0, 0, 0};
+    hsize_t tcnt[] = {TCNT, 1, 1};
+    hsize_t tstd[] = {TSTD, 1, 1};
+    hsize_t tblk[] = {TBLK};
+    hsize_t flags_blk[] = {Nm, N_ANTS};
+    hsize_t thresh_blk[] = {TBLK, f->nants, 2};
+
+    f->time_file_space = H5Dget_space(f->time);
+    H5Sselect_hyperslab(f->time_file_space, H5S_SELECT_SET, zero, tstd, tcnt, tblk);
+    f->flags_file_space = H5Dget_space(f->flags);
+    H5Sselect_hyperslab(f->flags_file_space, H5S_SELECT_SET, zero, tstd, tcnt, flags_blk);
+    if (f->thresh >= 0){
+       f->thresh_file_space = H5Dget_space(f->thresh);
+       H5Sselect_hyperslab(f->thresh_file_space, H5S_SELECT_SET, zero, tstd, tcnt,
+                           thresh_blk);
+    }
+}
+
+int h5_output_file_create(h5_output_file_t *f, const char *filename,
+                          hdf5_header_t *header, uint64_t nblocks, int codec)
+{
+    // Bytes per block along the time axis, i.e. per (a,p,c)
+    hsize_t tbytes = N_TIME_PER_BLOCK * header->nbits / 4;
+    hsize_t file_dim[] = {header->Nants, DIM1, DIM2, nblocks*tbytes};
+    hsize_t file_max[] = {header->Nants, DIM1, DIM2, H5S_UNLIMITED};
+    hsize_t time_dim[] = {nblocks};
+    hsize_t time_max[] = {H5S_UNLIMITED};
+    hsize_t time_chunk[] = {TIME_CHUNK};
+    hsize_t time_entry_dim[] = {1};
+    hsize_t flags_dim[] = {nblocks*Nm, N_ANTS};
+    hsize_t flags_max[] = {H5S_UNLIMITED, N_ANTS};
+    hsize_t flags_chunk[] = {N_BLOCK_PER_FILE*Nm, N_ANTS};
+    hsize_t flags_entry_dim[] = {Nm, N_ANTS};
+    hsize_t thresh_dim[] = {nblocks, header->Nants, 2};
+    hsize_t thresh_max[] = {H5S_UNLIMITED, header->Nants, 2};
+    hsize_t thresh_chunk[] = {N_BLOCK_PER_FILE, header->Nants, 2};
+    hsize_t thresh_entry_dim[] = {1, header->Nants, 2};
+    hsize_t dblk[] = {DBLK};   // Chunk size, one block
+    hid_t data_file_space, time_file_space, flags_file_space, thresh_file_space;
+    hid_t data_dcpl, time_dcpl, flags_dcpl, thresh_dcpl;
+    uint64_t time_fill = 0;
+    uint8_t flags_fill = 1;
+    unsigned int bshuf_cd[] = HDR_BSHUF_CD_VALUES;
+
+    dblk[0] = header->Nants;
+    dblk[3] = tbytes;
+    f->nblocks = nblocks;
+    f->codec = codec;
+    f->nbits = header->nbits;
+    f->tbytes = tbytes;
+    f->nants = header->Nants;
+    f->thresh = -1;
+    f->file = H5Fcreate(filename, H5F_ACC_EXCL, H5P_DEFAULT, H5P_DEFAULT);
+    if (f->file < 0){
+       hashpipe_error(__FUNCTION__, "error creating %s", filename);
+       return HASHPIPE_ERR_SYS;
+    }
+    write_hdf5_header(header, f->file);
+
+    data_file_space = H5Screate_simple(FILE_DATA_RANK, file_dim, file_max);
+    time_file_space = H5Screate_simple(1, time_dim, time_max);
+    f->time_mem_space = H5Screate_simple(1, time_entry_dim, NULL);
+    flags_file_space = H5Screate_simple(2, flags_dim, flags_max);
+    f->flags_mem_space = H5Screate_simple(2, flags_entry_dim, NULL);
+
+    /* Reserve the data set's space in the file at creation time without
+       writing a fill value.  Every block of the file gets written anyway, so
+       creating a file costs no data I/O.  The small time data set is zero
+       filled so that the time stamps of unwritten blocks read as 0, and the
+       flags data set is filled with 1 so that unwritten blocks read as
+       flagged.  All data sets can grow past nblocks and shrink when the file
+       is closed.
+
+       Compressed files list the codec's filter in the data set's filter
+       pipeline.  The filter need not be available here since chunks are
+       compressed by the writer; it is optional so that chunks that do not
+       compress can be stored as is.  Compressed chunks vary in size, so their
+       space is allocated as they are written.
+    */
+    data_dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(data_dcpl, FILE_DATA_RANK, dblk);
+    if (codec == HDR_CODEC_LZ4){
+       H5Pset_filter(data_dcpl, HDR_BSHUF_FILTER_ID, H5Z_FLAG_OPTIONAL,
+                     HDR_BSHUF_NCD_VALUES, bshuf_cd);
+    }else if (codec == HDR_CODEC_NIBBLE){
+       H5Pset_filter(data_dcpl, HDR_NIB_FILTER_ID, H5Z_FLAG_OPTIONAL, 0, NULL);
+    }else{
+       H5Pset_alloc_time(data_dcpl, H5D_ALLOC_TIME_EARLY);
+    }
+    H5Pset_fill_time(data_dcpl, H5D_FILL_TIME_NEVER);
+    time_dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(time_dcpl, 1, time_chunk);
+    H5Pset_alloc_time(time_dcpl, H5D_ALLOC_TIME_EARLY);
+    H5Pset_fill_value(time_dcpl, H5T_NATIVE_UINT64, &time_fill);
+    flags_dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(flags_dcpl, 2, flags_chunk);
+    H5Pset_fill_value(flags_dcpl, H5T_NATIVE_UINT8, &flags_fill);
+
+    f->data = H5Dcreate(f->file, "data", H5T_STD_U8BE, data_file_space,
+                        H5P_DEFAULT, data_dcpl, H5P_DEFAULT);
+    if (f->data < 0){
+       hashpipe_error(__FUNCTION__, "error creating data set of %s", filename);
+       H5Fclose(f->file);
+       f->file = -1;
+       return HASHPIPE_ERR_GEN;
+    }
+    f->time = H5Dcreate(f->file, "time", H5T_STD_U64BE, time_file_space,
+                        H5P_DEFAULT, time_dcpl, H5P_DEFAULT);
+    f->flags = H5Dcreate(f->file, "flags", H5T_STD_U8LE, flags_file_space,
+                         H5P_DEFAULT, flags_dcpl, H5P_DEFAULT);
+    if (f->nbits == 2){
+       thresh_file_space = H5Screate_simple(3, thresh_dim, thresh_max);
+       f->thresh_mem_space = H5Screate_simple(3, thresh_entry_dim, NULL);
+       thresh_dcpl = H5Pcreate(H5P_DATASET_CREATE);
+       H5Pset_chunk(thresh_dcpl, 3, thresh_chunk);
+       f->thresh = H5Dcreate(f->file, "header/requant_thresh", H5T_STD_U8LE,
+                             thresh_file_space, H5P_DEFAULT, thresh_dcpl, H5P_DEFAULT);
+       H5Pclose(thresh_dcpl);
+       H5Sclose(thresh_file_space);
+    }
+    H5Pclose(data_dcpl);
+    H5Pclose(time_dcpl);
+    H5Pclose(flags_dcpl);
+    H5Sclose(data_file_space);
+    H5Sclose(time_file_space);
+    H5Sclose(flags_file_space);
+
+    select_time_entry(f);
+
+    return HASHPIPE_OK;
+}
+
+// Sets the length of the data sets to nblocks blocks
+static int set_nblocks(h5_output_file_t *f, uint64_t nblocks)
+{
+    hsize_t file_dim[] = {f->nants, DIM1, DIM2, nblocks*f->tbytes};
+    hsize_t time_dim[] = {nblocks};
+    hsize_t flags_dim[] = {nblocks*Nm, N_ANTS};
+    hsize_t thresh_dim[] = {nblocks, f->nants, 2};
+
+    if (H5Dset_extent(f->data, file_dim) < 0 || H5Dset_extent(f->time, time_dim) < 0 ||
+        H5Dset_extent(f->flags, flags_dim) < 0 ||
+        (f->thresh >= 0 && H5Dset_extent(f->thresh, thresh_dim) < 0)){
+       return HASHPIPE_ERR_GEN;
+    }
+    f->nblocks = nblocks;
+    H5Sclose(f->time_file_space);
+    H5Sclose(f->flags_file_space);
+    if (f->thresh >= 0){
+       H5Sclose(f->thresh_file_space);
+    }
+    select_time_entry(f);
+    return HASHPIPE_OK;
+}
+
+// Writes chunk data of nbytes bytes (and the block's time stamp) as block
+// blk_idx of the file.  filter_mask is 0 for a compressed chunk and 1 for a
+// block stored as is in a compressed file.
+static int write_chunk(h5_output_file_t *f, uint64_t blk_idx, const void *data,
+                       size_t nbytes, uint32_t filter_mask, uint64_t now)
+{
+    hsize_t doffset[] = {0, 0, 0, blk_idx*f->tbytes};
+    hssize_t toffset[] = {blk_idx};
+    herr_t status;
+
+    // Grow the file by doubling
+    if (blk_idx >= f->nblocks &&
+        set_nblocks(f, blk_idx < 2*f->nblocks ? 2*f->nblocks : blk_idx+1) != HASHPIPE_OK){
+       return HASHPIPE_ERR_GEN;
+    }
+
+    status = H5Dwrite_chunk(f->data, H5P_DEFAULT, filter_mask, doffset,
+                            nbytes, data);
+    if (status >= 0){
+       H5Soffset_simple(f->time_file_space, toffset);
+       status = H5Dwrite(f->time, H5T_NATIVE_UINT64, f->time_mem_space,
+                         f->time_file_space, H5P_DEFAULT, &now);
+    }
+    return status < 0 ? HASHPIPE_ERR_GEN : HASHPIPE_OK;
+}
+
+int h5_output_file_write(h5_output_file_t *f, uint64_t blk_idx,
+                         const void *data, uint64_t now)
+{
+    return write_chunk(f, blk_idx, data, f->nants*DIM1*DIM2*f->tbytes,
+                       f->codec != HDR_CODEC_NONE ? 1 : 0, now);
+}
+
+int h5_output_file_write_compressed(h5_output_file_t *f, uint64_t blk_idx,
+                                    const void *data, size_t nbytes, uint64_t now)
+{
+    return write_chunk(f, blk_idx, data, nbytes, 0, now);
+}
+
+int h5_output_file_write_thresh(h5_output_file_t *f, uint64_t blk_idx,
+                                const uint8_t *thresh)
+{
+    hssize_t toffset[] = {blk_idx, 0, 0};
+
+    if (f->thresh < 0 || blk_idx >= f->nblocks){
+       return HASHPIPE_ERR_GEN;
+    }
+    H5Soffset_simple(f->thresh_file_space, toffset);
+    return H5Dwrite(f->thresh, H5T_NATIVE_UINT8, f->thresh_mem_space,
+                    f->thresh_file_space, H5P_DEFAULT, thresh) < 0 ?
+           HASHPIPE_ERR_GEN : HASHPIPE_OK;
+}
+
+int h5_output_file_write_flags(h5_output_file_t *f, uint64_t blk_idx,
+                               const uint64_t *pkt_map, const int32_t *chan)
+{
+    hssize_t foffset[] = {blk_idx*Nm, 0};
+    uint8_t flags[Nm*N_ANTS];
+
+    if (blk_idx >= f->nblocks){
+       return HASHPIPE_ERR_GEN;
+    }
+    hdr_pkt_map_flags(pkt_map, chan, flags);
+    H5Soffset_simple(f->flags_file_space, foffset);
+    return H5Dwrite(f->flags, H5T_NATIVE_UINT8, f->flags_mem_space,
+                    f->flags_file_space, H5P_DEFAULT, flags) < 0 ?
+           HASHPIPE_ERR_GEN : HASHPIPE_OK;
+}
+
+int h5_output_file_truncate(h5_output_file_t *f, uint64_t nblocks)
+{
+    return nblocks < f->nblocks ? set_nblocks(f, nblocks) : HASHPIPE_OK;
+}
+
+void h5_output_file_close(h5_output_file_t *f)
+{
+    if (f->file < 0){
+       return;
+    }
+    H5Sclose(f->time_file_space);
+    H5Sclose(f->time_mem_space);
+    H5Sclose(f->flags_file_space);
+    H5Sclose(f->flags_mem_space);
+    H5Dclose(f->flags);
+    if (f->thresh >= 0){
+       H5Sclose(f->thresh_file_space);
+       H5Sclose(f->thresh_mem_space);
+       H5Dclose(f->thresh);
+    }
+    H5Dclose(f->data);
+    H5Dclose(f->time);
+    H5Fclose(f->file);
+    f->file = -1;
+}
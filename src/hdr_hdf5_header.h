@@ -1,5 +1,5 @@
 #ifndef _HERA_HDF5_HEADER_H
-#define HERA_HDF5_HEADER_H
+#define _HERA_HDF5_HEADER_H
 
 #include "hdr_databuf.h"
 #include <hdf5.h>
@@ -8,11 +8,11 @@
 #define N_BLOCK_PER_FILE 32
 #define N_TIME_PER_FILE  (N_BLOCK_PER_FILE * N_TIME_PER_BLOCK)
 
-/* The strategy for writing hdf5 files here is to build the entire file first
-   and then replace a chunk of the file as each block arrives and ready to 
-   be written. This is easy because once the size of the file is fixed, 
-   the number of blocks are set and the dataset does not need to be dynamically
-   expanded.
+/* The strategy for writing hdf5 files here is to allocate the file for the
+   expected number of blocks first and then fill in a chunk of the file as
+   each block arrives and is ready to be written. N_BLOCK_PER_FILE is the
+   default number of blocks per file; the data sets are extendible in time so
+   files can be rotated after a different number of blocks.
 */
 
 #define FILE_DATA_RANK   4
@@ -43,6 +43,7 @@
                           N_STRP_CHANS_PER_X, \
                           N_TIME_PER_BLOCK
 /* Time */
+#define TIME_CHUNK        64              // time entries per chunk
 #define TCNT              1
 #define TSTD              1
 #define TBLK              1               
@@ -55,6 +56,14 @@
   H5Sclose(dataspace_id); \
   H5Dclose(dataset_id)
 
+#define H5_WRITE_HEADER_ARRAY(group_id, h5_name, file_type, mem_type, buf, dims) \
+  dataspace_id = H5Screate_simple(1, dims, NULL); \
+  dataset_id = H5Dcreate2(group_id, h5_name, file_type, dataspace_id,\
+                        H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT); \
+  H5Dwrite(dataset_id, mem_type, H5S_ALL, H5S_ALL, H5P_DEFAULT, buf); \
+  H5Sclose(dataspace_id); \
+  H5Dclose(dataset_id)
+
 typedef struct hdf5_extra_keywords{
     uint64_t kwargs;
 } hdf5_extra_keywords_t;
@@ -65,12 +74,97 @@ typedef struct hdf5_header{
    int64_t Nants_data;          // Number of antennas with valid data
    int64_t Nfreqs;              // Number of frequency channels
    double  freq_array[N_STRP_CHANS_PER_X];  //Freq channel centers
+   int32_t chan_array[N_STRP_CHANS_PER_X];  //X engine channel of each freq
    int64_t Npols;               // Number of polarizations
    int64_t Ntimes;              // Number of time samples
    int64_t ant_array[N_ANTS];    // Order of antenna numbers in data
    double channel_width;
    char time_units[64];
+   int64_t nbits;               // Bits per real or imaginary value, 4 or 2
+   int64_t nbeams;              // Beams in place of the Nants antennas, or 0
 
 }hdf5_header_t;
 
+// Returns a newly allocated header for a file recording channels chan[] of X
+// engine xid.  The caller frees it.
+struct hdf5_header *initialize_header(int xid, const int32_t *chan);
+
+// Writes the header group of an HDF5 file
+void write_hdf5_header(hdf5_header_t *header, hid_t file_id);
+
+/* An open output file.  The file, its datasets and the time dataspaces stay
+   open until the file rotates.  Files are created with room for a given
+   number of blocks, grow as needed and can be truncated to the number of
+   blocks actually written before closing.  The data set is chunked with one
+   chunk per stripper block (DBLK), whose memory layout is exactly the
+   chunk's, so each block is handed to HDF5 with H5Dwrite_chunk and bypasses
+   datatype conversion and selections.  The time file dataspace carries a
+   selection for the first entry that is moved to each block's entry with
+   H5Soffset_simple.
+
+   Files of requantized blocks (header nbits 2, see hdr_databuf.h) hold two
+   samples per byte, so the time axis of the data set counts sample pairs,
+   and have a "header/requant_thresh" data set (block, antenna, pol) holding
+   the thresholds each block was requantized with.
+
+   Files of beam blocks (header nbeams > 0) have Nants = nbeams rows in
+   place of antennas.
+
+   Every file has a "flags" data set (time, antenna) of uint8 with Nm
+   entries per block, one per Nt time samples.  A flag is 1 if the F engine
+   packet holding a recorded channel of the antenna at that time was lost
+   (see hdr_pkt_bit), in which case its data are zero.  Beam files flag the
+   input antennas of the beams.
+*/
+typedef struct h5_output_file {
+    hid_t file;
+    hid_t data, time;                 // datasets
+    hid_t time_file_space, time_mem_space;
+    hid_t flags;                      // flags data set
+    hid_t flags_file_space, flags_mem_space;
+    hid_t thresh;                     // requant_thresh data set, or -1
+    hid_t thresh_file_space, thresh_mem_space;
+    uint64_t nblocks;                 // current length in blocks
+    int codec;                        // HDR_CODEC_* of the data set
+    int nbits;                        // header nbits
+    uint64_t nants;                   // header Nants, rows of the data set
+    uint64_t tbytes;                  // bytes per block along the time axis
+} h5_output_file_t;
+
+// Creates filename, which must not exist, with header and empty data and time
+// data sets with room for nblocks blocks.  Unless codec is HDR_CODEC_NONE, the data set is
+// declared as compressed with codec (see hdr_compress.h).  Returns
+// HASHPIPE_OK, HASHPIPE_ERR_SYS or HASHPIPE_ERR_GEN.
+int h5_output_file_create(h5_output_file_t *f, const char *filename,
+                          hdf5_header_t *header, uint64_t nblocks, int codec);
+
+// Writes one block (and its time stamp in ms) as block blk_idx of the file.
+// Returns HASHPIPE_OK or HASHPIPE_ERR_GEN.
+int h5_output_file_write(h5_output_file_t *f, uint64_t blk_idx,
+                         const void *data, uint64_t now);
+
+// Writes a block compressed by hdr_compress_block (nbytes bytes) with the
+// file's codec as block blk_idx of a compressed file.  Returns HASHPIPE_OK or HASHPIPE_ERR_GEN.
+int h5_output_file_write_compressed(h5_output_file_t *f, uint64_t blk_idx,
+                                    const void *data, size_t nbytes, uint64_t now);
+
+// Records the requantization thresholds of the Nants*2 inputs of block
+// blk_idx, which has been written, in a file of requantized blocks.
+// Returns HASHPIPE_OK or HASHPIPE_ERR_GEN.
+int h5_output_file_write_thresh(h5_output_file_t *f, uint64_t blk_idx,
+                                const uint8_t *thresh);
+
+// Records the flags of block blk_idx, which has been written, computed from
+// its packet presence map pkt_map and recorded channels chan[].  Returns
+// HASHPIPE_OK or HASHPIPE_ERR_GEN.
+int h5_output_file_write_flags(h5_output_file_t *f, uint64_t blk_idx,
+                               const uint64_t *pkt_map, const int32_t *chan);
+
+// Shrinks the file's data sets to nblocks blocks.  Returns HASHPIPE_OK or
+// HASHPIPE_ERR_GEN.
+int h5_output_file_truncate(h5_output_file_t *f, uint64_t nblocks);
+
+// Closes the file, if open (f->file >= 0)
+void h5_output_file_close(h5_output_file_t *f);
+
 #endif //_HERA_HDF5_HEADER_H
@@ -0,0 +1,286 @@
+/* hdr_int_writer.c
+ *
+ * Writer of integrated products (see hdr_int_writer.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hashpipe.h"
+#include "hdr_int_writer.h"
+
+typedef struct {
+    hid_t file;
+    hid_t prod, time, mcnt, nblocks;
+    int32_t xid;
+    int32_t chan[Nsc];
+    uint64_t nints;                  // integrations written
+} int_file_t;
+
+static int int_file_create(int_file_t *f, const hdr_int_writer_t *w,
+                           const hdr_int_info_t *info)
+{
+    const hdr_int_product_t *prod = &w->prod;
+    char filename[4096];
+    hsize_t prod_dim[HDR_INT_MAX_RANK+1];
+    hsize_t prod_max[HDR_INT_MAX_RANK+1];
+    hsize_t prod_chunk[HDR_INT_MAX_RANK+1];
+    hsize_t int_dim[] = {w->ints_per_file};
+    hsize_t int_max[] = {H5S_UNLIMITED};
+    hsize_t int_chunk[] = {TIME_CHUNK};
+    hsize_t dims[1];
+    hid_t group_id, dataset_id, dataspace_id;
+    hid_t space, dcpl;
+    double chan_width = 250.0/8192.0;
+    int64_t val;
+    int i, rv;
+
+    snprintf(filename, sizeof(filename), "%s/hera_volt_%s_%lu.h5",
+             w->dir, prod->name, (unsigned long)info->time_ms);
+    f->file = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
+    if(f->file < 0){
+      hashpipe_error(__FUNCTION__, "error creating %s", filename);
+      return HASHPIPE_ERR_SYS;
+    }
+    f->xid = info->xid;
+    memcpy(f->chan, info->chan, sizeof(f->chan));
+    f->nints = 0;
+
+    group_id = H5Gcreate2(f->file, "header", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    dims[0] = 1;
+    val = N_ANTS;
+    H5_WRITE_HEADER_I64(group_id, "Nants", val, dims);
+    val = Np;
+    H5_WRITE_HEADER_I64(group_id, "Npols", val, dims);
+    val = w->nblk;
+    H5_WRITE_HEADER_I64(group_id, "nblocks", val, dims);
+    val = w->nblk*N_TIME_PER_BLOCK;
+    H5_WRITE_HEADER_I64(group_id, "Nsamples", val, dims);
+    H5_WRITE_HEADER_ARRAY(group_id, "chan_width", H5T_IEEE_F64LE, H5T_NATIVE_DOUBLE,
+                          &chan_width, dims);
+    rv = prod->write_header(prod->arg, group_id, info);
+    H5Gclose(group_id);
+
+    prod_dim[0] = w->ints_per_file;
+    prod_max[0] = H5S_UNLIMITED;
+    prod_chunk[0] = 1;
+    for(i=0; i<prod->rank; i++){
+      prod_dim[i+1] = prod_max[i+1] = prod_chunk[i+1] = prod->dims[i];
+    }
+    space = H5Screate_simple(prod->rank+1, prod_dim, prod_max);
+    dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(dcpl, prod->rank+1, prod_chunk);
+    H5Pset_fill_time(dcpl, H5D_FILL_TIME_NEVER);
+    f->prod = H5Dcreate(f->file, prod->dset, prod->type, space,
+                        H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    H5Pclose(dcpl);
+    H5Sclose(space);
+
+    space = H5Screate_simple(1, int_dim, int_max);
+    dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(dcpl, 1, int_chunk);
+    f->time = H5Dcreate(f->file, "time", H5T_STD_U64LE, space,
+                        H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    f->mcnt = H5Dcreate(f->file, "mcnt", H5T_STD_U64LE, space,
+                        H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    f->nblocks = H5Dcreate(f->file, "nblocks", H5T_STD_I32LE, space,
+                           H5P_DEFAULT, dcpl, H5P_DEFAULT);
+    H5Pclose(dcpl);
+    H5Sclose(space);
+
+    if(rv != HASHPIPE_OK || f->prod < 0 || f->time < 0 || f->mcnt < 0 || f->nblocks < 0){
+      hashpipe_error(__FUNCTION__, "error creating data sets of %s", filename);
+      return HASHPIPE_ERR_GEN;
+    }
+    return HASHPIPE_OK;
+}
+
+// Writes val as entry i of a one dimensional data set
+static herr_t write_entry(hid_t dset, hid_t mem_type, uint64_t i, const void *val)
+{
+    hsize_t offset[] = {i};
+    hsize_t count[] = {1};
+    hid_t file_space = H5Dget_space(dset);
+    hid_t mem_space = H5Screate_simple(1, count, NULL);
+    herr_t status;
+
+    H5Sselect_hyperslab(file_space, H5S_SELECT_SET, offset, NULL, count, NULL);
+    status = H5Dwrite(dset, mem_type, mem_space, file_space, H5P_DEFAULT, val);
+    H5Sclose(mem_space);
+    H5Sclose(file_space);
+    return status;
+}
+
+static int int_file_write(int_file_t *f, const hdr_int_writer_t *w,
+                          const void *buf, const hdr_int_info_t *info)
+{
+    hsize_t offset[HDR_INT_MAX_RANK+1] = {f->nints};
+
+    if(H5Dwrite_chunk(f->prod, H5P_DEFAULT, 0, offset, w->prod.nbytes, buf) < 0
+    || write_entry(f->time, H5T_NATIVE_UINT64, f->nints, &info->time_ms) < 0
+    || write_entry(f->mcnt, H5T_NATIVE_UINT64, f->nints, &info->mcnt) < 0
+    || write_entry(f->nblocks, H5T_NATIVE_INT32, f->nints, &info->nblocks) < 0){
+      return HASHPIPE_ERR_GEN;
+    }
+    f->nints++;
+    return HASHPIPE_OK;
+}
+
+// Shrinks the data sets to the integrations written and closes the file
+static void int_file_close(int_file_t *f, const hdr_int_writer_t *w)
+{
+    hsize_t prod_dim[HDR_INT_MAX_RANK+1];
+    hsize_t int_dim[] = {f->nints};
+    int i;
+
+    if(f->file < 0){
+      return;
+    }
+    prod_dim[0] = f->nints;
+    for(i=0; i<w->prod.rank; i++){
+      prod_dim[i+1] = w->prod.dims[i];
+    }
+    if(f->prod >= 0){
+      H5Dset_extent(f->prod, prod_dim);
+      H5Dclose(f->prod);
+    }
+    if(f->time >= 0){
+      H5Dset_extent(f->time, int_dim);
+      H5Dclose(f->time);
+    }
+    if(f->mcnt >= 0){
+      H5Dset_extent(f->mcnt, int_dim);
+      H5Dclose(f->mcnt);
+    }
+    if(f->nblocks >= 0){
+      H5Dset_extent(f->nblocks, int_dim);
+      H5Dclose(f->nblocks);
+    }
+    H5Fclose(f->file);
+    f->file = -1;
+}
+
+static void *int_writer_run(void *arg)
+{
+    hdr_int_writer_t *w = (hdr_int_writer_t *)arg;
+    int_file_t f = {.file = -1};
+    int i, filled;
+    int rv;
+
+    while(1){
+      pthread_mutex_lock(&w->lock);
+      while(!w->filled[w->next_write] && !w->quit){
+        pthread_cond_wait(&w->cond, &w->lock);
+      }
+      i = w->next_write;
+      filled = w->filled[i];
+      pthread_mutex_unlock(&w->lock);
+      if(!filled){
+        break;
+      }
+
+      if(f.file >= 0 && (f.nints == (uint64_t)w->ints_per_file
+                         || f.xid != w->info[i].xid
+                         || (w->prod.by_chan
+                             && memcmp(f.chan, w->info[i].chan, sizeof(f.chan))))){
+        int_file_close(&f, w);
+      }
+      rv = HASHPIPE_OK;
+      if(f.file < 0 && (rv = int_file_create(&f, w, &w->info[i])) != HASHPIPE_OK){
+        int_file_close(&f, w);
+      }
+      if(rv == HASHPIPE_OK){
+        rv = int_file_write(&f, w, w->buf[i], &w->info[i]);
+      }
+
+      pthread_mutex_lock(&w->lock);
+      if(rv == HASHPIPE_OK){
+        w->nwritten++;
+      }else{
+        w->nerrors++;
+      }
+      w->filled[i] = 0;
+      w->next_write = (i + 1) % HDR_INT_NBUF;
+      pthread_mutex_unlock(&w->lock);
+    }
+
+    int_file_close(&f, w);
+    return NULL;
+}
+
+int hdr_int_writer_start(hdr_int_writer_t *w, const hdr_int_product_t *prod,
+                         const char *dir, int nblk, int ints_per_file)
+{
+    hbool_t threadsafe = 0;
+    int i;
+
+    // The writer makes HDF5 calls alongside hdr_write_thread
+    H5is_library_threadsafe(&threadsafe);
+    if(!threadsafe){
+      hashpipe_warn(__FUNCTION__, "HDF5 is not thread-safe, disabling the %s product",
+                    prod->name);
+      return HASHPIPE_ERR_GEN;
+    }
+
+    memset(w, 0, sizeof(*w));
+    w->prod = *prod;
+    strncpy(w->dir, dir, sizeof(w->dir)-1);
+    w->nblk = nblk;
+    w->ints_per_file = ints_per_file;
+    for(i=0; i<HDR_INT_NBUF; i++){
+      if(posix_memalign(&w->buf[i], 64, prod->nbytes)){
+        return HASHPIPE_ERR_SYS;
+      }
+    }
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    if(pthread_create(&w->thread, NULL, int_writer_run, w)){
+      hashpipe_error(__FUNCTION__, "error starting %s writer", prod->name);
+      return HASHPIPE_ERR_SYS;
+    }
+    return HASHPIPE_OK;
+}
+
+void *hdr_int_writer_get(hdr_int_writer_t *w)
+{
+    void *buf = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    if(!w->filled[w->next_get]){
+      buf = w->buf[w->next_get];
+      w->next_get = (w->next_get + 1) % HDR_INT_NBUF;
+    }
+    pthread_mutex_unlock(&w->lock);
+    if(buf){
+      memset(buf, 0, w->prod.nbytes);
+    }
+    return buf;
+}
+
+void hdr_int_writer_put(hdr_int_writer_t *w, void *buf, const hdr_int_info_t *info)
+{
+    int i;
+
+    for(i=0; w->buf[i] != buf; i++);
+    pthread_mutex_lock(&w->lock);
+    w->info[i] = *info;
+    w->filled[i] = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void hdr_int_writer_stop(hdr_int_writer_t *w)
+{
+    int i;
+
+    pthread_mutex_lock(&w->lock);
+    w->quit = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+    for(i=0; i<HDR_INT_NBUF; i++){
+      free(w->buf[i]);
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef _HDR_INT_WRITER_H
+#define _HDR_INT_WRITER_H
+
+/* Writer of integrated products (the power product and the correlator).
+ *
+ * Integration buffers are filled by the stripper and written by a writer
+ * thread in ring order: hdr_int_writer_get returns the next buffer, zeroed,
+ * or NULL if the writer has not written it yet, and hdr_int_writer_put
+ * queues it.  Each integration is appended to a hera_volt_<name>_<time>.h5
+ * file holding
+ *
+ *   <dset>          (integration, dims...) the product, one chunk per
+ *                   integration written with H5Dwrite_chunk
+ *   time            (integration) uint64, ms at the first block
+ *   mcnt            (integration) uint64, mcnt of the first block
+ *   nblocks         (integration) int32, blocks integrated
+ *   header/...      Nants, Npols, chan_width, nblocks, Nsamples and what the
+ *                   product's write_header adds
+ *
+ * A file is created with room for ints_per_file integrations and its data
+ * sets are shrunk to the integrations written when it is closed.  A new file
+ * is started every ints_per_file integrations and whenever the XID (or, for
+ * products by channel set, the channel set) changes.
+ */
+#include <stdint.h>
+#include <pthread.h>
+#include "hdr_databuf.h"
+#include "hdr_hdf5_header.h"
+
+#define HDR_INT_NBUF        4     // integration buffers
+#define HDR_INT_MAX_RANK    4     // dimensions of an integration
+
+// Integration handed to the writer
+typedef struct {
+    uint64_t mcnt;        // of the first block
+    uint64_t time_ms;     // at the first block
+    int32_t nblocks;
+    int32_t xid;
+    int32_t chan[Nsc];    // recorded channels, for products by channel set
+} hdr_int_info_t;
+
+// Product written by a writer
+typedef struct {
+    const char *name;               // file name part and product in messages
+    const char *dset;               // data set of the product
+    hid_t type;                     // HDF5 file type of its values
+    int rank;                       // dimensions of an integration
+    hsize_t dims[HDR_INT_MAX_RANK];
+    size_t nbytes;                  // bytes of an integration
+    int by_chan;                    // new file when the channel set changes
+    // Adds the product's datasets to the header group of a new file for
+    // integration info.  Returns HASHPIPE_OK or an error.
+    int (*write_header)(const void *arg, hid_t group, const hdr_int_info_t *info);
+    const void *arg;
+} hdr_int_product_t;
+
+typedef struct hdr_int_writer {
+    hdr_int_product_t prod;
+    char dir[256];
+    int nblk;                       // blocks per integration
+    int ints_per_file;
+    void *buf[HDR_INT_NBUF];
+    hdr_int_info_t info[HDR_INT_NBUF];
+    int filled[HDR_INT_NBUF];
+    int next_get, next_write;
+    int quit;
+    uint64_t nwritten;              // integrations written
+    uint64_t nerrors;               // integrations that failed to write
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} hdr_int_writer_t;
+
+// Allocates the buffers and starts the writer thread of product prod, which
+// is copied.  Returns HASHPIPE_OK, HASHPIPE_ERR_SYS or, if the HDF5 library
+// is not thread-safe, HASHPIPE_ERR_GEN.
+int hdr_int_writer_start(hdr_int_writer_t *w, const hdr_int_product_t *prod,
+                         const char *dir, int nblk, int ints_per_file);
+
+void *hdr_int_writer_get(hdr_int_writer_t *w);
+
+void hdr_int_writer_put(hdr_int_writer_t *w, void *buf, const hdr_int_info_t *info);
+
+// Writes any queued integrations, closes the file and frees the buffers
+void hdr_int_writer_stop(hdr_int_writer_t *w);
+
+#endif // _HDR_INT_WRITER_H
@@ -0,0 +1,393 @@
+/* hdr_nibble.c
+ *
+ * Lossless codec for 4b+4b complex voltage samples (see hdr_nibble.h).
+ */
+#include <string.h>
+#include <pthread.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "hdr_nibble.h"
+
+#define NMODELS     15
+#define MODEL_ZERO  0
+#define MODEL_FLAT  14
+#define MAX_LEN     12
+#define NIBS_PER_ROW (2*HDR_NIB_ROW_BYTES)
+
+// Code lengths of the zigzag mapped nibbles 0-15 for models 1-14.  Models
+// 1-13 are Huffman codes (limited to MAX_LEN bits) for a zero mean Gaussian
+// of the given sigma, in quantization steps, quantized to 4 bits.
+static const uint8_t code_len[NMODELS][16] = {
+    { 0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0}, // zero row
+    { 1,  3,  2,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  6,  6,  6}, // sigma 0.30
+    { 1,  3,  2,  5,  5,  8,  8,  8,  8,  8,  8,  7,  7,  7,  7,  7}, // sigma 0.55
+    { 1,  2,  3,  5,  4,  9,  9,  9,  9,  9,  9,  8,  8,  8,  8,  8}, // sigma 0.70
+    { 1,  3,  2,  4,  5,  7,  7, 10, 10,  9,  9,  9,  9,  9,  9,  9}, // sigma 0.85
+    { 1,  3,  2,  5,  4,  7,  6, 11, 11, 10, 10, 10, 10, 10, 10, 10}, // sigma 1.00
+    { 2,  2,  2,  4,  3,  6,  5,  8,  8, 10, 10, 10, 10, 10, 10,  9}, // sigma 1.20
+    { 2,  2,  2,  4,  3,  6,  5,  8,  7, 11, 10, 11, 11, 11, 11, 11}, // sigma 1.45
+    { 2,  3,  2,  3,  3,  5,  4,  6,  7,  9,  8, 11, 11, 12, 12, 11}, // sigma 1.75
+    { 2,  3,  3,  3,  3,  4,  4,  5,  5,  6,  5,  7,  8, 10,  9, 10}, // sigma 2.10
+    { 3,  3,  3,  3,  3,  3,  4,  4,  4,  6,  6,  7,  6,  9,  8,  9}, // sigma 2.45
+    { 3,  3,  3,  3,  3,  4,  4,  4,  4,  5,  5,  6,  6,  7,  6,  7}, // sigma 2.90
+    { 3,  3,  3,  4,  3,  4,  4,  4,  4,  5,  5,  5,  5,  6,  5,  6}, // sigma 3.60
+    { 3,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  5,  4,  5,  4,  4}, // sigma 4.60
+    { 4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4}, // flat
+};
+
+// Decode table entry for 12 bits of stream.  sym1/len1 is the first code.
+// If the second code also fits, len2 is the length of both and byte is the
+// decoded byte; otherwise len2 is 0 and byte holds the first nibble only.
+typedef struct dec_entry {
+    uint8_t byte;
+    uint8_t len2;
+    uint8_t sym1;
+    uint8_t len1;
+} dec_entry_t;
+
+static uint8_t zig[16];                        // nibble -> zigzag symbol
+static uint8_t unzig[16];                      // zigzag symbol -> nibble
+static uint32_t byte_code[NMODELS][256];       // codes of both nibbles of a byte
+static uint8_t byte_len[NMODELS][256];
+static uint8_t nib_len[NMODELS][32] __attribute__((aligned(32))); // by raw nibble, twice
+static dec_entry_t dec[NMODELS][1 << MAX_LEN];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+
+static uint32_t reverse_bits(uint32_t code, int len)
+{
+    uint32_t r = 0;
+    int i;
+
+    for(i=0; i<len; i++) {
+        r = (r << 1) | ((code >> i) & 1);
+    }
+    return r;
+}
+
+static void init_tables(void)
+{
+    uint32_t code[16];
+    uint32_t next;
+    int m, s, b, len, k, v;
+    dec_entry_t *e, *e2;
+
+    for(b=0; b<16; b++) {
+        v = b < 8 ? b : b - 16;
+        zig[b] = v >= 0 ? 2*v : -2*v - 1;
+        unzig[zig[b]] = b;
+    }
+
+    for(m=1; m<NMODELS; m++) {
+        // Canonical codes, stored bit reversed for the LSB first stream
+        next = 0;
+        for(len=1; len<=MAX_LEN; len++) {
+            for(s=0; s<16; s++) {
+                if(code_len[m][s] == len) {
+                    code[s] = reverse_bits(next++, len);
+                }
+            }
+            next <<= 1;
+        }
+
+        for(b=0; b<256; b++) {
+            byte_code[m][b] = code[zig[b >> 4]] | code[zig[b & 15]] << code_len[m][zig[b >> 4]];
+            byte_len[m][b] = code_len[m][zig[b >> 4]] + code_len[m][zig[b & 15]];
+        }
+        for(b=0; b<32; b++) {
+            nib_len[m][b] = code_len[m][zig[b & 15]];
+        }
+
+        for(s=0; s<16; s++) {
+            len = code_len[m][s];
+            for(k=code[s]; k < 1 << MAX_LEN; k += 1 << len) {
+                dec[m][k].sym1 = s;
+                dec[m][k].len1 = len;
+                dec[m][k].byte = unzig[s] << 4;
+                dec[m][k].len2 = 0;
+            }
+        }
+        for(k=0; k < 1 << MAX_LEN; k++) {
+            e = &dec[m][k];
+            e2 = &dec[m][k >> e->len1];
+            if(e2->len1 <= MAX_LEN - e->len1) {
+                e->byte |= unzig[e2->sym1];
+                e->len2 = e->len1 + e2->len1;
+            }
+        }
+    }
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Returns the model coding row in the fewest bits
+static int pick_model(const uint8_t *row)
+{
+    int best = MODEL_FLAT;
+    int best_bits = NIBS_PER_ROW * 4;
+    int bits, m;
+
+#ifdef __AVX2__
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    __m256i v = _mm256_loadu_si256((const __m256i *)row);
+    __m256i lo, hi, t, sum;
+
+    if(_mm256_testz_si256(v, v)) {
+        return MODEL_ZERO;
+    }
+    lo = _mm256_and_si256(v, mask);
+    hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+    for(m=1; m<MODEL_FLAT; m++) {
+        // Code lengths of both nibbles of each byte (at most 24), summed
+        t = _mm256_load_si256((const __m256i *)nib_len[m]);
+        sum = _mm256_sad_epu8(_mm256_add_epi8(_mm256_shuffle_epi8(t, lo),
+                                              _mm256_shuffle_epi8(t, hi)),
+                              _mm256_setzero_si256());
+        sum = _mm256_add_epi64(sum, _mm256_permute4x64_epi64(sum, 0x4e));
+        bits = _mm256_extract_epi64(sum, 0) + _mm256_extract_epi64(sum, 1);
+        if(bits < best_bits) {
+            best_bits = bits;
+            best = m;
+        }
+    }
+#else
+    int i, zero = 1;
+
+    for(i=0; i<HDR_NIB_ROW_BYTES; i++) {
+        zero &= row[i] == 0;
+    }
+    if(zero) {
+        return MODEL_ZERO;
+    }
+    for(m=1; m<MODEL_FLAT; m++) {
+        for(bits=0, i=0; i<HDR_NIB_ROW_BYTES; i++) {
+            bits += byte_len[m][row[i]];
+        }
+        if(bits < best_bits) {
+            best_bits = bits;
+            best = m;
+        }
+    }
+#endif
+    return best;
+}
+
+typedef struct bit_writer {
+    uint8_t *p;
+    uint64_t acc;
+    int nbits;
+} bit_writer_t;
+
+typedef struct bit_reader {
+    const uint8_t *p, *end;
+    uint64_t acc;
+    int nbits;
+} bit_reader_t;
+
+static inline void put_bits(bit_writer_t *w, uint32_t code, int len)
+{
+    w->acc |= (uint64_t)code << w->nbits;
+    w->nbits += len;
+    if(w->nbits >= 32) {
+        put_le32(w->p, w->acc);
+        w->p += 4;
+        w->acc >>= 32;
+        w->nbits -= 32;
+    }
+}
+
+// Codes the rows of stream s into w.  Returns 0 if out would overflow end.
+static int encode_stream(const uint8_t *in, size_t n, int s, bit_writer_t *w,
+                         const uint8_t *end)
+{
+    size_t r;
+    int i, m;
+
+    for(r=s*HDR_NIB_ROW_BYTES; r<n; r+=HDR_NIB_NSTREAMS*HDR_NIB_ROW_BYTES) {
+        // Room for the largest row plus the pending bits
+        if(end - w->p < 4 + (4 + NIBS_PER_ROW*MAX_LEN) / 8 + 1) {
+            return 0;
+        }
+        m = pick_model(in + r);
+        put_bits(w, m, 4);
+        for(i=0; m != MODEL_ZERO && i<HDR_NIB_ROW_BYTES; i++) {
+            put_bits(w, byte_code[m][in[r+i]], byte_len[m][in[r+i]]);
+        }
+    }
+    for(; w->nbits > 0; w->nbits -= 8) {
+        *w->p++ = w->acc;
+        w->acc >>= 8;
+    }
+    return 1;
+}
+
+size_t hdr_nib_encode(const uint8_t *in, size_t n, uint8_t *out, size_t out_size)
+{
+    bit_writer_t w;
+    uint8_t *start;
+    int s;
+
+    pthread_once(&tables_once, init_tables);
+
+    if(n % HDR_NIB_ROW_BYTES || n > UINT32_MAX || out_size < HDR_NIB_HEADER_BYTES) {
+        return 0;
+    }
+    put_le32(out, n);
+    out[4] = HDR_NIB_ROW_BYTES;
+    out[5] = 0;
+    out[6] = HDR_NIB_VERSION;
+    out[7] = HDR_NIB_NSTREAMS;
+
+    w.p = out + HDR_NIB_HEADER_BYTES;
+    for(s=0; s<HDR_NIB_NSTREAMS; s++) {
+        start = w.p;
+        w.acc = 0;
+        w.nbits = 0;
+        if(!encode_stream(in, n, s, &w, out + out_size)) {
+            return 0;
+        }
+        put_le32(out + 8 + 4*s, w.p - start);
+    }
+    return w.p - out;
+}
+
+// Tops up the reader to at least 56 bits, reading zeros past its end
+static inline void refill(bit_reader_t *b)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    uint64_t x;
+
+    if(b->end - b->p >= 8) {
+        memcpy(&x, b->p, sizeof(x));
+        b->acc |= x << b->nbits;
+        b->p += (63 - b->nbits) >> 3;
+        b->nbits |= 56;
+        return;
+    }
+#endif
+    while(b->nbits <= 56) {
+        b->acc |= (uint64_t)(b->p < b->end ? *b->p : 0) << b->nbits;
+        b->p++;
+        b->nbits += 8;
+    }
+}
+
+static inline void skip_bits(bit_reader_t *b, int len)
+{
+    b->acc >>= len;
+    b->nbits -= len;
+}
+
+static inline int read_model(bit_reader_t *b)
+{
+    int m;
+
+    refill(b);
+    m = b->acc & 15;
+    skip_bits(b, 4);
+    return m;
+}
+
+static inline uint8_t decode_byte(bit_reader_t *b, const dec_entry_t *table)
+{
+    const dec_entry_t *e;
+    uint8_t byte;
+
+    refill(b);
+    e = &table[b->acc & ((1 << MAX_LEN) - 1)];
+    if(e->len2) {
+        skip_bits(b, e->len2);
+        return e->byte;
+    }
+    // Rare long code, decode the nibbles one at a time
+    byte = e->byte;
+    skip_bits(b, e->len1);
+    e = &table[b->acc & ((1 << MAX_LEN) - 1)];
+    skip_bits(b, e->len1);
+    return byte | unzig[e->sym1];
+}
+
+size_t hdr_nib_decoded_size(const uint8_t *in, size_t in_size)
+{
+    return in_size < HDR_NIB_HEADER_BYTES ? 0 : get_le32(in);
+}
+
+size_t hdr_nib_decode(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size)
+{
+    bit_reader_t b[HDR_NIB_NSTREAMS];
+    const dec_entry_t *table[HDR_NIB_NSTREAMS];
+    int m[HDR_NIB_NSTREAMS];
+    const uint8_t *p = in + HDR_NIB_HEADER_BYTES;
+    size_t n, r, nrows;
+    uint8_t *o;
+    int i, s;
+
+    pthread_once(&tables_once, init_tables);
+
+    n = hdr_nib_decoded_size(in, in_size);
+    if(in_size < HDR_NIB_HEADER_BYTES || n > out_size || n % HDR_NIB_ROW_BYTES
+    || in[4] != HDR_NIB_ROW_BYTES || in[5] != 0 || in[6] != HDR_NIB_VERSION
+    || in[7] != HDR_NIB_NSTREAMS) {
+        return 0;
+    }
+    for(s=0; s<HDR_NIB_NSTREAMS; s++) {
+        b[s].p = p;
+        b[s].end = p + get_le32(in + 8 + 4*s);
+        b[s].acc = 0;
+        b[s].nbits = 0;
+        if(b[s].end > in + in_size || b[s].end < p) {
+            return 0;
+        }
+        p = b[s].end;
+    }
+
+    /* Rows go round-robin to the streams.  Decode a row of each stream at a
+       time, interleaving the streams byte by byte, so that the CPU works on
+       HDR_NIB_NSTREAMS independent dependency chains.
+    */
+    nrows = n / HDR_NIB_ROW_BYTES;
+    for(r=0; r<nrows; r+=HDR_NIB_NSTREAMS) {
+        o = out + r*HDR_NIB_ROW_BYTES;
+        for(s=0; s<HDR_NIB_NSTREAMS; s++) {
+            m[s] = r + s < nrows ? read_model(&b[s]) : MODEL_ZERO;
+            if(m[s] >= NMODELS) {
+                return 0;
+            }
+            table[s] = dec[m[s]];
+        }
+        if(r + HDR_NIB_NSTREAMS <= nrows && m[0] && m[1] && m[2] && m[3]) {
+            for(i=0; i<HDR_NIB_ROW_BYTES; i++) {
+                o[i]                      = decode_byte(&b[0], table[0]);
+                o[i+HDR_NIB_ROW_BYTES]    = decode_byte(&b[1], table[1]);
+                o[i+2*HDR_NIB_ROW_BYTES]  = decode_byte(&b[2], table[2]);
+                o[i+3*HDR_NIB_ROW_BYTES]  = decode_byte(&b[3], table[3]);
+            }
+            continue;
+        }
+        for(s=0; s<HDR_NIB_NSTREAMS && r + s < nrows; s++) {
+            for(i=0; i<HDR_NIB_ROW_BYTES; i++) {
+                o[s*HDR_NIB_ROW_BYTES + i] = m[s] ? decode_byte(&b[s], table[s]) : 0;
+            }
+        }
+    }
+
+    // Fail if decoding used bits past the end of a stream
+    for(s=0; s<HDR_NIB_NSTREAMS; s++) {
+        if((b[s].p - b[s].end) * 8 > b[s].nbits) {
+            return 0;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,70 @@
+/* hdr_nibble.h
+ *
+ * Lossless codec for 4b+4b complex voltage samples.  Each byte holds the
+ * real part in its high nibble and the imaginary part in its low nibble,
+ * both 4 bit two's complement.  The input is coded in rows of
+ * HDR_NIB_ROW_BYTES bytes, which in the stripper layout
+ * (hdr_stripper_databuf_data_idx8 order) are the Nm*Nt time samples of one
+ * antenna, pol and channel.  Rows of a real recording differ mostly in
+ * signal level (flagged antennas, RFI, bandpass), so each row is coded with
+ * the best of a fixed set of models:
+ *
+ *   0        the row is all zero, nothing else is stored
+ *   1-13     Huffman codes for the nibbles of a discretized Gaussian of
+ *            increasing sigma (0.3 to 4.6 quantization steps)
+ *   14       4 bits per nibble
+ *
+ * Nibbles are zigzag mapped (0, -1, 1, -2, ... -> 0, 1, 2, 3, ...) and coded
+ * high nibble first.  A coded buffer is
+ *
+ *   uint32 LE  decoded bytes
+ *   uint16 LE  row bytes (HDR_NIB_ROW_BYTES)
+ *   uint8      version (HDR_NIB_VERSION)
+ *   uint8      number of streams (HDR_NIB_NSTREAMS)
+ *   uint32 LE  bytes of each stream
+ *   the streams
+ *
+ * Row r is coded in stream r % HDR_NIB_NSTREAMS.  Each stream is a bit
+ * stream, LSB first, of a 4 bit model number per row followed by the codes
+ * of the row's 2*HDR_NIB_ROW_BYTES nibbles.
+ *
+ * The model of each row is picked by evaluating the code length of the row
+ * under every model with AVX2 table lookups.  Decoding looks up 12 bits of
+ * a stream at a time and yields a whole byte (both nibbles) per lookup when
+ * both codes fit, which they do for all but the rarest codes.  The streams
+ * are decoded in lockstep, which keeps several independent table lookups in
+ * flight.
+ */
+#ifndef _HDR_NIBBLE_H
+#define _HDR_NIBBLE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// HDF5 filter id.  In the range reserved for unregistered filters.
+#define HDR_NIB_FILTER_ID  307
+#define HDR_NIB_VERSION    1
+#define HDR_NIB_ROW_BYTES  32
+#define HDR_NIB_NSTREAMS   4
+#define HDR_NIB_HEADER_BYTES (8 + 4*HDR_NIB_NSTREAMS)
+
+// Largest coded size of n input bytes
+#define HDR_NIB_BOUND(n) \
+  (HDR_NIB_HEADER_BYTES + ((n) / HDR_NIB_ROW_BYTES) * (1 + 2*HDR_NIB_ROW_BYTES*12/8) + \
+   8*HDR_NIB_NSTREAMS)
+
+// Codes n bytes (a multiple of HDR_NIB_ROW_BYTES) from in into out, which
+// holds out_size bytes.  Returns the coded size or 0 if it would exceed
+// out_size.
+size_t hdr_nib_encode(const uint8_t *in, size_t n, uint8_t *out, size_t out_size);
+
+// Decodes in_size bytes from in into out, which holds out_size bytes.
+// Returns the number of bytes decoded or 0 if in is not a valid coded
+// buffer or does not fit in out.
+size_t hdr_nib_decode(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size);
+
+// Returns the number of bytes in decoded from in, or 0 if in_size is too
+// small to hold a header
+size_t hdr_nib_decoded_size(const uint8_t *in, size_t in_size);
+
+#endif // _HDR_NIBBLE_H
@@ -0,0 +1,158 @@
+/* hdr_nibble_bench.c
+ *
+ * Round trip and speed test of the hdr_nibble codec.  Codes stripper blocks,
+ * either synthetic (Gaussian noise of varying level per row, with some all
+ * zero rows standing in for flagged antennas) or read from a raw recording
+ * (.dat file), and reports the coded size and single thread encode and
+ * decode throughput.
+ *
+ * Usage: hdr_nibble_bench [-n NBLOCKS] [-z ZERO_FRACTION] [-i ITERATIONS] [RAWFILE]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+
+#include "hdr_databuf.h"
+#include "hdr_nibble.h"
+
+#define ELAPSED_NS(start,stop) \
+  (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
+
+// Fills one block with 4 bit Gaussian noise, sigma 1.5 to 3.5 steps per row
+static void fake_block(uint8_t *blk, double zero_fraction)
+{
+    int r, i, k, v[2];
+    double sigma, u1, u2;
+
+    for(r=0; r<N_BYTES_PER_STRP_BLOCK; r+=HDR_NIB_ROW_BYTES) {
+        if(drand48() < zero_fraction) {
+            memset(blk + r, 0, HDR_NIB_ROW_BYTES);
+            continue;
+        }
+        sigma = 1.5 + 2.0 * drand48();
+        for(i=0; i<HDR_NIB_ROW_BYTES; i++) {
+            u1 = 1.0 - drand48();
+            u2 = drand48();
+            for(k=0; k<2; k++) {
+                v[k] = lrint(sigma * sqrt(-2*log(u1)) * (k ? sin(2*M_PI*u2) : cos(2*M_PI*u2)));
+                v[k] = v[k] < -8 ? -8 : v[k] > 7 ? 7 : v[k];
+            }
+            blk[r+i] = (v[0] & 15) << 4 | (v[1] & 15);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int nblocks = 64;
+    int iterations = 10;
+    double zero_fraction = 0.05;
+    uint8_t *in, *coded, *out;
+    size_t *coded_size;
+    size_t total_coded = 0;
+    struct timespec start, stop;
+    int64_t encode_ns, decode_ns;
+    FILE *fp;
+    int opt, b, it;
+
+    while((opt = getopt(argc, argv, "n:z:i:h")) != -1) {
+        switch(opt) {
+        case 'n':
+            nblocks = atoi(optarg);
+            break;
+        case 'z':
+            zero_fraction = atof(optarg);
+            break;
+        case 'i':
+            iterations = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n NBLOCKS] [-z ZERO_FRACTION] [-i ITERATIONS] [RAWFILE]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if(nblocks < 1 || iterations < 1) {
+        fprintf(stderr, "NBLOCKS and ITERATIONS must be positive\n");
+        return 1;
+    }
+
+    in = (uint8_t *)malloc((size_t)nblocks * N_BYTES_PER_STRP_BLOCK);
+    out = (uint8_t *)malloc((size_t)nblocks * N_BYTES_PER_STRP_BLOCK);
+    coded = (uint8_t *)malloc((size_t)nblocks * HDR_NIB_BOUND(N_BYTES_PER_STRP_BLOCK));
+    coded_size = (size_t *)calloc(nblocks, sizeof(size_t));
+    if(!in || !out || !coded || !coded_size) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    if(optind < argc) {
+        if(!(fp = fopen(argv[optind], "r"))) {
+            perror(argv[optind]);
+            return 1;
+        }
+        nblocks = fread(in, N_BYTES_PER_STRP_BLOCK, nblocks, fp);
+        fclose(fp);
+        if(nblocks < 1) {
+            fprintf(stderr, "%s: no complete blocks\n", argv[optind]);
+            return 1;
+        }
+    } else {
+        srand48(1);
+        for(b=0; b<nblocks; b++) {
+            fake_block(in + (size_t)b * N_BYTES_PER_STRP_BLOCK, zero_fraction);
+        }
+    }
+
+#define BLK(buf, b) ((buf) + (size_t)(b) * N_BYTES_PER_STRP_BLOCK)
+#define CODED(b) (coded + (size_t)(b) * HDR_NIB_BOUND(N_BYTES_PER_STRP_BLOCK))
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(it=0; it<iterations; it++) {
+        for(b=0; b<nblocks; b++) {
+            coded_size[b] = hdr_nib_encode(BLK(in, b), N_BYTES_PER_STRP_BLOCK, CODED(b),
+                                           HDR_NIB_BOUND(N_BYTES_PER_STRP_BLOCK));
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    encode_ns = ELAPSED_NS(start, stop);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(it=0; it<iterations; it++) {
+        for(b=0; b<nblocks; b++) {
+            if(hdr_nib_decode(CODED(b), coded_size[b], BLK(out, b),
+                              N_BYTES_PER_STRP_BLOCK) != N_BYTES_PER_STRP_BLOCK) {
+                fprintf(stderr, "block %d does not decode\n", b);
+                return 1;
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    decode_ns = ELAPSED_NS(start, stop);
+
+    if(memcmp(in, out, (size_t)nblocks * N_BYTES_PER_STRP_BLOCK)) {
+        fprintf(stderr, "round trip mismatch\n");
+        return 1;
+    }
+    for(b=0; b<nblocks; b++) {
+        total_coded += coded_size[b];
+    }
+
+    printf("%d blocks of %d bytes, round trip ok\n", nblocks, N_BYTES_PER_STRP_BLOCK);
+    printf("coded size   %.2f%% (%.3f bits per 4 bit value)\n",
+           100.0 * total_coded / nblocks / N_BYTES_PER_STRP_BLOCK,
+           4.0 * total_coded / nblocks / N_BYTES_PER_STRP_BLOCK);
+    printf("encode       %.1f MB/s\n",
+           1e3 * iterations * nblocks * N_BYTES_PER_STRP_BLOCK / encode_ns);
+    printf("decode       %.1f MB/s (decoded bytes)\n",
+           1e3 * iterations * nblocks * N_BYTES_PER_STRP_BLOCK / decode_ns);
+
+    free(in);
+    free(out);
+    free(coded);
+    free(coded_size);
+    return 0;
+}
@@ -0,0 +1,66 @@
+/* hdr_nibble_h5filter.c
+ *
+ * HDF5 filter plugin for the hdr_nibble codec (filter id HDR_NIB_FILTER_ID,
+ * see hdr_nibble.h).  Put libh5hdrnib.so in a directory listed in
+ * HDF5_PLUGIN_PATH and any HDF5 application, including h5py, reads
+ * hera_volt_data_*.h5 files written with WRITCOMP=nib.  The plugin can also
+ * compress: a data set of 1 byte elements whose chunks are a multiple of
+ * HDR_NIB_ROW_BYTES bytes may use the filter.  Chunks that do not shrink are
+ * left uncompressed if the filter is optional.
+ */
+#include <stdlib.h>
+#include <hdf5.h>
+#include <H5PLextern.h>
+
+#include "hdr_nibble.h"
+
+static size_t hdr_nib_filter(unsigned int flags, size_t cd_nelmts,
+                             const unsigned int cd_values[], size_t nbytes,
+                             size_t *buf_size, void **buf)
+{
+    size_t out_size, n;
+    uint8_t *out;
+
+    if(flags & H5Z_FLAG_REVERSE) {
+        out_size = hdr_nib_decoded_size((const uint8_t *)*buf, nbytes);
+        if(!out_size || !(out = (uint8_t *)malloc(out_size))) {
+            return 0;
+        }
+        n = hdr_nib_decode((const uint8_t *)*buf, nbytes, out, out_size);
+    } else {
+        // Only keep the result if it is smaller than the chunk
+        out_size = nbytes;
+        if(!(out = (uint8_t *)malloc(out_size))) {
+            return 0;
+        }
+        n = hdr_nib_encode((const uint8_t *)*buf, nbytes, out, out_size);
+    }
+    if(!n) {
+        free(out);
+        return 0;
+    }
+    free(*buf);
+    *buf = out;
+    *buf_size = out_size;
+    return n;
+}
+
+static const H5Z_class2_t hdr_nib_class = {
+    H5Z_CLASS_T_VERS,
+    HDR_NIB_FILTER_ID,
+    1, 1,                       // encoder and decoder present
+    "hdr_nibble",
+    NULL,                       // can_apply
+    NULL,                       // set_local
+    hdr_nib_filter,
+};
+
+H5PL_type_t H5PLget_plugin_type(void)
+{
+    return H5PL_TYPE_FILTER;
+}
+
+const void *H5PLget_plugin_info(void)
+{
+    return &hdr_nib_class;
+}
@@ -0,0 +1,159 @@
+/* hdr_power.c
+ *
+ * Power kernels and the power product of the integration writer (see
+ * hdr_power.h).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+
+#include "hashpipe.h"
+#include "hdr_power.h"
+#include "hdr_hdf5_header.h"
+
+/* |V|^2 kernels.  Input rows are (c,t,p) bytes of 4b+4b samples for each
+ * (m,a); the power of (a,p,c) sums over m and t.
+ *
+ * The AVX2 kernel loads 32 bytes (8 channels) of a row at a time,
+ *
+ *   1. shuffles them from (c,t,p) to (c,p,t) order within each lane,
+ *   2. squares both nibbles of every byte with a pshufb lookup table and adds
+ *      them, giving |V|^2 <= 128 per byte,
+ *   3. adds adjacent (t0,t1) bytes into 16 bit (c,p) words with maddubs and
+ *      accumulates those over m for the whole row in 16 bits (at most
+ *      Nm*256 per word), and then
+ *   4. reorders each row's words to (p,c), widens them to 32 bits and adds
+ *      them to the integration buffer once per antenna.
+ */
+#if defined(__AVX2__) && Nt*Np == 4 && Nc % 8 == 0 && Nm <= 255
+#define HAVE_POWER_AVX2
+#endif
+
+// Square of a 4 bit two's complement value
+static inline uint32_t sq4(uint8_t n)
+{
+    int v = n & 0x8 ? (int)(n & 0xf) - 16 : n & 0xf;
+    return v*v;
+}
+
+static void power_block_scalar(uint32_t *acc, const uint8_t *indata, int a0, int a1)
+{
+    const uint8_t *row;
+    uint8_t s;
+    int m, a, c, t, p;
+
+    for(m=0; m<Nm; m++){
+      for(a=a0; a<a1; a++){
+        row = indata + hdr_input_databuf_data_idx8(m,a,0,0,0);
+        for(c=0; c<Nc; c++){
+          for(t=0; t<Nt; t++){
+            for(p=0; p<Np; p++){
+              s = row[(c*Nt + t)*Np + p];
+              acc[(a*Np + p)*Nc + c] += sq4(s >> 4) + sq4(s);
+            }
+          }
+        }
+      }
+    }
+}
+
+#ifdef HAVE_POWER_AVX2
+static void power_block_avx2(uint32_t *acc, const uint8_t *indata, int a0, int a1)
+{
+    // (c,t,p) -> (c,p,t) within each 4 byte channel
+    const __m256i cpt = _mm256_setr_epi8(
+        0, 2, 1, 3, 4, 6, 5, 7, 8, 10, 9, 11, 12, 14, 13, 15,
+        0, 2, 1, 3, 4, 6, 5, 7, 8, 10, 9, 11, 12, 14, 13, 15);
+    const __m256i sqlut = _mm256_setr_epi8(
+        0, 1, 4, 9, 16, 25, 36, 49, 64, 49, 36, 25, 16, 9, 4, 1,
+        0, 1, 4, 9, 16, 25, 36, 49, 64, 49, 36, 25, 16, 9, 4, 1);
+    // 16 bit (c,p) words -> (p,c) within each lane of 4 channels
+    const __m256i pc = _mm256_setr_epi8(
+        0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15,
+        0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+    const __m256i lo4 = _mm256_set1_epi8(0x0f);
+    const __m256i ones = _mm256_set1_epi8(1);
+    __m256i sum[Nc/8];
+    __m256i v, s;
+    __m256i *out;
+    const __m256i *row;
+    int a, m, j, p;
+
+    for(a=a0; a<a1; a++){
+      for(j=0; j<Nc/8; j++){
+        sum[j] = _mm256_setzero_si256();
+      }
+      for(m=0; m<Nm; m++){
+        row = (const __m256i *)(indata + hdr_input_databuf_data_idx8(m,a,0,0,0));
+        for(j=0; j<Nc/8; j++){
+          v = _mm256_shuffle_epi8(_mm256_loadu_si256(row + j), cpt);
+          s = _mm256_add_epi8(
+                _mm256_shuffle_epi8(sqlut, _mm256_and_si256(v, lo4)),
+                _mm256_shuffle_epi8(sqlut, _mm256_and_si256(_mm256_srli_epi16(v, 4), lo4)));
+          sum[j] = _mm256_add_epi16(sum[j], _mm256_maddubs_epi16(s, ones));
+        }
+      }
+      for(j=0; j<Nc/8; j++){
+        // Low 128 bits: pol 0 of channels 8j..8j+7, high 128 bits: pol 1
+        v = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(sum[j], pc), 0xd8);
+        for(p=0; p<Np; p++){
+          out = (__m256i *)(acc + (a*Np + p)*Nc + 8*j);
+          s = _mm256_cvtepu16_epi32(p ? _mm256_extracti128_si256(v, 1)
+                                      : _mm256_castsi256_si128(v));
+          _mm256_storeu_si256(out, _mm256_add_epi32(_mm256_loadu_si256(out), s));
+        }
+      }
+    }
+}
+#endif // HAVE_POWER_AVX2
+
+void hdr_power_accumulate(uint32_t *acc, const uint8_t *indata, int a0, int a1,
+                          int scalar)
+{
+#ifdef HAVE_POWER_AVX2
+    if(!scalar){
+      power_block_avx2(acc, indata, a0, a1);
+      return;
+    }
+#endif
+    power_block_scalar(acc, indata, a0, a1);
+}
+
+// Adds the power product's header datasets: Nfreqs and freq_array
+static int power_write_header(const void *arg, hid_t group_id, const hdr_int_info_t *info)
+{
+    hsize_t dims[1];
+    hid_t dataset_id, dataspace_id;
+    double freq_array[N_CHAN_PER_X];
+    double chan_width = 250.0/8192.0;
+    int64_t val;
+    int c;
+
+    dims[0] = 1;
+    val = N_CHAN_PER_X;
+    H5_WRITE_HEADER_I64(group_id, "Nfreqs", val, dims);
+    for(c=0; c<N_CHAN_PER_X; c++){
+      freq_array[c] = (info->xid*N_CHAN_PER_X + c) * chan_width;
+    }
+    dims[0] = N_CHAN_PER_X;
+    H5_WRITE_HEADER_ARRAY(group_id, "freq_array", H5T_IEEE_F64LE, H5T_NATIVE_DOUBLE,
+                          freq_array, dims);
+    return HASHPIPE_OK;
+}
+
+int hdr_power_writer_start(hdr_power_writer_t *pw, const char *dir, int nblk,
+                           int ints_per_file)
+{
+    hdr_int_product_t prod = {
+      .name = "power",
+      .dset = "power",
+      .type = H5T_STD_U32LE,
+      .rank = 3,
+      .dims = {N_ANTS, Np, N_CHAN_PER_X},
+      .nbytes = HDR_POWER_NVALUES*sizeof(uint32_t),
+      .write_header = power_write_header,
+    };
+
+    return hdr_int_writer_start(pw, &prod, dir, nblk, ints_per_file);
+}
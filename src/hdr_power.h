@@ -0,0 +1,68 @@
+#ifndef _HDR_POWER_H
+#define _HDR_POWER_H
+
+/* Quick-look power product.
+ *
+ * The stripper's workers add |V|^2 = re^2 + im^2 of every channel, antenna
+ * and pol of each input block (all N_CHAN_PER_X channels, not only the
+ * recorded ones) to an integration buffer of HDR_POWER_NVALUES uint32
+ * values in (a,p,c) order.  After PWRNBLK blocks the buffer is handed to a
+ * writer thread that appends it to a hera_volt_power_<time>.h5 file holding
+ *
+ *   power           (integration, antenna, pol, channel) uint32, the sum of
+ *                   |V|^2 over the N_TIME_PER_BLOCK*nblocks samples
+ *   time            (integration) uint64, ms at the first block
+ *   mcnt            (integration) uint64, mcnt of the first block
+ *   nblocks         (integration) int32, blocks integrated
+ *   header/...      Nants, Npols, Nfreqs, freq_array, chan_width, nblocks
+ *
+ * Every block adds at most N_TIME_PER_BLOCK*128 to a value, so up to
+ * HDR_POWER_MAX_NBLK blocks can be integrated without overflow.
+ */
+#include <stdint.h>
+#include "hdr_databuf.h"
+#include "hdr_int_writer.h"
+
+#define HDR_POWER_NVALUES   (N_INPUTS*N_CHAN_PER_X)
+#define HDR_POWER_MAX_NBLK  65536
+#define HDR_POWER_FILE_INTS 256   // default integrations per file
+
+// Adds the power of antennas a0 to a1-1 of input block indata to acc.  The
+// AVX2 kernel is used unless scalar is set or it is not compiled in.
+void hdr_power_accumulate(uint32_t *acc, const uint8_t *indata, int a0, int a1,
+                          int scalar);
+
+// Integration handed to the writer (chan is not used)
+typedef hdr_int_info_t hdr_power_int_t;
+
+/* Writer of power files (see hdr_int_writer.h).  hdr_power_writer_get
+ * returns the next integration buffer, zeroed, or NULL if the writer has not
+ * written it yet, and hdr_power_writer_put queues it.  A new file is started
+ * every ints_per_file integrations and whenever the XID changes.
+ */
+typedef hdr_int_writer_t hdr_power_writer_t;
+
+// Allocates the buffers and starts the writer thread.  Returns HASHPIPE_OK,
+// HASHPIPE_ERR_SYS or, if the HDF5 library is not thread-safe,
+// HASHPIPE_ERR_GEN.
+int hdr_power_writer_start(hdr_power_writer_t *pw, const char *dir, int nblk,
+                           int ints_per_file);
+
+static inline uint32_t *hdr_power_writer_get(hdr_power_writer_t *pw)
+{
+    return (uint32_t *)hdr_int_writer_get(pw);
+}
+
+static inline void hdr_power_writer_put(hdr_power_writer_t *pw, uint32_t *buf,
+                                        const hdr_power_int_t *info)
+{
+    hdr_int_writer_put(pw, buf, info);
+}
+
+// Writes any queued integrations, closes the file and frees the buffers
+static inline void hdr_power_writer_stop(hdr_power_writer_t *pw)
+{
+    hdr_int_writer_stop(pw);
+}
+
+#endif // _HDR_POWER_H
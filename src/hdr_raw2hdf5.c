@@ -0,0 +1,192 @@
+/* hdr_raw2hdf5.c
+ *
+ * Converts a raw recording (see hdr_raw_file.h) written by hdr_write_thread
+ * in raw mode into a hera_volt_data_*.h5 file with the same layout as the
+ * files hdr_write_thread writes in HDF5 mode.
+ *
+ * Usage: hdr_raw2hdf5 [-o OUTFILE] hera_volt_raw_<time>_<mcnt>[.idx] ...
+ *
+ * Without -o, hera_volt_raw_<suffix> is converted to hera_volt_data_<suffix>.h5
+ * in the current directory.  Existing files are not overwritten.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "hashpipe.h"
+#include "hdr_hdf5_header.h"
+#include "hdr_raw_file.h"
+
+static int convert(const char *name, const char *outname)
+{
+    char basename[4096];
+    char filename[4096];
+    char h5name[4096];
+    const char *file;
+    hdr_raw_index_header_t ih;
+    hdr_raw_index_entry_t entry;
+    hdf5_header_t *header;
+    h5_output_file_t h5file;
+    uint64_t blk_idx;
+    uint64_t nentries;
+    size_t header_bytes, entry_bytes;
+    uint64_t data_bytes;
+    uint8_t *buf;
+    FILE *idx;
+    int fd;
+    int nblks = 0;
+    int rv = 0;
+    size_t len;
+
+    // Strip any .idx or .dat suffix
+    strncpy(basename, name, sizeof(basename)-1);
+    basename[sizeof(basename)-1] = '\0';
+    len = strlen(basename);
+    if(len > 4 && (!strcmp(basename+len-4, ".idx") || !strcmp(basename+len-4, ".dat"))) {
+        basename[len-4] = '\0';
+    }
+
+    snprintf(filename, sizeof(filename), "%s.idx", basename);
+    if(!(idx = fopen(filename, "r"))) {
+        perror(filename);
+        return 1;
+    }
+    // Version 1 recordings have a shorter header and entries and 4 bit blocks
+    memset(&ih, 0, sizeof(ih));
+    memset(&entry, 0, sizeof(entry));
+    if(fread(&ih, HDR_RAW_INDEX_V1_HEADER_BYTES, 1, idx) != 1
+    || memcmp(ih.magic, HDR_RAW_INDEX_MAGIC, sizeof(ih.magic))
+    || ih.version < 1 || ih.version > HDR_RAW_INDEX_VERSION
+    || (ih.version > 1 && fread((char *)&ih + HDR_RAW_INDEX_V1_HEADER_BYTES,
+                                sizeof(ih) - HDR_RAW_INDEX_V1_HEADER_BYTES, 1, idx) != 1)) {
+        fprintf(stderr, "%s: not a raw recording index\n", filename);
+        fclose(idx);
+        return 1;
+    }
+    if(ih.version == 1) {
+        ih.nbits = 4;
+        header_bytes = HDR_RAW_INDEX_V1_HEADER_BYTES;
+        entry_bytes = HDR_RAW_INDEX_V1_ENTRY_BYTES;
+    } else {
+        header_bytes = sizeof(ih);
+        entry_bytes = ih.version == 2 ? HDR_RAW_INDEX_V2_ENTRY_BYTES : sizeof(entry);
+    }
+    // Beam recordings have nbeams rows in place of antennas
+    data_bytes = (uint64_t)ih.nants * (N_BYTES_PER_STRP_BLOCK/N_ANTS) * ih.nbits / 4;
+    if((ih.nbits != 4 && ih.nbits != 2)
+    || ih.record_bytes != hdr_raw_record_bytes(data_bytes)
+    || ih.nants != (ih.nbeams > 0 ? ih.nbeams : N_ANTS) || ih.nbeams > N_MAX_BEAMS
+    || ih.npols != 2 || ih.nchans != N_STRP_CHANS_PER_X
+    || ih.ntimes != N_TIME_PER_BLOCK) {
+        fprintf(stderr, "%s: record dimensions do not match this build\n", filename);
+        fclose(idx);
+        return 1;
+    }
+
+    snprintf(filename, sizeof(filename), "%s.dat", basename);
+    if((fd = open(filename, O_RDONLY)) == -1) {
+        perror(filename);
+        fclose(idx);
+        return 1;
+    }
+
+    if(outname) {
+        strncpy(h5name, outname, sizeof(h5name)-1);
+        h5name[sizeof(h5name)-1] = '\0';
+    } else {
+        file = strrchr(basename, '/') ? strrchr(basename, '/') + 1 : basename;
+        if(!strncmp(file, "hera_volt_raw_", 14)) {
+            snprintf(h5name, sizeof(h5name), "hera_volt_data_%s.h5", file + 14);
+        } else {
+            sprintf(h5name, "hera_volt_data_%lu.h5", (unsigned long)ih.create_time);
+        }
+    }
+
+    // Size the output file for the number of index entries
+    fseek(idx, 0, SEEK_END);
+    nentries = (ftell(idx) - header_bytes) / entry_bytes;
+    fseek(idx, header_bytes, SEEK_SET);
+
+    buf = (uint8_t *)malloc(ih.record_bytes);
+    header = initialize_header(ih.xid, ih.chan);
+    if(header) {
+        header->nbits = ih.nbits;
+        header->nbeams = ih.nbeams;
+        header->Nants = header->Nants_data = ih.nants;
+    }
+    if(!buf || !header
+    || h5_output_file_create(&h5file, h5name, header, nentries ? nentries : 1, 0) != HASHPIPE_OK) {
+        fprintf(stderr, "%s: error creating output file\n", h5name);
+        free(header);
+        free(buf);
+        close(fd);
+        fclose(idx);
+        return 1;
+    }
+    free(header);
+
+    while(fread(&entry, entry_bytes, 1, idx) == 1) {
+        blk_idx = entry.offset / ih.record_bytes;
+        // Before version 3 only good_data tells whether packets were lost
+        if(ih.version < 3) {
+            if(entry.good_data) {
+                hdr_pkt_map_fill(entry.pkt_map);
+            } else {
+                hdr_pkt_map_clear(entry.pkt_map);
+            }
+        }
+        if(pread(fd, buf, ih.record_bytes, entry.offset) != (ssize_t)ih.record_bytes) {
+            fprintf(stderr, "%s: short read of record %lu\n", filename, (unsigned long)blk_idx);
+            rv = 1;
+            break;
+        }
+        if(h5_output_file_write(&h5file, blk_idx, buf, entry.time_ms) != HASHPIPE_OK
+        || h5_output_file_write_flags(&h5file, blk_idx, entry.pkt_map, ih.chan) != HASHPIPE_OK
+        || (ih.nbits == 2
+            && h5_output_file_write_thresh(&h5file, blk_idx, entry.thresh) != HASHPIPE_OK)) {
+            fprintf(stderr, "%s: error writing block %lu\n", h5name, (unsigned long)blk_idx);
+            rv = 1;
+            break;
+        }
+        nblks++;
+    }
+
+    h5_output_file_close(&h5file);
+    free(buf);
+    close(fd);
+    fclose(idx);
+
+    printf("%s: %d blocks -> %s\n", basename, nblks, h5name);
+    return rv;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *outname = NULL;
+    int opt;
+    int rv = 0;
+
+    while((opt = getopt(argc, argv, "o:h")) != -1) {
+        switch(opt) {
+        case 'o':
+            outname = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-o OUTFILE] RAWFILE...\n", argv[0]);
+            return 1;
+        }
+    }
+    if(optind >= argc || (outname && argc - optind > 1)) {
+        fprintf(stderr, "Usage: %s [-o OUTFILE] RAWFILE...\n"
+                "(-o may only be given with a single RAWFILE)\n", argv[0]);
+        return 1;
+    }
+
+    for(; optind < argc; optind++) {
+        rv |= convert(argv[optind], outname);
+    }
+
+    return rv;
+}
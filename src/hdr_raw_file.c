@@ -0,0 +1,303 @@
+/* hdr_raw_file.c
+ *
+ * Routines for writing raw recordings (see hdr_raw_file.h).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+
+#include "hashpipe.h"
+#include "hdr_raw_file.h"
+
+int hdr_raw_writer_init(hdr_raw_writer_t *w, int qdepth)
+{
+    int i;
+
+    memset(w, 0, sizeof(*w));
+    w->qdepth = qdepth;
+    w->fd = -1;
+    w->buf = (uint8_t **)calloc(qdepth, sizeof(uint8_t *));
+    w->busy = (int *)calloc(qdepth, sizeof(int));
+    w->entry = (hdr_raw_index_entry_t *)calloc(qdepth, sizeof(hdr_raw_index_entry_t));
+    if(!w->buf || !w->busy || !w->entry) {
+        return HASHPIPE_ERR_SYS;
+    }
+    for(i=0; i<qdepth; i++) {
+        if(posix_memalign((void **)&w->buf[i], HDR_RAW_ALIGN, N_BYTES_PER_STRP_BLOCK)) {
+            return HASHPIPE_ERR_SYS;
+        }
+    }
+#ifdef HAVE_LIBURING_H
+    if((i = io_uring_queue_init(qdepth, &w->ring, 0)) < 0) {
+        errno = -i;
+        hashpipe_error(__FUNCTION__, "io_uring_queue_init");
+        return HASHPIPE_ERR_SYS;
+    }
+#endif
+    return HASHPIPE_OK;
+}
+
+int hdr_raw_file_create(const char *basename, const hdr_raw_index_header_t *ih,
+                        uint64_t nrecords, int *fd, FILE **idx)
+{
+    char filename[4096];
+    int rv;
+
+    snprintf(filename, sizeof(filename), "%s.dat", basename);
+    *fd = open(filename, O_WRONLY | O_CREAT | O_EXCL | O_DIRECT, 0644);
+    if(*fd == -1 && errno == EINVAL) {
+        hashpipe_warn(__FUNCTION__, "%s does not support O_DIRECT", filename);
+        *fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    }
+    if(*fd == -1) {
+        hashpipe_error(__FUNCTION__, "error creating %s", filename);
+        return HASHPIPE_ERR_SYS;
+    }
+    // Preallocate.  Not every file system supports this, which is harmless.
+    if(nrecords && (rv = posix_fallocate(*fd, 0, nrecords * ih->record_bytes))
+    && rv != EOPNOTSUPP && rv != EINVAL) {
+        errno = rv;
+        hashpipe_warn(__FUNCTION__, "error preallocating %s", filename);
+    }
+
+    snprintf(filename, sizeof(filename), "%s.idx", basename);
+    *idx = fopen(filename, "wx");
+    if(!*idx || fwrite(ih, sizeof(*ih), 1, *idx) != 1) {
+        hashpipe_error(__FUNCTION__, "error creating %s", filename);
+        hdr_raw_file_close(*fd, *idx, 0);
+        if(*idx) {
+            unlink(filename);
+        }
+        snprintf(filename, sizeof(filename), "%s.dat", basename);
+        unlink(filename);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    return HASHPIPE_OK;
+}
+
+void hdr_raw_index_set_create_time(FILE *idx, uint64_t create_time)
+{
+    long pos = ftell(idx);
+
+    fseek(idx, offsetof(hdr_raw_index_header_t, create_time), SEEK_SET);
+    fwrite(&create_time, sizeof(create_time), 1, idx);
+    fseek(idx, pos, SEEK_SET);
+}
+
+int hdr_rename_noreplace(const char *from, const char *to)
+{
+    if(!renameat2(AT_FDCWD, from, AT_FDCWD, to, RENAME_NOREPLACE)) {
+        return 0;
+    }
+    if(errno != EINVAL && errno != ENOSYS) {
+        return -1;
+    }
+    // The file system does not support RENAME_NOREPLACE
+    if(link(from, to)) {
+        return -1;
+    }
+    if(unlink(from)) {
+        unlink(to);
+        return -1;
+    }
+    return 0;
+}
+
+int hdr_raw_file_rename(const char *from, const char *to)
+{
+    char oldname[4096], newname[4096];
+    char oldidx[4096], newidx[4096];
+
+    snprintf(oldname, sizeof(oldname), "%s.dat", from);
+    snprintf(newname, sizeof(newname), "%s.dat", to);
+    if(hdr_rename_noreplace(oldname, newname)) {
+        return HASHPIPE_ERR_SYS;
+    }
+    snprintf(oldidx, sizeof(oldidx), "%s.idx", from);
+    snprintf(newidx, sizeof(newidx), "%s.idx", to);
+    if(hdr_rename_noreplace(oldidx, newidx)) {
+        // Leave both files under the old name
+        rename(newname, oldname);
+        return HASHPIPE_ERR_SYS;
+    }
+    return HASHPIPE_OK;
+}
+
+int hdr_raw_file_close(int fd, FILE *idx, uint64_t nbytes)
+{
+    int rv = HASHPIPE_OK;
+
+    if(fd != -1) {
+        // Drop any preallocated space that was not written
+        if(ftruncate(fd, nbytes)) {
+            rv = HASHPIPE_ERR_SYS;
+        }
+        close(fd);
+    }
+    if(idx) {
+        fclose(idx);
+    }
+    return rv;
+}
+
+int hdr_raw_writer_open(hdr_raw_writer_t *w, const char *basename,
+                        const hdr_raw_index_header_t *ih, uint64_t nrecords)
+{
+    int fd;
+    FILE *idx;
+
+    if(hdr_raw_file_create(basename, ih, nrecords, &fd, &idx) != HASHPIPE_OK) {
+        return HASHPIPE_ERR_SYS;
+    }
+    hdr_raw_writer_attach(w, fd, idx, ih->record_bytes);
+    return HASHPIPE_OK;
+}
+
+void hdr_raw_writer_attach(hdr_raw_writer_t *w, int fd, FILE *idx, uint64_t record_bytes)
+{
+    w->record_bytes = record_bytes;
+    w->fd = fd;
+    w->idx = idx;
+    w->offset = 0;
+    w->nwritten = 0;
+}
+
+// Records a completed write of buffer i
+static int complete_write(hdr_raw_writer_t *w, int i, ssize_t res)
+{
+    w->busy[i] = 0;
+    w->inflight--;
+    if(res != (ssize_t)w->record_bytes) {
+        errno = res < 0 ? -res : EIO;
+        hashpipe_error(__FUNCTION__, "write of record at offset %lu failed",
+                       (unsigned long)w->entry[i].offset);
+        return HASHPIPE_ERR_SYS;
+    }
+    fwrite(&w->entry[i], sizeof(w->entry[i]), 1, w->idx);
+    w->nwritten++;
+    return HASHPIPE_OK;
+}
+
+#ifdef HAVE_LIBURING_H
+// Reaps completions, waiting for at least one if wait is set.  Failed writes
+// are counted in nfailed.  Returns HASHPIPE_ERR_SYS only if waiting fails.
+static int reap(hdr_raw_writer_t *w, int wait)
+{
+    struct io_uring_cqe *cqe;
+
+    while(w->inflight) {
+        if(wait) {
+            if(io_uring_wait_cqe(&w->ring, &cqe) < 0) {
+                return HASHPIPE_ERR_SYS;
+            }
+            wait = 0;
+        } else if(io_uring_peek_cqe(&w->ring, &cqe)) {
+            break;
+        }
+        if(complete_write(w, (int)(uintptr_t)io_uring_cqe_get_data(cqe), cqe->res) != HASHPIPE_OK) {
+            __atomic_add_fetch(&w->nfailed, 1, __ATOMIC_RELAXED);
+        }
+        io_uring_cqe_seen(&w->ring, cqe);
+    }
+    return HASHPIPE_OK;
+}
+#endif
+
+int hdr_raw_writer_put(hdr_raw_writer_t *w, const hdr_stripper_header_t *hdr,
+                       const void *data, uint64_t time_ms)
+{
+    size_t n;
+    int i;
+
+#ifdef HAVE_LIBURING_H
+    struct io_uring_sqe *sqe;
+
+    // Pick up finished writes and wait for one if all buffers are busy
+    if(reap(w, w->inflight == w->qdepth) != HASHPIPE_OK || w->inflight == w->qdepth) {
+        return HASHPIPE_ERR_SYS;
+    }
+#endif
+    for(i=0; w->busy[i]; i++);
+
+    n = hdr_stripper_data_bytes(hdr);
+    n = n < w->record_bytes ? n : w->record_bytes;
+    memcpy(w->buf[i], data, n);
+    memset(w->buf[i] + n, 0, w->record_bytes - n);
+    w->entry[i].mcnt = hdr->mcnt;
+    w->entry[i].offset = w->offset;
+    w->entry[i].time_ms = time_ms;
+    w->entry[i].good_data = hdr->good_data;
+    memcpy(w->entry[i].thresh, hdr->thresh, sizeof(w->entry[i].thresh));
+    memcpy(w->entry[i].pkt_map, hdr->pkt_map, sizeof(w->entry[i].pkt_map));
+    w->busy[i] = 1;
+    w->inflight++;
+
+#ifdef HAVE_LIBURING_H
+    sqe = io_uring_get_sqe(&w->ring);
+    io_uring_prep_write(sqe, w->fd, w->buf[i], w->record_bytes, w->offset);
+    io_uring_sqe_set_data(sqe, (void *)(uintptr_t)i);
+    // The write stays in the submission queue if submitting fails, so its
+    // record is not reused
+    w->offset += w->record_bytes;
+    if(io_uring_submit(&w->ring) < 0) {
+        hashpipe_error(__FUNCTION__, "io_uring_submit");
+        return HASHPIPE_ERR_SYS;
+    }
+#else
+    // The record of a failed write is written over by the next block
+    if(complete_write(w, i, pwrite(w->fd, w->buf[i], w->record_bytes,
+                                   w->offset)) != HASHPIPE_OK) {
+        return HASHPIPE_ERR_SYS;
+    }
+    w->offset += w->record_bytes;
+#endif
+
+    return HASHPIPE_OK;
+}
+
+uint64_t hdr_raw_writer_detach(hdr_raw_writer_t *w, int *fd, FILE **idx)
+{
+#ifdef HAVE_LIBURING_H
+    while(w->inflight) {
+        if(reap(w, 1) != HASHPIPE_OK) {
+            break;
+        }
+    }
+#endif
+    *fd = w->fd;
+    *idx = w->idx;
+    w->fd = -1;
+    w->idx = NULL;
+    return w->offset;
+}
+
+int hdr_raw_writer_close(hdr_raw_writer_t *w)
+{
+    int fd;
+    FILE *idx;
+    uint64_t nbytes = hdr_raw_writer_detach(w, &fd, &idx);
+
+    return hdr_raw_file_close(fd, idx, nbytes);
+}
+
+void hdr_raw_writer_destroy(hdr_raw_writer_t *w)
+{
+    int i;
+
+    hdr_raw_writer_close(w);
+#ifdef HAVE_LIBURING_H
+    io_uring_queue_exit(&w->ring);
+#endif
+    for(i=0; i<w->qdepth; i++) {
+        free(w->buf[i]);
+    }
+    free(w->buf);
+    free(w->busy);
+    free(w->entry);
+}
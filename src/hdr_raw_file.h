@@ -0,0 +1,155 @@
+/* hdr_raw_file.h
+ *
+ * Raw recording format.  A raw recording is a pair of files:
+ *
+ *   hera_volt_raw_<time>_<mcnt>.dat  stripper blocks, one record of
+ *                                    record_bytes per block, written with
+ *                                    O_DIRECT
+ *   hera_volt_raw_<time>_<mcnt>.idx  an hdr_raw_index_header_t followed by
+ *                                    one hdr_raw_index_entry_t per block
+ *                                    written
+ *
+ * where mcnt is that of the first block.
+ *
+ * Records are stored exactly as the blocks are laid out in the stripper
+ * databuf, i.e. (a,p,c,m,t), which is also the layout of one chunk of the
+ * "data" data set of a hera_volt_data_*.h5 file.  Index entries are appended
+ * as writes complete, so they are not necessarily in offset order.
+ *
+ * Version 2 added nbits to the header and the requantization thresholds to
+ * the entries.  Version 3 added the blocks' packet presence maps (see
+ * hdr_pkt_bit) to the entries.  A recording holds either 4 bit blocks (N_BYTES_PER_STRP_BLOCK
+ * byte records) or requantized 2 bit blocks (N_BYTES_PER_RQNT_BLOCK byte
+ * records), see hdr_databuf.h.  Recordings of beam blocks have nants =
+ * nbeams rows and records padded to a multiple of HDR_RAW_ALIGN.
+ */
+#ifndef _HDR_RAW_FILE_H
+#define _HDR_RAW_FILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stddef.h>
+#include "hdr_databuf.h"
+
+#ifdef HAVE_LIBURING_H
+#include <liburing.h>
+#endif
+
+#define HDR_RAW_INDEX_MAGIC   "HDRRAWI1"
+#define HDR_RAW_INDEX_VERSION 3
+
+// O_DIRECT alignment of records and buffers
+#define HDR_RAW_ALIGN 4096
+
+#if N_BYTES_PER_RQNT_BLOCK % HDR_RAW_ALIGN
+#error N_BYTES_PER_RQNT_BLOCK must be a multiple of HDR_RAW_ALIGN
+#endif
+
+typedef struct hdr_raw_index_header {
+    char magic[8];         // HDR_RAW_INDEX_MAGIC
+    int32_t version;       // HDR_RAW_INDEX_VERSION
+    int32_t xid;           // X engine id
+    uint64_t create_time;  // Unix time the recording was started
+    uint64_t record_bytes; // Bytes per record
+    int32_t nants;         // Record dimensions (a,p,c,t)
+    int32_t npols;
+    int32_t nchans;
+    int32_t ntimes;
+    int32_t chan[N_STRP_CHANS_PER_X]; // X engine channel of each channel
+    int32_t nbits;         // Block header nbits (version 2)
+    int32_t nbeams;        // Block header nbeams (0 before beam blocks)
+} hdr_raw_index_header_t;
+
+typedef struct hdr_raw_index_entry {
+    uint64_t mcnt;         // mcnt of the block's first packet
+    uint64_t offset;       // Byte offset of the record in the .dat file
+    uint64_t time_ms;      // Wall time the block was received (ms)
+    int64_t good_data;     // The block's good_data flag
+    uint8_t thresh[N_INPUTS]; // Requantization thresholds if nbits is 2 (version 2)
+    uint64_t pkt_map[N_PKT_MAP_WORDS]; // The block's packet presence map (version 3)
+} hdr_raw_index_entry_t;
+
+// Sizes of the version 1 header and entry and of the version 2 entry
+#define HDR_RAW_INDEX_V1_HEADER_BYTES offsetof(hdr_raw_index_header_t, nbits)
+#define HDR_RAW_INDEX_V1_ENTRY_BYTES  offsetof(hdr_raw_index_entry_t, thresh)
+#define HDR_RAW_INDEX_V2_ENTRY_BYTES  offsetof(hdr_raw_index_entry_t, pkt_map)
+
+// Returns the record size for blocks of data_bytes bytes
+static inline uint64_t hdr_raw_record_bytes(uint64_t data_bytes)
+{
+    return (data_bytes + HDR_RAW_ALIGN - 1) / HDR_RAW_ALIGN * HDR_RAW_ALIGN;
+}
+
+// Raw writer.  Blocks are copied into one of qdepth aligned buffers and up to
+// qdepth writes are kept in flight with io_uring.  Without liburing, blocks
+// are written synchronously with pwrite.
+typedef struct hdr_raw_writer {
+    int qdepth;
+    int fd;
+    uint64_t record_bytes; // Bytes per record of the current file
+    FILE *idx;
+    uint64_t offset;       // Offset of the next record
+    int inflight;
+    uint8_t **buf;         // qdepth record buffers
+    int *busy;             // buffer i has a write in flight
+    hdr_raw_index_entry_t *entry; // index entry of each buffer
+    uint64_t nwritten;     // records written to the current file
+    uint64_t nfailed;      // queued writes that failed, over all files
+#ifdef HAVE_LIBURING_H
+    struct io_uring ring;
+#endif
+} hdr_raw_writer_t;
+
+// Allocates buffers for (and, with liburing, sets up a ring with) qdepth
+// writes in flight of up to N_BYTES_PER_STRP_BLOCK bytes.  Returns HASHPIPE_OK or HASHPIPE_ERR_SYS.
+int hdr_raw_writer_init(hdr_raw_writer_t *w, int qdepth);
+
+// Creates basename.dat, preallocated for nrecords records, and basename.idx
+// holding index header ih.  Neither may exist.  Falls back to buffered I/O if the file system
+// does not support O_DIRECT.  Returns HASHPIPE_OK or HASHPIPE_ERR_SYS.
+int hdr_raw_file_create(const char *basename, const hdr_raw_index_header_t *ih,
+                        uint64_t nrecords, int *fd, FILE **idx);
+
+// Updates the create_time of an index created by hdr_raw_file_create
+void hdr_raw_index_set_create_time(FILE *idx, uint64_t create_time);
+
+// Renames file from to to unless to exists, falling back to link and unlink
+// on file systems without RENAME_NOREPLACE.  Returns 0 or -1 (errno set).
+int hdr_rename_noreplace(const char *from, const char *to);
+
+// Renames from.dat and from.idx to to.dat and to.idx, which must not exist.
+// If either cannot be renamed, both keep their names.
+int hdr_raw_file_rename(const char *from, const char *to);
+
+// Truncates the .dat file to nbytes and closes both files
+int hdr_raw_file_close(int fd, FILE *idx, uint64_t nbytes);
+
+// Creates a raw recording with hdr_raw_file_create and attaches it to w
+int hdr_raw_writer_open(hdr_raw_writer_t *w, const char *basename,
+                        const hdr_raw_index_header_t *ih, uint64_t nrecords);
+
+// Makes w write records of record_bytes bytes to the files fd and idx,
+// starting at offset 0
+void hdr_raw_writer_attach(hdr_raw_writer_t *w, int fd, FILE *idx, uint64_t record_bytes);
+
+// Waits for all writes to complete, hands back the files and returns the
+// size of fd.  The records of failed writes are holes in fd without index
+// entries, so fd may hold more than nwritten records.
+uint64_t hdr_raw_writer_detach(hdr_raw_writer_t *w, int *fd, FILE **idx);
+
+// Queues one block (hdr_stripper_data_bytes of hdr, zero padded to the
+// file's record size) for writing.  Waits for a
+// write to complete if qdepth writes are in flight.  Returns HASHPIPE_OK or,
+// if the block could not be queued (or, without liburing, written),
+// HASHPIPE_ERR_SYS.  Queued writes that fail later are only counted in
+// nfailed, which other threads may read atomically.
+int hdr_raw_writer_put(hdr_raw_writer_t *w, const hdr_stripper_header_t *hdr,
+                       const void *data, uint64_t time_ms);
+
+// Waits for all writes to complete and closes the files, dropping any
+// preallocated space that was not written
+int hdr_raw_writer_close(hdr_raw_writer_t *w);
+
+void hdr_raw_writer_destroy(hdr_raw_writer_t *w);
+
+#endif // _HDR_RAW_FILE_H
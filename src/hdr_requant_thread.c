@@ -0,0 +1,346 @@
+/*
+ * hdr_requant_thread.c
+ *
+ * Optional stage between hdr_strip_thread and hdr_write_thread that
+ * requantizes the 4b+4b samples of each stripped block to 2b+2b, halving
+ * the data rate to disk (see "Requantized blocks" in hdr_databuf.h).  With
+ * RQNTBITS=4 blocks are passed through unchanged, so the stage can stay in
+ * the pipeline and be switched at any block boundary.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <immintrin.h>
+
+#include "hashpipe.h"
+#include "hdr_databuf.h"
+#include "hdr_trace.h"
+
+#define ELAPSED_NS(start,stop) \
+  (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
+
+// Bytes of one input (a,p) in a stripped block
+#define RQNT_INPUT_BYTES (Nsc*Nm*Nt)
+
+// Threshold in units of the RMS that minimizes the quantization noise of a
+// 4 level quantizer for Gaussian input
+#define RQNT_THRESH_SIGMA 0.9816
+
+/* Thresholds.  The power of every input is tracked as an exponential running
+ * mean over RQNTTAU blocks of the mean square 4 bit value of each block.  The
+ * threshold of an input is the smallest integer T > RQNT_THRESH_SIGMA*RMS,
+ * which for integer input values is the same quantizer as the real
+ * threshold.  Each block is requantized with the thresholds derived from the
+ * blocks before it; the first block after (re)starting primes the statistics
+ * with its own power.
+ */
+typedef struct {
+    double power[N_INPUTS];    // running mean square value
+    uint8_t thresh[N_INPUTS];
+    int primed;
+    int nbeams;                // block header nbeams the statistics are for
+} rqnt_stats_t;
+
+// Updates the first ninputs inputs
+static void rqnt_stats_update(rqnt_stats_t *rs, const uint32_t *sumsq, int ninputs,
+                              double tau)
+{
+    double p, t;
+    int i;
+
+    for(i=0; i<ninputs; i++){
+      p = (double)sumsq[i] / (2*RQNT_INPUT_BYTES);
+      rs->power[i] = rs->primed ? rs->power[i] + (p - rs->power[i]) / tau : p;
+      t = floor(RQNT_THRESH_SIGMA * sqrt(rs->power[i])) + 1;
+      rs->thresh[i] = t > 8 ? 8 : t;
+    }
+    rs->primed = 1;
+}
+
+// Code of each 4 bit value (as a nibble) for threshold T
+static void rqnt_lut(uint8_t *lut, int T)
+{
+    int n, v;
+
+    for(n=0; n<16; n++){
+      v = (n ^ 8) - 8;
+      lut[n] = v <= -T ? 0 : v < 0 ? 1 : v < T ? 2 : 3;
+    }
+}
+
+// Square of each 4 bit value (as a nibble)
+static const uint8_t rqnt_sq[16] = {
+    0, 1, 4, 9, 16, 25, 36, 49, 64, 49, 36, 25, 16, 9, 4, 1
+};
+
+/* Requantization kernels.  Both requantize inputs i0 to i1-1 of a block with
+ * thresholds thresh[] and store the sum of the squares of each input's 4 bit
+ * values in sumsq[].  The scalar kernel is the bit-exact reference.  The AVX2
+ * kernel maps 32 high and 32 low nibbles at a time to their codes and squares
+ * with byte shuffles, merges each pair of sample codes into a byte with a
+ * multiply-add and packs the results, and sums the squares with SAD.
+ */
+#if defined(__AVX2__) && RQNT_INPUT_BYTES % 64 == 0
+#define HAVE_RQNT_AVX2
+#endif
+
+static void requant_block_scalar(uint8_t *outdata, const uint8_t *indata,
+                                 const uint8_t *thresh, uint32_t *sumsq, int i0, int i1)
+{
+    const uint8_t *in;
+    uint8_t *out;
+    uint8_t lut[16];
+    uint8_t s[2];
+    uint32_t sum;
+    int i, k, j;
+
+    for(i=i0; i<i1; i++){
+      rqnt_lut(lut, thresh[i]);
+      in = indata + i*RQNT_INPUT_BYTES;
+      out = outdata + i*RQNT_INPUT_BYTES/2;
+      sum = 0;
+      for(k=0; k<RQNT_INPUT_BYTES; k+=2){
+        for(j=0; j<2; j++){
+          s[j] = lut[in[k+j] >> 4] << 2 | lut[in[k+j] & 15];
+          sum += rqnt_sq[in[k+j] >> 4] + rqnt_sq[in[k+j] & 15];
+        }
+        out[k/2] = s[0] << 4 | s[1];
+      }
+      sumsq[i] = sum;
+    }
+}
+
+#ifdef HAVE_RQNT_AVX2
+static void requant_block_avx2(uint8_t *outdata, const uint8_t *indata,
+                               const uint8_t *thresh, uint32_t *sumsq, int i0, int i1)
+{
+    const __m256i nib = _mm256_set1_epi8(0x0f);
+    const __m256i sq = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)rqnt_sq));
+    // Multiply-add weights: first sample of a pair * 16 + second sample
+    const __m256i pair = _mm256_set1_epi16(0x0110);
+    const __m256i zero = _mm256_setzero_si256();
+    const uint8_t *in;
+    __m256i *out;
+    __m256i lut, x, hi, lo, s, w[2], acc;
+    uint8_t lut16[16];
+    int i, k, j;
+
+    for(i=i0; i<i1; i++){
+      rqnt_lut(lut16, thresh[i]);
+      lut = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)lut16));
+      in = indata + i*RQNT_INPUT_BYTES;
+      out = (__m256i *)(outdata + i*RQNT_INPUT_BYTES/2);
+      acc = zero;
+      for(k=0; k<RQNT_INPUT_BYTES; k+=64){
+        for(j=0; j<2; j++){
+          x = _mm256_loadu_si256((const __m256i *)(in + k + 32*j));
+          hi = _mm256_and_si256(_mm256_srli_epi16(x, 4), nib);
+          lo = _mm256_and_si256(x, nib);
+          s = _mm256_or_si256(_mm256_slli_epi16(_mm256_shuffle_epi8(lut, hi), 2),
+                              _mm256_shuffle_epi8(lut, lo));
+          w[j] = _mm256_maddubs_epi16(s, pair);
+          x = _mm256_add_epi8(_mm256_shuffle_epi8(sq, hi), _mm256_shuffle_epi8(sq, lo));
+          acc = _mm256_add_epi64(acc, _mm256_sad_epu8(x, zero));
+        }
+        // packus interleaves the lanes of its operands, permute them back
+        _mm256_stream_si256(out + k/64,
+            _mm256_permute4x64_epi64(_mm256_packus_epi16(w[0], w[1]), 0xd8));
+      }
+      sumsq[i] = _mm256_extract_epi64(acc, 0) + _mm256_extract_epi64(acc, 1) +
+                 _mm256_extract_epi64(acc, 2) + _mm256_extract_epi64(acc, 3);
+    }
+    _mm_sfence();
+}
+#endif // HAVE_RQNT_AVX2
+
+// Requantizes the first ninputs inputs of a block (all of them unless it
+// is a beam block)
+static void requant_block(uint8_t *outdata, const uint8_t *indata, const uint8_t *thresh,
+                          uint32_t *sumsq, int ninputs, int scalar)
+{
+#ifdef HAVE_RQNT_AVX2
+    if(!scalar){
+      requant_block_avx2(outdata, indata, thresh, sumsq, 0, ninputs);
+      return;
+    }
+#endif
+    requant_block_scalar(outdata, indata, thresh, sumsq, 0, ninputs);
+}
+
+static void *hdr_requant_thread_run(hashpipe_thread_args_t * args){
+    hdr_stripper_databuf_t *idb = (hdr_stripper_databuf_t *)args->ibuf;
+    hdr_stripper_databuf_t *odb = (hdr_stripper_databuf_t *)args->obuf;
+    hashpipe_status_t st = args->st;
+    const char *status_key = args->thread_desc->skey;
+
+    hdr_trace_thread_name("requant");
+
+    int rv;
+    uint64_t mcnt = 0;
+    uint8_t *indata;
+    uint8_t *outdata;
+    int iblk = 0;
+    int oblk = 0;
+    int nbits = 4;             // RQNTBITS: 2 to requantize, 4 to pass through
+    double tau = 64;           // RQNTTAU: running RMS time constant (blocks)
+    char kernel[16] = "avx2";  // RQNTKERN: "avx2" or "scalar"
+    int check = 0;             // RQNTCHK: compare with the scalar kernel
+    uint32_t mismatch = 0;     // blocks that failed the check
+    uint8_t *refdata = NULL;   // scalar kernel output for the check
+    uint32_t sumsq[N_INPUTS], refsumsq[N_INPUTS];
+    int tmin = 0, tmax = 0;
+    struct timespec start, stop;
+    uint64_t rqnt_ns = 0;
+    size_t rqnt_bytes = N_BYTES_PER_STRP_BLOCK;
+    rqnt_stats_t stats;
+    int ninputs;
+    int i;
+
+    memset(&stats, 0, sizeof(stats));
+
+    while (run_threads()) {
+
+        hashpipe_status_lock_safe(&st);
+        hputi4(st.buf, "RQNTBKIN", iblk);
+        hputs(st.buf, status_key, "waiting");
+        hputi4(st.buf, "RQNTBKOU", oblk);
+        hputi8(st.buf, "RQNTMCNT", mcnt);
+        hgeti4(st.buf, "RQNTBITS", &nbits);
+        hgetr8(st.buf, "RQNTTAU", &tau);
+        hgets(st.buf, "RQNTKERN", sizeof(kernel), kernel);
+        hgeti4(st.buf, "RQNTCHK", &check);
+        if(nbits != 2 && nbits != 4){
+            hashpipe_warn(__FUNCTION__, "RQNTBITS must be 2 or 4, not %d", nbits);
+            nbits = 4;
+        }
+        tau = tau < 1 ? 1 : tau;
+        hputi4(st.buf, "RQNTBITS", nbits);
+        hputr8(st.buf, "RQNTTAU", tau);
+        hputs(st.buf, "RQNTKERN", kernel);
+        if(rqnt_ns) {
+            hputi8(st.buf, "RQNTNS", rqnt_ns);
+            hputr4(st.buf, "RQNTGBPS", (float)rqnt_bytes/rqnt_ns);
+        }
+        hputi4(st.buf, "RQNTTMIN", tmin);
+        hputi4(st.buf, "RQNTTMAX", tmax);
+        hputu4(st.buf, "RQNTMISM", mismatch);
+        hashpipe_status_unlock_safe(&st);
+
+        while ((rv=hdr_stripper_databuf_wait_filled(idb, iblk))!= HASHPIPE_OK){
+            if (rv==HASHPIPE_TIMEOUT){
+                hashpipe_status_lock_safe(&st);
+                hputs(st.buf, status_key, "blocked");
+                hashpipe_status_unlock_safe(&st);
+                continue;
+            }else{
+                hashpipe_error(__FUNCTION__, "error waiting for filled databuf");
+                pthread_exit(NULL);
+                break;
+            }
+        }
+
+        while ((rv=hdr_stripper_databuf_wait_free(odb, oblk))!= HASHPIPE_OK){
+            if (rv==HASHPIPE_TIMEOUT){
+                hashpipe_status_lock_safe(&st);
+                hputs(st.buf, status_key, "outblocked");
+                hashpipe_status_unlock_safe(&st);
+                continue;
+            }else{
+                hashpipe_error(__FUNCTION__, "error waiting for free databuf");
+                pthread_exit(NULL);
+                break;
+            }
+        }
+
+        hashpipe_status_lock_safe(&st);
+        hputs(st.buf, status_key, "requantizing");
+        hashpipe_status_unlock_safe(&st);
+        mcnt = idb->block[iblk].header.mcnt;
+
+        indata = (uint8_t *)idb->block[iblk].data;
+        outdata = (uint8_t *)odb->block[oblk].data;
+        odb->block[oblk].header = idb->block[iblk].header;
+        ninputs = hdr_stripper_nants(&idb->block[iblk].header)*Np;
+        rqnt_bytes = hdr_stripper_data_bytes(&idb->block[iblk].header);
+
+        // Statistics restart when antenna and beam blocks alternate
+        if(stats.nbeams != idb->block[iblk].header.nbeams){
+          stats.nbeams = idb->block[iblk].header.nbeams;
+          stats.primed = 0;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if(nbits == 4 || idb->block[iblk].header.nbits == 2){
+          // Pass through; statistics restart when requantization resumes
+          memcpy(outdata, indata, rqnt_bytes);
+          stats.primed = 0;
+        }else{
+          if(!stats.primed){
+            requant_block(outdata, indata, stats.thresh, sumsq, ninputs, 0);
+            rqnt_stats_update(&stats, sumsq, ninputs, tau);
+          }
+          requant_block(outdata, indata, stats.thresh, sumsq, ninputs,
+                        !strcmp(kernel, "scalar"));
+          odb->block[oblk].header.nbits = 2;
+          memcpy(odb->block[oblk].header.thresh, stats.thresh, sizeof(stats.thresh));
+        }
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        rqnt_ns = ELAPSED_NS(start, stop);
+
+        if(odb->block[oblk].header.nbits == 2 && idb->block[iblk].header.nbits != 2){
+          if(check){
+            if(!refdata && !(refdata = malloc(N_BYTES_PER_RQNT_BLOCK))){
+              hashpipe_error(__FUNCTION__, "error allocating check buffer");
+              pthread_exit(NULL);
+            }
+            requant_block_scalar(refdata, indata, stats.thresh, refsumsq, 0, ninputs);
+            if(memcmp(refdata, outdata, rqnt_bytes/2) ||
+               memcmp(refsumsq, sumsq, ninputs*sizeof(sumsq[0]))){
+              hashpipe_warn(__FUNCTION__, "%s kernel output differs from scalar kernel (mcnt %lu)",
+                            kernel, mcnt);
+              mismatch++;
+            }
+          }
+          // Thresholds for the next block
+          rqnt_stats_update(&stats, sumsq, ninputs, tau);
+          for(tmin=8, tmax=0, i=0; i<ninputs; i++){
+            tmin = stats.thresh[i] < tmin ? stats.thresh[i] : tmin;
+            tmax = stats.thresh[i] > tmax ? stats.thresh[i] : tmax;
+          }
+        }
+
+        // Mark input block as free, output block as filled
+        hdr_stripper_databuf_set_filled(odb, oblk);
+        hdr_stripper_databuf_set_free(idb, iblk);
+
+        iblk = (iblk + 1)%idb->header.n_block;
+        oblk = (oblk + 1)%odb->header.n_block;
+
+        /* Will exit if thread has been cancelled */
+        pthread_testcancel();
+    }
+
+    free(refdata);
+
+    // Thread success!
+    return THREAD_OK;
+}
+
+
+hashpipe_thread_desc_t hdr_requant_thread = {
+    name: "hdr_requant_thread",
+    skey: "RQNTSTAT",
+    init: NULL,
+    run: hdr_requant_thread_run,
+    ibuf_desc: {hdr_stripper_databuf_create},
+    obuf_desc: {hdr_stripper_databuf_create}
+};
+
+static __attribute__((constructor)) void ctor(){
+    register_hashpipe_thread(&hdr_requant_thread);
+}
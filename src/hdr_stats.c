@@ -0,0 +1,356 @@
+/* hdr_stats.c
+ *
+ * Status publisher thread for lock-free statistics and latency histograms
+ * (see hdr_stats.h).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "hdr_stats.h"
+#include "hdr_trace.h"
+
+static void *publisher_thread(void *arg)
+{
+    hdr_stats_publisher_t *p = (hdr_stats_publisher_t *)arg;
+    struct timespec next;
+    int quit = 0;
+
+    // Lowest priority, so the publisher never competes with the hot threads
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    clock_gettime(CLOCK_REALTIME, &next);
+    while(!quit) {
+        next.tv_nsec += (long)p->period_ms * 1000 * 1000;
+        next.tv_sec += next.tv_nsec / (1000*1000*1000);
+        next.tv_nsec %= 1000*1000*1000;
+
+        pthread_mutex_lock(&p->lock);
+        while(!p->quit && pthread_cond_timedwait(&p->cond, &p->lock, &next) != ETIMEDOUT);
+        quit = p->quit;
+        pthread_mutex_unlock(&p->lock);
+
+        hashpipe_status_lock_safe(p->st);
+        p->publish(p->st->buf, p->arg);
+        hashpipe_status_unlock_safe(p->st);
+        if(p->after) {
+            p->after(p->arg);
+        }
+    }
+
+    return NULL;
+}
+
+int hdr_stats_publisher_start(hdr_stats_publisher_t *p, hashpipe_status_t *st,
+                              int period_ms, int cpu, hdr_stats_publish_t publish,
+                              hdr_stats_after_t after, void *arg)
+{
+    cpu_set_t cpuset;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    p->st = st;
+    p->period_ms = period_ms > 0 ? period_ms : 1;
+    p->publish = publish;
+    p->after = after;
+    p->arg = arg;
+    p->quit = 0;
+    p->running = 0;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    if(pthread_create(&p->thread, NULL, publisher_thread, p)) {
+        hashpipe_error(__FUNCTION__, "error starting status publisher");
+        return HASHPIPE_ERR_SYS;
+    }
+    p->running = 1;
+
+    // The thread inherits the affinity of its creator, which is typically
+    // pinned to a busy polling CPU, so move it elsewhere
+    CPU_ZERO(&cpuset);
+    if(cpu >= 0) {
+        CPU_SET(cpu, &cpuset);
+    } else {
+        for(i=0; i<ncpus && i<CPU_SETSIZE; i++) {
+            CPU_SET(i, &cpuset);
+        }
+    }
+    if(pthread_setaffinity_np(p->thread, sizeof(cpuset), &cpuset)) {
+        hashpipe_warn(__FUNCTION__, "error setting status publisher affinity");
+    }
+
+    return HASHPIPE_OK;
+}
+
+void hdr_stats_publisher_stop(hdr_stats_publisher_t *p)
+{
+    if(!p->running) {
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+    pthread_join(p->thread, NULL);
+    p->running = 0;
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond);
+}
+
+// Latency histograms
+
+// Registered histograms
+static pthread_mutex_t hist_lock = PTHREAD_MUTEX_INITIALIZER;
+static hdr_hist_t *hist_list = NULL;
+
+// Histogram publisher.  pub_lock is only held to start and stop it, never by
+// the publisher itself, which locks the status buffer and then hist_lock.
+// pub_dump is the HISTDUMP path taken by the last publish, if any.
+static pthread_mutex_t pub_lock = PTHREAD_MUTEX_INITIALIZER;
+static int pub_refs = 0;
+static hashpipe_status_t pub_st;
+static hdr_stats_publisher_t pub;
+static char pub_dump[256];
+
+// Counts of all histograms of a prefix, only used by the publisher
+static uint64_t pub_count[HDR_HIST_NBUCKETS];
+
+uint64_t hdr_hist_bucket_low(int b)
+{
+    int e;
+
+    if(b < HDR_HIST_SUB) {
+        return b;
+    }
+    e = b / HDR_HIST_SUB + HDR_HIST_SUB_BITS - 1;
+    return (uint64_t)(HDR_HIST_SUB + b % HDR_HIST_SUB) << (e - HDR_HIST_SUB_BITS);
+}
+
+uint64_t hdr_hist_bucket_high(int b)
+{
+    if(b == HDR_HIST_NBUCKETS - 1) {
+        return UINT64_MAX;
+    }
+    return hdr_hist_bucket_low(b + 1) - 1;
+}
+
+void hdr_hist_register(hdr_hist_t *h, const char *prefix)
+{
+    memset(h->count, 0, sizeof(h->count));
+    h->max = 0;
+    snprintf(h->prefix, sizeof(h->prefix), "%.4s", prefix);
+
+    pthread_mutex_lock(&hist_lock);
+    h->next = hist_list;
+    hist_list = h;
+    pthread_mutex_unlock(&hist_lock);
+}
+
+void hdr_hist_unregister(hdr_hist_t *h)
+{
+    hdr_hist_t **p;
+
+    pthread_mutex_lock(&hist_lock);
+    for(p=&hist_list; *p; p=&(*p)->next) {
+        if(*p == h) {
+            *p = h->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&hist_lock);
+}
+
+uint64_t hdr_hist_quantile(const uint64_t *count, uint64_t n, double q)
+{
+    uint64_t rank, sum = 0;
+    int b;
+
+    if(n == 0) {
+        return 0;
+    }
+    // Smallest value that at least q*n values do not exceed
+    rank = (uint64_t)(q * n + 0.5);
+    if(rank < 1) {
+        rank = 1;
+    }
+    for(b=0; b<HDR_HIST_NBUCKETS; b++) {
+        sum += count[b];
+        if(sum >= rank) {
+            break;
+        }
+    }
+    return b < HDR_HIST_NBUCKETS ? hdr_hist_bucket_high(b) : UINT64_MAX;
+}
+
+// Adds up the histograms of prefix, starting at h, into pub_count.  Returns
+// the number of values, sets *max.
+static uint64_t hist_sum(hdr_hist_t *h, const char *prefix, uint64_t *max)
+{
+    uint64_t n = 0, c;
+    int b;
+
+    memset(pub_count, 0, sizeof(pub_count));
+    *max = 0;
+    for(; h; h=h->next) {
+        if(strcmp(h->prefix, prefix)) {
+            continue;
+        }
+        for(b=0; b<HDR_HIST_NBUCKETS; b++) {
+            c = hdr_stat_get(&h->count[b]);
+            pub_count[b] += c;
+            n += c;
+        }
+        c = hdr_stat_get(&h->max);
+        if(c > *max) {
+            *max = c;
+        }
+    }
+    return n;
+}
+
+// Returns whether h is the first registered histogram of its prefix
+static int hist_first(hdr_hist_t *h)
+{
+    hdr_hist_t *p;
+
+    for(p=hist_list; p!=h; p=p->next) {
+        if(!strcmp(p->prefix, h->prefix)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Writes the buckets of every prefix to path, with hist_lock held
+static void hist_dump(const char *path)
+{
+    hdr_hist_t *h;
+    uint64_t n, max;
+    FILE *f;
+    int b;
+
+    if(!(f = fopen(path, "w"))) {
+        hashpipe_error(__FUNCTION__, "error opening %s", path);
+        return;
+    }
+    fprintf(f, "# prefix low_ns high_ns count\n");
+    for(h=hist_list; h; h=h->next) {
+        if(!hist_first(h)) {
+            continue;
+        }
+        n = hist_sum(h, h->prefix, &max);
+        fprintf(f, "# %s count %lu max %lu\n", h->prefix, n, max);
+        for(b=0; b<HDR_HIST_NBUCKETS; b++) {
+            if(pub_count[b]) {
+                fprintf(f, "%s %lu %lu %lu\n", h->prefix, hdr_hist_bucket_low(b),
+                        hdr_hist_bucket_high(b), pub_count[b]);
+            }
+        }
+    }
+    if(fclose(f)) {
+        hashpipe_error(__FUNCTION__, "error writing %s", path);
+    }
+}
+
+static void hist_publish(char *buf, void *arg)
+{
+    char key[9];
+    uint64_t n, max;
+    hdr_hist_t *h;
+    int reset = 0;
+    int b;
+
+    hgeti4(buf, "HISTRST", &reset);
+    // The file is written by hist_dump_pending, once buf is unlocked
+    hgets(buf, "HISTDUMP", sizeof(pub_dump), pub_dump);
+    if(pub_dump[0]) {
+        hputs(buf, "HISTDUMP", "");
+    }
+
+    pthread_mutex_lock(&hist_lock);
+
+    // A reset racing a single writer (hdr_hist_record1) may leave a count of
+    // that writer behind
+    if(reset) {
+        for(h=hist_list; h; h=h->next) {
+            for(b=0; b<HDR_HIST_NBUCKETS; b++) {
+                hdr_stat_take(&h->count[b], 0);
+            }
+            hdr_stat_take(&h->max, 0);
+        }
+        hputi4(buf, "HISTRST", 0);
+    }
+
+    for(h=hist_list; h; h=h->next) {
+        if(!hist_first(h)) {
+            continue;
+        }
+        n = hist_sum(h, h->prefix, &max);
+        snprintf(key, sizeof(key), "%.4sP50", h->prefix);
+        hputu8(buf, key, hdr_hist_quantile(pub_count, n, 0.5));
+        snprintf(key, sizeof(key), "%.4sP99", h->prefix);
+        hputu8(buf, key, hdr_hist_quantile(pub_count, n, 0.99));
+        snprintf(key, sizeof(key), "%.4sP999", h->prefix);
+        hputu8(buf, key, hdr_hist_quantile(pub_count, n, 0.999));
+        snprintf(key, sizeof(key), "%.4sMAX", h->prefix);
+        hputu8(buf, key, max);
+        snprintf(key, sizeof(key), "%.4sCNT", h->prefix);
+        hputu8(buf, key, n);
+    }
+
+    pthread_mutex_unlock(&hist_lock);
+
+    hdr_trace_poll(buf);
+}
+
+static void hist_dump_pending(void *arg)
+{
+    if(pub_dump[0]) {
+        pthread_mutex_lock(&hist_lock);
+        hist_dump(pub_dump);
+        pthread_mutex_unlock(&hist_lock);
+        pub_dump[0] = '\0';
+    }
+}
+
+int hdr_hist_publisher_start(hashpipe_status_t *st)
+{
+    int period_ms = 1000;
+    int rv = HASHPIPE_OK;
+
+    hashpipe_status_lock_safe(st);
+    hgeti4(st->buf, "HISTPBMS", &period_ms);
+    hputi4(st->buf, "HISTPBMS", period_ms);
+    hputi4(st->buf, "HISTRST", 0);
+    hashpipe_status_unlock_safe(st);
+
+    pthread_mutex_lock(&pub_lock);
+    if(pub_refs == 0) {
+        // Copied, as the thread that starts the publisher may exit first
+        pub_st = *st;
+        rv = hdr_stats_publisher_start(&pub, &pub_st, period_ms, -1,
+                                       hist_publish, hist_dump_pending, NULL);
+    }
+    if(rv == HASHPIPE_OK) {
+        pub_refs++;
+    }
+    pthread_mutex_unlock(&pub_lock);
+
+    return rv;
+}
+
+void hdr_hist_publisher_stop(void)
+{
+    pthread_mutex_lock(&pub_lock);
+    if(pub_refs > 0 && --pub_refs == 0) {
+        hdr_stats_publisher_stop(&pub);
+    }
+    pthread_mutex_unlock(&pub_lock);
+}
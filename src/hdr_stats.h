@@ -0,0 +1,200 @@
+#ifndef _HDR_STATS_H
+#define _HDR_STATS_H
+
+/* Lock-free statistics.
+ *
+ * Threads on the packet path must not spin on the status buffer lock, which
+ * is shared with every other thread and with external status readers.  They
+ * keep their statistics in hdr_stat_t counters of cache line aligned structs
+ * (HDR_STATS_ALIGNED) instead and only update them with the relaxed atomics
+ * below.  A status publisher thread wakes up every period_ms, takes the
+ * status lock once and calls a publish function that snapshots the counters
+ * into status keys.
+ *
+ * Counters that are never reset (totals) are read with hdr_stat_get and
+ * published as is or as the difference to the previous snapshot.  Counters
+ * that cover the time since the last snapshot (minima, maxima, masks) are
+ * read and rearmed at once with hdr_stat_take.
+ */
+#include <stdint.h>
+#include <pthread.h>
+#include "hashpipe.h"
+
+#define HDR_STATS_ALIGNED __attribute__((aligned(64)))
+
+typedef uint64_t hdr_stat_t;
+
+static inline uint64_t hdr_stat_get(const hdr_stat_t *s)
+{
+    return __atomic_load_n(s, __ATOMIC_RELAXED);
+}
+
+static inline void hdr_stat_set(hdr_stat_t *s, uint64_t v)
+{
+    __atomic_store_n(s, v, __ATOMIC_RELAXED);
+}
+
+static inline void hdr_stat_add(hdr_stat_t *s, uint64_t v)
+{
+    __atomic_fetch_add(s, v, __ATOMIC_RELAXED);
+}
+
+static inline void hdr_stat_or(hdr_stat_t *s, uint64_t v)
+{
+    if(v) {
+        __atomic_fetch_or(s, v, __ATOMIC_RELAXED);
+    }
+}
+
+// Raises s to v.  Only stores if v is a new maximum, which is rare.
+static inline void hdr_stat_max(hdr_stat_t *s, uint64_t v)
+{
+    uint64_t cur = __atomic_load_n(s, __ATOMIC_RELAXED);
+    while(v > cur && !__atomic_compare_exchange_n(s, &cur, v, 1,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Lowers s to v.  Only stores if v is a new minimum, which is rare.
+static inline void hdr_stat_min(hdr_stat_t *s, uint64_t v)
+{
+    uint64_t cur = __atomic_load_n(s, __ATOMIC_RELAXED);
+    while(v < cur && !__atomic_compare_exchange_n(s, &cur, v, 1,
+                                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Returns s and sets it to reset (0 for maxima and masks, UINT64_MAX for
+// minima)
+static inline uint64_t hdr_stat_take(hdr_stat_t *s, uint64_t reset)
+{
+    return __atomic_exchange_n(s, reset, __ATOMIC_RELAXED);
+}
+
+// Called by the publisher with the status buffer locked
+typedef void (*hdr_stats_publish_t)(char *buf, void *arg);
+
+// Called by the publisher after unlocking the status buffer
+typedef void (*hdr_stats_after_t)(void *arg);
+
+/* Status publisher.  The thread runs at the lowest nice level and may run on
+ * any CPU, unless cpu is not negative, in which case it is pinned to cpu.
+ * publish(buf, arg) is called with the status buffer locked every period_ms
+ * and once more when the publisher is stopped, each time followed by
+ * after(arg), if not NULL, once the status buffer is unlocked.  Work that is
+ * slow or may block (e.g. file IO) goes in after.
+ */
+typedef struct hdr_stats_publisher {
+    hashpipe_status_t *st;
+    int period_ms;
+    hdr_stats_publish_t publish;
+    hdr_stats_after_t after;
+    void *arg;
+    int running;
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+} hdr_stats_publisher_t;
+
+// Returns HASHPIPE_OK or HASHPIPE_ERR_SYS
+int hdr_stats_publisher_start(hdr_stats_publisher_t *p, hashpipe_status_t *st,
+                              int period_ms, int cpu, hdr_stats_publish_t publish,
+                              hdr_stats_after_t after, void *arg);
+
+// Publishes a last time and stops the publisher, if running
+void hdr_stats_publisher_stop(hdr_stats_publisher_t *p);
+
+/* Latency histograms.  Values (ns) are counted in log-linear buckets: values
+ * below HDR_HIST_SUB have a bucket each, and every power of two above that is
+ * split into HDR_HIST_SUB buckets, so a bucket is at most 1/HDR_HIST_SUB
+ * (6%) wide relative to its values.  Values of 2^HDR_HIST_MAX_BITS ns (18
+ * minutes) and more are counted in the last bucket.
+ *
+ * Histograms are registered under a status key prefix of up to 4 characters.
+ * Histograms registered under the same prefix (e.g. one per thread) are
+ * added up when published.  The histogram publisher, which runs while any
+ * thread holds a reference to it, puts for every prefix XXXX
+ *
+ *   XXXXP50, XXXXP99, XXXXP999   50th, 99th and 99.9th percentile (ns)
+ *   XXXXMAX                      maximum (ns)
+ *   XXXXCNT                      number of values
+ *
+ * into the status buffer every HISTPBMS ms (default 1000).  Percentiles are
+ * the upper end of the bucket holding them.  Histograms count from start up
+ * until HISTRST is set to 1.  If HISTDUMP is set to a file name, the buckets
+ * of every prefix are written to that file, one "prefix low high count" line
+ * per bucket that is not empty.  HISTDUMP is cleared when the request is
+ * taken and the file is written right after, without the status buffer
+ * locked.  The publisher also handles the trace keys (see hdr_trace.h).
+ */
+#define HDR_HIST_SUB_BITS  4
+#define HDR_HIST_SUB       (1 << HDR_HIST_SUB_BITS)
+#define HDR_HIST_MAX_BITS  40
+#define HDR_HIST_NBUCKETS  ((HDR_HIST_MAX_BITS - HDR_HIST_SUB_BITS + 1) * HDR_HIST_SUB)
+
+typedef struct hdr_hist {
+    hdr_stat_t count[HDR_HIST_NBUCKETS];
+    hdr_stat_t max;
+    char prefix[5];
+    struct hdr_hist *next;  // registered histograms
+} hdr_hist_t;
+
+static inline int hdr_hist_bucket(uint64_t v)
+{
+    int e;
+
+    if(v < HDR_HIST_SUB) {
+        return v;
+    }
+    if(v >> HDR_HIST_MAX_BITS) {
+        return HDR_HIST_NBUCKETS - 1;
+    }
+    e = 63 - __builtin_clzll(v);
+    return (e - HDR_HIST_SUB_BITS + 1) * HDR_HIST_SUB
+         + ((v >> (e - HDR_HIST_SUB_BITS)) & (HDR_HIST_SUB - 1));
+}
+
+// Returns the lowest value of bucket b
+uint64_t hdr_hist_bucket_low(int b);
+
+// Returns the highest value of bucket b
+uint64_t hdr_hist_bucket_high(int b);
+
+// Counts v in h.  Safe with any number of threads recording to h.
+static inline void hdr_hist_record(hdr_hist_t *h, uint64_t v)
+{
+    hdr_stat_add(&h->count[hdr_hist_bucket(v)], 1);
+    hdr_stat_max(&h->max, v);
+}
+
+// Counts v in h, which only the calling thread records to.  Unlike
+// hdr_hist_record, this needs no locked instruction.
+static inline void hdr_hist_record1(hdr_hist_t *h, uint64_t v)
+{
+    hdr_stat_t *c = &h->count[hdr_hist_bucket(v)];
+
+    hdr_stat_set(c, hdr_stat_get(c) + 1);
+    if(v > hdr_stat_get(&h->max)) {
+        hdr_stat_set(&h->max, v);
+    }
+}
+
+// Clears h and registers it under prefix (up to 4 characters).  h must stay
+// valid until it is unregistered.
+void hdr_hist_register(hdr_hist_t *h, const char *prefix);
+
+void hdr_hist_unregister(hdr_hist_t *h);
+
+// Returns the value below which fraction q (0 to 1) of the n values counted
+// in count[HDR_HIST_NBUCKETS] lie, i.e. the upper end of its bucket, or 0 if
+// n is 0
+uint64_t hdr_hist_quantile(const uint64_t *count, uint64_t n, double q);
+
+// Takes a reference to the histogram publisher, starting it on status buffer
+// st if this is the first reference.  Returns HASHPIPE_OK or
+// HASHPIPE_ERR_SYS.
+int hdr_hist_publisher_start(hashpipe_status_t *st);
+
+// Drops a reference to the histogram publisher, stopping it with the last
+void hdr_hist_publisher_stop(void);
+
+#endif // _HDR_STATS_H
@@ -5,18 +5,371 @@
  * processing pipelines to be tested without the network portion of PAPER.
  */
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <unistd.h>
 #include <string.h>
 #include <pthread.h>
+#include <sched.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/types.h>
+#include <immintrin.h>
 
 #include "hashpipe.h"
 #include "hdr_databuf.h"
+#include "hdr_power.h"
+#include "hdr_corr.h"
+#include "hdr_trace.h"
+
+#define ELAPSED_NS(start,stop) \
+  (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
+
+/* Recorded channel set (STRPCHAN), re-read at every block boundary.  The set
+ * is compiled into a gather table holding the byte offset of each recorded
+ * channel within an (m,a) row of the input block, so the kernels never
+ * compute channel indexes per byte.
+ */
+typedef struct {
+    char spec[80];
+    int32_t chan[Nsc];   // X engine channel of each recorded channel
+    int32_t inoff[Nsc];  // byte offset of each recorded channel in a row
+    int contiguous;      // chan[c] == chan[0]+c, rows can be loaded directly
+} strip_chans_t;
+
+static void strip_chans_compile(strip_chans_t *sc)
+{
+    int c;
+
+    sc->contiguous = 1;
+    for(c=0; c<Nsc; c++){
+      sc->inoff[c] = sc->chan[c]*Nt*Np;
+      if(sc->chan[c] != sc->chan[0]+c){
+        sc->contiguous = 0;
+      }
+    }
+}
+
+/* Corner turn kernels: (m,a,c,t,p) -> (a,p,c,m,t) for the recorded channels.
+ *
+ * The scalar kernel is the bit-exact reference.  The AVX2 kernel handles one
+ * antenna at a time.  For every m it loads the Nsc*Nt*Np = 32 recorded bytes
+ * as one row (a plain load for contiguous channel sets, an 8 x 32 bit gather
+ * otherwise), then
+ *
+ *   1. shuffles the bytes of each row from (c,t,p) to (p,c,t) order within
+ *      each 128 bit lane, making every (p,c) pair a 16 bit (t0,t1) word,
+ *   2. transposes the 16 rows x 16 words with unpacks and lane permutes,
+ *      which gives one (m,t) vector for each (p,c), and
+ *   3. writes the 16 output vectors, i.e. the antenna's 512 contiguous output
+ *      bytes, with streaming stores.
+ */
+#if defined(__AVX2__) && Nsc*Nt*Np == 32 && Nm == 16
+#define HAVE_STRIP_AVX2
+#endif
+
+// Both kernels strip antennas a0 to a1-1 of a block
+static void strip_block_scalar(uint8_t *outdata, const uint8_t *indata,
+                               const strip_chans_t *sc, int a0, int a1)
+{
+    const uint8_t *row;
+    int m,a,p,c,t;
+
+    for(m=0; m<Nm; m++){
+      for(a=a0; a<a1; a++){
+        row = indata + hdr_input_databuf_data_idx8(m,a,0,0,0);
+        for(c=0; c<Nsc; c++){
+          for(t=0; t<Nt; t++){
+            for(p=0; p<Np; p++){
+              outdata[hdr_stripper_databuf_data_idx8(m,a,p,c,t)] =
+                row[sc->inoff[c] + t*Np + p];
+            }
+          }
+        }
+      }
+    }
+}
+
+#ifdef HAVE_STRIP_AVX2
+static void strip_block_avx2(uint8_t *outdata, const uint8_t *indata,
+                             const strip_chans_t *sc, int a0, int a1)
+{
+    const __m256i vindex = _mm256_loadu_si256((const __m256i *)sc->inoff);
+    const uint8_t *row;
+    // (c,t,p) -> (p,c,t) within each lane of 4 channels
+    const __m256i pct = _mm256_setr_epi8(
+        0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15,
+        0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    __m256i r[16], u[16];
+    __m256i *out;
+    int a, i, k, p, c;
+
+    for(a=a0; a<a1; a++){
+      // Load and shuffle one row per m
+      for(i=0; i<16; i++){
+        row = indata + hdr_input_databuf_data_idx8(i,a,0,0,0);
+        if(sc->contiguous){
+          r[i] = _mm256_loadu_si256((const __m256i *)(row + sc->inoff[0]));
+        }else{
+          r[i] = _mm256_i32gather_epi32((const int *)row, vindex, 1);
+        }
+        r[i] = _mm256_shuffle_epi8(r[i], pct);
+      }
+
+      // Transpose 16x16 16 bit words
+      for(i=0; i<16; i+=2){
+        u[i]   = _mm256_unpacklo_epi16(r[i], r[i+1]);
+        u[i+1] = _mm256_unpackhi_epi16(r[i], r[i+1]);
+      }
+      for(i=0; i<16; i+=4){
+        r[i]   = _mm256_unpacklo_epi32(u[i],   u[i+2]);
+        r[i+1] = _mm256_unpackhi_epi32(u[i],   u[i+2]);
+        r[i+2] = _mm256_unpacklo_epi32(u[i+1], u[i+3]);
+        r[i+3] = _mm256_unpackhi_epi32(u[i+1], u[i+3]);
+      }
+      for(i=0; i<4; i++){
+        u[2*i]     = _mm256_unpacklo_epi64(r[i],    r[i+4]);
+        u[2*i+1]   = _mm256_unpackhi_epi64(r[i],    r[i+4]);
+        u[2*i+8]   = _mm256_unpacklo_epi64(r[i+8],  r[i+12]);
+        u[2*i+9]   = _mm256_unpackhi_epi64(r[i+8],  r[i+12]);
+      }
+      // u[k] (u[k+8]) now holds word k in its low lane and word k+8 in its
+      // high lane for rows 0-7 (8-15).  Word k of a row is (p,c) with
+      // p = (k%8)/4 and c = 4*(k/8) + k%4.
+      for(k=0; k<8; k++){
+        p = k/4;
+        c = k%4;
+        out = (__m256i *)outdata + hdr_stripper_databuf_data_idx256(0,a,p,c,0);
+        _mm256_stream_si256(out, _mm256_permute2x128_si256(u[k], u[k+8], 0x20));
+        out = (__m256i *)outdata + hdr_stripper_databuf_data_idx256(0,a,p,c+4,0);
+        _mm256_stream_si256(out, _mm256_permute2x128_si256(u[k], u[k+8], 0x31));
+      }
+    }
+    _mm_sfence();
+}
+#endif // HAVE_STRIP_AVX2
+
+/* Worker pool.  STRPNTHR threads (including this thread) each strip a disjoint
+ * antenna range of the same block.  The pool meets at a "start" barrier once
+ * the block is ready and at a "done" barrier once every range is stripped,
+ * after which this thread marks the output block filled.  Worker i is pinned
+ * to the i-th CPU listed in STRPCPUS (e.g. "4,5,6,7"), if any.
+ *
+ * When the power product is on (PWRNBLK > 0, see hdr_power.h) each worker
+ * also adds the power of all channels of its antennas to the current
+ * integration buffer.  This taps the input blocks here because a hashpipe
+ * databuf has a single consumer.
+ *
+ * When the correlator is on (CORRNBLK > 0, see hdr_corr.h) the workers meet
+ * at a third "stripped" barrier once the whole block is stripped, and then
+ * each correlates a disjoint range of the baselines into the current
+ * integration buffer.
+ */
+#define MAX_STRIP_WORKERS 32
+
+struct strip_pool;
+
+typedef struct {
+    struct strip_pool *pool;
+    int id;
+    int a0, a1;        // antenna range
+    int cpu;           // -1 for no pinning
+    uint64_t ns;       // kernel time for the last block
+    uint64_t pwr_ns;   // power kernel time for the last block
+    uint64_t corr_ns;  // correlator kernel time for the last block
+    pthread_t thread;
+} strip_worker_t;
+
+typedef struct strip_pool {
+    int nworkers;
+    int quit;
+    int scalar;        // use the scalar kernel
+    const strip_chans_t *chans;
+    const uint8_t *indata;
+    uint8_t *outdata;
+    uint32_t *pwr_acc; // power integration buffer, or NULL
+    int32_t *corr_acc; // correlator integration buffer, or NULL
+    const hdr_corr_bl_t *corr_bl;
+    int corr_nbl;
+    pthread_mutex_t startup; // held until the barriers are set up
+    pthread_barrier_t start;
+    pthread_barrier_t stripped;
+    pthread_barrier_t done;
+    strip_worker_t worker[MAX_STRIP_WORKERS];
+} strip_pool_t;
+
+static void strip_worker_range(strip_worker_t *w)
+{
+    strip_pool_t *pool = w->pool;
+    struct timespec start, stop;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#ifdef HAVE_STRIP_AVX2
+    if(!pool->scalar){
+      strip_block_avx2(pool->outdata, pool->indata, pool->chans, w->a0, w->a1);
+    }else
+#endif
+    {
+      strip_block_scalar(pool->outdata, pool->indata, pool->chans, w->a0, w->a1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    w->ns = ELAPSED_NS(start, stop);
+
+    if(pool->pwr_acc){
+      hdr_power_accumulate(pool->pwr_acc, pool->indata, w->a0, w->a1, pool->scalar);
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      w->pwr_ns = ELAPSED_NS(stop, start);
+    }
+}
+
+// Correlates this worker's share of the baselines of the stripped block
+static void strip_worker_corr(strip_worker_t *w)
+{
+    strip_pool_t *pool = w->pool;
+    struct timespec start, stop;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    hdr_corr_accumulate(pool->corr_acc, pool->outdata, pool->corr_bl,
+                        w->id*pool->corr_nbl/pool->nworkers,
+                        (w->id+1)*pool->corr_nbl/pool->nworkers, pool->scalar);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    w->corr_ns = ELAPSED_NS(start, stop);
+}
+
+static void *strip_worker_run(void *arg)
+{
+    strip_worker_t *w = (strip_worker_t *)arg;
+    strip_pool_t *pool = w->pool;
+
+    pthread_mutex_lock(&pool->startup);
+    pthread_mutex_unlock(&pool->startup);
+    while(1){
+      pthread_barrier_wait(&pool->start);
+      if(pool->quit){
+        break;
+      }
+      strip_worker_range(w);
+      if(pool->corr_acc){
+        pthread_barrier_wait(&pool->stripped);
+        strip_worker_corr(w);
+      }
+      pthread_barrier_wait(&pool->done);
+    }
+    return NULL;
+}
+
+static void strip_pin_cpu(pthread_t thread, int cpu)
+{
+    cpu_set_t cpuset;
+
+    if(cpu < 0){
+      return;
+    }
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if(pthread_setaffinity_np(thread, sizeof(cpuset), &cpuset)){
+      hashpipe_warn(__FUNCTION__, "could not pin strip worker to cpu %d", cpu);
+    }
+}
+
+// Stops the workers started by strip_pool_start
+static void strip_pool_stop(strip_pool_t *pool)
+{
+    int i;
+
+    pool->quit = 1;
+    pthread_barrier_wait(&pool->start);
+    for(i=1; i<pool->nworkers; i++){
+      pthread_join(pool->worker[i].thread, NULL);
+    }
+    pthread_barrier_destroy(&pool->start);
+    pthread_barrier_destroy(&pool->stripped);
+    pthread_barrier_destroy(&pool->done);
+    pthread_mutex_destroy(&pool->startup);
+}
+
+// Sets up nworkers workers (worker 0 being the calling thread) and starts
+// workers 1 to nworkers-1.  Returns 0, or -1 if a worker could not be
+// started, in which case the workers that were started are stopped.
+static int strip_pool_start(strip_pool_t *pool, int nworkers, const char *cpus)
+{
+    char *p = (char *)cpus;
+    int i;
+
+    memset(pool, 0, sizeof(strip_pool_t));
+    pool->nworkers = nworkers;
+    for(i=0; i<nworkers; i++){
+      pool->worker[i].pool = pool;
+      pool->worker[i].id = i;
+      pool->worker[i].a0 = i*Na/nworkers;
+      pool->worker[i].a1 = (i+1)*Na/nworkers;
+      pool->worker[i].cpu = -1;
+      if(*p){
+        pool->worker[i].cpu = strtol(p, &p, 0);
+        while(*p == ',' || *p == ' ') p++;
+      }
+    }
+
+    pool->worker[0].thread = pthread_self();
+    strip_pin_cpu(pool->worker[0].thread, pool->worker[0].cpu);
+
+    // The workers wait for the barriers, which are sized for the workers
+    // that actually started
+    pthread_mutex_init(&pool->startup, NULL);
+    pthread_mutex_lock(&pool->startup);
+    for(i=1; i<nworkers; i++){
+      if(pthread_create(&pool->worker[i].thread, NULL, strip_worker_run, &pool->worker[i])){
+        hashpipe_error(__FUNCTION__, "error starting strip worker %d", i);
+        break;
+      }
+      strip_pin_cpu(pool->worker[i].thread, pool->worker[i].cpu);
+    }
+    pool->nworkers = i;
+    pthread_barrier_init(&pool->start, NULL, i);
+    pthread_barrier_init(&pool->stripped, NULL, i);
+    pthread_barrier_init(&pool->done, NULL, i);
+    pthread_mutex_unlock(&pool->startup);
+
+    if(i < nworkers){
+      strip_pool_stop(pool);
+      return -1;
+    }
+    return 0;
+}
+
+// Strips one block, and adds its power to pwr_acc and the visibilities of
+// the nbl baselines bl to corr_acc unless they are NULL, using all workers
+static void strip_pool_run(strip_pool_t *pool, uint8_t *outdata, const uint8_t *indata,
+                           const strip_chans_t *chans, int scalar, uint32_t *pwr_acc,
+                           int32_t *corr_acc, const hdr_corr_bl_t *bl, int nbl)
+{
+    pool->chans = chans;
+    pool->pwr_acc = pwr_acc;
+    pool->corr_acc = corr_acc;
+    pool->corr_bl = bl;
+    pool->corr_nbl = nbl;
+    pool->outdata = outdata;
+    pool->indata = indata;
+    pool->scalar = scalar;
+
+    if(pool->nworkers == 1){
+      strip_worker_range(&pool->worker[0]);
+      if(corr_acc){
+        strip_worker_corr(&pool->worker[0]);
+      }
+      return;
+    }
+    pthread_barrier_wait(&pool->start);
+    strip_worker_range(&pool->worker[0]);
+    if(corr_acc){
+      pthread_barrier_wait(&pool->stripped);
+      strip_worker_corr(&pool->worker[0]);
+    }
+    pthread_barrier_wait(&pool->done);
+}
 
 static void *hdr_strip_thread_run(hashpipe_thread_args_t * args){
     hdr_input_databuf_t    *idb = (hdr_input_databuf_t *)args->ibuf;  
@@ -24,15 +377,104 @@ static void *hdr_strip_thread_run(hashpipe_thread_args_t * args){
     hashpipe_status_t st = args->st;
     const char *status_key = args->thread_desc->skey;
 
+    hdr_trace_thread_name("strip");
+
     /* Main loop */
     int rv;              // store return of buffer status calls
     uint64_t mcnt = 0;   // mcnt of each block
     uint8_t *indata;     // typecast the data block into a char pointer
     uint8_t *outdata;    // to allow incrementing by a byte.
-    uint64_t inoffset, outoffset;
-    int m,a,p,c,t;
     int iblk = 0;
     int oblk = 0;
+    char kernel[16] = "avx2";  // STRPKERN: "avx2" or "scalar"
+    int check = 0;             // STRPCHK: compare with the scalar kernel
+    uint32_t mismatch = 0;     // blocks that failed the check
+    uint64_t nzeroed = 0;      // STRPZERO: missing packets zeroed
+    uint8_t *refdata = NULL;   // scalar kernel output for the check
+    struct timespec start, stop;
+    uint64_t strip_ns = 0;     // STRPNS: corner turn time of the last block
+    uint64_t prod_ns = 0;      // STRPPRNS: rest of the pool time, spent on the products
+    int nworkers = 1;          // STRPNTHR
+    char cpus[256] = "";       // STRPCPUS
+    char key[16];
+    strip_pool_t pool;
+    strip_chans_t chans;
+    char spec[sizeof(chans.spec)];
+    int i;
+    int pwr_nblk = 0;                       // PWRNBLK, 0 for no power product
+    int pwr_fints = HDR_POWER_FILE_INTS;    // PWRFINT
+    char pwr_dir[256] = ".";                // PWRDIR
+    hdr_power_writer_t pw;
+    uint32_t *pwr_acc = NULL;               // current integration, if any
+    hdr_power_int_t pwr_info;
+    uint32_t pwr_drop = 0;                  // blocks not integrated
+    uint64_t pwr_ns;
+    int corr_nblk = 0;                      // CORRNBLK, 0 for no correlator
+    int corr_fints = HDR_CORR_FILE_INTS;    // CORRFINT
+    char corr_dir[256] = ".";               // CORRDIR
+    char corr_spec[80] = "auto";            // CORRBL
+    hdr_corr_bl_t *corr_bl = NULL;
+    int corr_nbl = 0;
+    hdr_corr_writer_t cw;
+    int32_t *corr_acc = NULL;               // current integration, if any
+    hdr_corr_int_t corr_info;
+    uint32_t corr_drop = 0;                 // blocks not integrated
+    uint64_t corr_ns;
+    int32_t xid = -1;
+    struct timeval tv;
+
+    hdr_chan_set_default(chans.chan);
+    sprintf(chans.spec, "0-%d", Nsc-1);
+    strip_chans_compile(&chans);
+
+    hashpipe_status_lock_safe(&st);
+    hgeti4(st.buf, "STRPNTHR", &nworkers);
+    hgets(st.buf, "STRPCPUS", sizeof(cpus), cpus);
+    nworkers = nworkers < 1 ? 1 : nworkers > MAX_STRIP_WORKERS ? MAX_STRIP_WORKERS : nworkers;
+    hputi4(st.buf, "STRPNTHR", nworkers);
+    hgeti4(st.buf, "PWRNBLK", &pwr_nblk);
+    hgeti4(st.buf, "PWRFINT", &pwr_fints);
+    hgets(st.buf, "PWRDIR", sizeof(pwr_dir), pwr_dir);
+    pwr_nblk = pwr_nblk < 0 ? 0 : pwr_nblk > HDR_POWER_MAX_NBLK ? HDR_POWER_MAX_NBLK : pwr_nblk;
+    pwr_fints = pwr_fints < 1 ? 1 : pwr_fints;
+    hgeti4(st.buf, "CORRNBLK", &corr_nblk);
+    hgeti4(st.buf, "CORRFINT", &corr_fints);
+    hgets(st.buf, "CORRDIR", sizeof(corr_dir), corr_dir);
+    hgets(st.buf, "CORRBL", sizeof(corr_spec), corr_spec);
+    corr_nblk = corr_nblk < 0 ? 0 : corr_nblk > HDR_CORR_MAX_NBLK ? HDR_CORR_MAX_NBLK : corr_nblk;
+    corr_fints = corr_fints < 1 ? 1 : corr_fints;
+    hashpipe_status_unlock_safe(&st);
+
+    if(pwr_nblk > 0 && hdr_power_writer_start(&pw, pwr_dir, pwr_nblk, pwr_fints) != HASHPIPE_OK){
+      pwr_nblk = 0;
+    }
+    if(corr_nblk > 0){
+      if(!(corr_bl = malloc(HDR_CORR_MAX_BL*sizeof(hdr_corr_bl_t)))
+      || (corr_nbl = hdr_corr_parse_baselines(corr_spec, corr_bl)) < 0){
+        hashpipe_warn(__FUNCTION__, "invalid CORRBL \"%s\", disabling the correlator", corr_spec);
+        corr_nblk = 0;
+      }else if(hdr_corr_writer_start(&cw, corr_dir, corr_nblk, corr_fints,
+                                     corr_bl, corr_nbl) != HASHPIPE_OK){
+        corr_nblk = 0;
+      }
+      if(corr_nblk == 0){
+        corr_nbl = 0;
+      }
+    }
+    hashpipe_status_lock_safe(&st);
+    hputi4(st.buf, "PWRNBLK", pwr_nblk);
+    hputi4(st.buf, "PWRFINT", pwr_fints);
+    hputs(st.buf, "PWRDIR", pwr_dir);
+    hputi4(st.buf, "CORRNBLK", corr_nblk);
+    hputi4(st.buf, "CORRFINT", corr_fints);
+    hputs(st.buf, "CORRDIR", corr_dir);
+    hputs(st.buf, "CORRBL", corr_spec);
+    hputi4(st.buf, "CORRNBL", corr_nbl);
+    hashpipe_status_unlock_safe(&st);
+
+    if(strip_pool_start(&pool, nworkers, cpus)){
+      pthread_exit(NULL);
+    }
 
     while (run_threads()) {
 
@@ -41,8 +483,60 @@ static void *hdr_strip_thread_run(hashpipe_thread_args_t * args){
         hputs(st.buf, status_key, "waiting");
         hputi4(st.buf, "STRPBKOUT", oblk);
         hputi8(st.buf, "STRPMCNT", mcnt);
+        hgets(st.buf, "STRPKERN", sizeof(kernel), kernel);
+        hgeti4(st.buf, "STRPCHK", &check);
+        hputs(st.buf, "STRPKERN", kernel);
+        if(strip_ns) {
+            hputi8(st.buf, "STRPNS", strip_ns);
+            hputr4(st.buf, "STRPGBPS", (float)N_BYTES_PER_STRP_BLOCK/strip_ns);
+            hputi8(st.buf, "STRPPRNS", prod_ns);
+            for(i=0; i<nworkers; i++){
+                sprintf(key, "STRPW%dNS", i);
+                hputi8(st.buf, key, pool.worker[i].ns);
+            }
+        }
+        hputu4(st.buf, "STRPMISM", mismatch);
+        hputu8(st.buf, "STRPZERO", nzeroed);
+        if(pwr_nblk > 0 || corr_nblk > 0){
+            hgeti4(st.buf, "XID", &xid);
+        }
+        if(pwr_nblk > 0){
+            pwr_ns = 0;
+            for(i=0; i<nworkers; i++){
+                if(pool.worker[i].pwr_ns > pwr_ns){
+                    pwr_ns = pool.worker[i].pwr_ns;
+                }
+            }
+            hputi8(st.buf, "PWRNS", pwr_ns);
+            hputu4(st.buf, "PWRDROP", pwr_drop);
+            hputu8(st.buf, "PWRNINT", pw.nwritten);
+            hputu8(st.buf, "PWRERR", pw.nerrors);
+        }
+        if(corr_nblk > 0){
+            corr_ns = 0;
+            for(i=0; i<nworkers; i++){
+                if(pool.worker[i].corr_ns > corr_ns){
+                    corr_ns = pool.worker[i].corr_ns;
+                }
+            }
+            hputi8(st.buf, "CORRNS", corr_ns);
+            hputu4(st.buf, "CORRDROP", corr_drop);
+            hputu8(st.buf, "CORRNINT", cw.w.nwritten);
+            hputu8(st.buf, "CORRERR", cw.w.nerrors);
+        }
+        // Pick up a new channel set, if any
+        strcpy(spec, chans.spec);
+        hgets(st.buf, STRPCHAN_KEY, sizeof(spec), spec);
+        if(strcmp(spec, chans.spec)){
+            if(hdr_chan_set_parse(spec, chans.chan) == HASHPIPE_OK){
+                strcpy(chans.spec, spec);
+                strip_chans_compile(&chans);
+            }else{
+                hashpipe_warn(__FUNCTION__, "ignoring invalid %s \"%s\"", STRPCHAN_KEY, spec);
+            }
+        }
+        hputs(st.buf, STRPCHAN_KEY, chans.spec);
         hashpipe_status_unlock_safe(&st);
-        sleep(1);
  
         /* Wait for new block to be filled, then copy the
          * relevant data and clear it.
@@ -60,6 +554,19 @@ static void *hdr_strip_thread_run(hashpipe_thread_args_t * args){
             }
         }
 
+        while ((rv=hdr_stripper_databuf_wait_free(odb, oblk))!= HASHPIPE_OK){
+            if (rv==HASHPIPE_TIMEOUT){
+                hashpipe_status_lock_safe(&st);
+                hputs(st.buf, status_key, "outblocked");
+                hashpipe_status_unlock_safe(&st);
+                continue;
+            }else{
+                hashpipe_error(__FUNCTION__, "error waiting for free databuf");
+                pthread_exit(NULL);
+                break;
+            }
+        }
+
         //fprintf(stderr, "Got new data!  in_blk:%d  out_blk:%d\n", iblk, oblk);
         /*Got new data! Copy into new buffer*/
         hashpipe_status_lock_safe(&st);
@@ -75,23 +582,94 @@ static void *hdr_strip_thread_run(hashpipe_thread_args_t * args){
         //fprintf(stderr,"Input shared mem loc:%p\n",indata);
         //fprintf(stderr,"Output shared mem loc:%p\n",outdata);
         
-        odb->block[oblk].header.good_data = 1;
+        odb->block[oblk].header.good_data = idb->block[iblk].header.good_data;
         odb->block[oblk].header.mcnt = mcnt;
+        memcpy(odb->block[oblk].header.chan, chans.chan, sizeof(chans.chan));
+        odb->block[oblk].header.nbits = 4;
+        odb->block[oblk].header.nbeams = 0;
+        memcpy(odb->block[oblk].header.pkt_map, idb->block[iblk].header.pkt_map,
+               sizeof(odb->block[oblk].header.pkt_map));
 
-        for(m=0; m<Nm; m++){
-          for(a=0; a<Na; a++){
-            for(c=0; c<Nsc; c++){
-              for(t=0; t<Nt; t++){
-                for(p=0; p<Np; p++){
-                  inoffset  = hdr_input_databuf_data_idx8(m,a,p,c,t); 
-                  outoffset = hdr_stripper_databuf_data_idx8(m,a,p,c,t);
-                  memcpy(outdata+outoffset, indata+inoffset, 1);
-                }
-              }
-            }
+        // Zero the stale data of packets that were not received, which also
+        // keeps them out of the power product and the correlator
+        if(!idb->block[iblk].header.good_data){
+          nzeroed += hdr_input_block_zero_missing(&idb->block[iblk]);
+        }
+
+        // Start a new integration if there is none or the XID changed.  A
+        // block is not integrated if the power writer has fallen behind.
+        if(pwr_acc && pwr_info.xid != xid){
+          hdr_power_writer_put(&pw, pwr_acc, &pwr_info);
+          pwr_acc = NULL;
+        }
+        if(pwr_nblk > 0 && !pwr_acc){
+          if((pwr_acc = hdr_power_writer_get(&pw))){
+            gettimeofday(&tv, NULL);
+            pwr_info.mcnt = mcnt;
+            pwr_info.time_ms = (uint64_t)(tv.tv_sec*1000) + (uint64_t)(tv.tv_usec/1000);
+            pwr_info.nblocks = 0;
+            pwr_info.xid = xid;
+          }else{
+            pwr_drop++;
           }
         }
-        
+
+        // Likewise for the correlator, which also starts a new integration
+        // when the channel set changes
+        if(corr_acc && (corr_info.xid != xid
+                        || memcmp(corr_info.chan, chans.chan, sizeof(chans.chan)))){
+          hdr_corr_writer_put(&cw, corr_acc, &corr_info);
+          corr_acc = NULL;
+        }
+        if(corr_nblk > 0 && !corr_acc){
+          if((corr_acc = hdr_corr_writer_get(&cw))){
+            gettimeofday(&tv, NULL);
+            corr_info.mcnt = mcnt;
+            corr_info.time_ms = (uint64_t)(tv.tv_sec*1000) + (uint64_t)(tv.tv_usec/1000);
+            corr_info.nblocks = 0;
+            corr_info.xid = xid;
+            memcpy(corr_info.chan, chans.chan, sizeof(chans.chan));
+          }else{
+            corr_drop++;
+          }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        strip_pool_run(&pool, outdata, indata, &chans, !strcmp(kernel, "scalar"), pwr_acc,
+                       corr_acc, corr_bl, corr_nbl);
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+        // The workers strip their ranges at the same time, so the slowest
+        // sets the corner turn time of the block
+        for(strip_ns=0, i=0; i<nworkers; i++){
+          if(pool.worker[i].ns > strip_ns){
+            strip_ns = pool.worker[i].ns;
+          }
+        }
+        prod_ns = ELAPSED_NS(start, stop);
+        prod_ns = prod_ns > strip_ns ? prod_ns - strip_ns : 0;
+
+        if(pwr_acc && ++pwr_info.nblocks == pwr_nblk){
+          hdr_power_writer_put(&pw, pwr_acc, &pwr_info);
+          pwr_acc = NULL;
+        }
+        if(corr_acc && ++corr_info.nblocks == corr_nblk){
+          hdr_corr_writer_put(&cw, corr_acc, &corr_info);
+          corr_acc = NULL;
+        }
+
+        if(check){
+          if(!refdata && !(refdata = malloc(N_BYTES_PER_STRP_BLOCK))){
+            hashpipe_error(__FUNCTION__, "error allocating check buffer");
+            pthread_exit(NULL);
+          }
+          strip_block_scalar(refdata, indata, &chans, 0, Na);
+          if(memcmp(refdata, outdata, N_BYTES_PER_STRP_BLOCK)){
+            hashpipe_warn(__FUNCTION__, "%s kernel output differs from scalar kernel (mcnt %lu)",
+                          kernel, mcnt);
+            mismatch++;
+          }
+        }
+
 
         // Mark input block as free, output block as filled
         hdr_stripper_databuf_set_filled(odb, oblk);
@@ -105,6 +683,23 @@ static void *hdr_strip_thread_run(hashpipe_thread_args_t * args){
         pthread_testcancel();
     }
 
+    strip_pool_stop(&pool);
+    free(refdata);
+    if(pwr_nblk > 0){
+      // Keep a partial integration, its nblocks tells
+      if(pwr_acc && pwr_info.nblocks > 0){
+        hdr_power_writer_put(&pw, pwr_acc, &pwr_info);
+      }
+      hdr_power_writer_stop(&pw);
+    }
+    if(corr_nblk > 0){
+      if(corr_acc && corr_info.nblocks > 0){
+        hdr_corr_writer_put(&cw, corr_acc, &corr_info);
+      }
+      hdr_corr_writer_stop(&cw);
+    }
+    free(corr_bl);
+
     // Thread success!
     return THREAD_OK;
 }
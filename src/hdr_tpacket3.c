@@ -0,0 +1,128 @@
+/* hdr_tpacket3.c
+ *
+ * Routines for opening and reading a TPACKET_V3 packet socket ring.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+
+#include "hashpipe.h"
+#include "hdr_tpacket3.h"
+
+int hdr_tpacket3_open(struct hdr_tpacket3 *p_tp3, const char *ifname)
+{
+    int version = TPACKET_V3;
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    unsigned int ifindex;
+
+    p_tp3->fd = -1;
+    p_tp3->p_ring = NULL;
+    p_tp3->next_block = 0;
+
+    ifindex = if_nametoindex(ifname);
+    if(ifindex == 0) {
+        hashpipe_error(__FUNCTION__, "unknown interface %s", ifname);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    p_tp3->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+    if(p_tp3->fd == -1) {
+        hashpipe_error(__FUNCTION__, "socket");
+        return HASHPIPE_ERR_SYS;
+    }
+
+    if(setsockopt(p_tp3->fd, SOL_PACKET, PACKET_VERSION,
+                  &version, sizeof(version)) == -1) {
+        hashpipe_error(__FUNCTION__, "setsockopt(PACKET_VERSION)");
+        goto error;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = p_tp3->block_size;
+    req.tp_block_nr = p_tp3->nblocks;
+    req.tp_frame_size = p_tp3->frame_size;
+    req.tp_frame_nr = (p_tp3->block_size / p_tp3->frame_size) * p_tp3->nblocks;
+    req.tp_retire_blk_tov = p_tp3->retire_ms;
+    if(setsockopt(p_tp3->fd, SOL_PACKET, PACKET_RX_RING,
+                  &req, sizeof(req)) == -1) {
+        hashpipe_error(__FUNCTION__, "setsockopt(PACKET_RX_RING)");
+        goto error;
+    }
+
+    p_tp3->p_ring = mmap(NULL, (size_t)p_tp3->block_size * p_tp3->nblocks,
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED,
+                         p_tp3->fd, 0);
+    if(p_tp3->p_ring == MAP_FAILED) {
+        p_tp3->p_ring = NULL;
+        hashpipe_error(__FUNCTION__, "mmap");
+        goto error;
+    }
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_IP);
+    sll.sll_ifindex = ifindex;
+    if(bind(p_tp3->fd, (struct sockaddr *)&sll, sizeof(sll)) == -1) {
+        hashpipe_error(__FUNCTION__, "bind");
+        goto error;
+    }
+
+    return HASHPIPE_OK;
+
+error:
+    hdr_tpacket3_close(p_tp3);
+    return HASHPIPE_ERR_SYS;
+}
+
+struct tpacket_block_desc *hdr_tpacket3_recv_block_nonblock(struct hdr_tpacket3 *p_tp3)
+{
+    struct tpacket_block_desc *p_desc = (struct tpacket_block_desc *)
+        (p_tp3->p_ring + (size_t)p_tp3->next_block * p_tp3->block_size);
+
+    if(!(__atomic_load_n(&p_desc->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+         & TP_STATUS_USER)) {
+        return NULL;
+    }
+
+    p_tp3->next_block = (p_tp3->next_block + 1) % p_tp3->nblocks;
+    return p_desc;
+}
+
+int hdr_tpacket3_stats(struct hdr_tpacket3 *p_tp3,
+                       unsigned int *p_pkts, unsigned int *p_drops)
+{
+    struct tpacket_stats_v3 stats;
+    socklen_t len = sizeof(stats);
+
+    if(getsockopt(p_tp3->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) == -1) {
+        return HASHPIPE_ERR_SYS;
+    }
+    if(p_pkts) {
+        *p_pkts = stats.tp_packets;
+    }
+    if(p_drops) {
+        *p_drops = stats.tp_drops;
+    }
+    return HASHPIPE_OK;
+}
+
+int hdr_tpacket3_close(struct hdr_tpacket3 *p_tp3)
+{
+    if(p_tp3->p_ring) {
+        munmap(p_tp3->p_ring, (size_t)p_tp3->block_size * p_tp3->nblocks);
+        p_tp3->p_ring = NULL;
+    }
+    if(p_tp3->fd != -1) {
+        close(p_tp3->fd);
+        p_tp3->fd = -1;
+    }
+    return HASHPIPE_OK;
+}
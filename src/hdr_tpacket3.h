@@ -0,0 +1,67 @@
+/* hdr_tpacket3.h
+ *
+ * Minimal TPACKET_V3 packet socket ring.  Unlike the TPACKET_V2 ring used by
+ * hashpipe_pktsock, the kernel hands a V3 ring to user space one block at a
+ * time.  A block holds a variable number of frames and is retired either when
+ * it is full or when the retire timeout expires, so the receiver can process
+ * every frame of a block before giving the whole block back to the kernel.
+ */
+#ifndef _HDR_TPACKET3_H
+#define _HDR_TPACKET3_H
+
+#include <stdint.h>
+#include <linux/if_packet.h>
+
+struct hdr_tpacket3 {
+    unsigned int block_size; // Bytes per ring block (multiple of PAGE_SIZE)
+    unsigned int nblocks;    // Number of ring blocks
+    unsigned int frame_size; // Frame size hint for the kernel
+    unsigned int retire_ms;  // Block retire timeout in milliseconds
+    int fd;
+    unsigned char *p_ring;
+    unsigned int next_block;
+};
+
+// Frame access macros, analogous to hashpipe's PKT_* macros for TPACKET_V2
+// frames.  Like those, these assume IP headers without options.
+#define TP3_HDR(p,f)     (((struct tpacket3_hdr *)(p))->f)
+#define TP3_NET(p)       (((unsigned char *)(p)) + TP3_HDR(p, tp_net))
+#define TP3_IS_UDP(p)    (TP3_NET(p)[9] == 0x11)
+#define TP3_UDP_DST(p)   ((TP3_NET(p)[22] << 8) | TP3_NET(p)[23])
+#define TP3_UDP_SIZE(p)  ((TP3_NET(p)[24] << 8) | TP3_NET(p)[25])
+#define TP3_UDP_DATA(p)  (TP3_NET(p) + 28)
+
+// Number of frames in a retired block
+#define TP3_BLOCK_NPKTS(pd) ((pd)->hdr.bh1.num_pkts)
+
+static inline unsigned char *hdr_tpacket3_first_frame(struct tpacket_block_desc *p_desc)
+{
+    return (unsigned char *)p_desc + p_desc->hdr.bh1.offset_to_first_pkt;
+}
+
+static inline unsigned char *hdr_tpacket3_next_frame(unsigned char *p_frame)
+{
+    return p_frame + TP3_HDR(p_frame, tp_next_offset);
+}
+
+// Opens a TPACKET_V3 packet socket bound to interface ifname and maps its
+// ring.  The block_size, nblocks, frame_size, and retire_ms fields of p_tp3
+// must be set by the caller.  Returns HASHPIPE_OK or HASHPIPE_ERR_SYS.
+int hdr_tpacket3_open(struct hdr_tpacket3 *p_tp3, const char *ifname);
+
+// Returns the next retired block or NULL if the kernel still owns it.
+struct tpacket_block_desc *hdr_tpacket3_recv_block_nonblock(struct hdr_tpacket3 *p_tp3);
+
+// Returns a block (and all of its frames) to the kernel.
+static inline void hdr_tpacket3_release_block(struct tpacket_block_desc *p_desc)
+{
+    __atomic_store_n(&p_desc->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+}
+
+// Gets (and resets) the socket's packet and drop counters.
+int hdr_tpacket3_stats(struct hdr_tpacket3 *p_tp3,
+                       unsigned int *p_pkts, unsigned int *p_drops);
+
+int hdr_tpacket3_close(struct hdr_tpacket3 *p_tp3);
+
+#endif // _HDR_TPACKET3_H
@@ -0,0 +1,256 @@
+/* hdr_trace.c
+ *
+ * Per-thread binary trace rings of the databuf hand-offs (see hdr_trace.h).
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <x86intrin.h>
+#include <sys/syscall.h>
+
+#include "hdr_databuf.h"
+#include "hdr_trace.h"
+
+#define MAX_TRACE_BUFS 16
+
+typedef struct trace_ring {
+    uint64_t head;                  // records written, stored with release
+    int32_t tid;
+    char name[16];
+    struct trace_ring *next;
+    hdr_trace_rec_t rec[HDR_TRACE_NRECS];
+} trace_ring_t;
+
+int hdr_trace_level = 0;
+
+// Rings are never freed, so a dump also covers threads that have exited
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_ring_t *trace_rings = NULL;
+static hdr_trace_file_buf_t trace_bufs[MAX_TRACE_BUFS];
+static int trace_nbufs = 0;
+static uint64_t trace_tsc0, trace_ns0;
+static int trace_dumping = 0;
+
+static __thread trace_ring_t *my_ring = NULL;
+static __thread char my_name[16];
+
+static uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000*1000*1000 + ts.tv_nsec;
+}
+
+static trace_ring_t *ring_create(void)
+{
+    trace_ring_t *r = (trace_ring_t *)calloc(1, sizeof(trace_ring_t));
+
+    if(!r) {
+        return NULL;
+    }
+    r->tid = syscall(SYS_gettid);
+    if(my_name[0]) {
+        strcpy(r->name, my_name);
+    } else {
+        pthread_getname_np(pthread_self(), r->name, sizeof(r->name));
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    r->next = trace_rings;
+    trace_rings = r;
+    pthread_mutex_unlock(&trace_lock);
+
+    return r;
+}
+
+void hdr_trace_record(uint32_t event, const hashpipe_databuf_t *d, int block_id)
+{
+    trace_ring_t *r = my_ring;
+    hdr_trace_rec_t *rec;
+    uint64_t head;
+
+    if(!r) {
+        // A thread that cannot get a ring does not trace
+        static __thread int failed = 0;
+        if(failed || !(r = my_ring = ring_create())) {
+            failed = 1;
+            return;
+        }
+    }
+
+    head = r->head;
+    rec = &r->rec[head & (HDR_TRACE_NRECS - 1)];
+    rec->tsc = __rdtsc();
+    rec->mask = __atomic_load_n(&hdr_trace_level, __ATOMIC_RELAXED) > 1 && d ?
+                hdr_databuf_total_mask((hashpipe_databuf_t *)d) : 0;
+    rec->tid = r->tid;
+    rec->buf = d ? d->semid : -1;
+    rec->block_id = block_id;
+    rec->event = event;
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void hdr_trace_thread_name(const char *name)
+{
+    snprintf(my_name, sizeof(my_name), "%s", name);
+    if(my_ring) {
+        pthread_mutex_lock(&trace_lock);
+        strcpy(my_ring->name, my_name);
+        pthread_mutex_unlock(&trace_lock);
+    }
+}
+
+void hdr_trace_buf(const hashpipe_databuf_t *d, int databuf_id, const char *type)
+{
+    hdr_trace_file_buf_t *b;
+
+    if(!d) {
+        return;
+    }
+    pthread_mutex_lock(&trace_lock);
+    if(trace_nbufs < MAX_TRACE_BUFS) {
+        b = &trace_bufs[trace_nbufs++];
+        b->semid = d->semid;
+        b->databuf_id = databuf_id;
+        snprintf(b->type, sizeof(b->type), "%s", type);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void hdr_trace_set_level(int level)
+{
+    level = level < 0 ? 0 : level > 2 ? 2 : level;
+
+    pthread_mutex_lock(&trace_lock);
+    if(level && !trace_tsc0) {
+        trace_ns0 = clock_ns();
+        trace_tsc0 = __rdtsc();
+    }
+    __atomic_store_n(&hdr_trace_level, level, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// Copies the valid records of r, oldest first, to rec and returns their
+// number.  Records the owner may have overwritten while they were copied
+// are dropped.
+static uint32_t ring_copy(trace_ring_t *r, hdr_trace_rec_t *rec)
+{
+    uint64_t head, start, after, i;
+
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    start = head > HDR_TRACE_NRECS ? head - HDR_TRACE_NRECS : 0;
+    for(i=start; i<head; i++) {
+        rec[i-start] = r->rec[i & (HDR_TRACE_NRECS - 1)];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    // The owner may be writing record after over record after-NRECS
+    if(after + 1 > start + HDR_TRACE_NRECS) {
+        i = after + 1 - HDR_TRACE_NRECS - start;
+        if(i >= head - start) {
+            return 0;
+        }
+        memmove(rec, rec + i, (head - start - i) * sizeof(hdr_trace_rec_t));
+        start += i;
+    }
+    return head - start;
+}
+
+int hdr_trace_dump(const char *path)
+{
+    hdr_trace_file_header_t hdr;
+    hdr_trace_file_thread_t th;
+    hdr_trace_rec_t *rec;
+    trace_ring_t *r;
+    FILE *f;
+    int rv = HASHPIPE_OK;
+
+    if(!(rec = (hdr_trace_rec_t *)malloc(HDR_TRACE_NRECS * sizeof(hdr_trace_rec_t)))) {
+        hashpipe_error(__FUNCTION__, "error allocating trace dump buffer");
+        return HASHPIPE_ERR_SYS;
+    }
+    if(!(f = fopen(path, "w"))) {
+        hashpipe_error(__FUNCTION__, "error opening %s", path);
+        free(rec);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, HDR_TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = HDR_TRACE_VERSION;
+    hdr.nbufs = trace_nbufs;
+    for(r=trace_rings; r; r=r->next) {
+        hdr.nthreads++;
+    }
+    hdr.tsc0 = trace_tsc0;
+    hdr.ns0 = trace_ns0;
+    hdr.ns1 = clock_ns();
+    hdr.tsc1 = __rdtsc();
+    if(fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+       fwrite(trace_bufs, sizeof(trace_bufs[0]), trace_nbufs, f) != trace_nbufs) {
+        rv = HASHPIPE_ERR_SYS;
+    }
+    for(r=trace_rings; r && rv == HASHPIPE_OK; r=r->next) {
+        memset(&th, 0, sizeof(th));
+        th.tid = r->tid;
+        memcpy(th.name, r->name, sizeof(th.name));
+        th.nrecs = ring_copy(r, rec);
+        if(fwrite(&th, sizeof(th), 1, f) != 1 ||
+           fwrite(rec, sizeof(hdr_trace_rec_t), th.nrecs, f) != th.nrecs) {
+            rv = HASHPIPE_ERR_SYS;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+
+    if(fclose(f) || rv != HASHPIPE_OK) {
+        hashpipe_error(__FUNCTION__, "error writing %s", path);
+        rv = HASHPIPE_ERR_SYS;
+    }
+    free(rec);
+    return rv;
+}
+
+static void *dump_thread(void *arg)
+{
+    char *path = (char *)arg;
+
+    hdr_trace_dump(path);
+    free(path);
+    __atomic_store_n(&trace_dumping, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void hdr_trace_poll(char *buf)
+{
+    char path[256] = "";
+    pthread_attr_t attr;
+    pthread_t thread;
+    char *arg;
+    int level = hdr_trace_level;
+
+    if(hgeti4(buf, "TRACE", &level) && level != hdr_trace_level) {
+        hdr_trace_set_level(level);
+    }
+    hputi4(buf, "TRACE", hdr_trace_level);
+
+    // The dump takes a while, so it is written without the status buffer
+    // locked, one at a time
+    hgets(buf, "TRACEDMP", sizeof(path), path);
+    if(!path[0] || __atomic_exchange_n(&trace_dumping, 1, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    hputs(buf, "TRACEDMP", "");
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if(!(arg = strdup(path)) || pthread_create(&thread, &attr, dump_thread, arg)) {
+        hashpipe_error(__FUNCTION__, "error starting trace dump");
+        free(arg);
+        __atomic_store_n(&trace_dumping, 0, __ATOMIC_RELEASE);
+    }
+    pthread_attr_destroy(&attr);
+}
@@ -0,0 +1,119 @@
+#ifndef _HDR_TRACE_H
+#define _HDR_TRACE_H
+
+/* Binary event tracing of the databuf hand-offs.
+ *
+ * Every thread that calls the hdr_*_databuf_* wait and set functions while
+ * tracing is on gets a ring of the last HDR_TRACE_NRECS fixed size records
+ * (TSC timestamp, thread, databuf, block id, event and, at level 2, the
+ * databuf's block status mask).  Only the owning thread writes to its ring
+ * and the level is checked with a single relaxed load, so tracing costs one
+ * not taken branch when it is off and no system call when it is on at level
+ * 1.  Level 2 reads the mask, which takes a semctl call per event unless the
+ * databuf uses the futex hand-off (see hdr_databuf.h).
+ *
+ * The status keys are handled by the histogram publisher (see hdr_stats.h):
+ *
+ *   TRACE     0 (default) off, 1 on, 2 on with masks
+ *   TRACEDMP  if set to a file name, the rings are written to that file by
+ *             a background thread and TRACEDMP is cleared
+ *
+ * hdr_trace2json converts the file to Chrome trace / Perfetto JSON.  Records
+ * are timestamped with the TSC, which is assumed to be invariant and
+ * synchronized between CPUs, as on all current x86 servers.
+ */
+#include <stdint.h>
+#include "hashpipe.h"
+
+#define HDR_TRACE_NRECS (1 << 16)  // records per thread, a power of 2
+
+// Events.  WAIT_* is recorded before and GOT_* after a wait.
+#define HDR_TRACE_WAIT_FREE    1
+#define HDR_TRACE_GOT_FREE     2
+#define HDR_TRACE_WAIT_FILLED  3
+#define HDR_TRACE_GOT_FILLED   4
+#define HDR_TRACE_SET_FREE     5
+#define HDR_TRACE_SET_FILLED   6
+#define HDR_TRACE_EVENT_MASK   0x0f
+// Flags
+#define HDR_TRACE_BUSY         0x10  // busy waiting
+#define HDR_TRACE_FAILED       0x20  // the wait or set did not return HASHPIPE_OK
+
+typedef struct {
+    uint64_t tsc;
+    uint64_t mask;      // databuf block status mask, 0 below level 2
+    int32_t tid;        // kernel thread id
+    int32_t buf;        // semid of the databuf
+    int32_t block_id;
+    uint32_t event;     // HDR_TRACE_* event and flags
+} hdr_trace_rec_t;
+
+/* Dump file layout (host byte order):
+ *
+ *   hdr_trace_file_header_t
+ *   nbufs    x hdr_trace_file_buf_t
+ *   nthreads x (hdr_trace_file_thread_t, nrecs x hdr_trace_rec_t)
+ *
+ * Records of a thread are in time order.  (tsc0, ns0) and (tsc1, ns1) are
+ * pairs of TSC and CLOCK_MONOTONIC readings taken when tracing was first
+ * enabled and at the dump, which give the TSC rate.
+ */
+#define HDR_TRACE_MAGIC   "HDRTRACE"
+#define HDR_TRACE_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nbufs;
+    uint32_t nthreads;
+    uint32_t reserved;
+    uint64_t tsc0;
+    uint64_t ns0;
+    uint64_t tsc1;
+    uint64_t ns1;
+} hdr_trace_file_header_t;
+
+// Databuf created by this process
+typedef struct {
+    int32_t semid;
+    int32_t databuf_id;
+    char type[24];      // "input" or "stripper"
+} hdr_trace_file_buf_t;
+
+typedef struct {
+    int32_t tid;
+    uint32_t nrecs;
+    char name[16];
+} hdr_trace_file_thread_t;
+
+// Current level, only to be read through hdr_trace
+extern int hdr_trace_level;
+
+void hdr_trace_record(uint32_t event, const hashpipe_databuf_t *d, int block_id);
+
+// Records event on block block_id of d if tracing is on
+static inline void hdr_trace(uint32_t event, const void *d, int block_id)
+{
+    if(__builtin_expect(__atomic_load_n(&hdr_trace_level, __ATOMIC_RELAXED), 0)) {
+        hdr_trace_record(event, (const hashpipe_databuf_t *)d, block_id);
+    }
+}
+
+// Names the calling thread in dumps (up to 15 characters).  Threads that
+// are not named are listed under their kernel thread name.
+void hdr_trace_thread_name(const char *name);
+
+// Lists databuf databuf_id of type type in dumps
+void hdr_trace_buf(const hashpipe_databuf_t *d, int databuf_id, const char *type);
+
+// Sets the trace level (0, 1 or 2)
+void hdr_trace_set_level(int level);
+
+// Writes all rings to path.  Returns HASHPIPE_OK or HASHPIPE_ERR_SYS.
+int hdr_trace_dump(const char *path);
+
+// Handles the TRACE and TRACEDMP status keys, called with the status buffer
+// locked
+void hdr_trace_poll(char *buf);
+
+#endif // _HDR_TRACE_H
@@ -0,0 +1,271 @@
+/* hdr_trace2json.c
+ *
+ * Converts a trace dump (see hdr_trace.h) to the Chrome trace event JSON
+ * format, which chrome://tracing and ui.perfetto.dev open.  Every thread is a
+ * track with its databuf waits as slices and block hand-offs (setting a block
+ * filled or free and the wait of another thread for it that this ends) as
+ * flow arrows.
+ *
+ * Usage: hdr_trace2json [-o OUTFILE] TRACEFILE
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "hdr_trace.h"
+
+#define MAX_BUFS    64
+#define MAX_BLOCKS  256
+
+typedef struct {
+    hdr_trace_rec_t rec;
+    int thread;                 // index into threads
+    uint32_t seq;               // order within the thread
+} event_t;
+
+typedef struct {
+    hdr_trace_file_thread_t info;
+    int waiting;                // a WAIT_* is pending
+    hdr_trace_rec_t wait;
+} thread_t;
+
+static hdr_trace_file_buf_t bufs[MAX_BUFS];
+static int nbufs = 0;
+// Flow id of the last hand-off of each block, by buffer, block and
+// direction (0 filled, 1 free), 0 for none
+static uint64_t pending[MAX_BUFS][MAX_BLOCKS][2];
+
+static double tsc0, us_per_tick;
+static int first = 1;
+
+static int cmp_event(const void *a, const void *b)
+{
+    const event_t *ea = (const event_t *)a;
+    const event_t *eb = (const event_t *)b;
+
+    if(ea->rec.tsc != eb->rec.tsc) {
+        return ea->rec.tsc < eb->rec.tsc ? -1 : 1;
+    }
+    if(ea->thread != eb->thread) {
+        return ea->thread - eb->thread;
+    }
+    return ea->seq < eb->seq ? -1 : ea->seq > eb->seq;
+}
+
+// Returns the index of the buffer with semid, adding it if needed, or -1
+static int buf_index(int32_t semid)
+{
+    int i;
+
+    for(i=0; i<nbufs; i++) {
+        if(bufs[i].semid == semid) {
+            return i;
+        }
+    }
+    if(nbufs == MAX_BUFS) {
+        return -1;
+    }
+    bufs[nbufs].semid = semid;
+    bufs[nbufs].databuf_id = -1;
+    strcpy(bufs[nbufs].type, "unknown");
+    return nbufs++;
+}
+
+static double ts_us(uint64_t tsc)
+{
+    return ((double)tsc - tsc0) * us_per_tick;
+}
+
+static void put_sep(FILE *out)
+{
+    fputs(first ? "\n" : ",\n", out);
+    first = 0;
+}
+
+static void put_slice(FILE *out, const char *name, const hdr_trace_rec_t *rec,
+                      double ts, double dur, uint64_t flow, int flow_in)
+{
+    int b = buf_index(rec->buf);
+
+    put_sep(out);
+    fprintf(out, "{\"name\":\"%s\",\"cat\":\"databuf\",\"ph\":\"X\",\"pid\":1,"
+            "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", name, rec->tid, ts, dur);
+    if(flow) {
+        fprintf(out, ",\"bind_id\":%lu,\"%s\":true", flow, flow_in ? "flow_in" : "flow_out");
+    }
+    fprintf(out, ",\"args\":{\"databuf\":%d,\"type\":\"%s\",\"block\":%d,\"mask\":\"0x%lx\"}}",
+            b >= 0 ? bufs[b].databuf_id : -1, b >= 0 ? bufs[b].type : "unknown",
+            rec->block_id, rec->mask);
+}
+
+static const char *wait_name(uint32_t event)
+{
+    int filled = (event & HDR_TRACE_EVENT_MASK) == HDR_TRACE_GOT_FILLED;
+
+    if(event & HDR_TRACE_FAILED) {
+        return filled ? "wait filled (failed)" : "wait free (failed)";
+    }
+    if(event & HDR_TRACE_BUSY) {
+        return filled ? "busywait filled" : "busywait free";
+    }
+    return filled ? "wait filled" : "wait free";
+}
+
+static void convert_event(FILE *out, thread_t *t, const hdr_trace_rec_t *rec,
+                          uint64_t *next_flow)
+{
+    int ev = rec->event & HDR_TRACE_EVENT_MASK;
+    int dir = ev == HDR_TRACE_WAIT_FREE || ev == HDR_TRACE_GOT_FREE ||
+              ev == HDR_TRACE_SET_FREE;
+    int b = buf_index(rec->buf);
+    int blk = rec->block_id;
+    uint64_t *p = b >= 0 && blk >= 0 && blk < MAX_BLOCKS ? &pending[b][blk][dir] : NULL;
+    uint64_t flow = 0;
+
+    switch(ev) {
+    case HDR_TRACE_WAIT_FREE:
+    case HDR_TRACE_WAIT_FILLED:
+        t->waiting = 1;
+        t->wait = *rec;
+        break;
+    case HDR_TRACE_GOT_FREE:
+    case HDR_TRACE_GOT_FILLED:
+        // The start of the wait may have been overwritten in the ring
+        if(!t->waiting || (t->wait.event & HDR_TRACE_EVENT_MASK) != ev - 1
+        || t->wait.buf != rec->buf || t->wait.block_id != blk) {
+            t->waiting = 0;
+            break;
+        }
+        t->waiting = 0;
+        if(p && !(rec->event & HDR_TRACE_FAILED)) {
+            flow = *p;
+            *p = 0;
+        }
+        put_slice(out, wait_name(rec->event), &t->wait, ts_us(t->wait.tsc),
+                  ts_us(rec->tsc) - ts_us(t->wait.tsc), flow, 1);
+        break;
+    case HDR_TRACE_SET_FREE:
+    case HDR_TRACE_SET_FILLED:
+        if(p) {
+            flow = *p = ++*next_flow;
+        }
+        put_slice(out, ev == HDR_TRACE_SET_FILLED ? "set filled" : "set free",
+                  rec, ts_us(rec->tsc), 0, flow, 0);
+        break;
+    }
+}
+
+static int convert(const char *name, FILE *out)
+{
+    hdr_trace_file_header_t hdr;
+    thread_t *threads = NULL;
+    event_t *events = NULL;
+    size_t nevents = 0;
+    uint64_t next_flow = 0;
+    uint32_t i, j;
+    size_t k;
+    FILE *in;
+    int rv = 1;
+
+    if(!(in = fopen(name, "r"))) {
+        perror(name);
+        return 1;
+    }
+    if(fread(&hdr, sizeof(hdr), 1, in) != 1
+    || memcmp(hdr.magic, HDR_TRACE_MAGIC, sizeof(hdr.magic))
+    || hdr.version != HDR_TRACE_VERSION || hdr.nbufs > MAX_BUFS
+    || fread(bufs, sizeof(bufs[0]), hdr.nbufs, in) != hdr.nbufs) {
+        fprintf(stderr, "%s: not a trace dump\n", name);
+        goto done;
+    }
+    nbufs = hdr.nbufs;
+    if(hdr.tsc1 <= hdr.tsc0 || hdr.ns1 <= hdr.ns0) {
+        fprintf(stderr, "%s: no trace\n", name);
+        goto done;
+    }
+    tsc0 = hdr.tsc0;
+    us_per_tick = (double)(hdr.ns1 - hdr.ns0) / (hdr.tsc1 - hdr.tsc0) / 1000;
+
+    if(!(threads = (thread_t *)calloc(hdr.nthreads + 1, sizeof(thread_t)))) {
+        perror("calloc");
+        goto done;
+    }
+    for(i=0; i<hdr.nthreads; i++) {
+        if(fread(&threads[i].info, sizeof(threads[i].info), 1, in) != 1
+        || !(events = (event_t *)realloc(events, (nevents + threads[i].info.nrecs + 1)
+                                                 * sizeof(event_t)))) {
+            fprintf(stderr, "%s: truncated trace dump\n", name);
+            goto done;
+        }
+        threads[i].info.name[sizeof(threads[i].info.name)-1] = '\0';
+        for(j=0; j<threads[i].info.nrecs; j++, nevents++) {
+            if(fread(&events[nevents].rec, sizeof(hdr_trace_rec_t), 1, in) != 1) {
+                fprintf(stderr, "%s: truncated trace dump\n", name);
+                goto done;
+            }
+            events[nevents].thread = i;
+            events[nevents].seq = j;
+        }
+    }
+    qsort(events, nevents, sizeof(event_t), cmp_event);
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    put_sep(out);
+    fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"args\":{\"name\":\"hashpipe\"}}");
+    for(i=0; i<hdr.nthreads; i++) {
+        put_sep(out);
+        fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"%s\"}}", threads[i].info.tid,
+                threads[i].info.name);
+    }
+    for(k=0; k<nevents; k++) {
+        convert_event(out, &threads[events[k].thread], &events[k].rec, &next_flow);
+    }
+    fprintf(out, "\n]}\n");
+
+    fprintf(stderr, "%s: %u threads, %zu events\n", name, hdr.nthreads, nevents);
+    rv = ferror(out) ? 1 : 0;
+
+done:
+    free(events);
+    free(threads);
+    fclose(in);
+    return rv;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *outname = NULL;
+    FILE *out = stdout;
+    int opt;
+    int rv;
+
+    while((opt = getopt(argc, argv, "o:h")) != -1) {
+        switch(opt) {
+        case 'o':
+            outname = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-o OUTFILE] TRACEFILE\n", argv[0]);
+            return 1;
+        }
+    }
+    if(optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-o OUTFILE] TRACEFILE\n", argv[0]);
+        return 1;
+    }
+
+    if(outname && !(out = fopen(outname, "w"))) {
+        perror(outname);
+        return 1;
+    }
+    rv = convert(argv[optind], out);
+    if(outname && fclose(out)) {
+        perror(outname);
+        rv = 1;
+    }
+
+    return rv;
+}
@@ -7,45 +7,1024 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include "hashpipe.h"
 #include "hdr_hdf5_header.h"
 #include "hdr_databuf.h"
+#include "hdr_raw_file.h"
+#include "hdr_compress.h"
+#include "hdr_stats.h"
+#include "hdr_trace.h"
 
-struct hdf5_header *initialize_header(){
-   int i;
-   struct hdf5_header *header;
-   header = calloc(1, sizeof(hdf5_header_t));
+#define ELAPSED_NS(start,stop) \
+  (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
 
-   header->Nants = N_ANTS;
-   header->Nants_data = N_ANTS;
-   header->Npols = 2;
-   header->Nfreqs = N_STRP_CHANS_PER_X;
-   header->channel_width = 250.0/8192.0;
-   header->Ntimes = 131072;  // 32 per block* 4096 blocks
-   //header->time_units = (char *)malloc(128, sizeof(char));
-   strcpy(header->time_units, "millisec");
+/* An output file of a block writer: a hera_volt_data_*.h5 file or, in raw
+   mode (WRITMODE=raw), a raw recording (see hdr_raw_file.h) that
+   hdr_raw2hdf5 converts to the same HDF5 layout.
+*/
+typedef struct out_file {
+    char name[4096];                        // without extension
+    int xid;
+    int32_t chan[N_STRP_CHANS_PER_X];       // channel set of file
+    int nbits;                              // block header nbits of file
+    int nbeams;                             // block header nbeams of file
+    uint64_t nblks;                         // blocks written to file
+    uint64_t nbytes;                        // raw mode: size of the .dat file
+    uint64_t first_mcnt, last_mcnt;         // of the blocks written
+    h5_output_file_t h5;                    // HDF5 mode
+    int fd;                                 // raw mode
+    FILE *idx;
+} out_file_t;
 
-   for(i=0; i<N_ANTS; i++)
-      header->ant_array[i] = i;
+/* Writer state of one output directory (target).  Used by the run thread in
+   synchronous mode and by the target's I/O thread in pooled mode.  The run
+   thread decides when a file starts and names it.
 
-   return header;
+   With WRITPREC=1 (the default), a helper thread per writer creates the next
+   file under a temporary name and preallocates room for WRITROTB blocks
+   ahead of time, and closes (and truncates) retired files.  Starting a new
+   file is then a rename and a handle swap.  The pre-created file is only
+   used if its header (XID, channel set, nbits, nbeams) is still current;
+   otherwise the new file is created inline.
+*/
+typedef struct block_writer {
+    hashpipe_status_t st;
+    int raw;
+    int codec;                              // HDR_CODEC_* of HDF5 files
+    char dir[1024];
+    uint64_t nblocks;                       // blocks to preallocate per file
+    out_file_t cur;                         // current file
+    FILE *manifest;                         // shared by all writers, or NULL
+    hdr_raw_writer_t rawfile;               // writes cur in raw mode
+    int open;
+    int64_t max_write_ns;
+    char ns_key[9], max_key[9];             // status keys for write times
+    hdr_hist_t write_hist;                  // write times, WRIT* or WR<i>*
+    // Pre-creation helper
+    int precreate;
+    pthread_t helper;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int quit;
+    int next_state;                         // NEXT_*
+    out_file_t next;                        // pre-created file
+    int retired_pending;
+    out_file_t retired;                     // file for the helper to close
+} block_writer_t;
+
+#define NEXT_EMPTY    0
+#define NEXT_CREATING 1
+#define NEXT_READY    2
+#define NEXT_FAILED   3
+
+static const char *out_file_ext(block_writer_t *w)
+{
+    return w->raw ? ".dat" : ".h5";
+}
+
+// Returns the antenna (or beam) rows of each block of file f
+static int out_file_nants(const out_file_t *f)
+{
+    return f->nbeams > 0 ? f->nbeams : N_ANTS;
+}
+
+// Returns the data bytes of each block of file f
+static uint64_t out_file_block_bytes(const out_file_t *f)
+{
+    return (uint64_t)out_file_nants(f) * (N_BYTES_PER_STRP_BLOCK/N_ANTS) * f->nbits / 4;
+}
+
+// Returns the bytes each block of file f takes up in a raw recording
+static uint64_t out_file_record_bytes(const out_file_t *f)
+{
+    return hdr_raw_record_bytes(out_file_block_bytes(f));
+}
+
+// Sets the header of file f for blocks with header hdr of X engine xid
+static void out_file_set_header(out_file_t *f, int xid, const hdr_stripper_header_t *hdr)
+{
+    f->xid = xid;
+    memcpy(f->chan, hdr->chan, sizeof(f->chan));
+    f->nbits = hdr->nbits == 2 ? 2 : 4;
+    f->nbeams = hdr->nbeams;
+}
+
+// Returns 1 if file f has the header for blocks with header hdr of X engine
+// xid
+static int out_file_matches(const out_file_t *f, int xid, const hdr_stripper_header_t *hdr)
+{
+    return f->xid == xid && f->nbits == (hdr->nbits == 2 ? 2 : 4) &&
+           f->nbeams == hdr->nbeams && !memcmp(f->chan, hdr->chan, sizeof(f->chan));
+}
+
+// Creates file f named f->name for f->xid, f->chan, f->nbits and f->nbeams
+static int out_file_create(block_writer_t *w, out_file_t *f)
+{
+    hdr_raw_index_header_t ih;
+    char filename[4096+8];
+    int rv;
+
+    f->nblks = 0;
+    f->nbytes = 0;
+    f->fd = -1;
+    f->idx = NULL;
+    f->h5.file = -1;
+    if (!w->raw){
+       sprintf(filename, "%s.h5", f->name);
+       hdf5_header_t *header = initialize_header(f->xid, f->chan);
+       header->nbits = f->nbits;
+       header->nbeams = f->nbeams;
+       header->Nants = header->Nants_data = out_file_nants(f);
+       rv = h5_output_file_create(&f->h5, filename, header, w->nblocks, w->codec);
+       free(header);
+       return rv;
+    }
+
+    memset(&ih, 0, sizeof(ih));
+    memcpy(ih.magic, HDR_RAW_INDEX_MAGIC, sizeof(ih.magic));
+    ih.version = HDR_RAW_INDEX_VERSION;
+    ih.xid = f->xid;
+    ih.create_time = time(NULL);
+    ih.record_bytes = out_file_record_bytes(f);
+    ih.nants = out_file_nants(f);
+    ih.npols = 2;
+    ih.nchans = N_STRP_CHANS_PER_X;
+    ih.ntimes = N_TIME_PER_BLOCK;
+    memcpy(ih.chan, f->chan, sizeof(ih.chan));
+    ih.nbits = f->nbits;
+    ih.nbeams = f->nbeams;
+    return hdr_raw_file_create(f->name, &ih, w->nblocks, &f->fd, &f->idx);
 }
 
-void write_hdf5_header(hdf5_header_t *header, hid_t file_id){
-   hid_t group_id, dataset_id, dataspace_id;
-   hsize_t dims[1];
+// Closes file f, dropping any preallocated space that was not written
+static void out_file_close(block_writer_t *w, out_file_t *f)
+{
+    if (w->raw){
+       hdr_raw_file_close(f->fd, f->idx, f->nbytes);
+    }else if (f->h5.file >= 0){
+       h5_output_file_truncate(&f->h5, f->nblks);
+       h5_output_file_close(&f->h5);
+    }
+}
+
+static int out_file_rename(block_writer_t *w, out_file_t *f, const char *name)
+{
+    char oldname[4096+8], newname[4096+8];
+
+    if (w->raw){
+       if (hdr_raw_file_rename(f->name, name) != HASHPIPE_OK){
+          return HASHPIPE_ERR_SYS;
+       }
+       hdr_raw_index_set_create_time(f->idx, time(NULL));
+    }else{
+       sprintf(oldname, "%s.h5", f->name);
+       sprintf(newname, "%s.h5", name);
+       if (hdr_rename_noreplace(oldname, newname)){
+          return HASHPIPE_ERR_SYS;
+       }
+    }
+    strcpy(f->name, name);
+    return HASHPIPE_OK;
+}
 
-   group_id = H5Gcreate2(file_id, "header", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+// Closes and removes file f
+static void out_file_discard(block_writer_t *w, out_file_t *f)
+{
+    char filename[4096+8];
+
+    out_file_close(w, f);
+    sprintf(filename, "%s%s", f->name, out_file_ext(w));
+    unlink(filename);
+    if (w->raw){
+       sprintf(filename, "%s.idx", f->name);
+       unlink(filename);
+    }
+}
+
+static void *block_writer_helper(void *arg)
+{
+    static unsigned int seq = 0;
+    block_writer_t *w = (block_writer_t *)arg;
+    out_file_t f;
+    int rv;
+
+    pthread_mutex_lock(&w->lock);
+    while (1){
+       if (w->retired_pending){
+          f = w->retired;
+          pthread_mutex_unlock(&w->lock);
+          out_file_close(w, &f);
+          pthread_mutex_lock(&w->lock);
+          w->retired_pending = 0;
+          pthread_cond_broadcast(&w->cond);
+       }else if (w->quit){
+          break;
+       }else if (w->next_state == NEXT_EMPTY){
+          // Create the next file for the current XID and block header
+          w->next_state = NEXT_CREATING;
+          f = w->next;
+          pthread_mutex_unlock(&w->lock);
+          snprintf(f.name, sizeof(f.name), "%s/.hera_volt_next_%d_%u", w->dir,
+                   getpid(), __atomic_add_fetch(&seq, 1, __ATOMIC_RELAXED));
+          rv = out_file_create(w, &f);
+          pthread_mutex_lock(&w->lock);
+          w->next = f;
+          w->next_state = rv == HASHPIPE_OK ? NEXT_READY : NEXT_FAILED;
+          pthread_cond_broadcast(&w->cond);
+       }else{
+          pthread_cond_wait(&w->cond, &w->lock);
+       }
+    }
+    pthread_mutex_unlock(&w->lock);
 
-   dims[0] = 1;
-   H5_WRITE_HEADER_I64(group_id, "Nants", header->Nants, dims);
-   H5_WRITE_HEADER_I64(group_id, "Nants_data", header->Nants_data, dims);
-   H5_WRITE_HEADER_I64(group_id, "Nfreqs", header->Nfreqs, dims);
-   H5_WRITE_HEADER_I64(group_id, "Ntimes", header->Ntimes, dims);
-   H5_WRITE_HEADER_I64(group_id, "Npols", header->Npols, dims);
-   H5_WRITE_HEADER_I64(group_id, "chan_width", header->channel_width, dims);
-   H5_WRITE_HEADER_I64(group_id, "time_units", header->time_units, dims);
-   H5Gclose(group_id);
+    return NULL;
+}
+
+static int block_writer_init(block_writer_t *w, hashpipe_status_t *st, int raw, int qdepth,
+                             const char *dir, uint64_t nblocks, int precreate, int codec)
+{
+    memset(w, 0, sizeof(*w));
+    w->st = *st;
+    w->raw = raw;
+    w->codec = codec;
+    snprintf(w->dir, sizeof(w->dir), "%s", dir);
+    w->nblocks = nblocks;
+    strcpy(w->ns_key, "WRITENS");
+    strcpy(w->max_key, "WRITEMAX");
+    if (raw && hdr_raw_writer_init(&w->rawfile, qdepth) != HASHPIPE_OK){
+       return HASHPIPE_ERR_SYS;
+    }
+
+    w->precreate = precreate;
+    if (precreate){
+       w->next.xid = -1;
+       hashpipe_status_lock_safe(&w->st);
+       hgeti4(w->st.buf, "XID", &w->next.xid);
+       hashpipe_status_unlock_safe(&w->st);
+       hdr_chan_set_default(w->next.chan);
+       w->next.nbits = 4;
+       w->next.nbeams = 0;
+       pthread_mutex_init(&w->lock, NULL);
+       pthread_cond_init(&w->cond, NULL);
+       if (pthread_create(&w->helper, NULL, block_writer_helper, w)){
+          return HASHPIPE_ERR_SYS;
+       }
+    }
+    return HASHPIPE_OK;
+}
+
+// Adds a line "<file> <first mcnt> <last mcnt> <blocks>" for the current
+// file, which is being closed, to the manifest
+static void block_writer_manifest(block_writer_t *w)
+{
+    if (w->manifest){
+       fprintf(w->manifest, "%s%s %lu %lu %lu\n", w->cur.name, out_file_ext(w),
+               (unsigned long)w->cur.first_mcnt, (unsigned long)w->cur.last_mcnt,
+               (unsigned long)w->cur.nblks);
+       fflush(w->manifest);
+    }
+}
+
+// Closes the current file
+static void block_writer_close(block_writer_t *w)
+{
+    if (!w->open){
+       return;
+    }
+    w->open = 0;
+    if (w->raw){
+       w->cur.nbytes = hdr_raw_writer_detach(&w->rawfile, &w->cur.fd, &w->cur.idx);
+       w->cur.nblks = w->rawfile.nwritten;
+    }
+    block_writer_manifest(w);
+    out_file_close(w, &w->cur);
+}
+
+// Stops the helper, closes all files and frees the writer's resources
+static void block_writer_destroy(block_writer_t *w)
+{
+    hdr_hist_unregister(&w->write_hist);
+    block_writer_close(w);
+    if (w->precreate){
+       pthread_mutex_lock(&w->lock);
+       w->quit = 1;
+       pthread_cond_broadcast(&w->cond);
+       pthread_mutex_unlock(&w->lock);
+       pthread_join(w->helper, NULL);
+       pthread_mutex_destroy(&w->lock);
+       pthread_cond_destroy(&w->cond);
+       // Remove an unused pre-created file
+       if (w->next_state == NEXT_READY){
+          out_file_discard(w, &w->next);
+       }
+    }
+    if (w->raw){
+       hdr_raw_writer_destroy(&w->rawfile);
+    }
+}
+
+/* Starts file name for XID xid and blocks with header hdr (channel set,
+   nbits and nbeams).  The current file is handed to the helper to close.
+   The pre-created file is used if it matches and the helper is asked to
+   pre-create another one.
+*/
+static int block_writer_start_file(block_writer_t *w, const char *name, int xid,
+                                   const hdr_stripper_header_t *hdr)
+{
+    int rv = HASHPIPE_ERR_GEN;
+
+    if (w->raw && w->open){
+       w->cur.nbytes = hdr_raw_writer_detach(&w->rawfile, &w->cur.fd, &w->cur.idx);
+       w->cur.nblks = w->rawfile.nwritten;
+    }
+    if (w->open){
+       block_writer_manifest(w);
+    }
+
+    if (w->precreate){
+       pthread_mutex_lock(&w->lock);
+       while (w->retired_pending || w->next_state == NEXT_CREATING){
+          pthread_cond_wait(&w->cond, &w->lock);
+       }
+       if (w->open){
+          w->retired = w->cur;
+          w->retired_pending = 1;
+       }
+       if (w->next_state == NEXT_READY){
+          if (out_file_matches(&w->next, xid, hdr)){
+             w->cur = w->next;
+             rv = out_file_rename(w, &w->cur, name);
+             if (rv != HASHPIPE_OK){
+                // Remove the pre-created file, the new file is created
+                // instead
+                hashpipe_warn(__FUNCTION__, "error renaming %s to %s",
+                              w->cur.name, name);
+                out_file_discard(w, &w->cur);
+             }
+          }else{
+             // Stale header, discard the file
+             out_file_discard(w, &w->next);
+          }
+       }
+       // Pre-create the next file with the latest XID and block header
+       out_file_set_header(&w->next, xid, hdr);
+       w->next_state = NEXT_EMPTY;
+       pthread_cond_broadcast(&w->cond);
+       pthread_mutex_unlock(&w->lock);
+    }else if (w->open){
+       out_file_close(w, &w->cur);
+    }
+    w->open = 0;
+
+    if (rv != HASHPIPE_OK){
+       strcpy(w->cur.name, name);
+       out_file_set_header(&w->cur, xid, hdr);
+       rv = out_file_create(w, &w->cur);
+       if (rv != HASHPIPE_OK){
+          return rv;
+       }
+    }
+
+    printf("New file: %s%s\n\n", w->cur.name, out_file_ext(w));
+    if (w->raw){
+       hdr_raw_writer_attach(&w->rawfile, w->cur.fd, w->cur.idx,
+                             out_file_record_bytes(&w->cur));
+    }
+    w->cur.nblks = 0;
+    w->open = 1;
+    return HASHPIPE_OK;
+}
+
+/* Writes a block with header hdr received at time now (ms).  data holds
+   nbytes bytes: the block itself if nbytes is its size
+   (hdr_stripper_data_bytes), otherwise the block compressed by
+   hdr_compress_block.  If filename is not NULL, the current file is closed
+   and the block starts a new file named filename (without extension).  The
+   caller starts a new file whenever the block's nbits or nbeams changes.
+*/
+static int block_writer_put(block_writer_t *w, const hdr_stripper_header_t *hdr,
+                            const void *data, size_t nbytes, uint64_t now,
+                            const char *filename)
+{
+    struct timespec start, stop;
+    int64_t write_ns;
+    int xid = -1;
+    int rv;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (filename){
+       hashpipe_status_lock_safe(&w->st);
+       hgeti4(w->st.buf, "XID", &xid);
+       hashpipe_status_unlock_safe(&w->st);
+
+       rv = block_writer_start_file(w, filename, xid, hdr);
+       if (rv != HASHPIPE_OK){
+          return rv;
+       }
+    }else if (!w->open){
+       return HASHPIPE_ERR_PARAM;
+    }
+
+    if (w->raw){
+       rv = hdr_raw_writer_put(&w->rawfile, hdr, data, now);
+    }else if (nbytes < hdr_stripper_data_bytes(hdr)){
+       rv = h5_output_file_write_compressed(&w->cur.h5, w->cur.nblks, data, nbytes, now);
+    }else{
+       rv = h5_output_file_write(&w->cur.h5, w->cur.nblks, data, now);
+    }
+    if (rv == HASHPIPE_OK && !w->raw && w->cur.nbits == 2){
+       rv = h5_output_file_write_thresh(&w->cur.h5, w->cur.nblks, hdr->thresh);
+    }
+    if (rv == HASHPIPE_OK && !w->raw){
+       rv = h5_output_file_write_flags(&w->cur.h5, w->cur.nblks, hdr->pkt_map, hdr->chan);
+    }
+    if (rv != HASHPIPE_OK){
+       hashpipe_error(__FUNCTION__, "error writing block %lu of %s",
+                      (unsigned long)w->cur.nblks, w->cur.name);
+       return rv;
+    }
+    if (!w->cur.nblks){
+       w->cur.first_mcnt = hdr->mcnt;
+    }
+    w->cur.last_mcnt = hdr->mcnt;
+    w->cur.nblks++;
+
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+    write_ns = ELAPSED_NS(start, stop);
+    if (write_ns > w->max_write_ns){
+       w->max_write_ns = write_ns;
+    }
+    hdr_hist_record1(&w->write_hist, write_ns);
+
+    hashpipe_status_lock_safe(&w->st);
+    hputi8(w->st.buf, w->ns_key, write_ns);
+    hputi8(w->st.buf, w->max_key, w->max_write_ns);
+    hashpipe_status_unlock_safe(&w->st);
+
+    return HASHPIPE_OK;
+}
+
+/* Compression (WRITCOMP=lz4 or nib).  Blocks are compressed with the codec
+   (see hdr_compress.h) and stored with its HDF5 filter, so HDF5 readers
+   with the filter plugin decode them transparently.  Blocks that do not
+   compress are stored as is.  In pooled mode each target has
+   WRITCTHR compression threads working through its pool ahead of the I/O
+   thread; otherwise the run thread compresses inline.  HDF5 mode only.
+
+   Each compressor publishes its throughput while busy as WRTC<n>MB (MB/s)
+   and WRITCRAT is the overall compression ratio.
+*/
+#define MAX_COMPRESS_THREADS 16
+
+typedef struct compressor {
+    hashpipe_status_t st;
+    int codec;
+    char mb_key[9];
+    uint8_t *tmp;                           // bitshuffle scratch
+    uint64_t bytes_in;
+    int64_t busy_ns;
+    struct write_pool *pool;                // pooled mode
+    pthread_t thread;
+} compressor_t;
+
+// Totals over all compressors
+static uint64_t compress_bytes_in, compress_bytes_out;
+
+static int compressor_init(compressor_t *c, hashpipe_status_t *st, int codec, int id)
+{
+    memset(c, 0, sizeof(*c));
+    c->st = *st;
+    c->codec = codec;
+    sprintf(c->mb_key, "WRTC%dMB", id);
+    c->tmp = (uint8_t *)malloc(HDR_BSHUF_BLOCK);
+    return c->tmp ? HASHPIPE_OK : HASHPIPE_ERR_SYS;
+}
+
+// Compresses block data of nbytes bytes and nbits bits per value into out
+// (nbytes bytes).  Returns the compressed size or 0 if the block is to be
+// stored as is.
+static size_t compress_block(compressor_t *c, const void *data, size_t nbytes, int nbits,
+                             void *out)
+{
+    struct timespec start, stop;
+    uint64_t total_in, total_out;
+    size_t n;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    n = hdr_compress_block(c->codec, data, nbytes, nbits, out, c->tmp);
+    clock_gettime(CLOCK_MONOTONIC, &stop);
+
+    c->bytes_in += nbytes;
+    c->busy_ns += ELAPSED_NS(start, stop);
+    total_in = __atomic_add_fetch(&compress_bytes_in, nbytes, __ATOMIC_RELAXED);
+    total_out = __atomic_add_fetch(&compress_bytes_out, n ? n : nbytes, __ATOMIC_RELAXED);
+
+    hashpipe_status_lock_safe(&c->st);
+    hputr4(c->st.buf, c->mb_key, c->busy_ns ? 1e3 * c->bytes_in / c->busy_ns : 0);
+    hputr4(c->st.buf, "WRITCRAT", (double)total_in / total_out);
+    hashpipe_status_unlock_safe(&c->st);
+
+    return n;
+}
+
+/* Pooled mode (WRITPOOL > 0).  Each target has a pool of WRITPOOL page
+   locked buffers.  Each filled stripper block is copied into a buffer of its
+   target's pool and freed right away.  A background I/O thread per target
+   drains the pool to disk, so a disk stall only backs up into the stripper
+   once the pool is full.  The largest high-water mark of the pools is
+   published as WRITPLHW for sizing the pools against observed stalls.
+*/
+#define MAX_WRITE_POOL 1024
+
+typedef struct write_job {
+    hdr_stripper_header_t hdr;
+    uint64_t now;
+    int new_file;           // block starts file filename
+    uint64_t file_id;       // run thread's number of the file of the block
+    char filename[4096];
+    uint8_t *data;
+    uint8_t *cdata;         // compressed block
+    size_t csize;           // size of cdata, 0 if not compressed
+    int ready;              // compressed, if compressing
+    int close_file;         // no block, close the current file
+} write_job_t;
+
+typedef struct write_pool {
+    int depth;
+    write_job_t *job;
+    int head, tail, count;  // head: next to fill, tail: next to write
+    int hwm;                // high-water mark of count
+    uint64_t nlost;         // blocks that could not be written
+    uint64_t failed_file;   // file_id of the last file that could not be
+                            // started or was closed by a write error
+    int ncomp;              // compression threads
+    compressor_t *comp;
+    int chead, cpending;    // chead: next to compress
+    int quit;
+    pthread_mutex_t lock;
+    pthread_cond_t filled, freed;
+    pthread_t thread;
+    block_writer_t *writer;
+} write_pool_t;
+
+static void *write_pool_run(void *arg)
+{
+    write_pool_t *pool = (write_pool_t *)arg;
+    write_job_t *job;
+
+    while (1){
+       pthread_mutex_lock(&pool->lock);
+       while (!(pool->count && pool->job[pool->tail].ready) &&
+              !(pool->quit && !pool->count)){
+          pthread_cond_wait(&pool->filled, &pool->lock);
+       }
+       if (!pool->count){
+          pthread_mutex_unlock(&pool->lock);
+          break;
+       }
+       job = &pool->job[pool->tail];
+       pthread_mutex_unlock(&pool->lock);
+
+       if (job->close_file){
+          block_writer_close(pool->writer);
+       }else if (block_writer_put(pool->writer, &job->hdr,
+                            job->csize ? job->cdata : job->data,
+                            job->csize ? job->csize : hdr_stripper_data_bytes(&job->hdr),
+                            job->now,
+                            job->new_file ? job->filename : NULL) != HASHPIPE_OK){
+          hashpipe_error(__FUNCTION__, "error writing pooled block");
+          __atomic_fetch_add(&pool->nlost, 1, __ATOMIC_RELAXED);
+          // Let the run thread start another file (see hdr_write_thread_run)
+          if (!pool->writer->open){
+             __atomic_store_n(&pool->failed_file, job->file_id, __ATOMIC_RELAXED);
+          }
+       }
+
+       pthread_mutex_lock(&pool->lock);
+       pool->tail = (pool->tail + 1) % pool->depth;
+       pool->count--;
+       pthread_cond_signal(&pool->freed);
+       pthread_mutex_unlock(&pool->lock);
+    }
+
+    return NULL;
+}
+
+// Compresses pool entries in order as they are queued
+static void *write_pool_compress(void *arg)
+{
+    compressor_t *c = (compressor_t *)arg;
+    write_pool_t *pool = c->pool;
+    write_job_t *job;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1){
+       while (!pool->cpending && !pool->quit){
+          pthread_cond_wait(&pool->filled, &pool->lock);
+       }
+       if (!pool->cpending){
+          break;
+       }
+       job = &pool->job[pool->chead];
+       pool->chead = (pool->chead + 1) % pool->depth;
+       pool->cpending--;
+       pthread_mutex_unlock(&pool->lock);
+
+       if (!job->close_file){
+          job->csize = compress_block(c, job->data, hdr_stripper_data_bytes(&job->hdr),
+                                      job->hdr.nbits, job->cdata);
+       }
+
+       pthread_mutex_lock(&pool->lock);
+       job->ready = 1;
+       pthread_cond_broadcast(&pool->filled);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+/* Allocates a pool of depth entries for writer and starts its I/O thread
+   and, if ncomp > 0, ncomp compression threads publishing as compressors
+   first_comp to first_comp+ncomp-1.
+*/
+static int write_pool_start(write_pool_t *pool, int depth, block_writer_t *writer,
+                            int ncomp, int first_comp)
+{
+    int i;
+
+    memset(pool, 0, sizeof(*pool));
+    pool->depth = depth;
+    pool->writer = writer;
+    pool->ncomp = ncomp;
+    pool->job = (write_job_t *)calloc(depth, sizeof(write_job_t));
+    pool->comp = (compressor_t *)calloc(ncomp, sizeof(compressor_t));
+    if (!pool->job || !pool->comp){
+       return HASHPIPE_ERR_SYS;
+    }
+    for (i=0; i<depth; i++){
+       if (posix_memalign((void **)&pool->job[i].data, 4096, N_BYTES_PER_STRP_BLOCK)){
+          return HASHPIPE_ERR_SYS;
+       }
+       // Touch and pin the buffer so a copy never takes a page fault
+       memset(pool->job[i].data, 0, N_BYTES_PER_STRP_BLOCK);
+       if (mlock(pool->job[i].data, N_BYTES_PER_STRP_BLOCK)){
+          hashpipe_warn(__FUNCTION__, "mlock of pool buffer %d failed", i);
+       }
+       if (ncomp > 0 && !(pool->job[i].cdata = (uint8_t *)malloc(N_BYTES_PER_STRP_BLOCK))){
+          return HASHPIPE_ERR_SYS;
+       }
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->filled, NULL);
+    pthread_cond_init(&pool->freed, NULL);
+    if (pthread_create(&pool->thread, NULL, write_pool_run, pool)){
+       return HASHPIPE_ERR_SYS;
+    }
+    for (i=0; i<ncomp; i++){
+       if (compressor_init(&pool->comp[i], &writer->st, writer->codec,
+                           first_comp + i) != HASHPIPE_OK){
+          return HASHPIPE_ERR_SYS;
+       }
+       pool->comp[i].pool = pool;
+       if (pthread_create(&pool->comp[i].thread, NULL, write_pool_compress, &pool->comp[i])){
+          return HASHPIPE_ERR_SYS;
+       }
+    }
+    return HASHPIPE_OK;
+}
+
+// Returns the next free pool entry, waiting for the I/O thread if the pool is
+// full.  *waited is set if the pool was full.
+static write_job_t *write_pool_get(write_pool_t *pool, int *waited)
+{
+    write_job_t *job;
+
+    pthread_mutex_lock(&pool->lock);
+    *waited = pool->count == pool->depth;
+    while (pool->count == pool->depth){
+       pthread_cond_wait(&pool->freed, &pool->lock);
+    }
+    job = &pool->job[pool->head];
+    pthread_mutex_unlock(&pool->lock);
+    return job;
+}
+
+// Hands the entry returned by write_pool_get to the I/O thread or, if
+// close_file is set, has the I/O thread close the current file once the
+// entries before it are written.  Returns the number of entries queued.
+static int write_pool_put(write_pool_t *pool, int close_file)
+{
+    int count;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->job[pool->head].close_file = close_file;
+    pool->job[pool->head].ready = !pool->ncomp;
+    pool->job[pool->head].csize = 0;
+    if (pool->ncomp){
+       pool->cpending++;
+    }
+    pool->head = (pool->head + 1) % pool->depth;
+    count = ++pool->count;
+    if (count > pool->hwm){
+       pool->hwm = count;
+    }
+    pthread_cond_broadcast(&pool->filled);
+    pthread_mutex_unlock(&pool->lock);
+    return count;
+}
+
+// Drains the pool and stops the I/O and compression threads
+static void write_pool_stop(write_pool_t *pool)
+{
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->filled);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->thread, NULL);
+    for (i=0; i<pool->ncomp; i++){
+       pthread_join(pool->comp[i].thread, NULL);
+       free(pool->comp[i].tmp);
+    }
+    free(pool->comp);
+
+    for (i=0; i<pool->depth; i++){
+       munlock(pool->job[i].data, N_BYTES_PER_STRP_BLOCK);
+       free(pool->job[i].data);
+       free(pool->job[i].cdata);
+    }
+    free(pool->job);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->filled);
+    pthread_cond_destroy(&pool->freed);
+}
+
+/* Output targets.  WRITDIRS is a comma separated list of output directories,
+   ideally each on its own device.  Each directory gets its own writer and, in
+   pooled mode, its own I/O thread.  Whole files are distributed over the
+   targets: a new file goes to the target with the fewest blocks waiting in
+   its pool, i.e. the one keeping up best, with ties going round-robin.
+   hera_volt_manifest.txt in the first directory lists every file with its
+   first and last mcnt and the number of blocks written to it.  The writers
+   add a file when they close it.
+*/
+#define MAX_WRITE_TARGETS 16
+
+typedef struct write_target {
+    char dir[1024];
+    block_writer_t writer;
+    write_pool_t pool;
+} write_target_t;
+
+// Splits WRITDIRS into targets[].dir and returns the number of targets
+static int parse_write_dirs(char *dirs, write_target_t *targets)
+{
+    char *dir, *saveptr;
+    int n = 0;
+
+    for (dir = strtok_r(dirs, ",", &saveptr); dir && n < MAX_WRITE_TARGETS;
+         dir = strtok_r(NULL, ",", &saveptr)){
+       while (*dir == ' '){
+          dir++;
+       }
+       if (*dir){
+          snprintf(targets[n++].dir, sizeof(targets[0].dir), "%s", dir);
+       }
+    }
+    if (n == 0){
+       strcpy(targets[n++].dir, ".");
+    }
+    return n;
+}
+
+// Returns the blocks lost after being queued, by the I/O threads of the
+// targets' pools or by raw writes that failed to complete
+static uint64_t targets_lost(write_target_t *targets, int ntargets)
+{
+    uint64_t n = 0;
+    int i;
+
+    for (i=0; i<ntargets; i++){
+       n += __atomic_load_n(&targets[i].pool.nlost, __ATOMIC_RELAXED) +
+            __atomic_load_n(&targets[i].writer.rawfile.nfailed, __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+// Picks the target for a new file.  Pool counts are read without the pool
+// locks; a stale count only affects which target gets the file.
+static int pick_target(write_target_t *targets, int ntargets, int depth, int last)
+{
+    int i, t, best = (last + 1) % ntargets;
+
+    for (i=1; depth > 0 && i<ntargets; i++){
+       t = (last + 1 + i) % ntargets;
+       if (targets[t].pool.count < targets[best].pool.count){
+          best = t;
+       }
+    }
+    return best;
+}
+
+/* Trigger mode (TRIGNBLK > 0).  Instead of being written, every block is
+   copied into a ring of the last TRIGNBLK blocks in RAM, backed by huge pages
+   if enough are reserved (TRIGHUGE is 1 if so), and nothing goes to disk
+   until a trigger is set in TRIGGER as
+
+     mcnt START END     blocks holding any mcnt from START to END, or
+     time START END     blocks received from START to END (ms since epoch).
+
+   The writer then takes the trigger, clears TRIGGER, and writes the blocks
+   of the window still in the ring, oldest first, to a new file through the
+   usual write path.  Blocks of the window that arrive later are written as
+   they arrive, and the file is closed with the first block past the window.
+   At most TRIGRATE ring blocks are written per block received, so the
+   backlog of a trigger drains while the input keeps flowing.  Another
+   trigger is only taken once the current one is written.
+*/
+#define TRIG_HUGE_PAGE (2*1024*1024)
+
+typedef struct trig_ring {
+    uint64_t n;                     // blocks, 0 if not in trigger mode
+    size_t bytes;                   // mapped bytes
+    int huge;                       // backed by huge pages
+    uint8_t *data;
+    hdr_stripper_header_t *hdr;
+    uint64_t *now;                  // time each block was received (ms)
+    uint64_t nin;                   // blocks put in the ring
+    int active;                     // a trigger is being written
+    int by_time;                    // window in ms rather than mcnt
+    uint64_t start, end;            // window, inclusive
+    uint64_t next;                  // sequence number of the next block to look at
+    uint64_t ntrig;                 // triggers written
+    uint64_t nwritten;              // blocks written
+    uint64_t nlost;                 // window blocks overwritten before being written
+} trig_ring_t;
+
+static int trig_ring_init(trig_ring_t *r, uint64_t n)
+{
+    memset(r, 0, sizeof(*r));
+    r->bytes = (n*N_BYTES_PER_STRP_BLOCK + TRIG_HUGE_PAGE - 1) / TRIG_HUGE_PAGE * TRIG_HUGE_PAGE;
+    r->data = mmap(NULL, r->bytes, PROT_READ|PROT_WRITE,
+                   MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_POPULATE, -1, 0);
+    r->huge = r->data != MAP_FAILED;
+    if (!r->huge){
+       // Not enough huge pages reserved, fall back to transparent huge pages
+       r->data = mmap(NULL, r->bytes, PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+       if (r->data == MAP_FAILED){
+          return HASHPIPE_ERR_SYS;
+       }
+       madvise(r->data, r->bytes, MADV_HUGEPAGE);
+       if (mlock(r->data, r->bytes)){
+          hashpipe_warn(__FUNCTION__, "mlock of trigger ring failed");
+       }
+    }
+    r->hdr = (hdr_stripper_header_t *)calloc(n, sizeof(hdr_stripper_header_t));
+    r->now = (uint64_t *)calloc(n, sizeof(uint64_t));
+    if (!r->hdr || !r->now){
+       return HASHPIPE_ERR_SYS;
+    }
+    r->n = n;
+    return HASHPIPE_OK;
+}
+
+static void trig_ring_destroy(trig_ring_t *r)
+{
+    if (r->data && r->data != MAP_FAILED){
+       munmap(r->data, r->bytes);
+    }
+    free(r->hdr);
+    free(r->now);
+}
+
+static void trig_ring_insert(trig_ring_t *r, const hdr_stripper_header_t *hdr,
+                             const void *data, uint64_t now)
+{
+    uint64_t slot = r->nin % r->n;
+
+    r->hdr[slot] = *hdr;
+    r->now[slot] = now;
+    memcpy(r->data + slot*N_BYTES_PER_STRP_BLOCK, data, hdr_stripper_data_bytes(hdr));
+    r->nin++;
+}
+
+// Parses trigger spec and starts writing it from the oldest block in the
+// ring.  Returns HASHPIPE_OK or HASHPIPE_ERR_PARAM.
+static int trig_ring_trigger(trig_ring_t *r, const char *spec)
+{
+    char kind[8];
+    unsigned long long start, end;
+
+    if (sscanf(spec, "%7s %llu %llu", kind, &start, &end) != 3 || start > end
+    || (strcmp(kind, "mcnt") && strcmp(kind, "time"))){
+       return HASHPIPE_ERR_PARAM;
+    }
+    r->by_time = !strcmp(kind, "time");
+    r->start = start;
+    r->end = end;
+    r->next = r->nin > r->n ? r->nin - r->n : 0;
+    r->active = 1;
+    return HASHPIPE_OK;
+}
+
+/* Returns the slot of the next block of the current trigger to write, or -1
+   if there is none yet.  Ends the trigger (clearing r->active) at the first
+   block past its window.  A block is in an mcnt window if any of the
+   N_TIME_PER_BLOCK*TIME_DEMUX mcnts it spans is.
+*/
+static int64_t trig_ring_next(trig_ring_t *r)
+{
+    const hdr_stripper_header_t *hdr;
+    uint64_t slot;
+
+    while (r->active && r->next < r->nin){
+       if (r->next + r->n < r->nin){
+          r->nlost += r->nin - r->n - r->next;
+          r->next = r->nin - r->n;
+       }
+       slot = r->next % r->n;
+       hdr = &r->hdr[slot];
+       if (r->by_time ? r->now[slot] > r->end : hdr->mcnt > r->end){
+          r->active = 0;
+          r->ntrig++;
+          break;
+       }
+       r->next++;
+       if (r->by_time ? r->now[slot] >= r->start : hdr->mcnt + N_TIME_PER_BLOCK*TIME_DEMUX > r->start){
+          r->nwritten++;
+          return slot;
+       }
+    }
+    return -1;
+}
+
+static int init(hashpipe_thread_args_t *args)
+{
+    hashpipe_status_t st = args->st;
+    int depth = 0;
+    int qdepth = 4;
+    char mode[80] = "hdf5";
+    char dirs[4096] = ".";
+    unsigned long long rot_blocks = N_BLOCK_PER_FILE;
+    unsigned long long rot_mbytes = 0;
+    unsigned long long rot_secs = 0;
+    int precreate = 1;
+    char comp[80] = "none";
+    int ncomp = 2;
+    unsigned long long trig_nblk = 0;
+    int trig_rate = 4;
+
+    hashpipe_status_lock_safe(&st);
+    hgeti4(st.buf, "WRITPOOL", &depth);
+    depth = depth < 0 ? 0 : depth > MAX_WRITE_POOL ? MAX_WRITE_POOL : depth;
+    hputi4(st.buf, "WRITPOOL", depth);
+    hgets(st.buf, "WRITMODE", sizeof(mode), mode);
+    if (strcmp(mode, "raw") && strcmp(mode, "hdf5")){
+       hashpipe_warn(__FUNCTION__, "unknown WRITMODE \"%s\", using hdf5", mode);
+       strcpy(mode, "hdf5");
+    }
+    hputs(st.buf, "WRITMODE", mode);
+    // Raw mode writes in flight
+    hgeti4(st.buf, "WRITQD", &qdepth);
+    qdepth = qdepth < 1 ? 1 : qdepth > 64 ? 64 : qdepth;
+    hputi4(st.buf, "WRITQD", qdepth);
+    hgets(st.buf, "WRITDIRS", sizeof(dirs), dirs);
+    hputs(st.buf, "WRITDIRS", dirs);
+    // File rotation limits, 0 for none
+    hgetu8(st.buf, "WRITROTB", &rot_blocks);
+    hputu8(st.buf, "WRITROTB", rot_blocks);
+    hgetu8(st.buf, "WRITROTM", &rot_mbytes);
+    hputu8(st.buf, "WRITROTM", rot_mbytes);
+    hgetu8(st.buf, "WRITROTS", &rot_secs);
+    hputu8(st.buf, "WRITROTS", rot_secs);
+    hgeti4(st.buf, "WRITPREC", &precreate);
+    hputi4(st.buf, "WRITPREC", precreate);
+    // Compression: none, lz4 (bitshuffle + LZ4) or nib (hdr_nibble.h),
+    // threads per target
+    hgets(st.buf, "WRITCOMP", sizeof(comp), comp);
+    hputs(st.buf, "WRITCOMP", comp);
+    hgeti4(st.buf, "WRITCTHR", &ncomp);
+    hputi4(st.buf, "WRITCTHR", ncomp);
+    hputr4(st.buf, "WRITCRAT", 1.0);
+    hputi4(st.buf, "WRITPLHW", 0);
+    // Blocks lost to write errors
+    hputu8(st.buf, "WRITLOST", 0);
+    // Trigger mode: ring blocks, ring blocks written per block received
+    hgetu8(st.buf, "TRIGNBLK", &trig_nblk);
+    hputu8(st.buf, "TRIGNBLK", trig_nblk);
+    hgeti4(st.buf, "TRIGRATE", &trig_rate);
+    hputi4(st.buf, "TRIGRATE", trig_rate < 2 ? 2 : trig_rate);
+    if (trig_nblk > 0){
+       hputs(st.buf, "TRIGGER", "");
+    }
+    hashpipe_status_unlock_safe(&st);
+
+    return 0;
 }
 
 void *hdr_write_thread_run(hashpipe_thread_args_t *args){
@@ -53,94 +1032,206 @@ void *hdr_write_thread_run(hashpipe_thread_args_t *args){
     hashpipe_status_t st = args->st;
     const char *status_key = args->thread_desc->skey;
 
+    hdr_trace_thread_name("write");
+
     /*Main loop*/
     int rv;
     uint64_t mcnt = 0;
-    uint64_t *data;
-    int block_id;
-    uint64_t nblks = N_BLOCK_PER_FILE;
-    char filename[4096];
+    int block_id = 0;
     struct timeval tv;
+    struct timespec start, stop;
     uint64_t now;
+    int depth = 0;
+    int qdepth = 4;
+    char mode[80] = "hdf5";
+    char dirs[4096] = ".";
+    char filename[4096];
+    int queued, waited, hwm;
+    int i;
+    write_target_t *targets;
+    int ntargets;
+    int target = -1;         // target of the current file
+    uint64_t nblks = 0;                     // blocks in the current file
+    uint64_t file_bytes = 0;                // data bytes in the current file
+    uint64_t nlost = 0;                     // blocks that could not be written
+    uint64_t queued_lost = 0;               // blocks lost after being queued
+    uint64_t file_id = 0;                   // number of the current file
+    uint64_t lost;
+    size_t nbytes;
+    uint64_t file_start = 0;                // start time of the current file (ms)
+    unsigned long long rot_blocks = N_BLOCK_PER_FILE;
+    unsigned long long rot_mbytes = 0;
+    unsigned long long rot_secs = 0;
+    uint64_t max_blocks;
+    int precreate = 1;
+    hbool_t threadsafe = 0;
+    char comp[80] = "none";
+    int ncomp = 2;
+    int codec;
+    compressor_t inline_comp;               // synchronous mode
+    uint8_t *cbuf = NULL;
+    size_t csize = 0;
+    int32_t file_chan[N_STRP_CHANS_PER_X];  // channel set of the current file
+    int file_nbits = 4;                     // block nbits of the current file
+    int file_nbeams = 0;                    // block nbeams of the current file
+    int new_file;
+    FILE *manifest;
+    write_job_t *job;
+    const hdr_stripper_header_t *hdr;       // block being written
+    const uint8_t *data;
+    uint64_t blk_now;
+    unsigned long long trig_nblk = 0;
+    int trig_rate = 4;
+    char trigger[80];
+    char prefix[5];                         // histogram status key prefix
+    trig_ring_t ring;
+    int64_t slot = -1;
+    int nput;
 
-    /* Datasets */
-    hid_t h5file, h5data, h5time;
-    /* Dataspaces */
-    hid_t h5ds_data_file, h5ds_data_mem, h5ds_data_block, 
-          h5ds_time, h5ds_time_entry;
-    /* Dimensions */
-    hsize_t mem_dim[] = {MEM_DIM};    hsize_t file_dim[] = {FILE_DIM};
-    hsize_t time_dim[] = {TIME_DIM};  hsize_t block_dim[] = {BLOCK_DIM};
-    hsize_t time_entry_dim[] = {1};
-
-    /* The strategy for writing hdf5 files here is to build the entire file first
-       and then replace a chunk of the file as each block arrives and ready to 
-       be written. This is easy because once the size of the file is fixed, 
-       the number of blocks are set and the dataset does not need to be dynamically
-       expanded.
+    /* The strategy for writing hdf5 files here is to allocate the file for
+       the expected number of blocks first and then fill in a chunk of the
+       file as each block arrives and is ready to be written.  The data sets
+       only need to be resized if a file outgrows its allocation and when a
+       file is closed early.
     */
 
-    hsize_t dcnt[] = {DCNT};   // Number of blocks in each dimension
-    hsize_t dstd[] = {DSTD};   // Don't skip any points 
-    hsize_t dblk[] = {DBLK};   // Define block
- 
-    hsize_t tcnt[] = {TCNT};
-    hsize_t tstd[] = {TSTD};
-    hsize_t tblk[] = {TBLK};
-    herr_t status;
+    hashpipe_status_lock_safe(&st);
+    hgeti4(st.buf, "WRITPOOL", &depth);
+    hgets(st.buf, "WRITMODE", sizeof(mode), mode);
+    hgeti4(st.buf, "WRITQD", &qdepth);
+    hgets(st.buf, "WRITDIRS", sizeof(dirs), dirs);
+    hgetu8(st.buf, "WRITROTB", &rot_blocks);
+    hgetu8(st.buf, "WRITROTM", &rot_mbytes);
+    hgetu8(st.buf, "WRITROTS", &rot_secs);
+    hgeti4(st.buf, "WRITPREC", &precreate);
+    hgets(st.buf, "WRITCOMP", sizeof(comp), comp);
+    hgeti4(st.buf, "WRITCTHR", &ncomp);
+    hgetu8(st.buf, "TRIGNBLK", &trig_nblk);
+    hgeti4(st.buf, "TRIGRATE", &trig_rate);
+    hashpipe_status_unlock_safe(&st);
 
-    uint8_t *init_data;
-    init_data = (uint8_t *)calloc(MEM_DIM,sizeof(uint8_t));
+    codec = hdr_codec_parse(comp);
+    if (codec < 0){
+       hashpipe_warn(__FUNCTION__, "unknown WRITCOMP %s, not compressing", comp);
+       codec = HDR_CODEC_NONE;
+    }else if (codec != HDR_CODEC_NONE && !strcmp(mode, "raw")){
+       hashpipe_warn(__FUNCTION__, "WRITCOMP only applies to HDF5 mode");
+       codec = HDR_CODEC_NONE;
+    }else if (!hdr_codec_available(codec)){
+       hashpipe_warn(__FUNCTION__, "WRITCOMP %s is not available in this build", comp);
+       codec = HDR_CODEC_NONE;
+    }
+    if (ncomp < 1 || ncomp > MAX_COMPRESS_THREADS){
+       ncomp = ncomp < 1 ? 1 : MAX_COMPRESS_THREADS;
+    }
+    // Fewer than 2 ring blocks per block received would never catch up
+    trig_rate = trig_rate < 2 ? 2 : trig_rate;
 
-    uint64_t *times;
-    times = (uint64_t *)calloc(N_TIME_PER_FILE, sizeof(uint64_t));
+    /* Files rotate after rot_blocks blocks or rot_mbytes of block data,
+       whichever comes first (0 for no limit).  Files are preallocated for
+       max_blocks blocks, the smaller of the two limits in 4 bit blocks, or
+       N_BLOCK_PER_FILE if there is no limit, and grow as needed.
+    */
+    max_blocks = rot_blocks;
+    if (rot_mbytes > 0){
+       uint64_t mb_blocks = rot_mbytes*1024*1024 / N_BYTES_PER_STRP_BLOCK;
+       mb_blocks = mb_blocks > 0 ? mb_blocks : 1;
+       if (max_blocks == 0 || mb_blocks < max_blocks){
+          max_blocks = mb_blocks;
+       }
+    }
 
-    while (run_threads()){
-       
-       hashpipe_status_lock_safe(&st);
-       hputi4(st.buf, "WRITEIN", block_id);
-       hputs(st.buf, status_key, "waiting");
-       hputi8(st.buf, "WRITEMCNT", mcnt);
-       hashpipe_status_unlock_safe(&st);
-       sleep(1);
+    targets = (write_target_t *)calloc(MAX_WRITE_TARGETS, sizeof(write_target_t));
+    if (!targets){
+       hashpipe_error(__FUNCTION__, "error allocating write targets");
+       pthread_exit(NULL);
+    }
+    ntargets = parse_write_dirs(dirs, targets);
+
+    /* Without a thread-safe HDF5 library only one thread may make HDF5 calls.
+       Skip pre-creation and, with several targets, the per target I/O
+       threads.
+    */
+    H5is_library_threadsafe(&threadsafe);
+    if (strcmp(mode, "raw") && !threadsafe){
+       if (precreate){
+          hashpipe_warn(__FUNCTION__, "HDF5 is not thread-safe, disabling WRITPREC");
+          precreate = 0;
+       }
+       if (ntargets > 1 && depth > 0){
+          hashpipe_warn(__FUNCTION__, "HDF5 is not thread-safe, disabling WRITPOOL");
+          depth = 0;
+       }
+    }
 
-       /*Create a new file. Populate the header.*/
-       if (nblks == N_BLOCK_PER_FILE){
+    for (i=0; i<ntargets; i++){
+       if (block_writer_init(&targets[i].writer, &st, !strcmp(mode, "raw"), qdepth,
+                             targets[i].dir, max_blocks ? max_blocks : N_BLOCK_PER_FILE,
+                             precreate, codec) != HASHPIPE_OK){
+          hashpipe_error(__FUNCTION__, "error setting up %s writer", mode);
+          pthread_exit(NULL);
+       }
+       if (ntargets > 1){
+          sprintf(targets[i].writer.ns_key, "WRT%dNS", i);
+          sprintf(targets[i].writer.max_key, "WRT%dMAX", i);
+          snprintf(prefix, sizeof(prefix), "WR%d", i);
+          hdr_hist_register(&targets[i].writer.write_hist, prefix);
+       }else{
+          hdr_hist_register(&targets[i].writer.write_hist, "WRIT");
+       }
+       if (depth > 0 && write_pool_start(&targets[i].pool, depth, &targets[i].writer,
+                                         codec != HDR_CODEC_NONE ? ncomp : 0,
+                                         i*ncomp) != HASHPIPE_OK){
+          hashpipe_error(__FUNCTION__, "error allocating %d block write pool", depth);
+          pthread_exit(NULL);
+       }
+    }
 
-          /*Create a hdf5 file, set header, initialize a dataset and wait for data*/
-          sprintf(filename, "hera_volt_data_%lu.h5", (unsigned long)time(NULL));
-          printf("New file: %s\n\n",filename);
-          hid_t h5file = H5Fcreate(filename, H5F_ACC_TRUNC, 
-                                   H5P_DEFAULT, H5P_DEFAULT);
-          hdf5_header_t *header = initialize_header();
-          write_hdf5_header(header, h5file);
+    if (hdr_hist_publisher_start(&st) != HASHPIPE_OK){
+       pthread_exit(NULL);
+    }
 
-          h5ds_time      = H5Screate_simple(1,    time_dim, NULL);
-          h5ds_data_mem  = H5Screate_simple(MEM_DATA_RANK,  mem_dim,  NULL); 
-          h5ds_data_file = H5Screate_simple(FILE_DATA_RANK, file_dim, NULL);
+    if (codec != HDR_CODEC_NONE && depth == 0){
+       cbuf = (uint8_t *)malloc(N_BYTES_PER_STRP_BLOCK);
+       if (!cbuf || compressor_init(&inline_comp, &st, codec, 0) != HASHPIPE_OK){
+          hashpipe_error(__FUNCTION__, "error allocating compression buffers");
+          pthread_exit(NULL);
+       }
+    }
 
-          h5data = H5Dcreate(h5file, "data", H5T_STD_U8BE, h5ds_data_file,
-                             H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
-          status = H5Dwrite(h5data, H5T_NATIVE_UINT8, h5ds_data_mem, h5ds_data_file,
-                            H5P_DEFAULT, init_data);
+    memset(&ring, 0, sizeof(ring));
+    if (trig_nblk > 0 && trig_ring_init(&ring, trig_nblk) != HASHPIPE_OK){
+       hashpipe_error(__FUNCTION__, "error allocating %llu block trigger ring", trig_nblk);
+       pthread_exit(NULL);
+    }
+    if (ring.n){
+       hashpipe_status_lock_safe(&st);
+       hputi4(st.buf, "TRIGHUGE", ring.huge);
+       hashpipe_status_unlock_safe(&st);
+    }
 
-          h5time = H5Dcreate(h5file, "time", H5T_STD_U64BE, h5ds_time,
-                             H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
-          status = H5Dwrite(h5time, H5T_NATIVE_UINT64, H5S_ALL, H5S_ALL, 
-                            H5P_DEFAULT, times);
+    sprintf(filename, "%s/hera_volt_manifest.txt", targets[0].dir);
+    manifest = fopen(filename, "a");
+    if (!manifest){
+       hashpipe_warn(__FUNCTION__, "error opening %s", filename);
+    }
+    for (i=0; i<ntargets; i++){
+       targets[i].writer.manifest = manifest;
+    }
 
-          printf("Wrote init dataset to file\n");
+    hashpipe_status_lock_safe(&st);
+    hputi4(st.buf, "WRITNTGT", ntargets);
+    hashpipe_status_unlock_safe(&st);
 
-          status = H5Sclose(h5ds_data_file);
-          status = H5Sclose(h5ds_data_mem);
-          status = H5Sclose(h5ds_time);
-          status = H5Dclose(h5data);
-          status = H5Dclose(h5time);
-          status = H5Fclose(h5file);      
-          status = status;
+    hdr_chan_set_default(file_chan);
 
-          nblks = 0;
-       }
+    while (run_threads()){
+       
+       hashpipe_status_lock_safe(&st);
+       hputi4(st.buf, "WRITEIN", block_id);
+       hputs(st.buf, status_key, "waiting");
+       hputi8(st.buf, "WRITEMCNT", mcnt);
+       hashpipe_status_unlock_safe(&st);
 
        /*Wait for new block*/
        while ((rv=hdr_stripper_databuf_wait_filled(idb, block_id))!=HASHPIPE_OK){
@@ -150,60 +1241,204 @@ void *hdr_write_thread_run(hashpipe_thread_args_t *args){
              hashpipe_status_unlock_safe(&st);
              continue;
           }else{
-             hashpipe_error(__FUNCTION__, "error waiting for free databuf");
+             hashpipe_error(__FUNCTION__, "error waiting for filled databuf");
              pthread_exit(NULL);
              break;
           }
        }
 
-      /*Reopen hdf5 file and write the received block of data.*/
-      h5file = H5Fopen(filename, H5F_ACC_RDWR, H5P_DEFAULT);
-      h5data = H5Dopen(h5file, "data", H5P_DEFAULT);
-      h5time = H5Dopen(h5file, "time", H5P_DEFAULT);
+       hashpipe_status_lock_safe(&st);
+       hputs(st.buf, status_key, "writing");
+       hashpipe_status_unlock_safe(&st);
 
-      hsize_t doffset[4] = {0, 0, 0, nblks*N_TIME_PER_BLOCK};
-      hsize_t toffset[] = {nblks};
-      h5ds_data_block = H5Screate_simple(1, block_dim, NULL);
-      h5ds_time_entry = H5Screate_simple(1, time_entry_dim, NULL);
+      gettimeofday(&tv, NULL);
+      now = (uint64_t)(tv.tv_sec*1000) + (uint64_t)(tv.tv_usec/1000);
 
-      h5ds_data_file = H5Dget_space(h5data);
-      status = H5Sselect_hyperslab(h5ds_data_file, H5S_SELECT_SET, 
-                                   doffset, dstd, dcnt, dblk);
+      // In trigger mode, take a new trigger once the last one is written
+      if (ring.n && !ring.active){
+         hashpipe_status_lock_safe(&st);
+         *trigger = '\0';
+         hgets(st.buf, "TRIGGER", sizeof(trigger), trigger);
+         if (*trigger){
+            if (trig_ring_trigger(&ring, trigger) != HASHPIPE_OK){
+               hashpipe_warn(__FUNCTION__, "ignoring invalid TRIGGER \"%s\"", trigger);
+            }
+            hputs(st.buf, "TRIGGER", "");
+         }
+         hashpipe_status_unlock_safe(&st);
+      }
 
-      h5ds_time = H5Dget_space(h5time);
-      status = H5Sselect_hyperslab(h5ds_time, H5S_SELECT_SET, 
-                                   toffset, tstd, tcnt, tblk);
+      /*Write the received block or, in trigger mode, up to TRIGRATE blocks
+        of the current trigger from the ring.*/
+      for (nput = 0; ring.n ? nput < trig_rate && (slot = trig_ring_next(&ring)) >= 0
+                            : nput == 0; nput++){
+         if (ring.n){
+            hdr = &ring.hdr[slot];
+            data = ring.data + slot*N_BYTES_PER_STRP_BLOCK;
+            blk_now = ring.now[slot];
+         }else{
+            hdr = &idb->block[block_id].header;
+            data = (const uint8_t *)idb->block[block_id].data;
+            blk_now = now;
+         }
 
-      /*Copy data over*/
-      data = (uint64_t *)idb->block[block_id].data;
-      status = H5Dwrite(h5data, H5T_NATIVE_UINT8, h5ds_data_block, h5ds_data_file, 
-                        H5P_DEFAULT, data);
+         /*In pooled mode, start another file if the I/O thread could not
+           start the current one or lost it to a write error.*/
+         if (depth > 0 && target >= 0 &&
+             __atomic_load_n(&targets[target].pool.failed_file, __ATOMIC_RELAXED) == file_id){
+            target = -1;
+         }
 
-      gettimeofday(&tv, NULL);
-      now = (uint64_t)(tv.tv_sec*1000) + (uint64_t)(tv.tv_usec/1000);
-      status = H5Dwrite(h5time, H5T_NATIVE_UINT64, h5ds_time_entry, h5ds_time, 
-                        H5P_DEFAULT, &now);
-
-      status = H5Sclose(h5ds_data_file);
-      status = H5Sclose(h5ds_data_block);
-      status = H5Sclose(h5ds_time_entry);
-      status = H5Sclose(h5ds_time);
-      status = H5Dclose(h5data);
-      status = H5Dclose(h5time);
-      status = H5Fclose(h5file);
-
-      // Mark input block as free, output block as filled
+         /*Start a new file when the current one is full or old enough or the
+           recorded channel set, the sample size or the number of beams
+           changed.*/
+         nbytes = hdr_stripper_data_bytes(hdr);
+         new_file = target < 0 ||
+                    (rot_blocks > 0 && nblks >= rot_blocks) ||
+                    (rot_mbytes > 0 && file_bytes + nbytes > rot_mbytes*1024*1024 && nblks > 0) ||
+                    (rot_secs > 0 && blk_now - file_start >= rot_secs*1000) ||
+                    memcmp(file_chan, hdr->chan, sizeof(file_chan)) ||
+                    file_nbits != (hdr->nbits == 2 ? 2 : 4) ||
+                    file_nbeams != hdr->nbeams;
+         if (new_file){
+            target = pick_target(targets, ntargets, depth, target);
+            // Files can start faster than one a second, so the first mcnt
+            // keeps their names apart
+            snprintf(filename, sizeof(filename), "%s/hera_volt_%s_%lu_%lu",
+                     targets[target].dir, strcmp(mode, "raw") ? "data" : "raw",
+                     (unsigned long)time(NULL), (unsigned long)hdr->mcnt);
+            memcpy(file_chan, hdr->chan, sizeof(file_chan));
+            file_nbits = hdr->nbits == 2 ? 2 : 4;
+            file_nbeams = hdr->nbeams;
+            file_id++;
+            file_start = blk_now;
+            nblks = 0;
+            file_bytes = 0;
+
+            hashpipe_status_lock_safe(&st);
+            hputi4(st.buf, "WRITTGT", target);
+            hashpipe_status_unlock_safe(&st);
+         }
+         mcnt = hdr->mcnt;
+         nblks++;
+         file_bytes += nbytes;
+
+         if (depth > 0){
+            /*Copy the block into the pool and let the I/O thread write it.*/
+            job = write_pool_get(&targets[target].pool, &waited);
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            job->hdr = *hdr;
+            memcpy(job->data, data, nbytes);
+            job->now = blk_now;
+            job->new_file = new_file;
+            job->file_id = file_id;
+            if (new_file){
+               strcpy(job->filename, filename);
+            }
+            queued = write_pool_put(&targets[target].pool, 0);
+            clock_gettime(CLOCK_MONOTONIC, &stop);
+
+            for (hwm=0, i=0; i<ntargets; i++){
+               if (targets[i].pool.hwm > hwm){
+                  hwm = targets[i].pool.hwm;
+               }
+            }
+
+            hashpipe_status_lock_safe(&st);
+            hputi8(st.buf, "WRITCPNS", ELAPSED_NS(start, stop));
+            hputi4(st.buf, "WRITPLCT", queued);
+            hputi4(st.buf, "WRITPLHW", hwm);
+            if (waited){
+               hputs(st.buf, status_key, "poolfull");
+            }
+            hashpipe_status_unlock_safe(&st);
+         }else{
+            /*Write the block.*/
+            if (cbuf){
+               csize = compress_block(&inline_comp, data, nbytes, hdr->nbits, cbuf);
+            }
+            if (block_writer_put(&targets[target].writer, hdr,
+                                 csize ? (void *)cbuf : (const void *)data,
+                                 csize ? csize : nbytes, blk_now,
+                                 new_file ? filename : NULL) != HASHPIPE_OK){
+               // The block is lost.  If the file could not be started, try
+               // another one with the next block.
+               nblks--;
+               file_bytes -= nbytes;
+               if (!targets[target].writer.open){
+                  target = -1;
+               }
+               hashpipe_status_lock_safe(&st);
+               hputu8(st.buf, "WRITLOST", ++nlost + queued_lost);
+               hashpipe_status_unlock_safe(&st);
+            }
+         }
+
+         /*Blocks lost after being queued, by the I/O threads or by raw
+           writes that failed to complete, do not count towards rotation.*/
+         lost = targets_lost(targets, ntargets);
+         if (lost > queued_lost){
+            nblks = nblks > lost - queued_lost ? nblks - (lost - queued_lost) : 0;
+            file_bytes = file_bytes > (lost - queued_lost)*nbytes ?
+                         file_bytes - (lost - queued_lost)*nbytes : 0;
+            queued_lost = lost;
+            hashpipe_status_lock_safe(&st);
+            hputu8(st.buf, "WRITLOST", nlost + queued_lost);
+            hashpipe_status_unlock_safe(&st);
+         }
+      }
+
+      if (ring.n){
+         // Close the file of a trigger that has been written
+         if (!ring.active && target >= 0){
+            if (depth > 0){
+               write_pool_get(&targets[target].pool, &waited);
+               write_pool_put(&targets[target].pool, 1);
+            }else{
+               block_writer_close(&targets[target].writer);
+            }
+            target = -1;
+         }
+         trig_ring_insert(&ring, &idb->block[block_id].header,
+                          idb->block[block_id].data, now);
+
+         hashpipe_status_lock_safe(&st);
+         hputi4(st.buf, "TRIGACT", ring.active);
+         hputu8(st.buf, "TRIGNTRG", ring.ntrig);
+         hputu8(st.buf, "TRIGNWR", ring.nwritten);
+         hputu8(st.buf, "TRIGLOST", ring.nlost);
+         hputu8(st.buf, "TRIGSPAN", now - ring.now[ring.nin > ring.n ? ring.nin % ring.n : 0]);
+         hashpipe_status_unlock_safe(&st);
+      }
+
+      // Mark input block as free
       hdr_stripper_databuf_set_free(idb, block_id);
 
       // Setup for next block
       block_id = (block_id + 1)%idb->header.n_block;
-      printf("Number of blocks: %ld\n",nblks);
-      nblks++;
 
       /* Will exit if thread has been cancelled */
       pthread_testcancel();
     }
 
+    hdr_hist_publisher_stop();
+    // The writers add their last files to the manifest
+    for (i=0; i<ntargets; i++){
+       if (depth > 0){
+          write_pool_stop(&targets[i].pool);
+       }
+       block_writer_destroy(&targets[i].writer);
+    }
+    if (manifest){
+       fclose(manifest);
+    }
+    free(targets);
+    trig_ring_destroy(&ring);
+    if (cbuf){
+       free(inline_comp.tmp);
+       free(cbuf);
+    }
+
     // Thread success!
     return THREAD_OK;
 }
@@ -212,7 +1447,7 @@ void *hdr_write_thread_run(hashpipe_thread_args_t *args){
 hashpipe_thread_desc_t hdr_write_thread = {
     name: "hdr_write_thread",
     skey: "WRITESTAT",
-    init: NULL,
+    init: init,
     run: hdr_write_thread_run,
     ibuf_desc: {hdr_stripper_databuf_create},
     obuf_desc: {NULL} 
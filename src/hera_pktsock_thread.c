@@ -14,10 +14,15 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <errno.h>
+#include <linux/filter.h>
 
 #include "hashpipe.h"
 #include "hdr_databuf.h"
+#include "hdr_tpacket3.h"
+#include "hdr_stats.h"
+#include "hdr_trace.h"
 
 
 #define DEBUG_NET
@@ -30,10 +35,20 @@
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
 #endif
 
+#define ELAPSED_NS(start,stop) \
+  (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
+
 //#define PKTSOCK_BYTES_PER_FRAME (16384)
 //#define PKTSOCK_FRAMES_PER_BLOCK (8)
 //#define PKTSOCK_NBLOCKS (800)
 //#define PKTSOCK_NFRAMES (PKTSOCK_FRAMES_PER_BLOCK * PKTSOCK_NBLOCKS)
+
+// TPACKET_V3 ring geometry (used when NETTPVER is 3).  A V3 block holds as
+// many frames as fit, so these blocks hold at least PKTSOCK_FRAMES_PER_BLOCK
+// frames.  Partially filled blocks are retired after PKTSOCK_V3_RETIRE_MS.
+#define PKTSOCK_V3_BLOCK_SIZE (PKTSOCK_BYTES_PER_FRAME * PKTSOCK_FRAMES_PER_BLOCK)
+#define PKTSOCK_V3_RETIRE_MS  (4)
+
 #define PKTSOCK_BYTES_PER_FRAME (4864)
 #define PKTSOCK_FRAMES_PER_BLOCK (128)
 #define PKTSOCK_NBLOCKS (5000)
@@ -61,9 +76,202 @@ typedef struct {
     int t; // first time sample in the packet // formerly known as sub_block_i
     int c; // first channel in the packet
     int a; // antenna in the packet
-    int block_packet_counter[N_INPUT_BLOCKS];
+    int ant_lo; // first antenna owned by this capture shard
+    int ant_hi; // one past the last antenna owned by this capture shard
+    int shard; // this shard's index
+    uint32_t shard_bit; // this shard's bit in shard_sync's shard masks
+    // shard_sync.newest_seq when this shard started waiting for the other
+    // shards before an mcnt reset, and when that was
+    uint64_t stall_seq;
+    struct timespec stall_start;
+    // Packets of each block received by this shard, see hdr_pkt_bit
+    uint64_t block_pkt_map[N_INPUT_BLOCKS][N_PKT_MAP_WORDS];
 } block_info_t;
 
+// Capture can be spread over NETNSHRD threads (shards).  Each shard has its
+// own packet socket, all of which are joined to one PACKET_FANOUT group whose
+// BPF program steers packets to shards by antenna number.  A shard writes only
+// the antenna rows it owns, so all shards share the same output blocks.  Each
+// shard decides on its own when it is done with a block and the last shard to
+// finish a block marks it filled.
+//
+// Each block has a state word holding the generation the block is used for
+// (the block's sequence number, see block_seq) and the shards that still hold
+// it, so that both change together with one compare and swap.  A shard only
+// writes to a block while it holds it, and a block is only reused for a new
+// generation once every shard has released the previous one and the block
+// has been filled and freed (see slot_acquire).  A shard that still holds a
+// block SHARD_RELEASE_MS after another shard wants to reuse it, e.g. because
+// its F engines went quiet, is released from all blocks and left out of new
+// ones until it acquires a block again.
+//
+// The consumer takes the blocks in turn, so generations must be started in
+// order: only the generation after the newest one may be started.  A shard
+// that is behind the others (after a stall, or when it has been released)
+// joins generations that have already been started and skips the others.  A
+// shard that gets packets for blocks the others have already reached jumps to
+// them, and only a shard that is not behind (or whose peers have stalled for
+// SHARD_RELEASE_MS) resets to a new mcnt.
+//
+// A shard checks that it holds a block and writes to it between
+// shard_write_begin and shard_write_end.  A shard releasing others from their
+// blocks waits for their writes in progress to end before it marks any of the
+// blocks filled, so a released shard never writes to a filled block.
+#define MAX_NET_SHARDS 16
+#define SHARD_RELEASE_MS (100)
+// Generations further apart than this many blocks are not compared, as after
+// an mcnt reset
+#define SHARD_MAX_LAG (1 << 16)
+
+#define SLOT_SHARDS     ((1ULL << MAX_NET_SHARDS) - 1) // shards holding the block
+#define SLOT_FILLING    (1ULL << MAX_NET_SHARDS)       // being marked filled
+#define SLOT_SEQ_SHIFT  (MAX_NET_SHARDS + 1)
+#define SLOT_SEQ_NONE   (UINT64_MAX >> SLOT_SEQ_SHIFT) // never used
+#define SLOT_STATE(seq, shards) (((uint64_t)(seq) << SLOT_SEQ_SHIFT) | (shards))
+#define SLOT_SEQ(state) ((state) >> SLOT_SEQ_SHIFT)
+
+typedef struct {
+    int nshards;
+    int last_filled;
+    uint32_t live; // shards included in new generations
+    uint64_t newest_seq; // latest generation started
+    uint64_t slot_state[N_INPUT_BLOCKS]; // see SLOT_STATE
+    // Nonzero while the shard writes to a block, see shard_write_begin
+    struct {
+	uint32_t writing;
+    } HDR_STATS_ALIGNED shard_busy[MAX_NET_SHARDS];
+    uint64_t pkt_map[N_INPUT_BLOCKS][N_PKT_MAP_WORDS]; // packets received over all shards
+    // Fused mode recorded channel set (STRPCHAN).  A new set is stored by the
+    // status publisher, picked up by the last shard to finish a block and
+    // takes effect with the next use of that block, so all shards strip a
+    // block with the same set.  chan is guarded by the sequence lock
+    // chan_seq, which is odd while the publisher writes chan.
+    char chan_spec[80];
+    uint32_t chan_seq;
+    int32_t chan[N_STRP_CHANS_PER_X];
+    int32_t slot_chan[N_INPUT_BLOCKS][N_STRP_CHANS_PER_X];
+} shard_sync_t;
+
+static shard_sync_t shard_sync;
+
+// Output buffer of the capture shards.  In the default two stage mode
+// (hera_pktsock_thread) this is a hdr_input_databuf_t that gets all channels of
+// every packet.  In fused capture+strip mode (hera_pktsock_strip_thread) it is
+// a hdr_stripper_databuf_t that gets only the recorded channels, scattered
+// directly into stripper order, so that hdr_strip_thread is not needed.
+#if N_STRP_BLOCKS != N_INPUT_BLOCKS
+#error N_STRP_BLOCKS != N_INPUT_BLOCKS
+#endif
+
+typedef struct {
+    int fused;
+    hdr_input_databuf_t *idb;    // two stage mode
+    hdr_stripper_databuf_t *sdb; // fused mode
+} net_output_t;
+
+static inline int64_t *block_good_data(net_output_t *out, int block_i)
+{
+    return out->fused ? &out->sdb->block[block_i].header.good_data
+                      : &out->idb->block[block_i].header.good_data;
+}
+
+static inline uint64_t *block_mcnt(net_output_t *out, int block_i)
+{
+    return out->fused ? &out->sdb->block[block_i].header.mcnt
+                      : &out->idb->block[block_i].header.mcnt;
+}
+
+static inline int net_output_busywait_free(net_output_t *out, int block_i)
+{
+    return out->fused ? hdr_stripper_databuf_busywait_free(out->sdb, block_i)
+                      : hdr_input_databuf_busywait_free(out->idb, block_i);
+}
+
+static inline int net_output_set_filled(net_output_t *out, int block_i)
+{
+    return out->fused ? hdr_stripper_databuf_set_filled(out->sdb, block_i)
+                      : hdr_input_databuf_set_filled(out->idb, block_i);
+}
+
+// Packet socket of the net thread.  NETTPVER selects the hashpipe
+// TPACKET_V2 frame ring (the default) or a TPACKET_V3 block ring.
+typedef struct {
+    int tpacket_version;
+    struct hashpipe_pktsock ps;
+    struct hdr_tpacket3 tp3;
+} net_sock_t;
+
+// A capture shard: one packet socket and the bookkeeping for its antennas
+typedef struct {
+    int shard;
+    int ant_lo; // first antenna owned by this shard
+    int ant_hi; // one past the last antenna owned by this shard
+    int bindport;
+    net_sock_t sock;
+    block_info_t binfo;
+    net_output_t *out;
+    pthread_t thread;
+} net_shard_t;
+
+// Statistics of the capture shards.  The shards only update these counters
+// (see hdr_stats.h).  The status publisher puts them into the status buffer
+// every NETPUBMS ms (see net_stats_publish), so nothing on the packet path
+// takes the status buffer lock.
+typedef struct {
+    hdr_stat_t npkts;        // packets timed
+    hdr_stat_t wait_ns;      // total wait, recv and proc times
+    hdr_stat_t recv_ns;
+    hdr_stat_t proc_ns;
+    hdr_stat_t min_wait_ns;  // per packet minima and maxima since the last snapshot
+    hdr_stat_t min_recv_ns;
+    hdr_stat_t min_proc_ns;
+    hdr_stat_t max_wait_ns;
+    hdr_stat_t max_recv_ns;
+    hdr_stat_t max_proc_ns;
+    hdr_stat_t sock_pkts;    // packet socket totals
+    hdr_stat_t sock_drops;
+} HDR_STATS_ALIGNED net_shard_stats_t;
+
+// Per packet wait, recv and proc time histograms of a shard, published as
+// NWAT*, NREC* and NPRC* for all shards together (see hdr_stats.h)
+typedef struct {
+    hdr_hist_t wait;
+    hdr_hist_t recv;
+    hdr_hist_t proc;
+} HDR_STATS_ALIGNED net_shard_hists_t;
+
+// Statistics of the filled blocks, updated by the last shard to finish each
+// block
+typedef struct {
+    hdr_stat_t nblocks;      // blocks filled
+    hdr_stat_t block_i;      // last block filled
+    hdr_stat_t mcnt;         // mcnt of the last block filled
+    hdr_stat_t missed_fe;    // MISSEDFE of the last block filled
+    hdr_stat_t missed_pkts;  // total dropped packets
+    hdr_stat_t loss_grp;     // NETLOSSG and NETLOSSM since the last snapshot
+    hdr_stat_t loss_m;
+    hdr_stat_t xid;          // XID, stored by the publisher
+} HDR_STATS_ALIGNED net_block_stats_t;
+
+// Totals of the previous snapshot
+typedef struct {
+    uint64_t npkts;
+    uint64_t wait_ns;
+    uint64_t recv_ns;
+    uint64_t proc_ns;
+    uint64_t sock_pkts;
+    uint64_t sock_drops;
+    uint64_t missed_pkts;
+} net_snapshot_t;
+
+static net_shard_stats_t net_stats[MAX_NET_SHARDS];
+static net_shard_hists_t net_hists[MAX_NET_SHARDS];
+static net_block_stats_t block_stats;
+static net_snapshot_t net_snap;
+static hdr_stats_publisher_t net_pub;
+static int net_pub_ms = 100; // NETPUBMS
+static int net_pub_cpu = -1; // NETPUBCP
+
 static hashpipe_status_t *st_p;
 
 #if 0
@@ -88,20 +296,20 @@ static void print_block_packet_counter(block_info_t * binfo) {
     int i;
     for(i=0;i<N_INPUT_BLOCKS;i++) {
 	if(i == binfo->block_i) {
-		fprintf(stdout, "*%03d ", binfo->block_packet_counter[i]);	
+		fprintf(stdout, "*%03d ", hdr_pkt_map_count(binfo->block_pkt_map[i]));
 	} else {
-		fprintf(stdout, " %03d ", binfo->block_packet_counter[i]);	
+		fprintf(stdout, " %03d ", hdr_pkt_map_count(binfo->block_pkt_map[i]));
 	}
     }
     fprintf(stdout, "\n");
 }
 
-static void print_ring_mcnts(hdr_input_databuf_t *hdr_input_databuf_p) {
+static void print_ring_mcnts(net_output_t *out) {
 
     int i;
 
     for(i=0; i < N_INPUT_BLOCKS; i++) {
-	printf("block %d mcnt %012lx\n", i, hdr_input_databuf_p->block[i].header.mcnt);
+	printf("block %d mcnt %012lx\n", i, *block_mcnt(out, i));
     }
 }
 #endif // DIE_ON_OUT_OF_SEQ_FILL
@@ -112,6 +320,38 @@ static inline int block_for_mcnt(uint64_t mcnt)
     return ((mcnt / TIME_DEMUX) / N_TIME_PER_BLOCK) % N_INPUT_BLOCKS;
 }
 
+// Returns the sequence number of the block holding mcnt, which identifies the
+// generation of physical block block_for_mcnt(mcnt) in shard_sync
+static inline uint64_t block_seq(uint64_t mcnt)
+{
+    return (mcnt / TIME_DEMUX) / N_TIME_PER_BLOCK;
+}
+
+// Returns nonzero if the shard with bit shard_bit holds the physical block of
+// mcnt for mcnt's generation, i.e. may write mcnt's data to it
+static inline int shard_holds(uint64_t mcnt, uint32_t shard_bit)
+{
+    uint64_t s = __atomic_load_n(&shard_sync.slot_state[block_for_mcnt(mcnt)],
+				 __ATOMIC_ACQUIRE);
+
+    return SLOT_SEQ(s) == block_seq(mcnt) && (s & shard_bit);
+}
+
+// Starts a write of the calling shard, which must then check that it (still)
+// holds the block before writing to it.  The fence pairs with the one in
+// shards_release: either the shard sees that it was released or the
+// releasing shard sees the write in progress.
+static inline void shard_write_begin(const block_info_t *binfo)
+{
+    __atomic_store_n(&shard_sync.shard_busy[binfo->shard].writing, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void shard_write_end(const block_info_t *binfo)
+{
+    __atomic_store_n(&shard_sync.shard_busy[binfo->shard].writing, 0, __ATOMIC_RELEASE);
+}
+
 #ifdef LOG_MCNTS
 #define MAX_MCNT_LOG (1024*1024)
 //static uint64_t mcnt_log[MAX_MCNT_LOG];
@@ -142,7 +382,8 @@ void dump_mcnt_log(int xid)
 }
 #endif
 
-static inline void get_header (unsigned char *p_frame, packet_header_t * pkt_header)
+// p_payload points to the UDP payload (i.e. the 8 byte F engine header)
+static inline void get_header (const unsigned char *p_payload, packet_header_t * pkt_header)
 {
 #ifdef TIMING_TEST
     static int pkt_counter=0;
@@ -153,7 +394,7 @@ static inline void get_header (unsigned char *p_frame, packet_header_t * pkt_hea
     //pkt_counter++;
 #else
     uint64_t raw_header;
-    raw_header = be64toh(*(unsigned long long *)PKT_UDP_DATA(p_frame));
+    raw_header = be64toh(*(unsigned long long *)p_payload);
     // raw header contains value of first time sample, not mcnt, as defined in this code
     //pkt_header->time        = (raw_header >> 27) & ((1L<<37)-1);
     //pkt_header->mcnt        = pkt_header->time >> 5;
@@ -179,11 +420,11 @@ static inline void get_header (unsigned char *p_frame, packet_header_t * pkt_hea
 }
 
 #ifdef DIE_ON_OUT_OF_SEQ_FILL
-static void die(hdr_input_databuf_t *hdr_input_databuf_p, block_info_t *binfo)
+static void die(net_output_t *out, block_info_t *binfo)
 {
     print_block_info(binfo);
     print_block_packet_counter(binfo);
-    print_ring_mcnts(hdr_input_databuf_p);
+    print_ring_mcnts(out);
 #ifdef LOG_MCNTS
     dump_mcnt_log();
 #endif
@@ -191,79 +432,148 @@ static void die(hdr_input_databuf_t *hdr_input_databuf_p, block_info_t *binfo)
 }
 #endif
 
-// This sets the "current" block to be marked as filled.  The current block is
-// the block corresponding to binfo->mcnt_start.  Returns mcnt of the block
-// being marked filled.
-static uint64_t set_block_filled(hdr_input_databuf_t *hdr_input_databuf_p, block_info_t *binfo)
+// Stores the current channel set for the next use of block_i.  Only called by
+// the last shard to finish block_i, before the block is marked filled.
+static void update_chan_set(int block_i)
 {
-    static int last_filled = -1;
+    uint32_t seq;
 
-    uint32_t block_missed_pkt_cnt=N_PACKETS_PER_BLOCK, block_missed_mod_cnt, block_missed_feng, missed_pkt_cnt=0;
+    do {
+	seq = __atomic_load_n(&shard_sync.chan_seq, __ATOMIC_ACQUIRE);
+	memcpy(shard_sync.slot_chan[block_i], shard_sync.chan, sizeof(shard_sync.chan));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while((seq & 1) || seq != __atomic_load_n(&shard_sync.chan_seq, __ATOMIC_RELAXED));
+}
 
-    uint32_t block_i = block_for_mcnt(binfo->mcnt_start);
+// Called by the status publisher: reads STRPCHAN and, if it changed and is
+// valid, stores the new channel set
+static void publish_chan_set(char *buf)
+{
+    char spec[sizeof(shard_sync.chan_spec)];
+    int32_t chan[N_STRP_CHANS_PER_X];
 
-    // Validate that we're filling blocks in the proper sequence
-    last_filled = (last_filled+1) % N_INPUT_BLOCKS;
-    if(last_filled != block_i) {
-	printf("block %d being marked filled, but expected block %d!\n", block_i, last_filled);
+    strcpy(spec, shard_sync.chan_spec);
+    hgets(buf, STRPCHAN_KEY, sizeof(spec), spec);
+    if(!strcmp(spec, shard_sync.chan_spec)) {
+	return;
+    }
+    if(hdr_chan_set_parse(spec, chan) == HASHPIPE_OK) {
+	strcpy(shard_sync.chan_spec, spec);
+	__atomic_store_n(&shard_sync.chan_seq, shard_sync.chan_seq+1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(shard_sync.chan, chan, sizeof(chan));
+	__atomic_store_n(&shard_sync.chan_seq, shard_sync.chan_seq+1, __ATOMIC_RELEASE);
+    } else {
+	hashpipe_warn(__FUNCTION__, "ignoring invalid %s \"%s\"", STRPCHAN_KEY, spec);
+    }
+    hputs(buf, STRPCHAN_KEY, shard_sync.chan_spec);
+}
 
-#ifdef DIE_ON_OUT_OF_SEQ_FILL
-	die(hdr_input_databuf_p, binfo);
+// Status of the packets missing from a block's packet presence map
+typedef struct {
+    int npkts;        // packets missing
+    int ngrps;        // antenna groups missing all their packets
+    uint64_t grp_mask; // bit g set if antenna group g missed any packets
+    uint64_t m_mask;   // bit m set if any packets at m are missing
+} pkt_loss_t;
+
+#if N_PKT_AGRPS > 64 || Nm > 64
+#error pkt_loss_t masks need N_PKT_AGRPS <= 64 and Nm <= 64
 #endif
+
+static void pkt_loss_compute(const uint64_t *map, pkt_loss_t *loss)
+{
+    int m, g, cp;
+    int nlost;
+
+    memset(loss, 0, sizeof(*loss));
+    loss->npkts = N_PACKETS_PER_BLOCK - hdr_pkt_map_count(map);
+    if(loss->npkts == 0) {
+	return;
+    }
+    for(g=0; g<N_PKT_AGRPS; g++) {
+	nlost = 0;
+	for(m=0; m<Nm; m++) {
+	    for(cp=0; cp<N_PKT_CPKTS; cp++) {
+		if(!hdr_pkt_map_test(map, hdr_pkt_bit(m, g, cp))) {
+		    nlost++;
+		    loss->m_mask |= 1ULL << m;
+		}
+	    }
+	}
+	if(nlost) {
+	    loss->grp_mask |= 1ULL << g;
+	}
+	if(nlost == Nm*N_PKT_CPKTS) {
+	    loss->ngrps++;
+	}
     }
+}
 
-    // Validate that block_i matches binfo->block_i
-    if(block_i != binfo->block_i) {
-	hashpipe_warn(__FUNCTION__,
-		"block_i for binfo's mcnt (%d) != binfo's block_i (%d)",
-		block_i, binfo->block_i);
+// Marks block_i filled once no shard holds it any more.  Called by the shard
+// that released the block last (or released the last shards from it), which
+// set SLOT_FILLING.  binfo is that shard's.
+static void block_fill(net_output_t *out, block_info_t *binfo, int block_i)
+{
+    uint64_t *pkt_map;
+    uint64_t mcnt = *block_mcnt(out, block_i);
+    pkt_loss_t loss;
+
+    // Hand the map on with the block and rearm it for the next generation of
+    // this block.  No shard can touch it until the block has been filled and
+    // freed.
+    pkt_map = out->fused ? out->sdb->block[block_i].header.pkt_map
+                         : out->idb->block[block_i].header.pkt_map;
+    memcpy(pkt_map, shard_sync.pkt_map[block_i], sizeof(shard_sync.pkt_map[block_i]));
+    hdr_pkt_map_clear(shard_sync.pkt_map[block_i]);
+    pkt_loss_compute(pkt_map, &loss);
+
+    // Validate that we're filling blocks in the proper sequence
+    shard_sync.last_filled = (shard_sync.last_filled+1) % N_INPUT_BLOCKS;
+    if(shard_sync.last_filled != block_i) {
+	printf("block %d being marked filled, but expected block %d!\n", block_i, shard_sync.last_filled);
+
+#ifdef DIE_ON_OUT_OF_SEQ_FILL
+	die(out, binfo);
+#endif
     }
 #ifdef LOG_MCNTS
-    filled_packets_counted += binfo->block_packet_counter[block_i];
+    filled_packets_counted += N_PACKETS_PER_BLOCK - loss.npkts;
 #endif
 
-    // If all packets are accounted for, mark this block as good
-    if(binfo->block_packet_counter[block_i] == N_PACKETS_PER_BLOCK) {
-	hdr_input_databuf_p->block[block_i].header.good_data = 1;
+    // If all packets are accounted for, mark this block as good.  Otherwise,
+    // in fused mode, zero the stale data of the missing packets (in two stage
+    // mode the stripper does that).
+    if(loss.npkts == 0) {
+	*block_good_data(out, block_i) = 1;
+    } else if(out->fused) {
+	hdr_stripper_block_zero_missing(&out->sdb->block[block_i]);
+    }
+
+    // Pick up a new recorded channel set for the next use of this block
+    if(out->fused) {
+	update_chan_set(block_i);
     }
 
     // Set the block as filled
-    if(hdr_input_databuf_set_filled(hdr_input_databuf_p, block_i) != HASHPIPE_OK) {
+    if(net_output_set_filled(out, block_i) != HASHPIPE_OK) {
 	hashpipe_error(__FUNCTION__, "error waiting for databuf filled call");
 	pthread_exit(NULL);
     }
 
-    // Calculate missing packets.
-    block_missed_pkt_cnt = N_PACKETS_PER_BLOCK - binfo->block_packet_counter[block_i];
-    //fprintf(stderr, "Packets in block %d: %d, N_PACKETS_PER_BLOCK: %d, N_PACKETS_PER_BLOCK_PER_F: %d,  mod_cnt: %d\n", block_i, binfo->block_packet_counter[block_i], N_PACKETS_PER_BLOCK,  N_PACKETS_PER_BLOCK_PER_F, block_missed_pkt_cnt % N_PACKETS_PER_BLOCK_PER_F);
-    // If we missed more than N_PACKETS_PER_BLOCK_PER_F, then assume we
-    // are missing one or more F engines.  Any missed packets beyond an
-    // integer multiple of N_PACKETS_PER_BLOCK_PER_F will be considered
-    // as dropped packets.
-    block_missed_feng    = N_INPUTS_PER_PACKET / 2 * block_missed_pkt_cnt / N_PACKETS_PER_BLOCK_PER_F;
-    block_missed_mod_cnt = block_missed_pkt_cnt % N_PACKETS_PER_BLOCK_PER_F;
-
-    // Reinitialize our XID to -1 (unknown until read from status buffer)
-    binfo->self_xid = -1;
-
-    // Update status buffer
-    hashpipe_status_lock_busywait_safe(st_p);
-    hputu4(st_p->buf, "NETBKOUT", block_i);
-    hputu4(st_p->buf, "MISSEDFE", block_missed_feng);
-    if(block_missed_mod_cnt) {
-        //fprintf(stdout, "Expected %d packets, Got %d\n", N_PACKETS_PER_BLOCK, binfo->block_packet_counter[block_i]);
-	// Increment MISSEDPK by number of missed packets for this block
-	hgetu4(st_p->buf, "MISSEDPK", &missed_pkt_cnt);
-	missed_pkt_cnt += block_missed_mod_cnt;
-	hputu4(st_p->buf, "MISSEDPK", missed_pkt_cnt);
-    //  fprintf(stderr, "got %d packets instead of %d\n",
-    //	    binfo->block_packet_counter[block_i], N_PACKETS_PER_BLOCK);
-    }
-    // Update our XID from status buffer
-    hgeti4(st_p->buf, "XID", &binfo->self_xid);
-    hashpipe_status_unlock_safe(st_p);
-
-    return binfo->mcnt_start;
+    // Update block statistics.  Antenna groups that missed all of their
+    // packets count as missing F engine antennas (MISSEDFE), any other
+    // missing packets as dropped packets (MISSEDPK).
+    hdr_stat_set(&block_stats.block_i, block_i);
+    hdr_stat_set(&block_stats.mcnt, mcnt);
+    hdr_stat_set(&block_stats.missed_fe, loss.ngrps*N_ANTS_PER_PACKET);
+    hdr_stat_add(&block_stats.missed_pkts, loss.npkts - loss.ngrps*Nm*N_PKT_CPKTS);
+    hdr_stat_or(&block_stats.loss_grp, loss.grp_mask);
+    hdr_stat_or(&block_stats.loss_m, loss.m_mask);
+    hdr_stat_add(&block_stats.nblocks, 1);
+
+    // Update our XID, as last read from the status buffer
+    binfo->self_xid = (int32_t)hdr_stat_get(&block_stats.xid);
 }
 
 static inline int calc_block_indexes(block_info_t *binfo, packet_header_t * pkt_header)
@@ -273,6 +583,11 @@ static inline int calc_block_indexes(block_info_t *binfo, packet_header_t * pkt_
 		"current packet Antenna ID %u out of range (0-%d)",
 		pkt_header->ant, Na-1);
 	return -1;
+    } else if(pkt_header->ant < binfo->ant_lo || pkt_header->ant >= binfo->ant_hi) {
+	hashpipe_error(__FUNCTION__,
+		"current packet Antenna ID %u not owned by this shard (%d-%d)",
+		pkt_header->ant, binfo->ant_lo, binfo->ant_hi-1);
+	return -1;
 // HERA TODO
 //    } else if(pkt_header->chan != binfo->self_xid && binfo->self_xid != -1) {
 //	hashpipe_error(__FUNCTION__,
@@ -298,21 +613,301 @@ static inline int calc_block_indexes(block_info_t *binfo, packet_header_t * pkt_
 
 // Initialize a block by clearing its "good data" flag and saving the first
 // (i.e. earliest) mcnt of the block.  Note that mcnt does not have to be a
-// multiple of Nm (number of mcnts per block).  In theory, the block's data
-// could be cleared as well, but that takes time and is largely unnecessary in
-// a properly functionong system.
-static inline void initialize_block(hdr_input_databuf_t * hdr_input_databuf_p, uint64_t mcnt)
+// multiple of Nm (number of mcnts per block).  The block's data are not
+// cleared.  Instead the packets received are recorded in the block's presence
+// map and the data of missing packets are zeroed once the block has been
+// filled (see hdr_pkt_bit).  Shards starting the same generation of a block
+// at once may both initialize it (see slot_acquire), so callers must pass the
+// block's starting mcnt to keep this idempotent.
+static inline void initialize_block(net_output_t * out, uint64_t mcnt)
 {
     int block_i = block_for_mcnt(mcnt);
 
-    hdr_input_databuf_p->block[block_i].header.good_data = 0;
+    *block_good_data(out, block_i) = 0;
     // Round pkt_mcnt down to nearest multiple of N_TIME_PER_BLOCK
-    hdr_input_databuf_p->block[block_i].header.mcnt = mcnt - (mcnt%N_TIME_PER_BLOCK);
+    *block_mcnt(out, block_i) = mcnt - (mcnt%N_TIME_PER_BLOCK);
+    if(out->fused) {
+	memcpy(out->sdb->block[block_i].header.chan, shard_sync.slot_chan[block_i],
+	       sizeof(shard_sync.slot_chan[block_i]));
+	out->sdb->block[block_i].header.nbits = 4;
+	out->sdb->block[block_i].header.nbeams = 0;
+    }
+}
+
+// Removes the shards in shard_mask from block_i, if it holds generation seq
+// (or any generation if seq is SLOT_SEQ_NONE).  Returns nonzero if no shard
+// holds the block after that, in which case SLOT_FILLING has been set and the
+// caller must call slot_fill.
+static int slot_clear(int block_i, uint64_t seq, uint64_t shard_mask)
+{
+    uint64_t *p = &shard_sync.slot_state[block_i];
+    uint64_t s = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+    uint64_t n;
+
+    do {
+	if(!(s & shard_mask) || (seq != SLOT_SEQ_NONE && SLOT_SEQ(s) != seq)) {
+	    return 0;
+	}
+	n = s & ~shard_mask;
+	if(!(n & SLOT_SHARDS)) {
+	    n |= SLOT_FILLING;
+	}
+    } while(!__atomic_compare_exchange_n(p, &s, n, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    return (n & SLOT_FILLING) != 0;
+}
+
+// Marks block_i filled after slot_clear set SLOT_FILLING
+static void slot_fill(net_output_t *out, block_info_t *binfo, int block_i)
+{
+    uint64_t *p = &shard_sync.slot_state[block_i];
+
+    block_fill(out, binfo, block_i);
+    __atomic_store_n(p, SLOT_STATE(SLOT_SEQ(__atomic_load_n(p, __ATOMIC_RELAXED)), 0),
+		     __ATOMIC_RELEASE);
+}
+
+// Releases the shards in shard_mask from block_i, if it holds generation seq
+// (or any generation if seq is SLOT_SEQ_NONE).  If no shard holds the block
+// after that, it is marked filled.  binfo is the calling shard's, which must
+// not be writing, and shard_mask must not hold other shards.
+static void slot_release(net_output_t *out, block_info_t *binfo, int block_i,
+	uint64_t seq, uint64_t shard_mask)
+{
+    if(slot_clear(block_i, seq, shard_mask)) {
+	slot_fill(out, binfo, block_i);
+    }
+}
+
+// Releases the shards in shard_mask from all blocks, oldest first starting
+// with block_i, and leaves them out of new generations.  The blocks no shard
+// holds any more are marked filled once the released shards' writes in
+// progress have ended.
+static void shards_release(net_output_t *out, block_info_t *binfo, int block_i,
+	uint64_t shard_mask)
+{
+    int fill[N_INPUT_BLOCKS];
+    int i;
+
+    hashpipe_warn(__FUNCTION__,
+	    "releasing capture shards 0x%lx, which held block %d for over %d ms",
+	    shard_mask, block_i, SHARD_RELEASE_MS);
+    __atomic_fetch_and(&shard_sync.live, ~(uint32_t)shard_mask, __ATOMIC_RELAXED);
+    for(i=0; i<N_INPUT_BLOCKS; i++) {
+	fill[i] = slot_clear((block_i + i) % N_INPUT_BLOCKS, SLOT_SEQ_NONE, shard_mask);
+    }
+
+    // Pairs with the fence in shard_write_begin
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for(i=0; i<shard_sync.nshards; i++) {
+	if(shard_mask & (1u << i)) {
+	    while(__atomic_load_n(&shard_sync.shard_busy[i].writing, __ATOMIC_ACQUIRE)) {
+		_mm_pause();
+	    }
+	}
+    }
+
+    for(i=0; i<N_INPUT_BLOCKS; i++) {
+	if(fill[i]) {
+	    slot_fill(out, binfo, (block_i + i) % N_INPUT_BLOCKS);
+	}
+    }
+}
+
+// Acquires the block starting at mcnt.  If another shard has already started
+// this generation of the block, the calling shard joins it.  Otherwise it
+// waits until all shards have released the previous generation and the block
+// has been filled and freed, initializes the block and starts the generation.
+// Shards that hold the previous generation for more than SHARD_RELEASE_MS are
+// released.  Returns nonzero if the calling shard holds the block, zero if the
+// generation was filled without it or skipped, or the thread is to stop.
+static int slot_acquire(net_output_t *out, block_info_t *binfo, uint64_t mcnt)
+{
+    int block_i = block_for_mcnt(mcnt);
+    uint64_t *p = &shard_sync.slot_state[block_i];
+    uint64_t seq = block_seq(mcnt);
+    uint64_t bit = binfo->shard_bit;
+    struct timespec start = {0}, now;
+    int waiting = 0;
+    uint64_t s;
+
+    s = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+    while(run_threads()) {
+	if(SLOT_SEQ(s) == seq) {
+	    if(s & bit) {
+		return 1;
+	    }
+	    if(!(s & SLOT_SHARDS)) {
+		return 0;
+	    }
+	    if(__atomic_compare_exchange_n(p, &s, s | bit, 0,
+					   __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return 1;
+	    }
+	    continue;
+	}
+
+	// If the block is already used for a later generation, or a later
+	// generation has been started elsewhere, we are behind.  Skip the
+	// block, without holding up its later generation.
+	if(SLOT_SEQ(s) != SLOT_SEQ_NONE && SLOT_SEQ(s) - seq - 1 < SHARD_MAX_LAG) {
+	    slot_release(out, binfo, block_i, SLOT_SEQ(s), bit);
+	    return 0;
+	}
+	if(__atomic_load_n(&shard_sync.newest_seq, __ATOMIC_RELAXED) - seq < SHARD_MAX_LAG) {
+	    return 0;
+	}
+
+	if(!(s & (SLOT_SHARDS | SLOT_FILLING))) {
+	    // The previous generation has been marked filled.  Wait (hopefully
+	    // not long!) for it to be freed.
+	    if(net_output_busywait_free(out, block_i) != HASHPIPE_OK) {
+		if (errno == EINTR) {
+		    // Interrupted by signal, return -1
+		    hashpipe_error(__FUNCTION__, "interrupted by signal waiting for free databuf");
+		    pthread_exit(NULL);
+		} else {
+		    hashpipe_error(__FUNCTION__, "error waiting for free databuf");
+		    pthread_exit(NULL);
+		}
+	    }
+	    // The block is initialized before the generation is started, so
+	    // shards that join it find it initialized.  Shards starting the
+	    // same generation at once initialize it the same way.  A shard that
+	    // has been released takes part in new generations again.
+	    initialize_block(out, mcnt);
+	    __atomic_fetch_or(&shard_sync.live, binfo->shard_bit, __ATOMIC_RELAXED);
+	    if(__atomic_compare_exchange_n(p, &s,
+		    SLOT_STATE(seq, __atomic_load_n(&shard_sync.live, __ATOMIC_RELAXED) | bit),
+		    0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		hdr_stat_max(&shard_sync.newest_seq, seq);
+		return 1;
+	    }
+	    continue;
+	}
+
+	// Another generation is still held (or being marked filled)
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if(!waiting) {
+	    start = now;
+	    waiting = 1;
+	} else if((s & SLOT_SHARDS)
+	       && ELAPSED_NS(start, now) > (int64_t)SHARD_RELEASE_MS*1000*1000) {
+	    shards_release(out, binfo, block_i, s & SLOT_SHARDS);
+	    waiting = 0;
+	}
+	s = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+    }
+    return 0;
+}
+
+// Moves a block that the calling shard holds on to the generation starting at
+// mcnt after an mcnt reset, without marking it filled.  Acquires the block
+// instead if the shard does not hold it any more.  Returns nonzero if the
+// calling shard holds the block.
+static int slot_retarget(net_output_t *out, block_info_t *binfo, uint64_t mcnt)
+{
+    int block_i = block_for_mcnt(mcnt);
+    uint64_t *p = &shard_sync.slot_state[block_i];
+    uint64_t seq = block_seq(mcnt);
+    uint64_t s = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+
+    while(SLOT_SEQ(s) != seq && (s & binfo->shard_bit)) {
+	initialize_block(out, mcnt);
+	if(__atomic_compare_exchange_n(p, &s,
+		SLOT_STATE(seq, __atomic_load_n(&shard_sync.live, __ATOMIC_RELAXED)
+				| binfo->shard_bit),
+		0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	    // Drop the packets of the old generation.  After an mcnt reset the
+	    // new generations are the latest, even if they are earlier.
+	    hdr_pkt_map_clear(shard_sync.pkt_map[block_i]);
+	    hdr_stat_set(&shard_sync.newest_seq, seq);
+	    return 1;
+	}
+    }
+    return slot_acquire(out, binfo, mcnt);
+}
+
+// This finishes this shard's part of the "current" block.  The current block
+// is the block corresponding to binfo->mcnt_start.  If this is the last shard
+// to finish the block, the block is marked as filled.  Returns mcnt of the
+// block being finished.
+static uint64_t set_block_filled(net_output_t *out, block_info_t *binfo)
+{
+    int i;
+
+    uint32_t block_i = block_for_mcnt(binfo->mcnt_start);
+
+    // Validate that block_i matches binfo->block_i
+    if(block_i != binfo->block_i) {
+	hashpipe_warn(__FUNCTION__,
+		"block_i for binfo's mcnt (%d) != binfo's block_i (%d)",
+		block_i, binfo->block_i);
+    }
+
+    // Nothing to do if this shard has been released from the block
+    shard_write_begin(binfo);
+    if(!shard_holds(binfo->mcnt_start, binfo->shard_bit)) {
+	shard_write_end(binfo);
+	return binfo->mcnt_start;
+    }
+
+    // Add our packets to the block's presence map and release the block,
+    // marking it filled if we are the last shard to release it
+    for(i=0; i<N_PKT_MAP_WORDS; i++) {
+	if(binfo->block_pkt_map[block_i][i]) {
+	    __atomic_fetch_or(&shard_sync.pkt_map[block_i][i],
+		    binfo->block_pkt_map[block_i][i], __ATOMIC_RELAXED);
+	}
+    }
+    shard_write_end(binfo);
+    slot_release(out, binfo, block_i, block_seq(binfo->mcnt_start), binfo->shard_bit);
+
+    return binfo->mcnt_start;
+}
+
+// Moves a shard that is behind the others on to the blocks starting with
+// generation seq, finishing its part of the blocks it leaves.
+static void shard_catch_up(net_output_t *out, block_info_t *binfo, uint64_t seq)
+{
+    int i;
+
+    for(i=0; i<2; i++) {
+	set_block_filled(out, binfo);
+	hdr_pkt_map_clear(binfo->block_pkt_map[binfo->block_i]);
+	binfo->mcnt_start += N_TIME_PER_BLOCK*TIME_DEMUX;
+	binfo->block_i = (binfo->block_i + 1) % N_INPUT_BLOCKS;
+    }
+    binfo->mcnt_start = seq*N_TIME_PER_BLOCK*TIME_DEMUX;
+    binfo->mcnt_log_late = binfo->mcnt_start + N_TIME_PER_BLOCK*TIME_DEMUX;
+    binfo->block_i = block_for_mcnt(binfo->mcnt_start);
+    hdr_pkt_map_clear(binfo->block_pkt_map[binfo->block_i]);
+    hdr_pkt_map_clear(binfo->block_pkt_map[(binfo->block_i+1)%N_INPUT_BLOCKS]);
+    binfo->out_of_seq_cnt = 0;
+    binfo->stall_seq = SLOT_SEQ_NONE;
+    slot_acquire(out, binfo, binfo->mcnt_start);
+    slot_acquire(out, binfo, binfo->mcnt_start+N_TIME_PER_BLOCK*TIME_DEMUX);
+}
+
+// Returns nonzero if no new generation has been started for SHARD_RELEASE_MS
+// since the calling shard first asked (since its last catch up or reset)
+static int shards_stalled(block_info_t *binfo)
+{
+    uint64_t newest = __atomic_load_n(&shard_sync.newest_seq, __ATOMIC_RELAXED);
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if(binfo->stall_seq != newest) {
+	binfo->stall_seq = newest;
+	binfo->stall_start = now;
+	return 0;
+    }
+    return ELAPSED_NS(binfo->stall_start, now) > (int64_t)SHARD_RELEASE_MS*1000*1000;
 }
 
 // This function must be called once and only once per block_info structure!
 // Subsequent calls are no-ops.
-static inline void initialize_block_info(block_info_t * binfo)
+static inline void initialize_block_info(block_info_t * binfo, int shard, int ant_lo, int ant_hi)
 {
     int i;
 
@@ -321,8 +916,13 @@ static inline void initialize_block_info(block_info_t * binfo)
 	return;
     }
 
+    binfo->ant_lo = ant_lo;
+    binfo->ant_hi = ant_hi;
+    binfo->shard = shard;
+    binfo->shard_bit = 1u << shard;
+
     for(i = 0; i < N_INPUT_BLOCKS; i++) {
-	binfo->block_packet_counter[i] = 0;
+	hdr_pkt_map_clear(binfo->block_pkt_map[i]);
     }
 
     // Initialize our XID to -1 (unknown until read from status buffer)
@@ -338,19 +938,45 @@ static inline void initialize_block_info(block_info_t * binfo)
     binfo->block_i = 0;
 
     binfo->out_of_seq_cnt = 0;
+    binfo->stall_seq = SLOT_SEQ_NONE;
     binfo->initialized = 1;
 }
 
+// Copies the recorded channels (chan[0] to chan[Nsc-1] of the X engine's
+// channels) of a packet's antennas into a stripper block.  Within the packet
+// each antenna's data are ordered (c,t,p), so for each (c,p) the Nt time
+// samples are gathered into one contiguous run of the stripper block.
+static inline void strip_packet(uint8_t *dest, const int32_t *chan,
+	block_info_t *binfo, const uint8_t *src)
+{
+    int i, c, t, p;
+    int pc; // channel within packet
+
+    for(i=0; i<N_ANTS_PER_PACKET; i++) {
+	for(c=0; c<Nsc; c++) {
+	    pc = chan[c] - binfo->c;
+	    if(pc < 0 || pc >= N_CHAN_PER_PACKET) {
+		continue;
+	    }
+	    for(p=0; p<Np; p++) {
+		for(t=0; t<Nt; t++) {
+		    dest[hdr_stripper_databuf_data_idx8(binfo->m, binfo->a+i, p, c, t)] =
+			src[(i*N_CHAN_PER_PACKET + pc)*Nt*Np + t*Np + p];
+		}
+	    }
+	}
+    }
+}
+
 // This function returns -1 unless the given packet causes a block to be marked
 // as filled in which case this function returns the marked block's first mcnt.
 // Any return value other than -1 will be stored in the status memory as
 // NETMCNT, so it is important that values other than -1 are returned rarely
 // (i.e. when marking a block as filled)!!!
-static inline uint64_t process_packet(
-	hdr_input_databuf_t *hdr_input_databuf_p, unsigned char*p_frame)
+static inline uint64_t process_packet(net_output_t *out,
+	block_info_t *binfo, const unsigned char *p_payload)
 {
 
-    static block_info_t binfo;
     packet_header_t pkt_header;
     const uint64_t *payload_p;
     int pkt_block_i;
@@ -359,6 +985,7 @@ static inline uint64_t process_packet(
     int64_t pkt_mcnt_dist;
     uint64_t pkt_mcnt;
     uint64_t cur_mcnt;
+    uint64_t newest, pkt_seq;
     uint64_t netmcnt = -1; // Value to return (!=-1 is stored in status memory)
     //int i;
 #if N_DEBUG_INPUT_BLOCKS == 1
@@ -367,26 +994,22 @@ static inline uint64_t process_packet(
     uint64_t * debug_ptr;
 #endif
 
-    // Lazy init binfo
-    if(!binfo.initialized) {
-	initialize_block_info(&binfo);
-    }
-
     // Parse packet header
-    get_header(p_frame, &pkt_header);
+    get_header(p_payload, &pkt_header);
     // mcnt is a spectra count, representing the first
     // time sample in the packet
     pkt_mcnt = pkt_header.mcnt;
     pkt_block_i = block_for_mcnt(pkt_mcnt);
-    cur_mcnt = binfo.mcnt_start;
+    cur_mcnt = binfo->mcnt_start;
 
     // Packet mcnt distance (how far away is this packet's mcnt from the
     // current mcnt).  Positive distance for pcnt mcnts > current mcnt.
     pkt_mcnt_dist = pkt_mcnt - cur_mcnt;
 
 #if N_DEBUG_INPUT_BLOCKS == 1
-    debug_ptr = (uint64_t *)&hdr_input_databuf_p->block[N_INPUT_BLOCKS];
-    debug_ptr[debug_offset++] = be64toh(*(unsigned long long *)PKT_UDP_DATA(p_frame));
+    // (two stage mode only)
+    debug_ptr = (uint64_t *)&out->idb->block[N_INPUT_BLOCKS];
+    debug_ptr[debug_offset++] = be64toh(*(unsigned long long *)p_payload);
     if(--debug_remaining == 0) {
 	exit(1);
     }
@@ -416,60 +1039,64 @@ static inline uint64_t process_packet(
 	// block + 2 blocks)
 	if(pkt_mcnt_dist >= 2*N_TIME_PER_BLOCK*TIME_DEMUX) {
 	    // Mark the current block as filled
-	    netmcnt = set_block_filled(hdr_input_databuf_p, &binfo);
+	    netmcnt = set_block_filled(out, binfo);
 
 	    // Advance mcnt_start to next block
 	    cur_mcnt += N_TIME_PER_BLOCK*TIME_DEMUX;
-	    binfo.mcnt_start += N_TIME_PER_BLOCK*TIME_DEMUX;
-	    binfo.block_i = (binfo.block_i + 1) % N_INPUT_BLOCKS;
-
-	    // Wait (hopefully not long!) to acquire the block after next (i.e.
-	    // the block that gets the current packet).
-	    if(hdr_input_databuf_busywait_free(hdr_input_databuf_p, pkt_block_i) != HASHPIPE_OK) {
-		if (errno == EINTR) {
-		    // Interrupted by signal, return -1
-		    hashpipe_error(__FUNCTION__, "interrupted by signal waiting for free databuf");
-		    pthread_exit(NULL);
-		    return -1; // We're exiting so return value is kind of moot
-		} else {
-		    hashpipe_error(__FUNCTION__, "error waiting for free databuf");
-		    pthread_exit(NULL);
-		    return -1; // We're exiting so return value is kind of moot
-		}
-	    }
-
-	    // Initialize the newly acquired block
-	    initialize_block(hdr_input_databuf_p, pkt_mcnt);
-	    // Reset binfo's packet counter for this packet's block
-	    binfo.block_packet_counter[pkt_block_i] = 0;
+	    binfo->mcnt_start += N_TIME_PER_BLOCK*TIME_DEMUX;
+	    binfo->block_i = (binfo->block_i + 1) % N_INPUT_BLOCKS;
+
+	    // Acquire the block after next (i.e. the block that gets the
+	    // current packet)
+	    slot_acquire(out, binfo, binfo->mcnt_start+N_TIME_PER_BLOCK*TIME_DEMUX);
+	    // Reset binfo's presence map for this packet's block
+	    hdr_pkt_map_clear(binfo->block_pkt_map[pkt_block_i]);
 	}
 
 	// Reset out-of-seq counter
-	binfo.out_of_seq_cnt = 0;
-
-	// Increment packet count for block
-	binfo.block_packet_counter[pkt_block_i]++;
+	binfo->out_of_seq_cnt = 0;
 #ifdef LOG_MCNTS
 	expected_packets_counted++;
 #endif
 
 	// Validate header FID and XID and calculate "m" and "f" indexes into
 	// block (stored in binfo).
-	if(calc_block_indexes(&binfo, &pkt_header)) {
+	if(calc_block_indexes(binfo, &pkt_header)) {
 	    // Bad packet, error already reported
 	    return -1;
 	}
 
+	// Drop the packet if this shard does not hold its block, e.g. because
+	// it was released from it after a lull in its packets
+	shard_write_begin(binfo);
+	if(!shard_holds(pkt_mcnt, binfo->shard_bit)) {
+	    shard_write_end(binfo);
+	    return netmcnt;
+	}
+
+	// Mark the packet as received
+	hdr_pkt_map_set(binfo->block_pkt_map[pkt_block_i],
+		hdr_pkt_bit(binfo->m, binfo->a/N_ANTS_PER_PACKET, binfo->c/N_CHAN_PER_PACKET));
+
+
+	// In fused mode, scatter only the recorded channels
+	if(out->fused) {
+	    strip_packet((uint8_t *)out->sdb->block[pkt_block_i].data,
+		    out->sdb->block[pkt_block_i].header.chan, binfo, p_payload+8);
+	    shard_write_end(binfo);
+	    return netmcnt;
+	}
 
 	// Copy data into buffer
         for(i=0; i<N_INPUTS_PER_PACKET/2; i++) {
 	    // Calculate starting points for unpacking this packet into block's data buffer.
-	    dest_p = (uint64_t *)(hdr_input_databuf_p->block[pkt_block_i].data)
-	        + hdr_input_databuf_data_idx(binfo.m, binfo.a + i, binfo.c, 0); //time index is always zero
-            //fprintf(stdout, "m:%d, a:%d, c:%d, %lu\n", binfo.m, binfo.a, binfo.c, hdr_input_databuf_data_idx(binfo.m, binfo.a, binfo.c, 0));
-	    payload_p        = (uint64_t *)(PKT_UDP_DATA(p_frame)+8+(i*2*N_CHAN_PER_PACKET*N_TIME_PER_PACKET));
+	    dest_p = (uint64_t *)(out->idb->block[pkt_block_i].data)
+	        + hdr_input_databuf_data_idx(binfo->m, binfo->a + i, binfo->c, 0); //time index is always zero
+            //fprintf(stdout, "m:%d, a:%d, c:%d, %lu\n", binfo->m, binfo->a, binfo->c, hdr_input_databuf_data_idx(binfo->m, binfo->a, binfo->c, 0));
+	    payload_p        = (uint64_t *)(p_payload+8+(i*2*N_CHAN_PER_PACKET*N_TIME_PER_PACKET));
 	    memcpy(dest_p, payload_p, 2*N_CHAN_PER_PACKET*N_TIME_PER_PACKET);
         }
+	shard_write_end(binfo);
 
 	return netmcnt;
     }
@@ -477,7 +1104,7 @@ static inline uint64_t process_packet(
     // restarts and MCNT rollover), then ignore it
     else if(pkt_mcnt_dist < 0 && pkt_mcnt_dist > -LATE_PKT_MCNT_THRESHOLD) {
 	// If not just after an mcnt reset, issue warning.
-	if(cur_mcnt >= binfo.mcnt_log_late) {
+	if(cur_mcnt >= binfo->mcnt_log_late) {
 	    hashpipe_warn("hera_pktsock_thread",
 		    "Ignoring late packet (%d mcnts late)",
 		    cur_mcnt - pkt_mcnt);
@@ -489,46 +1116,70 @@ static inline uint64_t process_packet(
     }
     // Else, it is an "out-of-order" packet.
     else {
+	// If the other shards have already reached the packet's block (or
+	// the one before it), we are behind them.  Jump to their blocks.
+	newest = __atomic_load_n(&shard_sync.newest_seq, __ATOMIC_RELAXED);
+	pkt_seq = MIN(block_seq(pkt_mcnt), newest - 1);
+	if(pkt_mcnt_dist > 0 && newest + 1 - block_seq(pkt_mcnt) < SHARD_MAX_LAG
+		&& pkt_seq >= block_seq(cur_mcnt) + 2) {
+	    shard_catch_up(out, binfo, pkt_seq);
+	    return -1;
+	}
+
 	// If not at start-up and this is the first out of order packet,
 	// issue warning.
-	if(cur_mcnt != 0 && binfo.out_of_seq_cnt == 0) {
+	if(cur_mcnt != 0 && binfo->out_of_seq_cnt == 0) {
 	    hashpipe_warn("hera_pktsock_thread",
 		    "out of seq mcnt %012lx (expected: %012lx <= mcnt < %012x)",
 		    pkt_mcnt, cur_mcnt, cur_mcnt+3*N_TIME_PER_BLOCK*TIME_DEMUX);
 	}
 
 	// Increment out-of-seq packet counter
-	binfo.out_of_seq_cnt++;
+	binfo->out_of_seq_cnt++;
 #ifdef LOG_MCNTS
 	outofseq_packets_counted++;
 #endif
 
 	// If too may out-of-seq packets
-	if(binfo.out_of_seq_cnt > MAX_OUT_OF_SEQ) {
+	if(binfo->out_of_seq_cnt > MAX_OUT_OF_SEQ) {
+	    // Every shard sees the same mcnt sequence (just for different
+	    // antennas), so all shards reset to the same mcnt on their own.
+	    // Only the shards holding the newest blocks reset, the others
+	    // catch up with them afterwards.  If the shards holding the newest
+	    // blocks have stalled, take over their blocks first.
+	    if(block_seq(cur_mcnt) + 1 != newest) {
+		if(!shards_stalled(binfo)) {
+		    return -1;
+		}
+		shard_catch_up(out, binfo, newest - 1);
+	    }
+	    binfo->stall_seq = SLOT_SEQ_NONE;
+
 	    // Reset current mcnt.  The value to reset to must be the first
 	    // value greater than or equal to pkt_mcnt that corresponds to the
 	    // same databuf block as the old current mcnt.
-	    if(binfo.block_i > pkt_block_i) {
-		// Advance pkt_mcnt to correspond to binfo.block_i
-		pkt_mcnt += TIME_DEMUX*N_TIME_PER_BLOCK*(binfo.block_i - pkt_block_i);
-	    } else if(binfo.block_i < pkt_block_i) {
-		// Advance pkt_mcnt to binfo.block_i + N_INPUT_BLOCKS blocks
-		pkt_mcnt += TIME_DEMUX*N_TIME_PER_BLOCK*(binfo.block_i + N_INPUT_BLOCKS - pkt_block_i);
+	    if(binfo->block_i > pkt_block_i) {
+		// Advance pkt_mcnt to correspond to binfo->block_i
+		pkt_mcnt += TIME_DEMUX*N_TIME_PER_BLOCK*(binfo->block_i - pkt_block_i);
+	    } else if(binfo->block_i < pkt_block_i) {
+		// Advance pkt_mcnt to binfo->block_i + N_INPUT_BLOCKS blocks
+		pkt_mcnt += TIME_DEMUX*N_TIME_PER_BLOCK*(binfo->block_i + N_INPUT_BLOCKS - pkt_block_i);
 	    }
-	    // Round pkt_mcnt down to nearest multiple of Nm
-	    binfo.mcnt_start = pkt_mcnt - (pkt_mcnt%N_TIME_PER_BLOCK);
-	    binfo.mcnt_log_late = binfo.mcnt_start + N_TIME_PER_BLOCK*TIME_DEMUX;
-	    binfo.block_i = block_for_mcnt(binfo.mcnt_start);
+	    // Round pkt_mcnt down to the start of its block, where every shard
+	    // resetting on a packet of this block ends up
+	    binfo->mcnt_start = pkt_mcnt - (pkt_mcnt%(N_TIME_PER_BLOCK*TIME_DEMUX));
+	    binfo->mcnt_log_late = binfo->mcnt_start + N_TIME_PER_BLOCK*TIME_DEMUX;
+	    binfo->block_i = block_for_mcnt(binfo->mcnt_start);
 	    hashpipe_warn("hera_pktsock_thread",
 		    "resetting to mcnt %012lx block %d based on packet mcnt %012lx",
-		    binfo.mcnt_start, block_for_mcnt(binfo.mcnt_start), pkt_mcnt);
+		    binfo->mcnt_start, block_for_mcnt(binfo->mcnt_start), pkt_mcnt);
 	    // Reinitialize/recycle our two already acquired blocks with new
 	    // mcnt values.
-	    initialize_block(hdr_input_databuf_p, binfo.mcnt_start);
-	    initialize_block(hdr_input_databuf_p, binfo.mcnt_start+TIME_DEMUX*N_TIME_PER_BLOCK);
-	    // Reset binfo's packet counters for these blocks.
-	    binfo.block_packet_counter[binfo.block_i] = 0;
-	    binfo.block_packet_counter[(binfo.block_i+1)%N_INPUT_BLOCKS] = 0;
+	    slot_retarget(out, binfo, binfo->mcnt_start);
+	    slot_retarget(out, binfo, binfo->mcnt_start+TIME_DEMUX*N_TIME_PER_BLOCK);
+	    // Reset binfo's presence maps for these blocks.
+	    hdr_pkt_map_clear(binfo->block_pkt_map[binfo->block_i]);
+	    hdr_pkt_map_clear(binfo->block_pkt_map[(binfo->block_i+1)%N_INPUT_BLOCKS]);
 	}
 	return -1;
     }
@@ -536,14 +1187,306 @@ static inline uint64_t process_packet(
     return netmcnt;
 }
 
-#define ELAPSED_NS(start,stop) \
-  (((int64_t)stop.tv_sec-start.tv_sec)*1000*1000*1000+(stop.tv_nsec-start.tv_nsec))
+// Timing statistics accumulated between blocks being marked filled.  In
+// TPACKET_V2 mode each sample covers a single packet.  In TPACKET_V3 mode each
+// sample covers a whole ring block and is normalized to ns per packet so that
+// the NETWATNS/NETRECNS/NETPRCNS keys are directly comparable between modes.
+typedef struct {
+    uint64_t packet_count;
+    uint64_t min_wait_ns; // min ns per single wait
+    uint64_t min_recv_ns; // min ns per single recv
+    uint64_t min_proc_ns; // min ns per single proc
+    uint64_t max_wait_ns; // max ns per single wait
+    uint64_t max_recv_ns; // max ns per single recv
+    uint64_t max_proc_ns; // max ns per single proc
+    uint64_t elapsed_wait_ns; // cumulative wait time per block
+    uint64_t elapsed_recv_ns; // cumulative recv time per block
+    uint64_t elapsed_proc_ns; // cumulative proc time per block
+} net_timing_t;
+
+static inline void net_timing_init(net_timing_t *t)
+{
+    memset(t, 0, sizeof(net_timing_t));
+    t->min_wait_ns = UINT64_MAX;
+    t->min_recv_ns = UINT64_MAX;
+    t->min_proc_ns = UINT64_MAX;
+}
+
+// Adds one timing sample covering npkts packets to t and, per packet, to the
+// shard's histograms h
+static inline void net_timing_add(net_timing_t *t, net_shard_hists_t *h,
+	uint64_t npkts, uint64_t wait_ns, uint64_t recv_ns, uint64_t proc_ns)
+{
+    t->elapsed_wait_ns += wait_ns;
+    t->elapsed_recv_ns += recv_ns;
+    t->elapsed_proc_ns += proc_ns;
+
+    // A ring block may hold no usable packets
+    if(npkts == 0) {
+	return;
+    }
+    t->packet_count += npkts;
+
+    wait_ns /= npkts;
+    recv_ns /= npkts;
+    proc_ns /= npkts;
+    // Update min max values
+    t->min_wait_ns = MIN(wait_ns, t->min_wait_ns);
+    t->min_recv_ns = MIN(recv_ns, t->min_recv_ns);
+    t->min_proc_ns = MIN(proc_ns, t->min_proc_ns);
+    t->max_wait_ns = MAX(wait_ns, t->max_wait_ns);
+    t->max_recv_ns = MAX(recv_ns, t->max_recv_ns);
+    t->max_proc_ns = MAX(proc_ns, t->max_proc_ns);
+
+    hdr_hist_record1(&h->wait, wait_ns);
+    hdr_hist_record1(&h->recv, recv_ns);
+    hdr_hist_record1(&h->proc, proc_ns);
+}
+
+// Adds the timing statistics and packet socket counts of the block that was
+// just marked filled to the shard's statistics s and starts a new average.
+static void net_timing_fold(net_shard_stats_t *s, net_timing_t *t,
+	unsigned int pktsock_pkts, unsigned int pktsock_drops)
+{
+    hdr_stat_add(&s->wait_ns, t->elapsed_wait_ns);
+    hdr_stat_add(&s->recv_ns, t->elapsed_recv_ns);
+    hdr_stat_add(&s->proc_ns, t->elapsed_proc_ns);
+    hdr_stat_add(&s->sock_pkts, pktsock_pkts);
+    hdr_stat_add(&s->sock_drops, pktsock_drops);
+    if(t->packet_count) {
+	hdr_stat_min(&s->min_wait_ns, t->min_wait_ns);
+	hdr_stat_min(&s->min_recv_ns, t->min_recv_ns);
+	hdr_stat_min(&s->min_proc_ns, t->min_proc_ns);
+	hdr_stat_max(&s->max_wait_ns, t->max_wait_ns);
+	hdr_stat_max(&s->max_recv_ns, t->max_recv_ns);
+	hdr_stat_max(&s->max_proc_ns, t->max_proc_ns);
+    }
+    // Packets last, so that the publisher never averages over fewer times
+    hdr_stat_add(&s->npkts, t->packet_count);
+
+    // Start new average
+    net_timing_init(t);
+}
+
+// Lowers (raises) the value of key to v.  The "get-then-put" allows the user
+// to reset the min max values in the status buffer.
+static void put_min(char *buf, const char *key, uint64_t v)
+{
+    long long cur;
+    if(hgeti8(buf, key, &cur) && cur >= 0 && (uint64_t)cur < v) {
+	v = cur;
+    }
+    hputi8(buf, key, v);
+}
+
+static void put_max(char *buf, const char *key, uint64_t v)
+{
+    long long cur;
+    if(hgeti8(buf, key, &cur) && (uint64_t)cur > v) {
+	v = cur;
+    }
+    hputi8(buf, key, v);
+}
+
+// Adds v to the value of key (which the user may reset)
+static void put_add(char *buf, const char *key, uint64_t v)
+{
+    unsigned long long cur = 0;
+    hgetu8(buf, key, &cur);
+    hputu8(buf, key, cur + v);
+}
+
+// Status publisher of the net thread (see hdr_stats.h).  Averages cover the
+// time since the previous snapshot, NETPKTS and NETDROPS are the packet
+// socket counts and NETLOSSG and NETLOSSM the antenna groups and m with lost
+// packets of the blocks filled since then.
+static void net_stats_publish(char *buf, void *arg)
+{
+    net_output_t *out = (net_output_t *)arg;
+    net_shard_stats_t *s;
+    net_snapshot_t now;
+    uint64_t min_wait = UINT64_MAX, min_recv = UINT64_MAX, min_proc = UINT64_MAX;
+    uint64_t max_wait = 0, max_recv = 0, max_proc = 0;
+    uint64_t npkts, v;
+    float ns_per_wait, ns_per_recv, ns_per_proc;
+    uint32_t missed_pkt_cnt = 0;
+    char mask[20];
+    int32_t xid = -1;
+    int i;
+
+    memset(&now, 0, sizeof(now));
+    for(i=0; i<shard_sync.nshards; i++) {
+	s = &net_stats[i];
+	now.npkts += hdr_stat_get(&s->npkts);
+	now.wait_ns += hdr_stat_get(&s->wait_ns);
+	now.recv_ns += hdr_stat_get(&s->recv_ns);
+	now.proc_ns += hdr_stat_get(&s->proc_ns);
+	now.sock_pkts += hdr_stat_get(&s->sock_pkts);
+	now.sock_drops += hdr_stat_get(&s->sock_drops);
+	// (MIN and MAX evaluate their arguments twice)
+	v = hdr_stat_take(&s->min_wait_ns, UINT64_MAX);
+	min_wait = MIN(min_wait, v);
+	v = hdr_stat_take(&s->min_recv_ns, UINT64_MAX);
+	min_recv = MIN(min_recv, v);
+	v = hdr_stat_take(&s->min_proc_ns, UINT64_MAX);
+	min_proc = MIN(min_proc, v);
+	v = hdr_stat_take(&s->max_wait_ns, 0);
+	max_wait = MAX(max_wait, v);
+	v = hdr_stat_take(&s->max_recv_ns, 0);
+	max_recv = MAX(max_recv, v);
+	v = hdr_stat_take(&s->max_proc_ns, 0);
+	max_proc = MAX(max_proc, v);
+    }
+    now.missed_pkts = hdr_stat_get(&block_stats.missed_pkts);
+
+    if(hdr_stat_get(&block_stats.nblocks)) {
+	hputu4(buf, "NETBKOUT", hdr_stat_get(&block_stats.block_i));
+	hputu8(buf, "NETMCNT", hdr_stat_get(&block_stats.mcnt));
+	hputu4(buf, "MISSEDFE", hdr_stat_get(&block_stats.missed_fe));
+    }
+
+    if(now.npkts > net_snap.npkts) {
+	npkts = now.npkts - net_snap.npkts;
+	ns_per_wait = (float)(now.wait_ns - net_snap.wait_ns) / npkts;
+	ns_per_recv = (float)(now.recv_ns - net_snap.recv_ns) / npkts;
+	ns_per_proc = (float)(now.proc_ns - net_snap.proc_ns) / npkts;
+	// Gbps = bits_per_packet / ns_per_packet
+	// (N_BYTES_PER_PACKET excludes header, so +8 for the header)
+	hputr4(buf, "NETGBPS", 8*(N_BYTES_PER_PACKET+8)/(ns_per_recv+ns_per_proc));
+	hputr4(buf, "NETWATNS", ns_per_wait);
+	hputr4(buf, "NETRECNS", ns_per_recv);
+	hputr4(buf, "NETPRCNS", ns_per_proc);
+    }
+    if(min_wait != UINT64_MAX) {
+	put_min(buf, "NETWATMN", min_wait);
+	put_min(buf, "NETRECMN", min_recv);
+	put_min(buf, "NETPRCMN", min_proc);
+	put_max(buf, "NETWATMX", max_wait);
+	put_max(buf, "NETRECMX", max_recv);
+	put_max(buf, "NETPRCMX", max_proc);
+    }
+
+    hputu8(buf, "NETPKTS",  now.sock_pkts - net_snap.sock_pkts);
+    hputu8(buf, "NETDROPS", now.sock_drops - net_snap.sock_drops);
+    put_add(buf, "NETPKTTL", now.sock_pkts - net_snap.sock_pkts);
+    put_add(buf, "NETDRPTL", now.sock_drops - net_snap.sock_drops);
+    if(now.missed_pkts > net_snap.missed_pkts) {
+	// Increment MISSEDPK by number of missed packets
+	hgetu4(buf, "MISSEDPK", &missed_pkt_cnt);
+	missed_pkt_cnt += now.missed_pkts - net_snap.missed_pkts;
+	hputu4(buf, "MISSEDPK", missed_pkt_cnt);
+    }
+
+    sprintf(mask, "%0*lx", (N_PKT_AGRPS+3)/4,
+	    (unsigned long)hdr_stat_take(&block_stats.loss_grp, 0));
+    hputs(buf, "NETLOSSG", mask);
+    sprintf(mask, "%0*lx", (Nm+3)/4, (unsigned long)hdr_stat_take(&block_stats.loss_m, 0));
+    hputs(buf, "NETLOSSM", mask);
+
+    hgeti4(buf, "XID", &xid);
+    hdr_stat_set(&block_stats.xid, (uint32_t)xid);
+
+    if(out->fused) {
+	publish_chan_set(buf);
+    }
+
+    net_snap = now;
+}
+
+#ifndef TIMING_TEST
+// Opens the packet socket of one shard
+static int net_sock_open(net_sock_t *p_sock, const char *bindhost, int tpacket_version)
+{
+    p_sock->tpacket_version = tpacket_version;
+
+    if(tpacket_version == 3) {
+	// The V3 ring uses the same amount of memory as the V2 ring, but the
+	// kernel hands it over one retired block at a time.
+	p_sock->tp3.block_size = PKTSOCK_V3_BLOCK_SIZE;
+	p_sock->tp3.nblocks = PKTSOCK_NBLOCKS;
+	p_sock->tp3.frame_size = PKTSOCK_BYTES_PER_FRAME;
+	p_sock->tp3.retire_ms = PKTSOCK_V3_RETIRE_MS;
+
+	return hdr_tpacket3_open(&p_sock->tp3, bindhost);
+    }
+
+    // Make frame_size be a divisor of block size so that frames will be
+    // contiguous in mapped mempory.  block_size must also be a multiple of
+    // page_size.  Easiest way is to oversize the frames to be 16384 bytes, which
+    // is bigger than we need, but keeps things easy.
+    p_sock->ps.frame_size = PKTSOCK_BYTES_PER_FRAME;
+    // total number of frames
+    p_sock->ps.nframes = PKTSOCK_NFRAMES;
+    // number of blocks
+    p_sock->ps.nblocks = PKTSOCK_NBLOCKS;
+
+    return hashpipe_pktsock_open(&p_sock->ps, bindhost, PACKET_RX_RING);
+}
+
+static void net_sock_close(net_sock_t *p_sock)
+{
+    if(p_sock->tpacket_version == 3) {
+	hdr_tpacket3_close(&p_sock->tp3);
+    } else {
+	hashpipe_pktsock_close(&p_sock->ps);
+    }
+}
+
+// Joins a shard's socket to fanout group fanout_id.  Sockets must join in
+// shard order because the kernel maps the BPF program's return value to the
+// group member with that index.
+static int net_sock_join_fanout(net_sock_t *p_sock, int fanout_id, int ants_per_shard)
+{
+    int fd = p_sock->tpacket_version == 3 ? p_sock->tp3.fd : p_sock->ps.fd;
+    int fanout_arg = (fanout_id & 0xffff) | (PACKET_FANOUT_CBPF << 16);
+
+    // The fanout demux runs with the packet positioned at its IP header.  The
+    // antenna number is the low 16 bits of the 8 byte F engine header at the
+    // start of the UDP payload, i.e. at offset 8+6 from the end of the IP
+    // header.  The kernel takes the returned shard index modulo the number of
+    // sockets in the group.
+    struct sock_filter code[] = {
+	BPF_STMT(BPF_LDX | BPF_B   | BPF_MSH, 0),              // X = IP header length
+	BPF_STMT(BPF_LD  | BPF_H   | BPF_IND, 8+6),            // A = antenna
+	BPF_STMT(BPF_ALU | BPF_DIV | BPF_K,   ants_per_shard), // A = shard
+	BPF_STMT(BPF_RET | BPF_A, 0)
+    };
+    struct sock_fprog prog = {
+	.len = sizeof(code)/sizeof(code[0]),
+	.filter = code
+    };
+
+    if(setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg))) {
+	hashpipe_error(__FUNCTION__, "setsockopt(PACKET_FANOUT)");
+	return HASHPIPE_ERR_SYS;
+    }
+    if(setsockopt(fd, SOL_PACKET, PACKET_FANOUT_DATA, &prog, sizeof(prog))) {
+	hashpipe_error(__FUNCTION__, "setsockopt(PACKET_FANOUT_DATA)");
+	return HASHPIPE_ERR_SYS;
+    }
+    return HASHPIPE_OK;
+}
+
+static void net_shards_close(net_shard_t *shards)
+{
+    int i;
+    for(i=0; i<shard_sync.nshards; i++) {
+	net_sock_close(&shards[i].sock);
+    }
+}
+#endif
 
 static int init(hashpipe_thread_args_t *args)
 {
     /* Read network params */
     char bindhost[80];
+    char spec[80] = "";
     int bindport = 8511;
+    int tpacket_version = 2;
+    int nshards = 1;
+    int fanout_id = getpid() & 0xffff;
+    int ants_per_shard;
+    int i;
 
     strcpy(bindhost, "0.0.0.0");
 
@@ -553,54 +1496,278 @@ static int init(hashpipe_thread_args_t *args)
     // Get info from status buffer if present (no change if not present)
     hgets(st.buf, "BINDHOST", 80, bindhost);
     hgeti4(st.buf, "BINDPORT", &bindport);
+    hgeti4(st.buf, "NETTPVER", &tpacket_version);
+    hgeti4(st.buf, "NETNSHRD", &nshards);
+    hgeti4(st.buf, "NETFOGRP", &fanout_id);
+    hgeti4(st.buf, "NETPUBMS", &net_pub_ms);
+    hgeti4(st.buf, "NETPUBCP", &net_pub_cpu);
+    nshards = MAX(1, MIN(nshards, MAX_NET_SHARDS));
+    // Split the antennas into nshards ranges of whole packets, dropping shards
+    // that would get none, as they would hold up every block
+    ants_per_shard = N_ANTS_PER_PACKET *
+	((Na/N_ANTS_PER_PACKET + nshards - 1) / nshards);
+    if((Na + ants_per_shard - 1) / ants_per_shard < nshards) {
+	hashpipe_warn(__FUNCTION__, "%d capture shards would own no antennas, using %d",
+		nshards - (Na + ants_per_shard - 1) / ants_per_shard,
+		(Na + ants_per_shard - 1) / ants_per_shard);
+	nshards = (Na + ants_per_shard - 1) / ants_per_shard;
+    }
+    net_pub_ms = MAX(1, net_pub_ms);
     // Store bind host/port info etc in status buffer
     hputs(st.buf, "BINDHOST", bindhost);
     hputi4(st.buf, "BINDPORT", bindport);
+    hputi4(st.buf, "NETTPVER", tpacket_version);
+    hputi4(st.buf, "NETNSHRD", nshards);
+    hputi4(st.buf, "NETFOGRP", fanout_id);
+    hputi4(st.buf, "NETPUBMS", net_pub_ms);
+    hputi4(st.buf, "NETPUBCP", net_pub_cpu);
+    // Initial recorded channel set (used in fused mode only)
+    sprintf(shard_sync.chan_spec, "0-%d", N_STRP_CHANS_PER_X-1);
+    hdr_chan_set_default(shard_sync.chan);
+    hgets(st.buf, STRPCHAN_KEY, sizeof(spec), spec);
+    if(*spec) {
+	if(hdr_chan_set_parse(spec, shard_sync.chan) == HASHPIPE_OK) {
+	    strcpy(shard_sync.chan_spec, spec);
+	} else {
+	    hashpipe_warn(__FUNCTION__, "ignoring invalid %s \"%s\"", STRPCHAN_KEY, spec);
+	}
+    }
+    hputs(st.buf, STRPCHAN_KEY, shard_sync.chan_spec);
     hputu4(st.buf, "MISSEDFE", 0);
     hputu4(st.buf, "MISSEDPK", 0);
     hashpipe_status_unlock_safe(&st);
 
-#ifndef TIMING_TEST
-    /* Set up pktsock */
-    struct hashpipe_pktsock *p_ps = (struct hashpipe_pktsock *)
-	malloc(sizeof(struct hashpipe_pktsock));
+    shard_sync.nshards = nshards;
+    shard_sync.last_filled = -1;
+    shard_sync.live = (1u << nshards) - 1;
+    memset(net_stats, 0, sizeof(net_stats));
+    for(i=0; i<nshards; i++) {
+	hdr_stat_set(&net_stats[i].min_wait_ns, UINT64_MAX);
+	hdr_stat_set(&net_stats[i].min_recv_ns, UINT64_MAX);
+	hdr_stat_set(&net_stats[i].min_proc_ns, UINT64_MAX);
+    }
+    memset(&block_stats, 0, sizeof(block_stats));
+    hdr_stat_set(&block_stats.xid, (uint32_t)-1);
+    memset(&net_snap, 0, sizeof(net_snap));
+    for(i=0; i<N_INPUT_BLOCKS; i++) {
+	shard_sync.slot_state[i] = SLOT_STATE(SLOT_SEQ_NONE, 0);
+	hdr_pkt_map_clear(shard_sync.pkt_map[i]);
+	memcpy(shard_sync.slot_chan[i], shard_sync.chan, sizeof(shard_sync.chan));
+    }
 
-    if(!p_ps) {
+    net_shard_t *shards = (net_shard_t *)calloc(nshards, sizeof(net_shard_t));
+    if(!shards) {
         perror(__FUNCTION__);
         return -1;
     }
-
-    // Make frame_size be a divisor of block size so that frames will be
-    // contiguous in mapped mempory.  block_size must also be a multiple of
-    // page_size.  Easiest way is to oversize the frames to be 16384 bytes, which
-    // is bigger than we need, but keeps things easy.
-    p_ps->frame_size = PKTSOCK_BYTES_PER_FRAME;
-    // total number of frames
-    p_ps->nframes = PKTSOCK_NFRAMES;
-    // number of blocks
-    p_ps->nblocks = PKTSOCK_NBLOCKS;
-
-    int rv = hashpipe_pktsock_open(p_ps, bindhost, PACKET_RX_RING);
-    if (rv!=HASHPIPE_OK) {
-        hashpipe_error("hera_pktsock_thread", "Error opening pktsock.");
-        pthread_exit(NULL);
+    for(i=0; i<nshards; i++) {
+	shards[i].shard = i;
+	shards[i].ant_lo = MIN(i*ants_per_shard, Na);
+	shards[i].ant_hi = MIN((i+1)*ants_per_shard, Na);
     }
 
-    // Store packet socket pointer in args
-    args->user_data = p_ps;
+#ifndef TIMING_TEST
+    /* Set up pktsocks */
+    for(i=0; i<nshards; i++) {
+	if(net_sock_open(&shards[i].sock, bindhost, tpacket_version) != HASHPIPE_OK) {
+	    hashpipe_error("hera_pktsock_thread", "Error opening pktsock.");
+	    pthread_exit(NULL);
+	}
+	if(nshards > 1 &&
+	   net_sock_join_fanout(&shards[i].sock, fanout_id, ants_per_shard) != HASHPIPE_OK) {
+	    hashpipe_error("hera_pktsock_thread", "Error joining fanout group %d.", fanout_id);
+	    pthread_exit(NULL);
+	}
+    }
 #endif
 
+    // Store shards pointer in args
+    args->user_data = shards;
+
     // Success!
     return 0;
 }
 
+// Receive loop of one capture shard.  Shard 0 runs in the hashpipe thread
+// itself, the others in threads started by run().
+static void *capture_loop(void *arg)
+{
+    net_shard_t *shard = (net_shard_t *)arg;
+    net_output_t *out = shard->out;
+    block_info_t *binfo = &shard->binfo;
+    const int bindport = shard->bindport;
+    // (N_BYTES_PER_PACKET excludes header, so +8 for the header)
+    const size_t expected_packet_size = N_BYTES_PER_PACKET + 8;
+
+#ifndef TIMING_TEST
+    net_sock_t * p_sock = &shard->sock;
+    struct hashpipe_pktsock * p_ps = &p_sock->ps;
+    struct hdr_tpacket3 * p_tp3 = &p_sock->tp3;
+    struct tpacket_block_desc * p_desc;
+    unsigned char *p_frame;
+#endif
+
+    /* Main loop */
+    uint64_t mcnt;
+    uint64_t pkt_mcnt;
+    uint64_t npkts;
+    unsigned int i;
+    int packet_size;
+    net_timing_t timing;
+    unsigned int pktsock_pkts = 0;  // Stats counter from socket packet
+    unsigned int pktsock_drops = 0; // Stats counter from socket packet
+    struct timespec start, stop;
+    struct timespec recv_start, recv_stop;
+    char name[16];
+
+    snprintf(name, sizeof(name), "net%d", shard->shard);
+    hdr_trace_thread_name(name);
+    net_timing_init(&timing);
+
+    while (run_threads()) {
+
+#ifndef TIMING_TEST
+	if(p_sock->tpacket_version == 3) {
+	    /* Read retired ring block */
+	    clock_gettime(CLOCK_MONOTONIC, &recv_start);
+	    do {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		p_desc = hdr_tpacket3_recv_block_nonblock(p_tp3);
+		clock_gettime(CLOCK_MONOTONIC, &recv_stop);
+	    } while (!p_desc && run_threads());
+
+	    if(!run_threads()) break;
+
+	    // Copy every packet of the ring block into the blocks where it
+	    // belongs.  Timing is only sampled once for the whole ring block.
+	    mcnt = -1;
+	    npkts = 0;
+	    p_frame = hdr_tpacket3_first_frame(p_desc);
+	    for(i=0; i<TP3_BLOCK_NPKTS(p_desc); i++) {
+		if(TP3_IS_UDP(p_frame) && TP3_UDP_DST(p_frame) == bindport) {
+		    // Same size check as for V2 frames (see below)
+		    packet_size = TP3_UDP_SIZE(p_frame) - 8; // -8 for the UDP header
+		    if (expected_packet_size != packet_size-8 && expected_packet_size != packet_size) {
+			#ifdef DEBUG_NET
+			hashpipe_warn("hera_pktsock_thread", "Invalid pkt size (%d)", packet_size);
+			#endif
+		    } else {
+			pkt_mcnt = process_packet(out, binfo, TP3_UDP_DATA(p_frame));
+			if(pkt_mcnt != -1) {
+			    mcnt = pkt_mcnt;
+			}
+			npkts++;
+		    }
+		}
+		p_frame = hdr_tpacket3_next_frame(p_frame);
+	    }
+	    // Release ring block back to kernel
+	    hdr_tpacket3_release_block(p_desc);
+	} else {
+	    /* Read packet */
+	    clock_gettime(CLOCK_MONOTONIC, &recv_start);
+	    do {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		//p.packet_size = recv(up.sock, p.data, HASHPIPE_MAX_PACKET_SIZE, 0);
+		p_frame = hashpipe_pktsock_recv_udp_frame_nonblock(p_ps, bindport);
+		clock_gettime(CLOCK_MONOTONIC, &recv_stop);
+	    } while (!p_frame && run_threads());
+
+	    if(!run_threads()) break;
+
+	    // Make sure received packet size matches expected packet size.  Allow
+	    // for optional 8 byte CRC in received packet.  Zlib's crc32 function
+	    // is too slow to use in realtime, so CRCs cannot be checked on the
+	    // fly.  If data errors are suspected, a separate CRC checking utility
+	    // should be used to read the packets from the network and verify CRCs.
+	    packet_size = PKT_UDP_SIZE(p_frame) - 8; // -8 for the UDP header
+	    if (expected_packet_size != packet_size-8 && expected_packet_size != packet_size) {
+		// Log warning and ignore wrongly sized packet
+		#ifdef DEBUG_NET
+		hashpipe_warn("hera_pktsock_thread", "Invalid pkt size (%d)", packet_size);
+		#endif
+		hashpipe_pktsock_release_frame(p_frame);
+		continue;
+	    }
+
+	    // Copy packet into any blocks where it belongs.
+	    mcnt = process_packet(out, binfo, PKT_UDP_DATA(p_frame));
+	    npkts = 1;
+	    // Release frame back to kernel
+	    hashpipe_pktsock_release_frame(p_frame);
+	}
+#endif
+
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	net_timing_add(&timing, &net_hists[shard->shard], npkts,
+		ELAPSED_NS(recv_start, start),
+		ELAPSED_NS(start, recv_stop),
+		ELAPSED_NS(recv_stop, stop));
+
+        if(mcnt != -1) {
+	    // Get stats from packet socket
+	    if(p_sock->tpacket_version == 3) {
+		hdr_tpacket3_stats(p_tp3, &pktsock_pkts, &pktsock_drops);
+	    } else {
+		hashpipe_pktsock_stats(p_ps, &pktsock_pkts, &pktsock_drops);
+	    }
+
+            // Update statistics and start new average
+	    net_timing_fold(&net_stats[shard->shard], &timing, pktsock_pkts, pktsock_drops);
+        }
+
+#if defined TIMING_TEST || defined NET_TIMING_TEST
+
+#define END_LOOP_COUNT (1*1000*1000)
+	static int loop_count=0;
+	static struct timespec tt_start, tt_stop;
+	if(loop_count == 0) {
+	    clock_gettime(CLOCK_MONOTONIC, &tt_start);
+	}
+	//if(loop_count == 1000000) pthread_exit(NULL);
+	if(loop_count == END_LOOP_COUNT) {
+	    clock_gettime(CLOCK_MONOTONIC, &tt_stop);
+	    int64_t elapsed = ELAPSED_NS(tt_start, tt_stop);
+	    printf("processed %d packets in %.6f ms (%.3f us per packet)\n",
+		    END_LOOP_COUNT, elapsed/1e6, elapsed/1e3/END_LOOP_COUNT);
+	    exit(0);
+	}
+	loop_count++;
+#endif
+
+        /* Will exit if thread has been cancelled */
+        pthread_testcancel();
+    }
+
+    return NULL;
+}
+
+// Unregisters the shards' histograms and drops the histogram publisher
+static void net_hists_stop(void *arg)
+{
+    int i;
+
+    hdr_hist_publisher_stop();
+    for(i=0; i<shard_sync.nshards; i++) {
+	hdr_hist_unregister(&net_hists[i].wait);
+	hdr_hist_unregister(&net_hists[i].recv);
+	hdr_hist_unregister(&net_hists[i].proc);
+    }
+}
+
 static void *run(hashpipe_thread_args_t * args)
 {
     // Local aliases to shorten access to args fields
-    // Our output buffer happens to be a hdr_input_databuf
-    hdr_input_databuf_t *db = (hdr_input_databuf_t *)args->obuf;
+    // Our output buffer is a hdr_input_databuf or, in fused mode, a
+    // hdr_stripper_databuf
+    net_output_t out;
+    out.fused = args->thread_desc->obuf_desc.create == hdr_stripper_databuf_create;
+    out.idb = out.fused ? NULL : (hdr_input_databuf_t *)args->obuf;
+    out.sdb = out.fused ? (hdr_stripper_databuf_t *)args->obuf : NULL;
     hashpipe_status_t st = args->st;
     const char * status_key = args->thread_desc->skey;
+    net_shard_t *shards = (net_shard_t *)args->user_data;
+    int i;
 
     st_p = &st;	// allow global (this source file) access to the status buffer
 
@@ -628,10 +1795,6 @@ static void *run(hashpipe_thread_args_t * args)
 	hashpipe_status_unlock_safe(&st);
     }
 
-#ifdef DEBUG_SEMS
-    fprintf(stderr, "s/tid %lu/NET/' <<.\n", pthread_self());
-#endif
-
 #if 0
     /* Copy status buffer */
     char status_buf[HASHPIPE_STATUS_SIZE];
@@ -641,7 +1804,7 @@ static void *run(hashpipe_thread_args_t * args)
 #endif
 
     // Acquire first two blocks to start
-    if(hdr_input_databuf_busywait_free(db, 0) != HASHPIPE_OK) {
+    if(net_output_busywait_free(&out, 0) != HASHPIPE_OK) {
 	if (errno == EINTR) {
 	    // Interrupted by signal, return -1
 	    hashpipe_error(__FUNCTION__, "interrupted by signal waiting for free databuf");
@@ -651,7 +1814,7 @@ static void *run(hashpipe_thread_args_t * args)
 	    pthread_exit(NULL);
 	}
     }
-    if(hdr_input_databuf_busywait_free(db, 1) != HASHPIPE_OK) {
+    if(net_output_busywait_free(&out, 1) != HASHPIPE_OK) {
 	if (errno == EINTR) {
 	    // Interrupted by signal, return -1
 	    hashpipe_error(__FUNCTION__, "interrupted by signal waiting for free databuf");
@@ -663,24 +1826,35 @@ static void *run(hashpipe_thread_args_t * args)
     }
 
     // Initialize the newly acquired block
-    initialize_block(db, 0);
-    initialize_block(db, N_TIME_PER_BLOCK*TIME_DEMUX);
+    initialize_block(&out, 0);
+    initialize_block(&out, N_TIME_PER_BLOCK*TIME_DEMUX);
+    // All shards start out holding them
+    shard_sync.slot_state[0] = SLOT_STATE(block_seq(0), shard_sync.live);
+    shard_sync.slot_state[1] = SLOT_STATE(block_seq(N_TIME_PER_BLOCK*TIME_DEMUX), shard_sync.live);
+    shard_sync.newest_seq = block_seq(N_TIME_PER_BLOCK*TIME_DEMUX);
 
     /* Read network params */
     int bindport = 8511;
-    // (N_BYTES_PER_PACKET excludes header, so +8 for the header)
-    size_t expected_packet_size = N_BYTES_PER_PACKET + 8;
 
+    pthread_cleanup_push(free, shards);
 #ifndef TIMING_TEST
-    /* Get pktsock from args*/
-    struct hashpipe_pktsock * p_ps = (struct hashpipe_pktsock*)args->user_data;
-    pthread_cleanup_push(free, p_ps);
-    pthread_cleanup_push((void (*)(void *))hashpipe_pktsock_close, p_ps);
+    pthread_cleanup_push((void (*)(void *))net_shards_close, shards);
 
     // Drop all packets to date
-    unsigned char *p_frame;
-    while((p_frame=hashpipe_pktsock_recv_frame_nonblock(p_ps))) {
-	hashpipe_pktsock_release_frame(p_frame);
+    for(i=0; i<shard_sync.nshards; i++) {
+	net_sock_t *p_sock = &shards[i].sock;
+	struct tpacket_block_desc *p_desc;
+	unsigned char *p_frame;
+
+	if(p_sock->tpacket_version == 3) {
+	    while((p_desc=hdr_tpacket3_recv_block_nonblock(&p_sock->tp3))) {
+		hdr_tpacket3_release_block(p_desc);
+	    }
+	} else {
+	    while((p_frame=hashpipe_pktsock_recv_frame_nonblock(&p_sock->ps))) {
+		hashpipe_pktsock_release_frame(p_frame);
+	    }
+	}
     }
 
     hashpipe_status_lock_safe(&st);
@@ -692,172 +1866,46 @@ static void *run(hashpipe_thread_args_t * args)
     hashpipe_status_unlock_safe(&st);
 #endif
 
-    /* Main loop */
-    uint64_t packet_count = 0;
-    uint64_t wait_ns = 0; // ns for most recent wait
-    uint64_t recv_ns = 0; // ns for most recent recv
-    uint64_t proc_ns = 0; // ns for most recent proc
-    uint64_t min_wait_ns = 99999; // min ns per single wait
-    uint64_t min_recv_ns = 99999; // min ns per single recv
-    uint64_t min_proc_ns = 99999; // min ns per single proc
-    uint64_t max_wait_ns = 0;     // max ns per single wait
-    uint64_t max_recv_ns = 0;     // max ns per single recv
-    uint64_t max_proc_ns = 0;     // max ns per single proc
-    uint64_t elapsed_wait_ns = 0; // cumulative wait time per block
-    uint64_t elapsed_recv_ns = 0; // cumulative recv time per block
-    uint64_t elapsed_proc_ns = 0; // cumulative proc time per block
-    uint64_t status_ns = 0; // User to fetch ns values from status buffer
-    float ns_per_wait = 0.0; // Average ns per wait over 1 block
-    float ns_per_recv = 0.0; // Average ns per recv over 1 block
-    float ns_per_proc = 0.0; // Average ns per proc over 1 block
-    unsigned int pktsock_pkts = 0;  // Stats counter from socket packet
-    unsigned int pktsock_drops = 0; // Stats counter from socket packet
-    uint64_t pktsock_pkts_total = 0;  // Stats total for socket packet
-    uint64_t pktsock_drops_total = 0; // Stats total for socket packet
-    struct timespec start, stop;
-    struct timespec recv_start, recv_stop;
-
-    while (run_threads()) {
-
-#ifndef TIMING_TEST
-        /* Read packet */
-	clock_gettime(CLOCK_MONOTONIC, &recv_start);
-	do {
-	    clock_gettime(CLOCK_MONOTONIC, &start);
-	    //p.packet_size = recv(up.sock, p.data, HASHPIPE_MAX_PACKET_SIZE, 0);
-	    p_frame = hashpipe_pktsock_recv_udp_frame_nonblock(p_ps, bindport);
-	    clock_gettime(CLOCK_MONOTONIC, &recv_stop);
-	} while (!p_frame && run_threads());
-
-	if(!run_threads()) break;
-
-	// Make sure received packet size matches expected packet size.  Allow
-	// for optional 8 byte CRC in received packet.  Zlib's crc32 function
-	// is too slow to use in realtime, so CRCs cannot be checked on the
-	// fly.  If data errors are suspected, a separate CRC checking utility
-	// should be used to read the packets from the network and verify CRCs.
-        int packet_size = PKT_UDP_SIZE(p_frame) - 8; // -8 for the UDP header
-	if (expected_packet_size != packet_size-8 && expected_packet_size != packet_size) {
-	    // Log warning and ignore wrongly sized packet
-	    #ifdef DEBUG_NET
-	    hashpipe_warn("hera_pktsock_thread", "Invalid pkt size (%d)", packet_size);
-	    #endif
-	    hashpipe_pktsock_release_frame(p_frame);
-	    continue;
+    // Start the capture shards.  Shard 0 runs in this thread.
+    for(i=0; i<shard_sync.nshards; i++) {
+	hdr_hist_register(&net_hists[i].wait, "NWAT");
+	hdr_hist_register(&net_hists[i].recv, "NREC");
+	hdr_hist_register(&net_hists[i].proc, "NPRC");
+	shards[i].out = &out;
+	shards[i].bindport = bindport;
+	initialize_block_info(&shards[i].binfo, i, shards[i].ant_lo, shards[i].ant_hi);
+    }
+    for(i=1; i<shard_sync.nshards; i++) {
+	if(pthread_create(&shards[i].thread, NULL, capture_loop, &shards[i])) {
+	    hashpipe_error(__FUNCTION__, "error starting capture shard %d", i);
+	    pthread_exit(NULL);
 	}
-#endif
-	packet_count++;
-
-        // Copy packet into any blocks where it belongs.
-        const uint64_t mcnt = process_packet((hdr_input_databuf_t *)db, p_frame);
-	// Release frame back to kernel
-	hashpipe_pktsock_release_frame(p_frame);
-
-	clock_gettime(CLOCK_MONOTONIC, &stop);
-	wait_ns = ELAPSED_NS(recv_start, start);
-	recv_ns = ELAPSED_NS(start, recv_stop);
-	proc_ns = ELAPSED_NS(recv_stop, stop);
-	elapsed_wait_ns += wait_ns;
-	elapsed_recv_ns += recv_ns;
-	elapsed_proc_ns += proc_ns;
-	// Update min max values
-	min_wait_ns = MIN(wait_ns, min_wait_ns);
-	min_recv_ns = MIN(recv_ns, min_recv_ns);
-	min_proc_ns = MIN(proc_ns, min_proc_ns);
-	max_wait_ns = MAX(wait_ns, max_wait_ns);
-	max_recv_ns = MAX(recv_ns, max_recv_ns);
-	max_proc_ns = MAX(proc_ns, max_proc_ns);
-
-        if(mcnt != -1) {
-            // Update status
-            ns_per_wait = (float)elapsed_wait_ns / packet_count;
-            ns_per_recv = (float)elapsed_recv_ns / packet_count;
-            ns_per_proc = (float)elapsed_proc_ns / packet_count;
-
-	    // Get stats from packet socket
-	    hashpipe_pktsock_stats(p_ps, &pktsock_pkts, &pktsock_drops);
-
-            hashpipe_status_lock_busywait_safe(&st);
-
-            hputu8(st.buf, "NETMCNT", mcnt);
-	    // Gbps = bits_per_packet / ns_per_packet
-	    // (N_BYTES_PER_PACKET excludes header, so +8 for the header)
-            hputr4(st.buf, "NETGBPS", 8*(N_BYTES_PER_PACKET+8)/(ns_per_recv+ns_per_proc));
-            hputr4(st.buf, "NETWATNS", ns_per_wait);
-            hputr4(st.buf, "NETRECNS", ns_per_recv);
-            hputr4(st.buf, "NETPRCNS", ns_per_proc);
-
-	    // Get and put min and max values.  The "get-then-put" allows the
-	    // user to reset the min max values in the status buffer.
-	    hgeti8(st.buf, "NETWATMN", (long long *)&status_ns);
-	    status_ns = MIN(min_wait_ns, status_ns);
-            hputi8(st.buf, "NETWATMN", status_ns);
-
-            hgeti8(st.buf, "NETRECMN", (long long *)&status_ns);
-	    status_ns = MIN(min_recv_ns, status_ns);
-            hputi8(st.buf, "NETRECMN", status_ns);
-
-            hgeti8(st.buf, "NETPRCMN", (long long *)&status_ns);
-	    status_ns = MIN(min_proc_ns, status_ns);
-            hputi8(st.buf, "NETPRCMN", status_ns);
-
-            hgeti8(st.buf, "NETWATMX", (long long *)&status_ns);
-	    status_ns = MAX(max_wait_ns, status_ns);
-            hputi8(st.buf, "NETWATMX", status_ns);
-
-            hgeti8(st.buf, "NETRECMX", (long long *)&status_ns);
-	    status_ns = MAX(max_recv_ns, status_ns);
-            hputi8(st.buf, "NETRECMX", status_ns);
-
-            hgeti8(st.buf, "NETPRCMX", (long long *)&status_ns);
-	    status_ns = MAX(max_proc_ns, status_ns);
-            hputi8(st.buf, "NETPRCMX", status_ns);
-
-            hputu8(st.buf, "NETPKTS",  pktsock_pkts);
-            hputu8(st.buf, "NETDROPS", pktsock_drops);
-
-            hgetu8(st.buf, "NETPKTTL", (long long unsigned int*)&pktsock_pkts_total);
-            hgetu8(st.buf, "NETDRPTL", (long long unsigned int*)&pktsock_drops_total);
-            hputu8(st.buf, "NETPKTTL", pktsock_pkts_total + pktsock_pkts);
-            hputu8(st.buf, "NETDRPTL", pktsock_drops_total + pktsock_drops);
-
-            hashpipe_status_unlock_safe(&st);
-
-	    // Start new average
-	    elapsed_wait_ns = 0;
-	    elapsed_recv_ns = 0;
-	    elapsed_proc_ns = 0;
-	    packet_count = 0;
-        }
+    }
 
-#if defined TIMING_TEST || defined NET_TIMING_TEST
+    // Start the status publishers
+    if(hdr_stats_publisher_start(&net_pub, &st, net_pub_ms, net_pub_cpu,
+				 net_stats_publish, NULL, &out) != HASHPIPE_OK) {
+	pthread_exit(NULL);
+    }
+    pthread_cleanup_push((void (*)(void *))hdr_stats_publisher_stop, &net_pub);
+    if(hdr_hist_publisher_start(&st) != HASHPIPE_OK) {
+	pthread_exit(NULL);
+    }
+    pthread_cleanup_push((void (*)(void *))net_hists_stop, NULL);
 
-#define END_LOOP_COUNT (1*1000*1000)
-	static int loop_count=0;
-	static struct timespec tt_start, tt_stop;
-	if(loop_count == 0) {
-	    clock_gettime(CLOCK_MONOTONIC, &tt_start);
-	}
-	//if(loop_count == 1000000) pthread_exit(NULL);
-	if(loop_count == END_LOOP_COUNT) {
-	    clock_gettime(CLOCK_MONOTONIC, &tt_stop);
-	    int64_t elapsed = ELAPSED_NS(tt_start, tt_stop);
-	    printf("processed %d packets in %.6f ms (%.3f us per packet)\n",
-		    END_LOOP_COUNT, elapsed/1e6, elapsed/1e3/END_LOOP_COUNT);
-	    exit(0);
-	}
-	loop_count++;
-#endif
+    capture_loop(&shards[0]);
 
-        /* Will exit if thread has been cancelled */
-        pthread_testcancel();
+    for(i=1; i<shard_sync.nshards; i++) {
+	pthread_join(shards[i].thread, NULL);
     }
 
-#ifndef TIMING_TEST
     /* Have to close all push's */
-    pthread_cleanup_pop(1); /* Closes push(hashpipe_pktsock_close) */
-    pthread_cleanup_pop(1); /* Closes push(hashpipe_udp_close) */
+    pthread_cleanup_pop(1); /* Closes push(net_hists_stop) */
+    pthread_cleanup_pop(1); /* Closes push(hdr_stats_publisher_stop) */
+#ifndef TIMING_TEST
+    pthread_cleanup_pop(1); /* Closes push(net_shards_close) */
 #endif
+    pthread_cleanup_pop(1); /* Closes push(free) */
 
     return NULL;
 }
@@ -871,9 +1919,21 @@ static hashpipe_thread_desc_t pktsock_thread = {
     obuf_desc: {hdr_input_databuf_create}
 };
 
+// Fused capture+strip variant.  Use it in place of hera_pktsock_thread and
+// hdr_strip_thread, i.e. feeding hdr_write_thread directly.
+static hashpipe_thread_desc_t pktsock_strip_thread = {
+    name: "hera_pktsock_strip_thread",
+    skey: "NETSTAT",
+    init: init,
+    run:  run,
+    ibuf_desc: {NULL},
+    obuf_desc: {hdr_stripper_databuf_create}
+};
+
 static __attribute__((constructor)) void ctor()
 {
   register_hashpipe_thread(&pktsock_thread);
+  register_hashpipe_thread(&pktsock_strip_thread);
 }
 
 // vi: set ts=8 sw=4 noet :